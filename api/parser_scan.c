@@ -0,0 +1,177 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Request parser: every delimiter scanner (scalar, SSE2, AVX2) must give
+ * the same result. A table of requests is parsed with each scanner the
+ * CPU supports, the delimiters are moved over every offset of a 16 and
+ * 32 bytes block by growing the fields around them.
+ */
+
+#include <monkey/monkey.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_parser.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAD_MAX    70
+#define BUF_SIZE   4096
+
+struct scan_type {
+    int type;
+    char *name;
+};
+
+static struct scan_type scan_types[] = {
+    {MK_HTTP_PARSER_SCAN_SCALAR, "scalar"},
+    {MK_HTTP_PARSER_SCAN_SSE2,   "sse2"  },
+    {MK_HTTP_PARSER_SCAN_AVX2,   "avx2"  }
+};
+
+/* Request templates, every %s is replaced by the padding */
+static char *requests[] = {
+    /* URI */
+    "GET /%s HTTP/1.1\r\n"
+    "Host: localhost\r\n\r\n",
+
+    /* URI and query string */
+    "GET /%s?%s HTTP/1.1\r\n"
+    "Host: localhost\r\n\r\n",
+
+    /* Header values */
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "X-Pad: v%s\r\n"
+    "User-Agent: u%s\r\n\r\n",
+
+    /* Chunk extensions and trailer fields */
+    "POST /%s HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Transfer-Encoding: chunked\r\n\r\n"
+    "5;ext=%s\r\n"
+    "hello\r\n"
+    "0\r\n"
+    "X-Trailer: %s\r\n\r\n"
+};
+
+static void pad_fill(char *pad, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        pad[i] = 'a' + (i % 26);
+    }
+    pad[len] = '\0';
+}
+
+static int ptr_print(char *out, size_t size, char *name, mk_ptr_t *p)
+{
+    return snprintf(out, size, "%s=%.*s|", name, (int) p->len,
+                    p->data ? p->data : "");
+}
+
+/* Parse the request and describe everything the parser found */
+static int request_parse(char *raw, int len, int offset,
+                         struct mk_server *server, char *out, size_t size)
+{
+    int ret;
+    int n = 0;
+    char *buf;
+    char mem[BUF_SIZE + 32];
+    struct mk_list *head;
+    struct mk_http_header *header;
+    struct mk_http_parser parser;
+    struct mk_http_request request;
+
+    /* Move the whole request over the alignments of the vector loads */
+    buf = mem + offset;
+    memcpy(buf, raw, len);
+    buf[len] = '\0';
+
+    memset(&request, 0, sizeof(request));
+    mk_http_parser_init(&parser);
+
+    ret = mk_http_parser(&request, &parser, buf, len, server);
+
+    n += snprintf(out + n, size - n, "ret=%i|i=%i|method=%i|",
+                  ret, parser.i, request.method);
+    n += ptr_print(out + n, size - n, "uri", &request.uri);
+    n += ptr_print(out + n, size - n, "qs", &request.query_string);
+    n += ptr_print(out + n, size - n, "proto", &request.protocol_p);
+    n += ptr_print(out + n, size - n, "body", &request.data);
+
+    mk_list_foreach(head, &parser.header_list) {
+        header = mk_list_entry(head, struct mk_http_header, _head);
+        n += ptr_print(out + n, size - n, "key", &header->key);
+        n += ptr_print(out + n, size - n, "val", &header->val);
+    }
+
+    return ret;
+}
+
+int main()
+{
+    int t;
+    int r;
+    int pad;
+    int len;
+    int offset;
+    int types = 0;
+    int failed = 0;
+    int checked = 0;
+    char raw[BUF_SIZE];
+    char padding[PAD_MAX + 1];
+    char expected[BUF_SIZE * 2];
+    char result[BUF_SIZE * 2];
+    struct mk_server server;
+
+    memset(&server, 0, sizeof(server));
+    server.max_request_size = BUF_SIZE;
+
+    for (t = 1; t < (int) (sizeof(scan_types) / sizeof(scan_types[0])); t++) {
+        if (mk_http_parser_scan_init(scan_types[t].type) != 0) {
+            printf("parser_scan: %s not available\n", scan_types[t].name);
+            continue;
+        }
+        types++;
+
+        for (r = 0; r < (int) (sizeof(requests) / sizeof(requests[0])); r++) {
+            for (pad = 0; pad <= PAD_MAX; pad++) {
+                pad_fill(padding, pad);
+                len = snprintf(raw, sizeof(raw), requests[r],
+                               padding, padding, padding);
+
+                for (offset = 0; offset < 32; offset++) {
+                    mk_http_parser_scan_init(MK_HTTP_PARSER_SCAN_SCALAR);
+                    if (request_parse(raw, len, offset, &server,
+                                      expected, sizeof(expected)) !=
+                        MK_HTTP_PARSER_OK) {
+                        printf("parser_scan: request %i (pad %i) "
+                               "not parsed\n", r, pad);
+                        failed++;
+                        continue;
+                    }
+
+                    mk_http_parser_scan_init(scan_types[t].type);
+                    request_parse(raw, len, offset, &server,
+                                  result, sizeof(result));
+
+                    checked++;
+                    if (strcmp(expected, result) != 0) {
+                        printf("parser_scan: %s differs, request %i "
+                               "(pad %i, offset %i)\n  scalar: %s\n  %s: %s\n",
+                               scan_types[t].name, r, pad, offset,
+                               expected, scan_types[t].name, result);
+                        failed++;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("parser_scan: %i vector scanner(s), %i requests compared, "
+           "%i failed\n", types, checked, failed);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
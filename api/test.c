@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <signal.h>
 #include <unistd.h>
 
@@ -13,6 +14,9 @@
 /* Main context set as global so the signal handler can use it */
 mk_ctx_t *ctx;
 
+/* Topic fed from main(), subscribers get one chunk per second */
+int tid;
+
 void cb_worker(void *data)
 {
     mk_info("[api test] test worker callback; data=%p", data);
@@ -48,18 +52,80 @@ void cb_test_chunks(mk_request_t *request, void *data)
 void cb_test_big_chunk(mk_request_t *request, void *data)
 {
     size_t chunk_size = 1024000000;
-    char *chunk;
+    FILE *f;
     (void) data;
 
     mk_http_status(request, 200);
     mk_http_header(request, "X-Monkey", 8, "OK", 2);
 
-    chunk = calloc(1, chunk_size);
-    mk_http_send(request, chunk, chunk_size, NULL);
-    free(chunk);
+    /* A sparse file is sent through sendfile(2), nothing is loaded in memory */
+    f = tmpfile();
+    if (f && ftruncate(fileno(f), chunk_size) == 0) {
+        mk_http_send_fd(request, fileno(f), 0, chunk_size);
+    }
+    if (f) {
+        fclose(f);
+    }
+    mk_http_done(request);
+}
+
+void cb_test_iov(mk_request_t *request, void *data)
+{
+    struct iovec iov[3] = {
+        {"test", 4}, {"-", 1}, {"iov\n", 4}
+    };
+    (void) data;
+
+    mk_http_status(request, 200);
+    mk_http_send_iov(request, iov, 3);
+    mk_http_done(request);
+}
+
+/* Runs on the handler thread pool, it can block without stalling a worker */
+void cb_test_blocking(mk_request_t *request, void *data)
+{
+    (void) data;
+
+    sleep(1);
+    mk_http_status(request, 200);
+    mk_http_send(request, "blocking\n", 9, NULL);
     mk_http_done(request);
 }
 
+/* Uploads are counted as they arrive, the body is never buffered */
+int cb_test_upload_body(mk_request_t *request, char *buf, size_t len,
+                        void *data)
+{
+    (void) buf;
+    (void) data;
+
+    request->handler_data = (void *) ((uintptr_t) request->handler_data + len);
+    return 0;
+}
+
+void cb_test_upload(mk_request_t *request, void *data)
+{
+    int len;
+    char msg[64];
+    (void) data;
+
+    len = snprintf(msg, sizeof(msg), "received %lu bytes\n",
+                   (unsigned long) (uintptr_t) request->handler_data);
+    mk_http_status(request, 200);
+    mk_http_send(request, msg, len, NULL);
+    mk_http_done(request);
+}
+
+/* The request stays open and receives every message published on 'tid' */
+void cb_test_topic(mk_request_t *request, void *data)
+{
+    (void) data;
+
+    mk_http_status(request, 200);
+    mk_http_header(request, "Content-Type", 12, "text/event-stream", 17);
+    mk_topic_subscribe(ctx, tid, request);
+}
+
 
 static void signal_handler(int signal)
 {
@@ -119,6 +185,9 @@ int main()
     /* Create a message queue and a callback for each message */
     qid = mk_mq_create(ctx, "/data", cb_queue_message, NULL);
 
+    /* Slow subscribers are closed once they have 1MB pending */
+    tid = mk_topic_create(ctx, "ticks", 1024 * 1024, MK_TOPIC_CLOSE);
+
     mk_config_set(ctx,
                   "Listen", API_PORT,
                   //"Timeout", "1",
@@ -130,6 +199,12 @@ int main()
                  NULL);
     mk_vhost_handler(ctx, vid, "/test_chunks", cb_test_chunks, NULL);
     mk_vhost_handler(ctx, vid, "/test_big_chunk", cb_test_big_chunk, NULL);
+    mk_vhost_handler(ctx, vid, "/test_iov", cb_test_iov, NULL);
+    mk_vhost_handler_blocking(ctx, vid, "/test_blocking", cb_test_blocking,
+                              NULL);
+    mk_vhost_handler(ctx, vid, "/test_topic", cb_test_topic, NULL);
+    mk_vhost_handler_stream(ctx, vid, "/test_upload", cb_test_upload_body,
+                            cb_test_upload, NULL);
     mk_vhost_handler(ctx, vid, "/", cb_main, NULL);
 
     mk_worker_callback(ctx,
@@ -144,7 +219,11 @@ int main()
         mk_mq_send(ctx, qid, &msg, len);
     }
 
-    sleep(3600);
+    for (i = 0; i < 3600; i++) {
+        len = snprintf(msg, sizeof(msg) - 1, "data: tick %i\n\n", i);
+        mk_topic_publish(ctx, tid, msg, len);
+        sleep(1);
+    }
 
     mk_stop(ctx);
     mk_destroy(ctx);
@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_AFFINITY_H
+#define MK_AFFINITY_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+
+/*
+ * Worker CPU affinity (WorkerAffinity): worker N is pinned to the Nth CPU
+ * of server->workers_cpus, wrapping around when there are more workers
+ * than CPUs in the list.
+ */
+int mk_affinity_parse(char *value, struct mk_server *server);
+int mk_affinity_worker_cpu(struct mk_server *server, int wid);
+int mk_affinity_set(int cpu);
+
+#endif
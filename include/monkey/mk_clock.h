@@ -23,22 +23,24 @@
 #define MK_CLOCK_H
 
 #include <time.h>
+#include <stdint.h>
 #include <monkey/mk_core.h>
 
-extern time_t log_current_utime;
 extern time_t monkey_init_time;
 
-extern mk_ptr_t log_current_time;
-extern mk_ptr_t headers_preset;
-
 #define MK_CLOCK_GMT_DATEFORMAT "Date: %a, %d %b %Y %H:%M:%S GMT\r\n"
 #define HEADER_PRESET_SIZE 128
 #define HEADER_TIME_BUFFER_SIZE 64
 #define LOG_TIME_BUFFER_SIZE 30
 
-void *mk_clock_worker_init(void *args);
-void mk_clock_set_time(void);
+/*
+ * Every thread keeps its own copy of the formatted strings, they are
+ * refreshed on first use after the second changes.
+ */
+time_t mk_clock_now();
+uint64_t mk_clock_now_msec();
+mk_ptr_t *mk_clock_log_time();
+mk_ptr_t *mk_clock_headers_preset(struct mk_server *server);
 void mk_clock_sequential_init(struct mk_server *server);
-void mk_clock_exit();
 
 #endif
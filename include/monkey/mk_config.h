@@ -24,7 +24,6 @@
 #include <unistd.h>
 
 #include <monkey/mk_info.h>
-#include "../../deps/rbtree/rbtree.h"
 
 #ifndef O_NOATIME
 #define O_NOATIME       01000000
@@ -67,6 +66,16 @@ struct mk_server
     int fd_limit;                 /* Limit of file descriptors */
     unsigned int server_capacity; /* total server capacity */
     short int workers;            /* number of worker threads */
+    int *workers_cpus;            /* CPU list for WorkerAffinity */
+    int workers_ncpus;
+    int conn_pool_size;           /* connection objects kept per worker */
+    int read_buf_size;            /* size of the shared read buffers    */
+    int read_buf_pool;            /* free read buffers kept per worker  */
+    int body_spill_size;          /* bodies above go to a temp file     */
+    int thread_stack_size;        /* stack size of handler coroutines   */
+    int thread_stack_pool;        /* free coroutines kept per worker    */
+    int thread_stack_check;       /* measure coroutines stack usage     */
+    int handler_threads;          /* threads for blocking lib handlers  */
     short int manual_tcp_cork;    /* If enabled it will handle TCP_CORK */
 
     int8_t fdt;                   /* is FDT enabled ? */
@@ -116,12 +125,19 @@ struct mk_server
 
     int max_request_size;
 
+    /* memory budget for the response cache (bytes), zero disables it */
+    size_t cache_memory;
+
     struct mk_list *index_files;
 
     /* configured host quantity */
     int nhosts;
     struct mk_list hosts;
 
+    /* host names index (open addressing), built before workers start */
+    struct mk_vhost_alias **vhost_table;
+    int vhost_table_size;
+
     mode_t open_flags;
     struct mk_list plugins;
 
@@ -136,7 +152,9 @@ struct mk_server
 
     /* Define the default mime type when is not possible to find the proper one */
     struct mk_list mimetype_list;
-    struct rb_tree mimetype_rb_head;
+    struct mk_mimetype **mimetype_table;   /* open addressing, by extension */
+    int mimetype_table_size;
+    int mimetype_count;
     void *mimetype_default;
     char *mimetype_default_str;
 
@@ -144,6 +162,9 @@ struct mk_server
     char server_signature_header[32];
     int  server_signature_header_len;
 
+    /* Default error pages, see mk_http_error_pages_init() */
+    struct mk_http_error_page *error_pages;
+
     /* Library  mode */
     int lib_mode;                   /* is running in Library mode ? */
     int lib_ch_manager[2];          /* lib channel manager */
@@ -46,6 +46,7 @@ extern "C" {
 /* --- end --- */
 
 #include "mk_core/mk_memory.h"
+#include "mk_core/mk_arena.h"
 #include "mk_core/mk_file.h"
 #include "mk_core/mk_event.h"
 #include "mk_core/mk_rconf.h"
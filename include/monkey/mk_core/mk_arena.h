@@ -0,0 +1,94 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_ARENA_H
+#define MK_ARENA_H
+
+#include <stdint.h>
+#include <stdarg.h>
+
+#include "mk_macros.h"
+#include "mk_memory.h"
+
+/*
+ * Bump allocator: memory is taken from a caller provided buffer and, once
+ * it's exhausted, from blocks chained to the arena. Single allocations are
+ * never released, everything is given back at once by mk_arena_reset().
+ */
+
+#define MK_ARENA_ALIGN        (2 * sizeof(void *))
+#define MK_ARENA_BLOCK_SIZE   4096   /* minimum size of an overflow block */
+
+struct mk_arena_block {
+    struct mk_arena_block *next;
+    size_t size;
+};
+
+struct mk_arena {
+    char *pos;                       /* next free byte                    */
+    char *end;                       /* end of the current block          */
+    char *buf;                       /* initial block                     */
+    size_t size;
+    struct mk_arena_block *blocks;   /* overflow blocks, last one first   */
+};
+
+void *mk_arena_alloc_block(struct mk_arena *arena, size_t size);
+char *mk_arena_strndup(struct mk_arena *arena, const char *str, size_t len);
+char *mk_arena_vprintf(struct mk_arena *arena, unsigned long *len,
+                       const char *fmt, va_list ap);
+char *mk_arena_printf(struct mk_arena *arena, unsigned long *len,
+                      const char *fmt, ...) PRINTF_WARNINGS(3,4);
+void mk_arena_release(struct mk_arena *arena);
+
+static inline void mk_arena_init(struct mk_arena *arena,
+                                 void *buf, size_t size)
+{
+    arena->buf = buf;
+    arena->size = size;
+    arena->pos = buf;
+    arena->end = (char *) buf + size;
+    arena->blocks = NULL;
+}
+
+static inline void *mk_arena_alloc(struct mk_arena *arena, size_t size)
+{
+    uintptr_t p;
+
+    p = ((uintptr_t) arena->pos + (MK_ARENA_ALIGN - 1)) &
+        ~((uintptr_t) MK_ARENA_ALIGN - 1);
+
+    if (mk_unlikely(p + size > (uintptr_t) arena->end)) {
+        return mk_arena_alloc_block(arena, size);
+    }
+
+    arena->pos = (char *) (p + size);
+    return (void *) p;
+}
+
+/* Free the overflow blocks and rewind to the initial buffer */
+static inline void mk_arena_reset(struct mk_arena *arena)
+{
+    if (arena->blocks) {
+        mk_arena_release(arena);
+    }
+    arena->pos = arena->buf;
+    arena->end = arena->buf + arena->size;
+}
+
+#endif
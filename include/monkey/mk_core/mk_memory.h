@@ -21,6 +21,7 @@
 #define MK_MEM_H
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #ifdef MALLOC_JEMALLOC
 #include <jemalloc/jemalloc.h>
@@ -77,6 +78,27 @@ void *mk_mem_alloc_z(const size_t size)
     return buf;
 }
 
+/* Allocate 'size' bytes aligned to 'align' (a power of two) */
+static inline ALLOCSZ_ATTR(2)
+void *mk_mem_alloc_aligned(const size_t align, const size_t size)
+{
+    int ret;
+    void *aux;
+
+#ifdef MALLOC_JEMALLOC
+    ret = je_posix_memalign(&aux, align, size);
+#else
+    ret = posix_memalign(&aux, align, size);
+#endif
+
+    if (mk_unlikely(ret != 0)) {
+        perror("posix_memalign");
+        return NULL;
+    }
+
+    return aux;
+}
+
 static inline ALLOCSZ_ATTR(2)
 void *mk_mem_realloc(void *ptr, const size_t size)
 {
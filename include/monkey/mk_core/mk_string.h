@@ -80,6 +80,30 @@ char *mk_string_copy_substr(const char *string, int pos_init, int pos_end);
 
 char *mk_string_tolower(const char *in);
 
+/*
+ * FNV-1a hash of 'len' bytes. With MK_STR_INSENSITIVE ASCII letters are
+ * hashed as lowercase, so names differing only in case hash the same.
+ */
+static inline unsigned int mk_string_hash(const void *data, size_t len,
+                                          int sensitive)
+{
+    size_t i;
+    unsigned char c;
+    const unsigned char *p = data;
+    unsigned int hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        c = p[i];
+        if (sensitive == MK_STR_INSENSITIVE && c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        hash ^= c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 #if defined (__APPLE__) || defined (_WIN32)
 void *memrchr(const void *s, int c, size_t n);
 #endif
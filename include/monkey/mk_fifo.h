@@ -25,24 +25,40 @@
 #include <monkey/mk_core.h>
 #include <pthread.h>
 
-#define MK_FIFO_BUF_SIZE   32768
+/*
+ * Every worker gets a ring of message references: the caller thread is the
+ * only producer (senders are serialized) and the worker the only consumer.
+ * Broadcast messages are written once and shared by all the rings.
+ */
+#define MK_FIFO_RING_SIZE  1024     /* slots per worker, power of two */
+#define MK_FIFO_CACHELINE    64
+
+/* Targets for mk_fifo_send_worker() */
+#define MK_FIFO_ALL        -1       /* every worker */
+#define MK_FIFO_ANY        -2       /* next worker, round-robin */
 
 struct mk_fifo_worker {
     struct mk_event event; /* event loop 'event' */
     int worker_id;         /* worker ID */
-    int channel[2];        /* pipe(2) communication channel */
+    int fd_r;              /* notification channel (eventfd or pipe) */
+    int fd_w;
     void *data;            /* opaque data for thread */
+    void *fifo;            /* original FIFO context associated with */
+    struct mk_fifo_msg **slots;
 
-    /* Read buffer */
-    char *buf_data;
-    size_t buf_len;
-    size_t buf_size;
+    /* Producer side */
+    uint64_t tail __attribute__ ((aligned(MK_FIFO_CACHELINE)));
+    int signaled;          /* consumer already notified */
+    int waiting;           /* producer waits for free slots */
+
+    /* Consumer side */
+    uint64_t head __attribute__ ((aligned(MK_FIFO_CACHELINE)));
 
-    void *fifo;            /* original FIFO context associated with */
     struct mk_list _head;  /* link to paremt mk_msg.workers list */
 };
 
 struct mk_fifo_msg {
+    uint32_t refs;         /* workers that did not consume it yet */
     uint32_t length;
     uint16_t flags;
     uint16_t queue_id;
@@ -66,7 +82,12 @@ struct mk_fifo_queue {
 struct mk_fifo {
     pthread_key_t *key;          /* pthread key */
     pthread_mutex_t mutex_init;  /* pthread mutex used for initialization */
+    pthread_mutex_t mutex_send;  /* serialize the producers */
+    pthread_cond_t cond_send;    /* a ring got free slots */
     void *data;                  /* opate data context */
+    int n_workers;               /* size of 'worker_ids' */
+    unsigned int next_worker;    /* round-robin target */
+    struct mk_fifo_worker **worker_ids;  /* workers by scheduler index */
     struct mk_list queues;       /* list of registered queues */
     struct mk_list workers;      /* context for Monkey workers */
 };
@@ -84,5 +105,11 @@ int mk_fifo_queue_destroy(struct mk_fifo *ctx, struct mk_fifo_queue *q);
 int mk_fifo_queue_id_destroy(struct mk_fifo *ctx, int id);
 int mk_fifo_destroy(struct mk_fifo *ctx);
 int mk_fifo_send(struct mk_fifo *ctx, int id, void *data, size_t size);
+int mk_fifo_send_count(struct mk_fifo *ctx, int id, void *data, size_t size,
+                       int *count);
+int mk_fifo_send_worker(struct mk_fifo *ctx, int id, int worker,
+                        void *data, size_t size);
+int mk_fifo_send_key(struct mk_fifo *ctx, int id, void *key, size_t key_len,
+                     void *data, size_t size);
 
 #endif
@@ -28,7 +28,24 @@
 
 /* Request buffer chunks = 4KB */
 #define MK_REQUEST_CHUNK (int) 4096
-#define MK_REQUEST_DEFAULT_PAGE  "<HTML><HEAD><STYLE type=\"text/css\"> body {font-size: 12px;} </STYLE></HEAD><BODY><H1>%s</H1>%s<BR><HR><ADDRESS>Powered by %s</ADDRESS></BODY></HTML>"
+#define MK_REQUEST_BUFFERS        256   /* free read buffers per worker */
+
+/*
+ * Request bodies bigger than BodySpillSize (KB) are not kept in the read
+ * buffer: they are spilled to a temporary file or handed to a streaming
+ * handler as they arrive, MK_HTTP_BODY_CHUNK bytes at most every time.
+ */
+#define MK_HTTP_BODY_SPILL_SIZE    16
+#define MK_HTTP_BODY_CHUNK      16384
+
+/* Where the body of a request is taken to (sr->body_mode) */
+#define MK_HTTP_BODY_NONE        0      /* not decided yet              */
+#define MK_HTTP_BODY_MEMORY      1      /* read buffer, default         */
+#define MK_HTTP_BODY_SPILL       2      /* temporary file               */
+#define MK_HTTP_BODY_STREAM      3      /* lib handler body callback    */
+#define MK_REQUEST_DEFAULT_PAGE_HEAD "<HTML><HEAD><STYLE type=\"text/css\"> body {font-size: 12px;} </STYLE></HEAD><BODY><H1>%s</H1>"
+#define MK_REQUEST_DEFAULT_PAGE_TAIL "<BR><HR><ADDRESS>Powered by %s</ADDRESS></BODY></HTML>"
+#define MK_REQUEST_DEFAULT_PAGE  MK_REQUEST_DEFAULT_PAGE_HEAD "%s" MK_REQUEST_DEFAULT_PAGE_TAIL
 
 /* Hard coded restrictions */
 #define MK_HTTP_DIRECTORY_BACKWARD ".."
@@ -131,11 +148,13 @@ struct mk_http_session
     /* creation time for this HTTP session */
     time_t init_time;
 
-    /* request body buffer */
+    /*
+     * Request buffer: it's borrowed from the worker read buffers when
+     * data arrives and returned once the request is done with nothing
+     * left to parse. Requests that don't fit move to a private buffer.
+     */
     char *body;
-
-    /* Initial fixed size buffer for small requests */
-    char body_fixed[MK_REQUEST_CHUNK];
+    int body_pooled;
 
     /*
      * FIXME: in previous versions of Monkey we used to parse the complete request
@@ -154,6 +173,15 @@ struct mk_http_session
      */
     struct mk_http_parser parser;
 
+    /*
+     * Last virtual host lookup: clients keep sending the same Host on a
+     * persistent connection, a miss (vhost == NULL) is cached as well.
+     */
+    char vhost_name[MK_HOSTNAME_LEN];
+    int vhost_name_len;
+    struct mk_vhost *vhost;
+    struct mk_vhost_alias *vhost_alias;
+
     /* Server context */
     struct mk_server *server;
 };
@@ -172,6 +200,20 @@ static inline int mk_http_status_completed(struct mk_http_session *cs,
     return 0;
 }
 
+/*
+ * Default error page, rendered once per server by mk_http_error_pages_init().
+ * Pages showing the request URI get it inserted at 'split'.
+ */
+struct mk_http_error_page {
+    int status;
+    int uri;
+    unsigned long split;
+    mk_ptr_t page;
+};
+
+int mk_http_error_pages_init(struct mk_server *server);
+void mk_http_error_pages_free(struct mk_server *server);
+
 int mk_http_error(int http_status, struct mk_http_session *cs,
                   struct mk_http_request *sr,
                   struct mk_server *server);
@@ -218,6 +260,44 @@ struct mk_http_header *mk_http_header_get(int name, struct mk_http_request *req,
 
 int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server);
 
+/*
+ * Queue the response headers input on the request stream. Errors raised
+ * before mk_http_init() (parser, request prepare, body) need it too, it
+ * is linked once per request.
+ */
+static inline void mk_http_headers_link(struct mk_http_request *sr)
+{
+    if (sr->in_headers.stream) {
+        return;
+    }
+
+    sr->in_headers.type        = MK_STREAM_IOV;
+    sr->in_headers.dynamic     = MK_FALSE;
+    sr->in_headers.cb_consumed = NULL;
+    sr->in_headers.cb_finished = NULL;
+    sr->in_headers.stream      = &sr->stream;
+    mk_list_add(&sr->in_headers._head, &sr->stream.inputs);
+}
+
+/*
+ * Request scoped memory: it's valid until the request ends and must not be
+ * freed by the caller.
+ */
+static inline void *mk_http_request_alloc(struct mk_http_request *sr,
+                                          size_t size)
+{
+    return mk_arena_alloc(&sr->arena, size);
+}
+
+static inline char *mk_http_request_strdup(struct mk_http_request *sr,
+                                           const char *str, size_t len)
+{
+    return mk_arena_strndup(&sr->arena, str, len);
+}
+
+char *mk_http_request_printf(struct mk_http_request *sr, unsigned long *len,
+                             const char *fmt, ...) PRINTF_WARNINGS(3,4);
+
 #define mk_http_session_get(conn)               \
     (struct mk_http_session *)                  \
     (((void *) conn) + sizeof(struct mk_sched_conn))
@@ -0,0 +1,131 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_HTTP_CACHE_H
+#define MK_HTTP_CACHE_H
+
+#include <regex.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_stream.h>
+#include <monkey/mk_scheduler.h>
+
+/* Default shared memory budget (CacheMemory) in megabytes */
+#define MK_HTTP_CACHE_MEMORY      32
+
+#define MK_HTTP_CACHE_BUCKETS   1024   /* hash table size, power of two */
+#define MK_HTTP_CACHE_VARY_MAX     8   /* Vary headers per rule         */
+
+/* mk_http_cache_lookup() return values */
+#define MK_HTTP_CACHE_PASS         0   /* not cached, run the handler   */
+#define MK_HTTP_CACHE_HIT          1   /* response queued from memory   */
+#define MK_HTTP_CACHE_WAIT         2   /* parked until the fill is done */
+
+/* Entry status */
+#define MK_HTTP_CACHE_FILLING      0
+#define MK_HTTP_CACHE_READY        1
+
+/* Request role */
+#define MK_HTTP_CACHE_REQ_FILL     0
+#define MK_HTTP_CACHE_REQ_WAIT     1
+#define MK_HTTP_CACHE_REQ_HIT      2
+
+/* Location rule from the [CACHE] section of a virtual host */
+struct mk_http_cache_rule {
+    regex_t match;
+    int ttl;                                    /* seconds             */
+    int n_vary;
+    mk_ptr_t vary[MK_HTTP_CACHE_VARY_MAX];      /* request header keys */
+    struct mk_list _head;                       /* link to vhost       */
+};
+
+/*
+ * A cached response. The entry is created by the first request that misses
+ * (FILLING) and becomes READY once that response was written in full to its
+ * client. The response is stored as:
+ *
+ *   [status line][header rows]["\r\n" + body]
+ *
+ * without the rows the core sets per request (Server, Date, Connection and
+ * Keep-Alive), those are added again on every hit.
+ */
+struct mk_http_cache_entry {
+    int status;
+    int http_status;
+    int linked;                   /* reachable from the hash table */
+    int refs;                     /* requests using it             */
+    unsigned int hash;
+    time_t expire;
+    time_t created;
+
+    char *key;
+    size_t key_len;
+
+    char *data;
+    size_t size;
+    size_t status_len;
+    size_t rows_len;
+
+    struct mk_list waiters;       /* requests parked on the fill   */
+    struct mk_list _head;         /* link to hash table bucket     */
+    struct mk_list _lru;          /* link to the eviction list     */
+};
+
+/* Per request state, referenced by sr->cache */
+struct mk_http_cache_req {
+    int role;
+    int parked;                   /* linked to a waiters/ready list */
+    struct mk_http_cache_rule *rule;
+    struct mk_http_cache_entry *entry;
+
+    struct mk_http_session *cs;
+    struct mk_http_request *sr;
+    struct mk_sched_worker *worker;
+
+    /* FILL: copy of the bytes written to the client */
+    char *buf;
+    size_t len;
+    size_t size;
+    int overflow;
+
+    /* HIT: response queued from the entry */
+    char age[32];
+    struct iovec io[6];
+    struct mk_iov iov;
+    struct mk_stream_input in;
+
+    struct mk_list _head;         /* link to waiters or ready list  */
+};
+
+struct mk_http_cache_rule *mk_http_cache_rule_create(char *match, int ttl);
+int mk_http_cache_rule_vary(struct mk_http_cache_rule *rule, char *header);
+void mk_http_cache_rule_free(struct mk_http_cache_rule *rule);
+
+int mk_http_cache_init(struct mk_server *server);
+void mk_http_cache_exit(struct mk_server *server);
+
+int mk_http_cache_lookup(struct mk_http_session *cs,
+                         struct mk_http_request *sr,
+                         struct mk_server *server);
+void mk_http_cache_request_free(struct mk_http_request *sr);
+void mk_http_cache_worker_wake(struct mk_sched_worker *sched,
+                               struct mk_server *server);
+
+#endif
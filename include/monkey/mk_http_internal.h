@@ -25,6 +25,9 @@
 #define MK_HEADER_IOV         32
 #define MK_HEADER_ETAG_SIZE   32
 
+/* Inline memory of the request arena, it grows in heap blocks if needed */
+#define MK_HTTP_ARENA_SIZE    1024
+
 struct response_headers
 {
     int status;
@@ -121,7 +124,11 @@ struct mk_http_request
 
     mk_ptr_t host;
     mk_ptr_t host_port;
+    mk_ptr_t if_match;
     mk_ptr_t if_modified_since;
+    mk_ptr_t if_none_match;
+    mk_ptr_t if_range;
+    mk_ptr_t if_unmodified_since;
     mk_ptr_t last_modified_since;
     mk_ptr_t range;
 
@@ -129,6 +136,15 @@ struct mk_http_request
 
     /* POST/PUT data */
     mk_ptr_t data;
+
+    /*
+     * Body of large requests: spilled to 'body_fd' and mapped on 'data'
+     * once complete, or handed to 'body_handler' as it arrives.
+     */
+    int body_mode;
+    int body_fd;
+    long body_stored;
+    struct mk_vhost_handler *body_handler;
     /*-----------------*/
 
     /*-Internal-*/
@@ -181,17 +197,40 @@ struct mk_http_request
      */
     void *handler_data;
 
+    /* Response cache state, NULL if the location is not cached */
+    struct mk_http_cache_req *cache;
+
     /* Parent Session */
     struct mk_http_session *session;
 
     /* coroutine thread (if any) */
     void *thread;
 
+    /* Library handlers: body batch still open to append chunks */
+    void *lib_batch;
+
+    /* Library handlers: job of a handler running on the thread pool */
+    void *lib_job;
+
+    /*
+     * Library handlers: topic subscription, the request stays open once
+     * the handler returns and 'lib_release' is invoked when it's freed.
+     */
+    void *lib_sub;
+    void (*lib_release)(struct mk_http_request *);
+
     /* Head to list of requests */
     struct mk_list _head;
 
     /* Response headers */
     struct response_headers headers;
+
+    /*
+     * Request scoped memory: everything allocated here is released at once
+     * when the request is done (see mk_http_request_alloc()).
+     */
+    struct mk_arena arena;
+    char arena_buf[MK_HTTP_ARENA_SIZE];
 };
 
 #endif
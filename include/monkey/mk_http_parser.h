@@ -80,7 +80,21 @@ enum {
     MK_ST_HEADER_VAL_STARTS ,
     MK_ST_HEADER_VALUE      ,
     MK_ST_HEADER_END        ,
-    MK_ST_BLOCK_END
+    MK_ST_BLOCK_END         ,
+
+    /* REQ_LEVEL_BODY (chunked) */
+    MK_ST_CHUNK_SIZE_START  ,
+    MK_ST_CHUNK_SIZE        ,
+    MK_ST_CHUNK_EXT         ,
+    MK_ST_CHUNK_SIZE_LF     ,
+    MK_ST_CHUNK_DATA        ,
+    MK_ST_CHUNK_DATA_CR     ,
+    MK_ST_CHUNK_DATA_LF     ,
+    MK_ST_CHUNK_TRAILER     ,
+    MK_ST_CHUNK_TRAILER_LINE,
+    MK_ST_CHUNK_TRAILER_LF  ,
+    MK_ST_CHUNK_END_LF      ,
+    MK_ST_CHUNK_DONE
 };
 
 /* Known HTTP Methods */
@@ -113,11 +127,16 @@ enum mk_request_headers {
     MK_HEADER_CONTENT_TYPE          ,
     MK_HEADER_HOST                  ,
     MK_HEADER_HTTP2_SETTINGS        ,
+    MK_HEADER_IF_MATCH              ,
     MK_HEADER_IF_MODIFIED_SINCE     ,
+    MK_HEADER_IF_NONE_MATCH         ,
+    MK_HEADER_IF_RANGE              ,
+    MK_HEADER_IF_UNMODIFIED_SINCE   ,
     MK_HEADER_LAST_MODIFIED         ,
     MK_HEADER_LAST_MODIFIED_SINCE   ,
     MK_HEADER_RANGE                 ,
     MK_HEADER_REFERER               ,
+    MK_HEADER_TRANSFER_ENCODING     ,
     MK_HEADER_UPGRADE               ,
     MK_HEADER_USER_AGENT            ,
     MK_HEADER_SIZEOF                ,
@@ -138,6 +157,9 @@ enum mk_request_headers {
 #define MK_UPGRADE_H2          "h2"
 #define MK_UPGRADE_H2C         "h2c"
 
+/* Transfer codings of a request body */
+#define MK_TE_CHUNKED          "chunked"
+
 struct mk_http_header {
     /* The header type/name, e.g: MK_HEADER_CONTENT_LENGTH */
     int type;
@@ -162,7 +184,6 @@ struct mk_http_parser {
     int                        status;  /* level status  */
     int                        next;    /* something next after status ? */
     int                        length;
-    int                        method;
 
     /* lookup fields */
     int                        start;
@@ -175,6 +196,19 @@ struct mk_http_parser {
     long int                   body_received;
     long int                   header_content_length;
 
+    /*
+     * Chunked body, decoded in place: the data is moved down from
+     * 'chunk_in' (next raw byte) to 'chunk_out' (end of the decoded
+     * data), 'chunk_size' is what is left of the current chunk and
+     * 'chunk_extra' counts the sizes, extensions and trailers.
+     */
+    int                        chunked;
+    int                        chunk_state;
+    int                        chunk_in;
+    int                        chunk_out;
+    long int                   chunk_size;
+    long int                   chunk_extra;
+
     /*
      * connection header value discovered: it can be set with
      * values:
@@ -197,8 +231,6 @@ struct mk_http_parser {
     int                        header_key;
     int                        header_sep;
     int                        header_val;
-    int                        header_min;
-    int                        header_max;
     int                        headers_extra_count;
 
     /* Known headers */
@@ -318,14 +350,11 @@ static inline void mk_http_parser_init(struct mk_http_parser *p)
     p->level  = REQ_LEVEL_FIRST;
     p->status = MK_ST_REQ_METHOD;
     p->chars  = -1;
-    p->method = -1;
 
     /* init headers */
     p->header_key = -1;
     p->header_sep = -1;
     p->header_val = -1;
-    p->header_min = -1;
-    p->header_max = -1;
     p->header_content_length = -1;
 
     /* init list header */
@@ -344,5 +373,18 @@ static inline int mk_http_parser_more(struct mk_http_parser *p, int len)
 
 int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                    char *buffer, int buf_len, struct mk_server *server);
+int mk_http_parser_chunked(struct mk_http_parser *p, char *buffer, int len,
+                           struct mk_server *server);
+
+/*
+ * Delimiter scanners of the parser. AUTO picks the widest one the CPU
+ * supports; the others are there to compare them.
+ */
+#define MK_HTTP_PARSER_SCAN_AUTO     0
+#define MK_HTTP_PARSER_SCAN_SCALAR   1
+#define MK_HTTP_PARSER_SCAN_SSE2     2
+#define MK_HTTP_PARSER_SCAN_AVX2     3
+
+int mk_http_parser_scan_init(int type);
 
 #endif /* MK_HTTP_H */
@@ -27,11 +27,20 @@
 #define MK_HTTP_THREAD_LIB     0
 #define MK_HTTP_THREAD_PLUGIN  1
 
+/* Default number of parked coroutines per worker (ThreadStacks) */
+#define MK_HTTP_THREAD_STACKS  64
+
+/* Default number of threads running blocking handlers (HandlerThreads) */
+#define MK_HTTP_THREAD_HANDLERS 4
+
 struct mk_http_thread {
     int close;                        /* Close TCP connection ?  */
     struct mk_http_session *session;  /* HTTP session            */
     struct mk_http_request *request;  /* HTTP request            */
     struct mk_thread       *parent;   /* Parent thread           */
+    char *guard;                      /* Stack guard page        */
+    char *stack_low;                  /* Stack limits            */
+    char *stack_high;
     struct mk_list _head;             /* Link to worker->threads */
 };
 
@@ -47,6 +56,11 @@ struct mk_http_thread *mk_http_thread_create(int type,
                                              int n_params,
                                              struct mk_list *params);
 int mk_http_thread_destroy(struct mk_http_thread *mth);
+int mk_http_thread_release(struct mk_http_thread *mth);
+
+void mk_http_thread_pool_init(struct mk_sched_worker *sched,
+                              struct mk_server *server);
+void mk_http_thread_pool_exit(struct mk_sched_worker *sched);
 
 int mk_http_thread_event(struct mk_event *event);
 
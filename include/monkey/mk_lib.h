@@ -30,11 +30,21 @@
 #include <monkey/mk_http_internal.h>
 
 #include <pthread.h>
+#include <sys/uio.h>
+
+struct mk_lib_pool;
+
+/* Topics: what to do with a subscriber having too much data queued */
+#define MK_TOPIC_SKIP     0       /* the message is not queued for it  */
+#define MK_TOPIC_CLOSE    1       /* the connection is closed          */
 
 struct mk_lib_ctx {
     pthread_t worker_tid;
     struct mk_server *server;
     struct mk_fifo *fifo;
+    struct mk_lib_pool *pool;     /* threads for blocking handlers */
+    int topics_qid;               /* fifo queue delivering to topics */
+    struct mk_list topics;
 };
 
 typedef struct mk_fifo_queue mk_mq_t;
@@ -55,6 +65,16 @@ MK_EXPORT int mk_vhost_create(mk_ctx_t *ctx, char *name);
 MK_EXPORT int mk_vhost_set(mk_ctx_t *ctx, int vid, ...);
 MK_EXPORT int mk_vhost_handler(mk_ctx_t *ctx, int vid, char *regex,
                                void (*cb)(mk_request_t *, void *), void *data);
+MK_EXPORT int mk_vhost_handler_blocking(mk_ctx_t *ctx, int vid, char *regex,
+                                        void (*cb)(mk_request_t *, void *),
+                                        void *data);
+MK_EXPORT int mk_vhost_handler_stream(mk_ctx_t *ctx, int vid, char *regex,
+                                      int (*cb_body)(mk_request_t *, char *,
+                                                     size_t, void *),
+                                      void (*cb)(mk_request_t *, void *),
+                                      void *data);
+MK_EXPORT int mk_vhost_cache(mk_ctx_t *ctx, int vid, char *regex, int ttl,
+                             char *vary);
 
 MK_EXPORT int mk_http_status(mk_request_t *req, int status);
 MK_EXPORT int mk_http_header(mk_request_t *req,
@@ -62,15 +82,34 @@ MK_EXPORT int mk_http_header(mk_request_t *req,
                              char *val, int val_len);
 MK_EXPORT int mk_http_send(mk_request_t *req, char *buf, size_t len,
                            void (*cb_finish)(mk_request_t *));
+MK_EXPORT int mk_http_send_buf(mk_request_t *req, char *buf, size_t len,
+                               void (*cb_free)(char *, void *), void *data);
+MK_EXPORT int mk_http_send_iov(mk_request_t *req, struct iovec *iov,
+                               int iovcnt);
+MK_EXPORT int mk_http_send_fd(mk_request_t *req, int fd, off_t offset,
+                              size_t len);
+MK_EXPORT int mk_http_flush(mk_request_t *req);
 MK_EXPORT int mk_http_done(mk_request_t *req);
 
 MK_EXPORT int mk_worker_callback(mk_ctx_t *ctx,
                                  void (*cb_func) (void *),
                                  void *data);
+MK_EXPORT int mk_worker_drain(mk_ctx_t *ctx, int wid, int drain);
+MK_EXPORT size_t mk_worker_stack_peak(mk_ctx_t *ctx);
 //MK_EXPORT int mk_mq_create(mk_ctx_t *ctx, char *name);
 MK_EXPORT int mk_mq_create(mk_ctx_t *ctx, char *name, void (*cb), void *data);
 
 MK_EXPORT int mk_mq_send(mk_ctx_t *ctx, int qid, void *data, size_t size);
+MK_EXPORT int mk_mq_send_worker(mk_ctx_t *ctx, int qid, int worker,
+                                void *data, size_t size);
+MK_EXPORT int mk_mq_send_key(mk_ctx_t *ctx, int qid, void *key,
+                             size_t key_len, void *data, size_t size);
+
+MK_EXPORT int mk_topic_create(mk_ctx_t *ctx, char *name,
+                              size_t max_pending, int policy);
+MK_EXPORT int mk_topic_subscribe(mk_ctx_t *ctx, int tid, mk_request_t *req);
+MK_EXPORT int mk_topic_publish(mk_ctx_t *ctx, int tid, void *data,
+                               size_t size);
 
 MK_EXPORT int mk_main();
 
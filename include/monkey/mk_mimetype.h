@@ -18,7 +18,6 @@
  */
 
 #include <monkey/mk_core.h>
-#include <rbtree.h>
 
 #ifndef MK_MIMETYPE_H
 #define MK_MIMETYPE_H
@@ -26,13 +25,17 @@
 #define MIMETYPE_DEFAULT_TYPE "text/plain\r\n"
 #define MIMETYPE_DEFAULT_NAME "default"
 
+/* Initial slots of the extensions table, it doubles when half full */
+#define MIMETYPE_TABLE_SIZE   256
+
 struct mk_mimetype
 {
     char *name;
+    int name_len;
+    unsigned int hash;
     mk_ptr_t type;
     mk_ptr_t header_type;
     struct mk_list _head;
-    struct rb_tree_node _rb_head;
 };
 
 int mk_mimetype_init(struct mk_server *server);
@@ -240,6 +240,15 @@ struct plugin_api
 #ifdef JEMALLOC_STATS
     int (*je_mallctl) (const char *, void *, size_t *, void *, size_t);
 #endif
+
+    /*
+     * Request scoped memory, released when the request ends. New members
+     * go last so plugins built against an older header keep working.
+     */
+    void *(*request_alloc) (struct mk_http_request *, size_t);
+    char *(*request_strdup) (struct mk_http_request *, const char *, size_t);
+    char *(*request_printf) (struct mk_http_request *, unsigned long *,
+                             const char *, ...) PRINTF_WARNINGS(3,4);
 };
 
 extern struct plugin_api *api;
@@ -35,6 +35,7 @@
 
 #define MK_SCHED_SIGNAL_DEADBEEF  0xDEADBEEF
 #define MK_SCHED_SIGNAL_FREE_ALL  0xFFEE0000
+#define MK_SCHED_SIGNAL_HTTP_CACHE 0xFFEE0001
 
 /*
  * Scheduler balancing mode:
@@ -50,6 +51,101 @@
 #define MK_SCHEDULER_FAIR_BALANCING   0
 #define MK_SCHEDULER_REUSEPORT        1
 
+/* Size of a CPU cache line, used to keep shared counters apart */
+#define MK_SCHED_CACHELINE           64
+
+/*
+ * Fair Balancing handoff: the acceptor thread accepts up to
+ * MK_SCHED_ACCEPT_BATCH connections per listener event and pushes them
+ * to the queue of the target worker, every worker owns a bounded queue
+ * of MK_SCHED_HANDOFF_SIZE slots (power of two).
+ */
+#define MK_SCHED_ACCEPT_BATCH        64
+#define MK_SCHED_HANDOFF_SIZE      1024
+
+struct mk_sched_handoff_slot {
+    uint64_t seq;
+    int fd;
+    struct mk_server_listen *listener;
+};
+
+/*
+ * Bounded multi-producer / single-consumer queue of accepted connections.
+ * Producer and consumer positions live on different cache lines, the
+ * consumer is woken up through 'fd' (an eventfd when available).
+ */
+struct mk_sched_handoff {
+    uint64_t enqueue_pos __attribute__ ((aligned(MK_SCHED_CACHELINE)));
+    int signaled;
+
+    uint64_t dequeue_pos __attribute__ ((aligned(MK_SCHED_CACHELINE)));
+    int fd_r;
+    int fd_w;
+    struct mk_event event;
+    struct mk_sched_handoff_slot *slots;
+};
+
+/*
+ * Calls that other threads want to run on a worker (library mode): they
+ * are pushed to a lock-free stack and only the push finding it empty
+ * wakes the worker up. Calls still pending when the worker exits get
+ * cb_cancel instead of cb.
+ */
+struct mk_sched_call {
+    void (*cb)(struct mk_sched_call *);
+    void (*cb_cancel)(struct mk_sched_call *);
+    struct mk_sched_call *next;
+};
+
+struct mk_sched_calls {
+    struct mk_sched_call *head;   /* last pushed call               */
+    int fd_r;
+    int fd_w;
+    struct mk_event event;
+};
+
+/* Connection object pools per worker, one per object size */
+#define MK_SCHED_CONN_POOLS           4
+
+/*
+ * Free list of connection objects (struct mk_sched_conn plus the protocol
+ * extra size) owned by a worker: objects are taken and returned by the
+ * same thread, so no locking is needed.
+ */
+struct mk_sched_conn_pool {
+    size_t size;                  /* object size, zero if slot unused */
+    unsigned int live;            /* objects in use                   */
+    unsigned int free;            /* objects in the free list         */
+    struct mk_list free_list;
+};
+
+/*
+ * Read buffers shared by the connections of a worker: a connection only
+ * holds one while a request is being read and served, idle keep-alive
+ * connections hold none.
+ */
+struct mk_sched_buf_pool {
+    size_t size;                  /* usable bytes per buffer           */
+    unsigned int keep;            /* max buffers kept in the free list */
+    unsigned int live;            /* buffers in use                    */
+    unsigned int free;            /* buffers in the free list          */
+    struct mk_list free_list;
+};
+
+/*
+ * Coroutines running the library handlers. A finished coroutine is parked
+ * with its stack and picked up again by the next handler invocation.
+ */
+struct mk_sched_co_pool {
+    size_t stack_size;            /* usable stack bytes per coroutine  */
+    size_t stack_peak;            /* highest stack usage measured      */
+    int stack_check;              /* measure the stack usage?          */
+    unsigned int keep;            /* max coroutines kept parked        */
+    unsigned int live;            /* coroutines running a handler      */
+    unsigned int free;            /* coroutines parked                 */
+    struct mk_list free_list;
+};
+
 /*
  * Thread-scope structure/variable that holds the Scheduler context for the
  * worker (or thread) in question.
@@ -59,10 +155,22 @@ struct mk_sched_worker
     /* The event loop on this scheduler thread */
     struct mk_event_loop *loop;
 
-    unsigned long long accepted_connections;
+    /*
+     * Connection counters: written by the worker only and read by the
+     * acceptor thread in Fair Balancing mode, they get their own cache
+     * line so the reads do not bounce the worker hot fields.
+     */
+    unsigned long long accepted_connections
+                       __attribute__ ((aligned(MK_SCHED_CACHELINE)));
     unsigned long long closed_connections;
     unsigned long long over_capacity;
 
+    /* Fair Balancing: connections handed by the acceptor thread */
+    struct mk_sched_handoff handoff;
+
+    /* Library mode: calls of the handlers running on the thread pool */
+    struct mk_sched_calls calls;
+
     /*
      * The timeout queue represents client connections that
      * have not initiated it requests or the request status
@@ -73,6 +181,8 @@ struct mk_sched_worker
 
     short int idx;
     unsigned char initialized;
+    int cpu;                      /* pinned CPU or -1 (WorkerAffinity) */
+    int drained;                  /* REUSEPORT: no new connections      */
 
     pthread_t tid;
     pid_t pid;
@@ -85,6 +195,11 @@ struct mk_sched_worker
 
     struct mk_list event_free_queue;
 
+    /* Closed connections returned to the pools after each loop round */
+    struct mk_list conn_free_queue;
+    struct mk_sched_conn_pool conn_pools[MK_SCHED_CONN_POOLS];
+    struct mk_sched_buf_pool read_buffers;
+
     /*
      * This variable is used to signal the active workers,
      * just available because of ULONG_MAX bug described
@@ -105,6 +220,7 @@ struct mk_sched_worker
     /* List of co-routine threads */
     struct mk_list threads;
     struct mk_list threads_purge;
+    struct mk_sched_co_pool coroutines;
 
 };
 
@@ -122,6 +238,7 @@ struct mk_sched_conn
     struct mk_plugin_network *net;     /* I/O network layer            */
     struct mk_channel channel;         /* stream channel               */
     struct mk_list timeout_head;       /* link to the timeout queue    */
+    struct mk_sched_conn_pool *pool;   /* owner pool, NULL if malloc'd */
     void *data;                        /* optional ref for protocols   */
 };
 
@@ -213,6 +330,15 @@ struct mk_sched_ctx {
 
 
 struct mk_sched_worker *mk_sched_next_target(struct mk_server *server);
+int mk_sched_handoff_push(struct mk_sched_worker *sched, int fd,
+                          struct mk_server_listen *listener);
+void mk_sched_handoff_signal(struct mk_sched_worker *sched);
+int mk_sched_handoff_pop(struct mk_sched_worker *sched, int *fd,
+                         struct mk_server_listen **listener);
+void mk_sched_handoff_ack(struct mk_sched_worker *sched);
+int mk_sched_call_push(struct mk_sched_worker *sched,
+                       struct mk_sched_call *call);
+void mk_sched_calls_run(struct mk_sched_worker *sched);
 int mk_sched_init(struct mk_server *server);
 int mk_sched_exit(struct mk_server *server);
 
@@ -285,6 +411,14 @@ int mk_sched_event_close(struct mk_sched_conn *conn,
 void mk_sched_event_free(struct mk_event *event);
 
 
+void mk_sched_conn_pool_put(struct mk_sched_worker *sched,
+                            struct mk_sched_conn *conn);
+void mk_sched_conn_pool_trim(struct mk_sched_worker *sched,
+                             struct mk_server *server);
+
+char *mk_sched_buf_get(struct mk_sched_worker *sched);
+void mk_sched_buf_put(struct mk_sched_worker *sched, char *buf);
+
 static inline void mk_sched_event_free_all(struct mk_sched_worker *sched)
 {
     struct mk_list *tmp;
@@ -296,6 +430,12 @@ static inline void mk_sched_event_free_all(struct mk_sched_worker *sched)
         mk_list_del(&event->_head);
         mk_mem_free(event);
     }
+
+    mk_list_foreach_safe(head, tmp, &sched->conn_free_queue) {
+        event = mk_list_entry(head, struct mk_event, _head);
+        mk_list_del(&event->_head);
+        mk_sched_conn_pool_put(sched, (struct mk_sched_conn *) event);
+    }
 }
 
 static inline void mk_sched_conn_timeout_add(struct mk_sched_conn *conn,
@@ -336,6 +476,8 @@ void mk_sched_worker_cb_free(struct mk_server *server);
 int mk_sched_send_signal(struct mk_server *server, uint64_t val);
 int mk_sched_workers_join(struct mk_server *server);
 int mk_sched_threads_purge(struct mk_sched_worker *sched);
+int mk_sched_threads_destroy_conn(struct mk_sched_worker *sched,
+                                  struct mk_sched_conn *conn);
 int mk_sched_threads_destroy_all(struct mk_sched_worker *sched);
 
 #endif
@@ -65,6 +65,9 @@ int mk_server_listen_check(struct mk_server_listen *listen, int server_fd);
 void mk_server_listen_free();
 struct mk_list *mk_server_listen_init(struct mk_server *server);
 
+int mk_server_reuseport_steer(struct mk_server *server);
+int mk_server_reuseport_drain(struct mk_server *server, int wid, int drain);
+
 unsigned int mk_server_capacity(struct mk_server *server);
 void mk_server_launch_workers(struct mk_server *server);
 void mk_server_worker_loop(struct mk_server *server);
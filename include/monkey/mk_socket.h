@@ -60,6 +60,7 @@ int mk_socket_set_tcp_fastopen(int sockfd);
 int mk_socket_set_tcp_nodelay(int sockfd);
 int mk_socket_set_tcp_defer_accept(int sockfd);
 int mk_socket_set_tcp_reuseport(int sockfd);
+int mk_socket_set_incoming_cpu(int sockfd, int cpu);
 int mk_socket_set_nonblocking(int sockfd);
 
 int mk_socket_create(int domain, int type, int protocol);
@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2016 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_STATIC_PLUGINS_H
+#define MK_STATIC_PLUGINS_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_plugin.h>
+
+extern struct mk_plugin mk_plugin_liana;
+
+
+static void mk_static_plugins(struct mk_list *plugins)
+{
+    struct mk_plugin *p;
+
+    
+    p = &mk_plugin_liana;
+    mk_list_add(&p->_head, plugins);
+
+}
+
+#endif
@@ -67,6 +67,14 @@ struct mk_channel {
     struct mk_plugin_network *io;
     struct mk_list streams;
     void *thread;
+
+    /*
+     * Optional tap: every chunk of data written to the socket is passed
+     * to this callback, returning -1 detaches it. The response cache uses
+     * it to keep a copy of what a handler sent.
+     */
+    int (*cb_written)(struct mk_channel *, char *, size_t);
+    void *written_data;
 };
 
 /* Stream input source */
@@ -26,8 +26,6 @@
 
 /* mk_cache.c */
 extern __thread struct mk_iov *mk_tls_cache_iov_header;
-extern __thread mk_ptr_t *mk_tls_cache_header_cl;
-extern __thread mk_ptr_t *mk_tls_cache_header_lm;
 extern __thread struct tm *mk_tls_cache_gmtime;
 extern __thread struct mk_gmt_cache *mk_tls_cache_gmtext;
 
@@ -53,8 +51,6 @@ extern __thread struct mk_server_timeout *mk_tls_server_timeout;
 
 /* mk_cache.c */
 pthread_key_t mk_tls_cache_iov_header;
-pthread_key_t mk_tls_cache_header_cl;
-pthread_key_t mk_tls_cache_header_lm;
 pthread_key_t mk_tls_cache_gmtime;
 pthread_key_t mk_tls_cache_gmtext;
 
@@ -76,8 +72,6 @@ pthread_key_t mk_tls_server_timeout;
 #define MK_TLS_INIT()                                           \
     /* mk_cache.c */                                            \
     pthread_key_create(&mk_tls_cache_iov_header, NULL);         \
-    pthread_key_create(&mk_tls_cache_header_cl, NULL);          \
-    pthread_key_create(&mk_tls_cache_header_lm, NULL);          \
     pthread_key_create(&mk_tls_cache_gmtime, NULL);             \
     pthread_key_create(&mk_tls_cache_gmtext, NULL);             \
                                                                 \
@@ -41,10 +41,11 @@ struct mk_gmt_cache {
 
 int    mk_utils_utime2gmt(char **data, time_t date);
 time_t mk_utils_gmt2utime(char *date);
+time_t mk_utils_http_date(const char *date, int len);
 
 int mk_buffer_cat(mk_ptr_t * p, char *buf1, int len1, char *buf2, int len2);
 
-char *mk_utils_url_decode(mk_ptr_t req_uri);
+char *mk_utils_url_decode(mk_ptr_t req_uri, struct mk_arena *arena);
 void mk_utils_stacktrace(void);
 
 unsigned int mk_utils_gen_hash(const void *key, int len);
@@ -29,6 +29,8 @@ struct mk_vhost_error_page {
     short int status;
     char *file;
     char *real_path;
+    char *data;                     /* page content, loaded with the vhost */
+    size_t size;
     struct mk_list _head;
 };
 
@@ -37,8 +39,23 @@ struct mk_vhost_handler_param {
     struct mk_list _head;
 };
 
+/* How a handler rule is matched against the URI */
+#define MK_VHOST_MATCH_REGEX     0         /* regexec() fallback             */
+#define MK_VHOST_MATCH_ANY       1         /* '.*', matches everything       */
+#define MK_VHOST_MATCH_EXACT     2         /* '^/status$'                    */
+#define MK_VHOST_MATCH_PREFIX    3         /* '^/api/'                       */
+#define MK_VHOST_MATCH_SUFFIX    4         /* '\.php$'                       */
+#define MK_VHOST_MATCH_CONTAINS  5         /* '/cgi-bin/'                    */
+
+/* Per worker cache of handler lookups on vhosts with regex rules */
+#define MK_VHOST_ROUTE_CACHE     32
+#define MK_VHOST_ROUTE_URI_MAX   96
+
 struct mk_vhost_handler {
     void *match;                           /* regex match rule               */
+    int match_type;                        /* MK_VHOST_MATCH_*               */
+    int match_len;                         /* literal length                 */
+    char *match_str;                       /* literal of non regex rules     */
     char *name;                            /* plugin handler name            */
     int n_params;                          /* number of parameters           */
 
@@ -46,6 +63,9 @@ struct mk_vhost_handler {
     void (*cb) (struct mk_http_request *, void *);
     void *data;
 
+    /* lib mode: receives the request body as it arrives */
+    int (*cb_body) (struct mk_http_request *, char *, size_t, void *);
+
     struct mk_list params;                 /* parameters given by config     */
     struct mk_plugin *handler;             /* handler plugin                 */
     struct mk_list _head;                  /* link to vhost->handlers        */
@@ -69,6 +89,9 @@ struct mk_vhost
     /* content handlers */
     struct mk_list handlers;
 
+    /* response cache rules (struct mk_http_cache_rule) */
+    struct mk_list cache_rules;
+
     /* link node */
     struct mk_list _head;
 };
@@ -78,6 +101,11 @@ struct mk_vhost_alias
     char *name;
     unsigned int len;
 
+    /* lookup index: '*.example.com' entries match any subdomain */
+    int wildcard;
+    unsigned int hash;
+    struct mk_vhost *host;
+
     struct mk_list _head;
 };
 
@@ -103,6 +131,7 @@ struct vhost_fdt_host {
 };
 
 struct mk_vhost *mk_vhost_read(char *path);
+int mk_vhost_index(struct mk_server *server);
 int mk_vhost_get(mk_ptr_t host, struct mk_vhost **vhost, struct
                  mk_vhost_alias **alias,
                  struct mk_server *server);
@@ -119,5 +148,8 @@ struct mk_vhost_handler *mk_vhost_handler_match(char *match,
                                                 void (*cb)(struct mk_http_request *,
                                                            void *),
                                                 void *data);
+struct mk_vhost_handler *mk_vhost_handler_next(struct mk_vhost *host,
+                                               struct mk_vhost_handler *prev,
+                                               char *uri, int len);
 
 #endif
@@ -305,7 +305,10 @@ int main(int argc, char **argv)
      * Once the all configuration is set, let mk_server configure the
      * internals. Not accepting connections yet.
      */
-    mk_server_setup(server);
+    if (mk_server_setup(server) != 0) {
+        mk_err("Server setup failed. Aborting.");
+        exit(EXIT_FAILURE);
+    }
 
     /* Register PID of Monkey */
     mk_utils_register_pid(server->path_conf_pidfile);
@@ -0,0 +1,139 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <mk_core/mk_memory.h>
+#include <mk_core/mk_macros.h>
+#include <mk_core/mk_arena.h>
+
+/* Slow path: the current block is full, chain a new one */
+void *mk_arena_alloc_block(struct mk_arena *arena, size_t size)
+{
+    size_t total;
+    char *data;
+    struct mk_arena_block *block;
+
+    total = sizeof(struct mk_arena_block) + size;
+    if (total < MK_ARENA_BLOCK_SIZE) {
+        total = MK_ARENA_BLOCK_SIZE;
+    }
+
+    block = mk_mem_alloc(total);
+    if (!block) {
+        return NULL;
+    }
+    block->size = total;
+    block->next = arena->blocks;
+    arena->blocks = block;
+
+    /* The header size keeps the data aligned to MK_ARENA_ALIGN */
+    data = (char *) block + sizeof(struct mk_arena_block);
+    arena->pos = data + size;
+    arena->end = (char *) block + total;
+
+    return data;
+}
+
+char *mk_arena_strndup(struct mk_arena *arena, const char *str, size_t len)
+{
+    char *buf;
+
+    buf = mk_arena_alloc(arena, len + 1);
+    if (!buf) {
+        return NULL;
+    }
+
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+
+    return buf;
+}
+
+/* Same as mk_string_build() but the result lives in the arena */
+char *mk_arena_vprintf(struct mk_arena *arena, unsigned long *len,
+                       const char *fmt, va_list ap)
+{
+    int n;
+    size_t avail;
+    char *buf;
+    va_list aq;
+
+    /* Try to format in place using what's left of the current block */
+    buf = mk_arena_alloc(arena, 0);
+    if (!buf) {
+        return NULL;
+    }
+    avail = arena->end - buf;
+
+    va_copy(aq, ap);
+    n = vsnprintf(buf, avail, fmt, aq);
+    va_end(aq);
+
+    if (n < 0) {
+        return NULL;
+    }
+
+    if ((size_t) n >= avail) {
+        buf = mk_arena_alloc(arena, n + 1);
+        if (!buf) {
+            return NULL;
+        }
+        vsnprintf(buf, n + 1, fmt, ap);
+    }
+    else {
+        arena->pos = buf + n + 1;
+    }
+
+    if (len) {
+        *len = n;
+    }
+
+    return buf;
+}
+
+char *mk_arena_printf(struct mk_arena *arena, unsigned long *len,
+                      const char *fmt, ...)
+{
+    char *buf;
+    va_list ap;
+
+    va_start(ap, fmt);
+    buf = mk_arena_vprintf(arena, len, fmt, ap);
+    va_end(ap);
+
+    return buf;
+}
+
+void mk_arena_release(struct mk_arena *arena)
+{
+    struct mk_arena_block *next;
+    struct mk_arena_block *block;
+
+    block = arena->blocks;
+    while (block) {
+        next = block->next;
+        mk_mem_free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
@@ -0,0 +1,206 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <pthread.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_affinity.h>
+
+#define MK_AFFINITY_MAX_CPUS   1024
+
+#if defined (__linux__)
+static int affinity_add(struct mk_server *server, int cpu)
+{
+    int *tmp;
+
+    tmp = mk_mem_realloc(server->workers_cpus,
+                         sizeof(int) * (server->workers_ncpus + 1));
+    if (!tmp) {
+        return -1;
+    }
+    tmp[server->workers_ncpus++] = cpu;
+    server->workers_cpus = tmp;
+
+    return 0;
+}
+
+/* Parse a CPU list like '0-3,8,10-11' */
+static int affinity_list(char *value, struct mk_server *server)
+{
+    int cpu;
+    long first;
+    long last;
+    char *p = value;
+    char *end;
+
+    while (*p) {
+        while (*p == ' ' || *p == ',') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= MK_AFFINITY_MAX_CPUS) {
+            return -1;
+        }
+        last = first;
+        p = end;
+
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= MK_AFFINITY_MAX_CPUS) {
+                return -1;
+            }
+            p = end;
+        }
+
+        if (*p != '\0' && *p != ',' && *p != ' ') {
+            return -1;
+        }
+
+        for (cpu = first; cpu <= last; cpu++) {
+            if (affinity_add(server, cpu) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    return server->workers_ncpus > 0 ? 0 : -1;
+}
+
+/* Returns true if 'cpu' is the first hardware thread of its core */
+static int affinity_cpu_primary(int cpu)
+{
+    int first;
+    char path[128];
+    char *buf;
+
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%i/topology/thread_siblings_list",
+             cpu);
+    buf = mk_file_to_buffer(path);
+    if (!buf) {
+        return MK_TRUE;
+    }
+    first = atoi(buf);
+    mk_mem_free(buf);
+
+    return (first == cpu);
+}
+
+/*
+ * Topology aware layout: the CPUs the process may run on, one hardware
+ * thread per core first and then their siblings, so workers do not share
+ * a core until every core has one. CPUs are kept in id order, which
+ * groups them by socket (NUMA node) on most systems.
+ */
+static int affinity_auto(struct mk_server *server)
+{
+    int i;
+    int pass;
+    int primary;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        mk_libc_error("sched_getaffinity");
+        return -1;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (!CPU_ISSET(i, &set)) {
+                continue;
+            }
+            primary = affinity_cpu_primary(i);
+            if ((pass == 0 && primary) || (pass == 1 && !primary)) {
+                if (affinity_add(server, i) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return server->workers_ncpus > 0 ? 0 : -1;
+}
+#endif
+
+/*
+ * Parse the WorkerAffinity value: 'Off', 'Auto' or a CPU list. Returns -1
+ * if the value is invalid.
+ */
+int mk_affinity_parse(char *value, struct mk_server *server)
+{
+    mk_mem_free(server->workers_cpus);
+    server->workers_cpus = NULL;
+    server->workers_ncpus = 0;
+
+    if (strcasecmp(value, "Off") == 0) {
+        return 0;
+    }
+
+#if defined (__linux__)
+    if (strcasecmp(value, "Auto") == 0) {
+        return affinity_auto(server);
+    }
+    return affinity_list(value, server);
+#else
+    mk_warn("WorkerAffinity is not supported on this platform");
+    return 0;
+#endif
+}
+
+/* CPU assigned to a worker, -1 if workers are not pinned */
+int mk_affinity_worker_cpu(struct mk_server *server, int wid)
+{
+    if (server->workers_ncpus == 0) {
+        return -1;
+    }
+
+    return server->workers_cpus[wid % server->workers_ncpus];
+}
+
+/* Pin the calling thread to 'cpu' */
+int mk_affinity_set(int cpu)
+{
+#if defined (__linux__)
+    int ret;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        return -1;
+    }
+
+    return 0;
+#else
+    (void) cpu;
+    return -1;
+#endif
+}
@@ -31,19 +31,6 @@
 void mk_cache_worker_init()
 {
     char *cache_error;
-    mk_ptr_t *p_tmp;
-
-    /* Cache header request -> last modified */
-    p_tmp = mk_mem_alloc_z(sizeof(mk_ptr_t));
-    p_tmp->data = mk_mem_alloc_z(32);
-    p_tmp->len = -1;
-    MK_TLS_SET(mk_tls_cache_header_lm, p_tmp);
-
-    /* Cache header request -> content length */
-    p_tmp = mk_mem_alloc_z(sizeof(mk_ptr_t));
-    p_tmp->data = mk_mem_alloc_z(MK_UTILS_INT2MKP_BUFFER_LEN);
-    p_tmp->len = -1;
-    MK_TLS_SET(mk_tls_cache_header_cl, p_tmp);
 
     /* Cache gmtime buffer */
     MK_TLS_SET(mk_tls_cache_gmtime, mk_mem_alloc(sizeof(struct tm)));
@@ -61,14 +48,6 @@ void mk_cache_worker_exit()
 {
     char *cache_error;
 
-    /* Cache header request -> last modified */
-    mk_ptr_free(MK_TLS_GET(mk_tls_cache_header_lm));
-    mk_mem_free(MK_TLS_GET(mk_tls_cache_header_lm));
-
-    /* Cache header request -> content length */
-    mk_ptr_free(MK_TLS_GET(mk_tls_cache_header_cl));
-    mk_mem_free(MK_TLS_GET(mk_tls_cache_header_cl));
-
     /* Cache gmtime buffer */
     mk_mem_free(MK_TLS_GET(mk_tls_cache_gmtime));
 
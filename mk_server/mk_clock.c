@@ -19,133 +19,110 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <pthread.h>
 #include <time.h>
-#include <unistd.h>
 
 #include <monkey/mk_core.h>
 #include <monkey/mk_config.h>
 #include <monkey/mk_clock.h>
-#include <monkey/mk_utils.h>
 
-pthread_t mk_clock_tid;
+/* Only the second matters, a coarse clock saves the hardware read */
+#ifdef CLOCK_REALTIME_COARSE
+#define MK_CLOCK_SOURCE CLOCK_REALTIME_COARSE
+#else
+#define MK_CLOCK_SOURCE CLOCK_REALTIME
+#endif
+
+struct mk_clock_cache {
+    time_t log_utime;
+    time_t headers_utime;
+    struct mk_server *server;
+
+    mk_ptr_t log_time;
+    mk_ptr_t headers_preset;
+
+    char log_buffer[LOG_TIME_BUFFER_SIZE];
+    char headers_buffer[HEADER_PRESET_SIZE];
+};
 
-time_t log_current_utime;
 time_t monkey_init_time;
 
-mk_ptr_t log_current_time = { NULL, LOG_TIME_BUFFER_SIZE - 2 };
-mk_ptr_t headers_preset = { NULL, HEADER_PRESET_SIZE - 1 };
+static __thread struct mk_clock_cache clock_cache;
 
-static char *log_time_buffers[2];
-static char *header_time_buffers[2];
+time_t mk_clock_now()
+{
+    struct timespec ts;
 
-/*
- * The mk_ptr_ts have two buffers for avoid in half-way access from
- * another thread while a buffer is being modified. The function below returns
- * one of two buffers to work with.
- */
-static inline char *_next_buffer(mk_ptr_t *pointer, char **buffers)
+    clock_gettime(MK_CLOCK_SOURCE, &ts);
+    return ts.tv_sec;
+}
+
+uint64_t mk_clock_now_msec()
 {
-    if (pointer->data == buffers[0]) {
-        return buffers[1];
-    }
-    else {
-        return buffers[0];
-    }
+    struct timespec ts;
+
+    clock_gettime(MK_CLOCK_SOURCE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static void mk_clock_log_set_time(time_t utime)
+mk_ptr_t *mk_clock_log_time()
 {
-    char *time_string;
+    time_t utime;
     struct tm result;
+    struct mk_clock_cache *cache = &clock_cache;
 
-    time_string = _next_buffer(&log_current_time, log_time_buffers);
-    log_current_utime = utime;
+    utime = mk_clock_now();
+    if (cache->log_utime == utime && cache->log_time.data) {
+        return &cache->log_time;
+    }
 
-    strftime(time_string, LOG_TIME_BUFFER_SIZE, "[%d/%b/%G %T %z]",
-             localtime_r(&utime, &result));
+    cache->log_time.len = strftime(cache->log_buffer, LOG_TIME_BUFFER_SIZE,
+                                   "[%d/%b/%G %T %z]",
+                                   localtime_r(&utime, &result));
+    cache->log_time.data = cache->log_buffer;
+    cache->log_utime = utime;
 
-    log_current_time.data = time_string;
+    return &cache->log_time;
 }
 
-static void mk_clock_headers_preset(time_t utime, struct mk_server *server)
+/* Server signature and Date headers, sent on every response */
+mk_ptr_t *mk_clock_headers_preset(struct mk_server *server)
 {
     int len1;
     int len2;
-    struct tm *gmt_tm;
+    time_t utime;
     struct tm result;
-    char *buffer;
+    struct mk_clock_cache *cache = &clock_cache;
 
-    buffer = _next_buffer(&headers_preset, header_time_buffers);
-
-    gmt_tm = gmtime_r(&utime, &result);
+    utime = mk_clock_now();
+    if (cache->headers_utime == utime && cache->server == server) {
+        return &cache->headers_preset;
+    }
 
-    len1 = snprintf(buffer,
+    len1 = snprintf(cache->headers_buffer,
                     HEADER_TIME_BUFFER_SIZE,
                     "%s",
                     server->server_signature_header);
+    if (len1 >= HEADER_TIME_BUFFER_SIZE) {
+        len1 = HEADER_TIME_BUFFER_SIZE - 1;
+    }
 
-    len2 = strftime(buffer + len1,
+    len2 = strftime(cache->headers_buffer + len1,
                     HEADER_PRESET_SIZE - len1,
                     MK_CLOCK_GMT_DATEFORMAT,
-                    gmt_tm);
-
-    headers_preset.data = buffer;
-    headers_preset.len  = len1 + len2;
-}
+                    gmtime_r(&utime, &result));
 
-void *mk_clock_worker_init(void *data)
-{
-    time_t cur_time;
-    struct mk_server *server = data;
+    cache->headers_preset.data = cache->headers_buffer;
+    cache->headers_preset.len  = len1 + len2;
+    cache->headers_utime = utime;
+    cache->server = server;
 
-    mk_utils_worker_rename("monkey: clock");
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-
-    mk_clock_tid = pthread_self();
-
-    while (1) {
-        cur_time = time(NULL);
-
-        if(cur_time != ((time_t)-1)) {
-            mk_clock_log_set_time(cur_time);
-            mk_clock_headers_preset(cur_time, server);
-        }
-        sleep(1);
-    }
-
-    return NULL;
-}
-
-void mk_clock_exit()
-{
-    pthread_cancel(mk_clock_tid);
-    pthread_join(mk_clock_tid, NULL);
-
-    mk_mem_free(header_time_buffers[0]);
-    mk_mem_free(header_time_buffers[1]);
-    mk_mem_free(log_time_buffers[0]);
-    mk_mem_free(log_time_buffers[1]);
+    return &cache->headers_preset;
 }
 
-/* This function must be called before any threads are created */
 void mk_clock_sequential_init(struct mk_server *server)
 {
-    /* Time when monkey was started */
-    monkey_init_time = time(NULL);
-
-    header_time_buffers[0] = mk_mem_alloc_z(HEADER_PRESET_SIZE);
-    header_time_buffers[1] = mk_mem_alloc_z(HEADER_PRESET_SIZE);
-
-    log_time_buffers[0] = mk_mem_alloc_z(LOG_TIME_BUFFER_SIZE);
-    log_time_buffers[1] = mk_mem_alloc_z(LOG_TIME_BUFFER_SIZE);
+    (void) server;
 
-
-    /* Set the time once */
-    time_t cur_time = time(NULL);
-
-    if (cur_time != ((time_t)-1)) {
-        mk_clock_log_set_time(cur_time);
-        mk_clock_headers_preset(cur_time, server);
-    }
+    /* Time when monkey was started */
+    monkey_init_time = mk_clock_now();
 }
@@ -29,6 +29,9 @@
 #include <monkey/mk_vhost.h>
 #include <monkey/mk_mimetype.h>
 #include <monkey/mk_info.h>
+#include <monkey/mk_http_cache.h>
+#include <monkey/mk_affinity.h>
+#include <monkey/mk_http_thread.h>
 
 #include <ctype.h>
 #include <limits.h>
@@ -105,6 +108,10 @@ void mk_config_free_all(struct mk_server *server)
 
     mk_config_listeners_free(server);
 
+    if (server->workers_cpus) {
+        mk_mem_free(server->workers_cpus);
+    }
+
     mk_ptr_free(&server->server_software);
     mk_mem_free(server);
 }
@@ -278,8 +285,16 @@ static int mk_config_listen_read(struct mk_rconf_section *section,
 static int mk_config_read_files(char *path_conf, char *file_conf,
                                 struct mk_server *server)
 {
+    int num;
+    int ret;
+    long cache_mb;
     unsigned long len;
+    char *end;
     char *tmp = NULL;
+    char *cache_memory;
+    char *conn_pool;
+    char *read_buf;
+    char *affinity;
     struct stat checkdir;
     struct mk_rconf *cnf;
     struct mk_rconf_section *section;
@@ -345,6 +360,29 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
         }
     }
 
+    /* Worker threads CPU affinity */
+    affinity = mk_rconf_section_get_key(section, "WorkerAffinity",
+                                        MK_RCONF_STR);
+    if (affinity) {
+        ret = mk_affinity_parse(affinity, server);
+        mk_mem_free(affinity);
+        if (ret != 0) {
+            mk_config_print_error_msg("WorkerAffinity", tmp);
+        }
+    }
+
+    /* Connection objects preallocated by each worker */
+    conn_pool = mk_rconf_section_get_key(section, "ConnectionPool",
+                                         MK_RCONF_STR);
+    if (conn_pool) {
+        num = atoi(conn_pool);
+        mk_mem_free(conn_pool);
+        if (num < 0) {
+            mk_config_print_error_msg("ConnectionPool", tmp);
+        }
+        server->conn_pool_size = num;
+    }
+
     /* Timeout */
     server->timeout = (size_t) mk_rconf_section_get_key(section,
                                                            "Timeout", MK_RCONF_NUM);
@@ -423,6 +461,55 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
         server->max_request_size *= 1024;
     }
 
+    /* Shared read buffers: size (KB) and how many each worker keeps */
+    read_buf = mk_rconf_section_get_key(section, "ReadBufferSize",
+                                        MK_RCONF_STR);
+    if (read_buf) {
+        num = atoi(read_buf);
+        mk_mem_free(read_buf);
+        if (num <= 0) {
+            mk_config_print_error_msg("ReadBufferSize", tmp);
+        }
+        server->read_buf_size = num * 1024;
+    }
+
+    read_buf = mk_rconf_section_get_key(section, "ReadBuffers",
+                                        MK_RCONF_STR);
+    if (read_buf) {
+        num = atoi(read_buf);
+        mk_mem_free(read_buf);
+        if (num < 0) {
+            mk_config_print_error_msg("ReadBuffers", tmp);
+        }
+        server->read_buf_pool = num;
+    }
+
+    /* Request bodies bigger than this (KB) are spilled to disk */
+    read_buf = mk_rconf_section_get_key(section, "BodySpillSize",
+                                        MK_RCONF_STR);
+    if (read_buf) {
+        num = atoi(read_buf);
+        mk_mem_free(read_buf);
+        if (num <= 0) {
+            mk_config_print_error_msg("BodySpillSize", tmp);
+        }
+        server->body_spill_size = num * 1024;
+    }
+
+    /* Response Cache Memory (MB) */
+    cache_memory = mk_rconf_section_get_key(section, "CacheMemory",
+                                            MK_RCONF_STR);
+    if (cache_memory) {
+        cache_mb = strtol(cache_memory, &end, 10);
+        ret = (end == cache_memory || *end != '\0' ||
+               cache_mb < 0 || (unsigned long) cache_mb > (SIZE_MAX >> 20));
+        mk_mem_free(cache_memory);
+        if (ret) {
+            mk_config_print_error_msg("CacheMemory", tmp);
+        }
+        server->cache_memory = (size_t) cache_mb * 1024 * 1024;
+    }
+
     /* Symbolic Links */
     server->symlink = (size_t) mk_rconf_section_get_key(section,
                                                      "SymLink", MK_RCONF_BOOL);
@@ -604,6 +691,20 @@ void mk_config_set_init_values(struct mk_server *server)
      * so we are setting a maximum request size to 32 KB */
     server->max_request_size = MK_REQUEST_CHUNK * 8;
 
+    /* Shared read buffers */
+    server->read_buf_size = MK_REQUEST_CHUNK;
+    server->read_buf_pool = MK_REQUEST_BUFFERS;
+    server->body_spill_size = MK_HTTP_BODY_SPILL_SIZE * 1024;
+
+    /* Coroutines for library handlers */
+    server->thread_stack_size = MK_THREAD_STACK_SIZE;
+    server->thread_stack_pool = MK_HTTP_THREAD_STACKS;
+    server->thread_stack_check = MK_FALSE;
+    server->handler_threads = MK_HTTP_THREAD_HANDLERS;
+
+    /* Response cache memory budget */
+    server->cache_memory = MK_HTTP_CACHE_MEMORY * 1024 * 1024;
+
     /* Internals */
     server->safe_event_write = MK_FALSE;
 
@@ -20,42 +20,63 @@
 #include <monkey/mk_fifo.h>
 #include <monkey/mk_scheduler.h>
 
+#include <fcntl.h>
+
+#ifdef MK_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 static struct mk_fifo_worker *mk_fifo_worker_create(struct mk_fifo *ctx,
-                                                    void *data)
+                                                    int id, void *data)
 {
-    int id;
-    int ret;
     struct mk_fifo_worker *fw;
+#ifndef MK_HAVE_EVENTFD
+    int ret;
+    int channel[2];
+#endif
 
-    /* Get an ID */
-    id = mk_list_size(&ctx->workers);
-
-    fw = mk_mem_alloc(sizeof(struct mk_fifo_worker));
+    fw = mk_mem_alloc_aligned(MK_FIFO_CACHELINE,
+                              sizeof(struct mk_fifo_worker));
     if (!fw) {
         perror("malloc");
         return NULL;
     }
+    memset(fw, '\0', sizeof(struct mk_fifo_worker));
     MK_EVENT_NEW(&fw->event);
 
     fw->worker_id = id;
     fw->data = data;
     fw->fifo = ctx;
 
-    fw->buf_data = mk_mem_alloc(MK_FIFO_BUF_SIZE);
-    if (!fw->buf_data) {
+    fw->slots = mk_mem_alloc(sizeof(struct mk_fifo_msg *) * MK_FIFO_RING_SIZE);
+    if (!fw->slots) {
         perror("malloc");
         mk_mem_free(fw);
         return NULL;
     }
-    fw->buf_len = 0;
-    fw->buf_size = MK_FIFO_BUF_SIZE;
 
-    ret = pipe(fw->channel);
+#ifdef MK_HAVE_EVENTFD
+    fw->fd_r = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fw->fd_r == -1) {
+        perror("eventfd");
+        mk_mem_free(fw->slots);
+        mk_mem_free(fw);
+        return NULL;
+    }
+    fw->fd_w = fw->fd_r;
+#else
+    ret = pipe(channel);
     if (ret == -1) {
         perror("pipe");
+        mk_mem_free(fw->slots);
         mk_mem_free(fw);
         return NULL;
     }
+    fcntl(channel[0], F_SETFL, O_NONBLOCK);
+    fcntl(channel[1], F_SETFL, O_NONBLOCK);
+    fw->fd_r = channel[0];
+    fw->fd_w = channel[1];
+#endif
 
     mk_list_add(&fw->_head, &ctx->workers);
     return fw;
@@ -69,18 +90,44 @@ static struct mk_fifo_worker *mk_fifo_worker_create(struct mk_fifo *ctx,
  */
 void mk_fifo_worker_setup(void *data)
 {
+    int id;
     struct mk_fifo_worker *mw = NULL;
     struct mk_fifo *ctx = data;
+    struct mk_server *server = ctx->data;
+    struct mk_sched_worker *sched = mk_sched_get_thread_conf();
 
     pthread_mutex_lock(&ctx->mutex_init);
 
-    mw = mk_fifo_worker_create(ctx, data);
+    /* Workers are addressed by their scheduler index */
+    if (!ctx->worker_ids) {
+        ctx->worker_ids = mk_mem_alloc_z(sizeof(struct mk_fifo_worker *) *
+                                         server->workers);
+        if (!ctx->worker_ids) {
+            pthread_mutex_unlock(&ctx->mutex_init);
+            return;
+        }
+        ctx->n_workers = server->workers;
+    }
+
+    id = sched ? sched->idx : mk_list_size(&ctx->workers);
+    if (id >= ctx->n_workers) {
+        mk_err("[msg] invalid worker id %i", id);
+        pthread_mutex_unlock(&ctx->mutex_init);
+        return;
+    }
+
+    mw = mk_fifo_worker_create(ctx, id, data);
     if (!mw) {
         mk_err("[msg] error configuring msg-worker context ");
         pthread_mutex_unlock(&ctx->mutex_init);
         return;
     }
 
+    /* Publish the worker to the senders */
+    pthread_mutex_lock(&ctx->mutex_send);
+    ctx->worker_ids[id] = mw;
+    pthread_mutex_unlock(&ctx->mutex_send);
+
     /* Make the current worker context available */
     pthread_setspecific(*ctx->key, mw);
     pthread_mutex_unlock(&ctx->mutex_init);
@@ -90,7 +137,7 @@ struct mk_fifo *mk_fifo_create(pthread_key_t *key, void *data)
 {
     struct mk_fifo *ctx;
 
-    ctx = mk_mem_alloc(sizeof(struct mk_fifo));
+    ctx = mk_mem_alloc_z(sizeof(struct mk_fifo));
     if (!ctx) {
         perror("malloc");
         return NULL;
@@ -106,6 +153,8 @@ struct mk_fifo *mk_fifo_create(pthread_key_t *key, void *data)
     ctx->key = key;
     pthread_key_create(ctx->key, NULL);
     pthread_mutex_init(&ctx->mutex_init, NULL);
+    pthread_mutex_init(&ctx->mutex_send, NULL);
+    pthread_cond_init(&ctx->cond_send, NULL);
 
     return ctx;
 }
@@ -132,8 +181,8 @@ int mk_fifo_queue_create(struct mk_fifo *ctx, char *name,
 
     /* queue name might need to be truncated if is too long */
     len = strlen(name);
-    if (len > (int) sizeof(name) - 1) {
-        len = sizeof(name) - 1;
+    if (len > (int) sizeof(q->name) - 1) {
+        len = sizeof(q->name) - 1;
     }
 
     /* Validate that name is not a duplicated */
@@ -218,6 +267,32 @@ static int mk_fifo_queue_destroy_all(struct mk_fifo *ctx)
     return c;
 }
 
+static struct mk_fifo_msg *fifo_msg_create(int id, void *data, size_t size,
+                                           int refs)
+{
+    struct mk_fifo_msg *msg;
+
+    msg = mk_mem_alloc(sizeof(struct mk_fifo_msg) + size);
+    if (!msg) {
+        perror("malloc");
+        return NULL;
+    }
+    msg->refs = refs;
+    msg->length = size;
+    msg->flags = 0;
+    msg->queue_id = (uint16_t) id;
+    memcpy(msg->data, data, size);
+
+    return msg;
+}
+
+static inline void fifo_msg_release(struct mk_fifo_msg *msg)
+{
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        mk_mem_free(msg);
+    }
+}
+
 static int mk_fifo_worker_destroy_all(struct mk_fifo *ctx)
 {
     int c = 0;
@@ -227,182 +302,219 @@ static int mk_fifo_worker_destroy_all(struct mk_fifo *ctx)
 
     mk_list_foreach_safe(head, tmp, &ctx->workers) {
         fw = mk_list_entry(head, struct mk_fifo_worker, _head);
-        close(fw->channel[0]);
-        close(fw->channel[1]);
+
+        /* Messages never consumed */
+        while (fw->head != fw->tail) {
+            fifo_msg_release(fw->slots[fw->head & (MK_FIFO_RING_SIZE - 1)]);
+            fw->head++;
+        }
+
+        close(fw->fd_r);
+        if (fw->fd_w != fw->fd_r) {
+            close(fw->fd_w);
+        }
         mk_list_del(&fw->_head);
-        mk_mem_free(fw->buf_data);
+        mk_mem_free(fw->slots);
         mk_mem_free(fw);
         c++;
     }
+    mk_mem_free(ctx->worker_ids);
+    ctx->worker_ids = NULL;
 
     return c;
 }
 
-static int msg_write(int fd, void *buf, size_t count)
+/*
+ * Producer side: reference the message from the worker ring, if the ring
+ * is full wait until the worker consumes some messages. Called with
+ * ctx->mutex_send held.
+ */
+static void fifo_ring_push(struct mk_fifo *ctx, struct mk_fifo_worker *fw,
+                           struct mk_fifo_msg *msg)
 {
-    ssize_t bytes;
-    size_t total = 0;
-
-    do {
-        bytes = write(fd, buf + total, count - total);
-        if (bytes == -1) {
-            if (errno == EAGAIN) {
-                /*
-                 * This could happen, since this function goal is not to
-                 * return until all data have been read, just sleep a little
-                 * bit (0.05 seconds)
-                 */
-                usleep(50000);
-                continue;
-            }
-        }
-        else if (bytes == 0) {
-            /* Broken pipe ? */
-            perror("write");
-            return -1;
+    int ret;
+    uint64_t val = 1;
+    uint64_t tail = fw->tail;
+
+    while (tail - __atomic_load_n(&fw->head, __ATOMIC_ACQUIRE) >=
+           MK_FIFO_RING_SIZE) {
+        __atomic_store_n(&fw->waiting, MK_TRUE, __ATOMIC_SEQ_CST);
+        if (tail - __atomic_load_n(&fw->head, __ATOMIC_SEQ_CST) <
+            MK_FIFO_RING_SIZE) {
+            break;
         }
-        total += bytes;
+        pthread_cond_wait(&ctx->cond_send, &ctx->mutex_send);
+    }
 
-    } while (total < count);
+    fw->slots[tail & (MK_FIFO_RING_SIZE - 1)] = msg;
+    __atomic_store_n(&fw->tail, tail + 1, __ATOMIC_RELEASE);
 
-    return total;
+    /* Wake up the worker, only if it was not already notified */
+    if (__atomic_exchange_n(&fw->signaled, MK_TRUE, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    ret = write(fw->fd_w, &val, sizeof(val));
+    if (ret == -1 && errno != EAGAIN) {
+        perror("write");
+    }
 }
 
 /*
- * Push a message into a queue: this function runs from the parent thread
- * so it needs to write the message to every thread pipe channel.
+ * Push a message into a queue: this function runs from the parent thread.
+ * The 'worker' target is a worker index, MK_FIFO_ALL or MK_FIFO_ANY; a
+ * broadcast message is written once and shared by the workers. If 'count'
+ * is set it gets the number of rings the message goes to before any worker
+ * can read it.
  */
-int mk_fifo_send(struct mk_fifo *ctx, int id, void *data, size_t size)
+static int fifo_send(struct mk_fifo *ctx, int id, int worker,
+                     void *data, size_t size, int *count)
 {
-    int ret;
-    struct mk_list *head;
-    struct mk_fifo_msg msg;
-    struct mk_fifo_queue *q;
-    struct mk_fifo_worker *fw;
+    int i;
+    int refs = 0;
+    struct mk_fifo_msg *msg;
+    struct mk_fifo_worker *fw = NULL;
 
     /* Validate queue ID */
-    q = mk_fifo_queue_get(ctx, id);
-    if (!q) {
+    if (!mk_fifo_queue_get(ctx, id)) {
         return -1;
     }
 
-    mk_list_foreach(head, &ctx->workers) {
-        fw = mk_list_entry(head, struct mk_fifo_worker, _head);
-
-        msg.length = size;
-        msg.flags = 0;
-        msg.queue_id = (uint16_t) id;
+    pthread_mutex_lock(&ctx->mutex_send);
 
-        ret = msg_write(fw->channel[1], &msg, sizeof(struct mk_fifo_msg));
-        if (ret == -1) {
-            perror("write");
-            fprintf(stderr, "[msg] error writing message header\n");
-            return -1;
+    if (worker == MK_FIFO_ALL) {
+        for (i = 0; i < ctx->n_workers; i++) {
+            if (ctx->worker_ids[i]) {
+                refs++;
+            }
+        }
+    }
+    else if (worker == MK_FIFO_ANY) {
+        for (i = 0; i < ctx->n_workers && !fw; i++) {
+            fw = ctx->worker_ids[ctx->next_worker++ % ctx->n_workers];
         }
+        refs = (fw != NULL);
+    }
+    else if (worker >= 0 && worker < ctx->n_workers) {
+        fw = ctx->worker_ids[worker];
+        refs = (fw != NULL);
+    }
 
-        ret = msg_write(fw->channel[1], data, size);
-        if (ret == -1) {
-            perror("write");
-            fprintf(stderr, "[msg] error writing message body\n");
-            return -1;
+    if (count) {
+        *count = refs;
+    }
+
+    if (refs == 0) {
+        pthread_mutex_unlock(&ctx->mutex_send);
+        return (worker == MK_FIFO_ALL) ? 0 : -1;
+    }
+
+    msg = fifo_msg_create(id, data, size, refs);
+    if (!msg) {
+        pthread_mutex_unlock(&ctx->mutex_send);
+        return -1;
+    }
+
+    if (fw) {
+        fifo_ring_push(ctx, fw, msg);
+    }
+    else {
+        for (i = 0; i < ctx->n_workers; i++) {
+            if (ctx->worker_ids[i]) {
+                fifo_ring_push(ctx, ctx->worker_ids[i], msg);
+            }
         }
     }
 
+    pthread_mutex_unlock(&ctx->mutex_send);
     return 0;
 }
 
-static inline void consume_bytes(char *buf, int bytes, int length)
+int mk_fifo_send_worker(struct mk_fifo *ctx, int id, int worker,
+                        void *data, size_t size)
 {
-    memmove(buf, buf + bytes, length - bytes);
+    return fifo_send(ctx, id, worker, data, size, NULL);
 }
 
-static inline int fifo_drop_msg(struct mk_fifo_worker *fw)
+/* Deliver a message to every worker */
+int mk_fifo_send(struct mk_fifo *ctx, int id, void *data, size_t size)
 {
-    size_t drop_bytes;
-    struct mk_fifo_msg *msg;
-
-    msg = (struct mk_fifo_msg *) fw->buf_data;
-    drop_bytes = (sizeof(struct mk_fifo_msg) + msg->length);
-    consume_bytes(fw->buf_data, drop_bytes, fw->buf_len);
-    fw->buf_len -= drop_bytes;
+    return fifo_send(ctx, id, MK_FIFO_ALL, data, size, NULL);
+}
 
-    return 0;
+/*
+ * Deliver a message to every worker registered so far, 'count' gets their
+ * number (see fifo_send()).
+ */
+int mk_fifo_send_count(struct mk_fifo *ctx, int id, void *data, size_t size,
+                       int *count)
+{
+    return fifo_send(ctx, id, MK_FIFO_ALL, data, size, count);
 }
 
-static inline int fifo_is_msg_ready(struct mk_fifo_worker *fw)
+/* Deliver a message to a worker chosen by 'key': same key, same worker */
+int mk_fifo_send_key(struct mk_fifo *ctx, int id, void *key, size_t key_len,
+                     void *data, size_t size)
 {
-    struct mk_fifo_msg *msg;
+    unsigned int hash;
 
-    msg = (struct mk_fifo_msg *) fw->buf_data;
-    if (fw->buf_len >= (msg->length + sizeof(struct mk_fifo_msg))) {
-        return MK_TRUE;
+    if (ctx->n_workers == 0) {
+        return -1;
     }
 
-    return MK_FALSE;
+    hash = mk_string_hash(key, key_len, MK_STR_SENSITIVE);
+    return mk_fifo_send_worker(ctx, id, hash % ctx->n_workers, data, size);
 }
 
+/* Consumer side: run the callbacks of every message queued so far */
 int mk_fifo_worker_read(void *event)
 {
-    int available;
-    char *tmp;
-    size_t size;
-    ssize_t bytes;
+    int ret;
+    uint64_t val;
+    uint64_t head;
+    uint64_t tail;
     struct mk_fifo_msg *fm;
     struct mk_fifo_worker *fw;
     struct mk_fifo_queue *fq;
+    struct mk_fifo *ctx;
 
     fw = (struct mk_fifo_worker *) event;
+    ctx = fw->fifo;
 
-    /* Check available space */
-    available = fw->buf_size - fw->buf_len;
-    if (available <= 1) {
-        size = fw->buf_size + (MK_FIFO_BUF_SIZE / 2);
-        tmp = mk_mem_realloc(fw->buf_data, size);
-        if (!tmp) {
-            perror("realloc");
-            return -1;
-        }
-        fw->buf_data = tmp;
-        fw->buf_size = size;
-        available = fw->buf_size - fw->buf_len;
-    }
-
-    /* Read data from pipe */
-    bytes = read(fw->channel[0], fw->buf_data + fw->buf_len, available);
-    if (bytes == 0) {
-        return -1;
-    }
-    else if (bytes == -1){
+    ret = read(fw->fd_r, &val, sizeof(val));
+    if (ret == -1 && errno != EAGAIN) {
         perror("read");
         return -1;
     }
 
-    fw->buf_len += bytes;
-
-    /* Find messages and trigger callbacks */
-    while (fw->buf_len > 0) {
-        if (fifo_is_msg_ready(fw) == MK_TRUE) {
-            /* we got a complete message */
-            fm = (struct mk_fifo_msg *) fw->buf_data;
-            fq = mk_fifo_queue_get(fw->fifo, fm->queue_id);
-            if (!fq) {
-                /* Invalid queue */
-                fprintf(stderr, "[fifo worker read] invalid queue id %i\n",
-                        fm->queue_id);
-                fifo_drop_msg(fw);
-                continue;
-            }
+    /* New messages must notify again, nothing pushed from now is missed */
+    __atomic_store_n(&fw->signaled, MK_FALSE, __ATOMIC_SEQ_CST);
 
-            /* Trigger callback if any */
-            if (fq->cb_message) {
-                fq->cb_message(fq, fm->data, fm->length, fq->data);
-            }
-            fifo_drop_msg(fw);
+    head = fw->head;
+    tail = __atomic_load_n(&fw->tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        fm = fw->slots[head & (MK_FIFO_RING_SIZE - 1)];
+        head++;
+
+        fq = mk_fifo_queue_get(ctx, fm->queue_id);
+        if (!fq) {
+            /* Invalid queue */
+            fprintf(stderr, "[fifo worker read] invalid queue id %i\n",
+                    fm->queue_id);
         }
-        else {
-            /* msg not ready */
-            break;
+        else if (fq->cb_message) {
+            fq->cb_message(fq, fm->data, fm->length, fq->data);
         }
+        fifo_msg_release(fm);
+    }
+    __atomic_store_n(&fw->head, head, __ATOMIC_SEQ_CST);
+
+    /* A producer waits for free slots */
+    if (__atomic_load_n(&fw->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&ctx->mutex_send);
+        fw->waiting = MK_FALSE;
+        pthread_cond_broadcast(&ctx->cond_send);
+        pthread_mutex_unlock(&ctx->mutex_send);
     }
 
     return 0;
@@ -412,6 +524,8 @@ int mk_fifo_destroy(struct mk_fifo *ctx)
 {
     mk_fifo_queue_destroy_all(ctx);
     mk_fifo_worker_destroy_all(ctx);
+    pthread_mutex_destroy(&ctx->mutex_send);
+    pthread_cond_destroy(&ctx->cond_send);
     mk_mem_free(ctx);
     return 0;
 }
@@ -29,7 +29,6 @@
 #include <monkey/mk_cache.h>
 #include <monkey/mk_http.h>
 #include <monkey/mk_vhost.h>
-#include <monkey/mk_tls.h>
 
 #define MK_HEADER_SHORT_DATE       "Date: "
 #define MK_HEADER_SHORT_LOCATION   "Location: "
@@ -162,15 +161,221 @@ static void cb_stream_iov_extended_free(struct mk_stream_input *in)
     mk_iov_free(iov);
 }
 
-/* Send response headers */
+/*
+ * Header templates: the status line and the rows that only depend on the
+ * status, connection policy, content type and transfer encoding are
+ * rendered once per worker and reused for every response with the same
+ * shape. The per-response values are appended right after.
+ */
+#define MK_HEADER_TPL_SLOTS     32
+#define MK_HEADER_TPL_SIZE      256
+
+/* Connection row codes */
+#define MK_HEADER_TPL_CONN_NONE     0
+#define MK_HEADER_TPL_CONN_KA       1
+#define MK_HEADER_TPL_CONN_CLOSE    2
+#define MK_HEADER_TPL_CONN_UPGRADE  3
+
+/* Room for a Content-Range row, see mk_header_content_range() */
+#define MK_HEADER_CONTENT_RANGE_MAX 128
+
+struct mk_header_tpl {
+    int status;         /* HTTP status, zero means unused slot */
+    int conn;           /* MK_HEADER_TPL_CONN_* */
+    int chunked;
+    int h2c;
+    unsigned long ct_len;
+    int ct_offset;      /* Content-Type row offset inside data */
+    int status_len;     /* status line length, the preset goes after it */
+    int len;
+    char data[MK_HEADER_TPL_SIZE];
+};
+
+static __thread struct mk_header_tpl mk_header_tpls[MK_HEADER_TPL_SLOTS];
+
+/* Write the Connection, Content-Type, Transfer-Encoding and Upgrade rows */
+static int mk_header_fixed_rows(char *buf, struct response_headers *sh,
+                                int conn, int *ct_offset)
+{
+    int len = 0;
+    const mk_ptr_t *row = NULL;
+
+    switch (conn) {
+    case MK_HEADER_TPL_CONN_KA:
+        row = &mk_header_conn_ka;
+        break;
+    case MK_HEADER_TPL_CONN_CLOSE:
+        row = &mk_header_conn_close;
+        break;
+    case MK_HEADER_TPL_CONN_UPGRADE:
+        row = &mk_header_conn_upgrade;
+        break;
+    }
+    if (row) {
+        memcpy(buf, row->data, row->len);
+        len += row->len;
+    }
+
+    *ct_offset = len;
+    if (sh->content_type.len > 0) {
+        memcpy(buf + len, sh->content_type.data, sh->content_type.len);
+        len += sh->content_type.len;
+    }
+
+    /*
+     * Transfer Encoding: the transfer encoding header is just sent when
+     * the response has some content defined by the HTTP status response
+     */
+    if (sh->transfer_encoding == MK_HEADER_TE_TYPE_CHUNKED) {
+        memcpy(buf + len, mk_header_te_chunked.data, mk_header_te_chunked.len);
+        len += mk_header_te_chunked.len;
+    }
+
+    if (sh->upgrade == MK_HEADER_UPGRADED_H2C) {
+        memcpy(buf + len, mk_header_upgrade_h2c.data,
+               mk_header_upgrade_h2c.len);
+        len += mk_header_upgrade_h2c.len;
+    }
+
+    return len;
+}
+
+/* Upper bound of mk_header_fixed_rows() output */
+static inline int mk_header_fixed_rows_size(struct response_headers *sh)
+{
+    return mk_header_conn_close.len + mk_header_conn_upgrade.len +
+        sh->content_type.len + mk_header_te_chunked.len +
+        mk_header_upgrade_h2c.len;
+}
+
+/*
+ * Lookup the template for the response shape, render it on a miss. It
+ * returns NULL when the response cannot be templated (custom status or
+ * rows too large), the caller renders the rows in place then.
+ */
+static struct mk_header_tpl *mk_header_tpl_get(struct response_headers *sh,
+                                               mk_ptr_t *response, int conn)
+{
+    int ct_offset;
+    int chunked;
+    int h2c;
+    unsigned int slot;
+    struct mk_header_tpl *tpl;
+
+    if (sh->status == MK_CUSTOM_STATUS ||
+        response->len + mk_header_fixed_rows_size(sh) > MK_HEADER_TPL_SIZE) {
+        return NULL;
+    }
+
+    chunked = (sh->transfer_encoding == MK_HEADER_TE_TYPE_CHUNKED);
+    h2c = (sh->upgrade == MK_HEADER_UPGRADED_H2C);
+
+    slot  = sh->status * 31 + sh->content_type.len * 7;
+    slot += (conn << 2) | (chunked << 1) | h2c;
+    tpl = &mk_header_tpls[slot & (MK_HEADER_TPL_SLOTS - 1)];
+
+    if (tpl->status == sh->status && tpl->conn == conn &&
+        tpl->chunked == chunked && tpl->h2c == h2c &&
+        tpl->ct_len == sh->content_type.len &&
+        memcmp(tpl->data + tpl->ct_offset, sh->content_type.data,
+               tpl->ct_len) == 0) {
+        return tpl;
+    }
+
+    /* Miss: render the template, replacing the previous slot owner */
+    memcpy(tpl->data, response->data, response->len);
+    tpl->len = response->len;
+    tpl->len += mk_header_fixed_rows(tpl->data + tpl->len, sh, conn,
+                                     &ct_offset);
+    tpl->status     = sh->status;
+    tpl->conn       = conn;
+    tpl->chunked    = chunked;
+    tpl->h2c        = h2c;
+    tpl->ct_len     = sh->content_type.len;
+    tpl->ct_offset  = response->len + ct_offset;
+    tpl->status_len = response->len;
+
+    return tpl;
+}
+
+static int mk_header_content_range(char *buf, struct response_headers *sh)
+{
+    int len = 0;
+
+    /* yyy- */
+    if (sh->ranges[0] >= 0 && sh->ranges[1] == -1) {
+        len = snprintf(buf, MK_HEADER_CONTENT_RANGE_MAX,
+                       "%s bytes %d-%ld/%ld\r\n",
+                       RH_CONTENT_RANGE,
+                       sh->ranges[0],
+                       (sh->real_length - 1),
+                       sh->real_length);
+    }
+    /* yyy-xxx */
+    else if (sh->ranges[0] >= 0 && sh->ranges[1] >= 0) {
+        len = snprintf(buf, MK_HEADER_CONTENT_RANGE_MAX,
+                       "%s bytes %d-%d/%ld\r\n",
+                       RH_CONTENT_RANGE,
+                       sh->ranges[0], sh->ranges[1],
+                       sh->real_length);
+    }
+    /* -xxx */
+    else if (sh->ranges[0] == -1 && sh->ranges[1] > 0) {
+        len = snprintf(buf, MK_HEADER_CONTENT_RANGE_MAX,
+                       "%s bytes %ld-%ld/%ld\r\n",
+                       RH_CONTENT_RANGE,
+                       (sh->real_length - sh->ranges[1]),
+                       (sh->real_length - 1),
+                       sh->real_length);
+    }
+
+    if (len < 0 || len >= MK_HEADER_CONTENT_RANGE_MAX) {
+        return 0;
+    }
+    return len;
+}
+
+/* Write a decimal number followed by CRLF, returns the bytes written */
+static int mk_header_ltoa(char *buf, long n)
+{
+    int len;
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+
+    do {
+        *--p = '0' + (n % 10);
+        n /= 10;
+    } while (n > 0);
+
+    len = (tmp + sizeof(tmp)) - p;
+    memcpy(buf, p, len);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+
+    return len;
+}
+
+/*
+ * Send response headers: the whole block (template, clock preset and the
+ * per-response rows) is written into one request scoped buffer so the
+ * headers go out as a single iov entry.
+ */
 int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                       struct mk_server *server)
 {
     int i = 0;
-    unsigned long len = 0;
-    char *buffer = 0;
+    int ret;
+    int conn;
+    int ct_offset;
+    int location_len = 0;
+    size_t size;
+    size_t len = 0;
+    char *buf;
+    char *lm;
     mk_ptr_t response;
+    mk_ptr_t *preset;
     struct response_headers *sh;
+    struct mk_header_tpl *tpl;
     struct mk_iov *iov;
 
     sh = &sr->headers;
@@ -194,7 +399,24 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
     /* Invalid status set */
     mk_bug(i == status_response_len);
 
-    mk_iov_add(iov, response.data, response.len, MK_FALSE);
+    /* Connection */
+    conn = MK_HEADER_TPL_CONN_NONE;
+    if (sh->connection == 0) {
+        if (cs->close_now == MK_FALSE) {
+            if (sr->connection.len > 0 &&
+                sr->protocol != MK_HTTP_PROTOCOL_11) {
+                conn = MK_HEADER_TPL_CONN_KA;
+            }
+        }
+        else {
+            conn = MK_HEADER_TPL_CONN_CLOSE;
+        }
+    }
+    else if (sh->connection == MK_HEADER_CONN_UPGRADED) {
+        conn = MK_HEADER_TPL_CONN_UPGRADE;
+    }
+
+    tpl = mk_header_tpl_get(sh, &response, conn);
 
     /*
      * Preset headers (mk_clock.c):
@@ -202,178 +424,123 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
      * - Server
      * - Date
      */
-    mk_iov_add(iov,
-               headers_preset.data,
-               headers_preset.len,
-               MK_FALSE);
+    preset = mk_clock_headers_preset(server);
 
-    /* Last-Modified */
+    /* Upper bound of the header block */
+    size = preset->len + mk_iov_crlf.len;
+    if (tpl) {
+        size += tpl->len;
+    }
+    else {
+        size += response.len + mk_header_fixed_rows_size(sh);
+    }
     if (sh->last_modified > 0) {
-        mk_ptr_t *lm = MK_TLS_GET(mk_tls_cache_header_lm);
-        lm->len = mk_utils_utime2gmt(&lm->data, sh->last_modified);
+        size += mk_header_last_modified.len + 32;
+    }
+    if (sh->location != NULL) {
+        location_len = strlen(sh->location);
+        size += mk_header_short_location.len + location_len;
+    }
+    if (sh->allow_methods.len > 0) {
+        size += mk_header_allow.len + sh->allow_methods.len;
+    }
+    if (sh->etag_len > 0) {
+        size += sh->etag_len;
+    }
+    if (sh->content_encoding.len > 0) {
+        size += mk_header_content_encoding.len + sh->content_encoding.len;
+    }
+    size += mk_header_content_length.len + 24 + MK_HEADER_CONTENT_RANGE_MAX;
 
-        mk_iov_add(iov,
-                   mk_header_last_modified.data,
-                   mk_header_last_modified.len,
-                   MK_FALSE);
-        mk_iov_add(iov,
-                   lm->data,
-                   lm->len,
-                   MK_FALSE);
+    buf = mk_http_request_alloc(sr, size);
+    if (!buf) {
+        return -1;
     }
 
-    /* Connection */
-    if (sh->connection == 0) {
-        if (cs->close_now == MK_FALSE) {
-            if (sr->connection.len > 0) {
-                if (sr->protocol != MK_HTTP_PROTOCOL_11) {
-                    mk_iov_add(iov,
-                               mk_header_conn_ka.data,
-                               mk_header_conn_ka.len,
-                               MK_FALSE);
-                }
-            }
+    /* Status line, preset and the fixed rows */
+    if (tpl) {
+        memcpy(buf, tpl->data, tpl->status_len);
+        len = tpl->status_len;
+        memcpy(buf + len, preset->data, preset->len);
+        len += preset->len;
+        memcpy(buf + len, tpl->data + tpl->status_len,
+               tpl->len - tpl->status_len);
+        len += tpl->len - tpl->status_len;
+    }
+    else {
+        memcpy(buf, response.data, response.len);
+        len = response.len;
+        memcpy(buf + len, preset->data, preset->len);
+        len += preset->len;
+        len += mk_header_fixed_rows(buf + len, sh, conn, &ct_offset);
+    }
+
+    /* Last-Modified */
+    if (sh->last_modified > 0) {
+        memcpy(buf + len, mk_header_last_modified.data,
+               mk_header_last_modified.len);
+        len += mk_header_last_modified.len;
+
+        lm = buf + len;
+        ret = mk_utils_utime2gmt(&lm, sh->last_modified);
+        if (ret > 0) {
+            len += ret;
         }
         else {
-            mk_iov_add(iov,
-                       mk_header_conn_close.data,
-                       mk_header_conn_close.len,
-                       MK_FALSE);
+            len -= mk_header_last_modified.len;
         }
     }
-    else if (sh->connection == MK_HEADER_CONN_UPGRADED) {
-             mk_iov_add(iov,
-                        mk_header_conn_upgrade.data,
-                        mk_header_conn_upgrade.len,
-                        MK_FALSE);
-    }
 
     /* Location */
     if (sh->location != NULL) {
-        mk_iov_add(iov,
-                   mk_header_short_location.data,
-                   mk_header_short_location.len,
-                   MK_FALSE);
-
-        mk_iov_add(iov,
-                   sh->location,
-                   strlen(sh->location),
-                   MK_TRUE);
+        memcpy(buf + len, mk_header_short_location.data,
+               mk_header_short_location.len);
+        len += mk_header_short_location.len;
+        memcpy(buf + len, sh->location, location_len);
+        len += location_len;
     }
 
     /* allowed methods */
     if (sh->allow_methods.len > 0) {
-        mk_iov_add(iov,
-                   mk_header_allow.data,
-                   mk_header_allow.len,
-                   MK_FALSE);
-        mk_iov_add(iov,
-                   sh->allow_methods.data,
-                   sh->allow_methods.len,
-                   MK_FALSE);
-    }
-
-    /* Content type */
-    if (sh->content_type.len > 0) {
-        mk_iov_add(iov,
-                   sh->content_type.data,
-                   sh->content_type.len,
-                   MK_FALSE);
-    }
-
-    /*
-     * Transfer Encoding: the transfer encoding header is just sent when
-     * the response has some content defined by the HTTP status response
-     */
-    switch (sh->transfer_encoding) {
-    case MK_HEADER_TE_TYPE_CHUNKED:
-        mk_iov_add(iov,
-                   mk_header_te_chunked.data,
-                   mk_header_te_chunked.len,
-                   MK_FALSE);
-        break;
+        memcpy(buf + len, mk_header_allow.data, mk_header_allow.len);
+        len += mk_header_allow.len;
+        memcpy(buf + len, sh->allow_methods.data, sh->allow_methods.len);
+        len += sh->allow_methods.len;
     }
 
     /* E-Tag */
     if (sh->etag_len > 0) {
-        mk_iov_add(iov, sh->etag_buf, sh->etag_len, MK_FALSE);
+        memcpy(buf + len, sh->etag_buf, sh->etag_len);
+        len += sh->etag_len;
     }
 
     /* Content-Encoding */
     if (sh->content_encoding.len > 0) {
-        mk_iov_add(iov, mk_header_content_encoding.data,
-                   mk_header_content_encoding.len,
-                   MK_FALSE);
-        mk_iov_add(iov, sh->content_encoding.data,
-                   sh->content_encoding.len,
-                   MK_FALSE);
+        memcpy(buf + len, mk_header_content_encoding.data,
+               mk_header_content_encoding.len);
+        len += mk_header_content_encoding.len;
+        memcpy(buf + len, sh->content_encoding.data,
+               sh->content_encoding.len);
+        len += sh->content_encoding.len;
     }
 
     /* Content-Length */
     if (sh->content_length >= 0 && sh->transfer_encoding != 0) {
-        /* Map content length to MK_POINTER */
-        mk_ptr_t *cl = MK_TLS_GET(mk_tls_cache_header_cl);
-        mk_string_itop(sh->content_length, cl);
-
-        /* Set headers */
-        mk_iov_add(iov,
-                   mk_header_content_length.data,
-                   mk_header_content_length.len,
-                   MK_FALSE);
-        mk_iov_add(iov,
-                   cl->data,
-                   cl->len,
-                   MK_FALSE);
+        memcpy(buf + len, mk_header_content_length.data,
+               mk_header_content_length.len);
+        len += mk_header_content_length.len;
+        len += mk_header_ltoa(buf + len, sh->content_length);
     }
 
     if ((sh->content_length != 0 && (sh->ranges[0] >= 0 || sh->ranges[1] >= 0)) &&
         server->resume == MK_TRUE) {
-        buffer = 0;
-
-        /* yyy- */
-        if (sh->ranges[0] >= 0 && sh->ranges[1] == -1) {
-            mk_string_build(&buffer,
-                            &len,
-                            "%s bytes %d-%ld/%ld\r\n",
-                            RH_CONTENT_RANGE,
-                            sh->ranges[0],
-                            (sh->real_length - 1), sh->real_length);
-            mk_iov_add(iov, buffer, len, MK_TRUE);
-        }
-
-        /* yyy-xxx */
-        if (sh->ranges[0] >= 0 && sh->ranges[1] >= 0) {
-            mk_string_build(&buffer,
-                            &len,
-                            "%s bytes %d-%d/%ld\r\n",
-                            RH_CONTENT_RANGE,
-                            sh->ranges[0], sh->ranges[1], sh->real_length);
-
-            mk_iov_add(iov, buffer, len, MK_TRUE);
-        }
-
-        /* -xxx */
-        if (sh->ranges[0] == -1 && sh->ranges[1] > 0) {
-            mk_string_build(&buffer,
-                            &len,
-                            "%s bytes %ld-%ld/%ld\r\n",
-                            RH_CONTENT_RANGE,
-                            (sh->real_length - sh->ranges[1]),
-                            (sh->real_length - 1), sh->real_length);
-            mk_iov_add(iov, buffer, len, MK_TRUE);
-        }
+        len += mk_header_content_range(buf + len, sh);
     }
 
-    if (sh->upgrade == MK_HEADER_UPGRADED_H2C) {
-        mk_iov_add(iov, mk_header_upgrade_h2c.data, mk_header_upgrade_h2c.len,
-                   MK_FALSE);
-    }
-
-
     if (sh->cgi == SH_NOCGI || sh->breakline == MK_HEADER_BREAKLINE) {
         if (!sr->headers._extra_rows) {
-            mk_iov_add(iov, mk_iov_crlf.data, mk_iov_crlf.len,
-                       MK_FALSE);
+            memcpy(buf + len, mk_iov_crlf.data, mk_iov_crlf.len);
+            len += mk_iov_crlf.len;
         }
         else {
             mk_iov_add(sr->headers._extra_rows, mk_iov_crlf.data,
@@ -381,6 +548,8 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
         }
     }
 
+    mk_iov_add(iov, buf, len, MK_FALSE);
+
     /*
      * Configure the Stream to dispatch the headers
      */
@@ -435,6 +604,7 @@ void mk_header_response_reset(struct response_headers *header)
     header->connection = 0;
     header->transfer_encoding = -1;
     header->last_modified = -1;
+    header->etag_len = 0;
     header->upgrade = -1;
     header->cgi = SH_NOCGI;
     mk_ptr_reset(&header->content_type);
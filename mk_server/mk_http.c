@@ -24,6 +24,7 @@
 #include <stdlib.h>
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <regex.h>
 
@@ -33,6 +34,7 @@
 #include <monkey/mk_http.h>
 #include <monkey/mk_http_status.h>
 #include <monkey/mk_http_thread.h>
+#include <monkey/mk_http_cache.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_config.h>
@@ -82,8 +84,25 @@ void mk_http_request_init(struct mk_http_session *session,
     request->uri_processed.data = NULL;
     request->real_path.data = NULL;
     request->handler_data = NULL;
+    request->cache = NULL;
+    request->lib_batch = NULL;
+    request->lib_job = NULL;
+    request->lib_sub = NULL;
+    request->lib_release = NULL;
+    request->query_string.data = NULL;
+    request->query_string.len = 0;
+    request->data.data = NULL;
+    request->data.len = 0;
+    request->body_mode = MK_HTTP_BODY_NONE;
+    request->body_fd = -1;
+    request->body_stored = 0;
+    request->body_handler = NULL;
 
     request->in_file.fd = -1;
+    request->in_headers.stream = NULL;
+
+    mk_arena_init(&request->arena, request->arena_buf,
+                  sizeof(request->arena_buf));
 
     /* Response Headers */
     mk_header_response_reset(&request->headers);
@@ -120,6 +139,7 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
 {
     int ret;
     int status = 0;
+    unsigned long len;
     char *temp;
     struct mk_list *hosts = &server->hosts;
     struct mk_list *alias;
@@ -127,10 +147,10 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
 
     /*
      * Process URI, if it contains ASCII encoded strings like '%20',
-     * it will return a new memory buffer with the decoded string, otherwise
+     * it will return a new request buffer with the decoded string, otherwise
      * it returns NULL
      */
-    temp = mk_utils_url_decode(sr->uri);
+    temp = mk_utils_url_decode(sr->uri, &sr->arena);
 
     if (temp) {
         sr->uri_processed.data = temp;
@@ -160,10 +180,16 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
     /* Header: Range */
     mk_http_point_header(&sr->range, &cs->parser, MK_HEADER_RANGE);
 
-    /* Header: If-Modified-Since */
+    /* Conditional headers */
+    mk_http_point_header(&sr->if_match, &cs->parser, MK_HEADER_IF_MATCH);
     mk_http_point_header(&sr->if_modified_since,
                          &cs->parser,
                          MK_HEADER_IF_MODIFIED_SINCE);
+    mk_http_point_header(&sr->if_none_match, &cs->parser,
+                         MK_HEADER_IF_NONE_MATCH);
+    mk_http_point_header(&sr->if_range, &cs->parser, MK_HEADER_IF_RANGE);
+    mk_http_point_header(&sr->if_unmodified_since, &cs->parser,
+                         MK_HEADER_IF_UNMODIFIED_SINCE);
 
     /* HTTP/1.1 needs Host header */
     if (!sr->host.data && sr->protocol == MK_HTTP_PROTOCOL_11) {
@@ -180,6 +206,15 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
         sr->_content_length.data = header->val.data;
         sr->_content_length.len  = header->val.len;
     }
+    else if (cs->parser.chunked == MK_TRUE) {
+        /*
+         * The chunked framing is gone once the body is decoded, handlers
+         * forwarding it (proxy, FastCGI) need the decoded length.
+         */
+        sr->_content_length.data =
+            mk_http_request_printf(sr, &len, "%li", cs->parser.body_received);
+        sr->_content_length.len  = len;
+    }
     else {
         sr->_content_length.data = NULL;
     }
@@ -195,13 +230,31 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
             sr->port = cs->parser.header_host_port;
         }
 
-        /* Match the virtual host */
-        mk_vhost_get(sr->host, &sr->host_conf, &sr->host_alias, server);
+        /* Match the virtual host, reuse the previous result if any */
+        if ((int) sr->host.len == cs->vhost_name_len &&
+            memcmp(sr->host.data, cs->vhost_name, sr->host.len) == 0) {
+            if (cs->vhost) {
+                sr->host_conf = cs->vhost;
+                sr->host_alias = cs->vhost_alias;
+            }
+        }
+        else {
+            ret = mk_vhost_get(sr->host, &sr->host_conf, &sr->host_alias,
+                               server);
+            if (sr->host.len < MK_HOSTNAME_LEN) {
+                memcpy(cs->vhost_name, sr->host.data, sr->host.len);
+                cs->vhost_name_len = sr->host.len;
+                cs->vhost = (ret == 0) ? sr->host_conf : NULL;
+                cs->vhost_alias = (ret == 0) ? sr->host_alias : NULL;
+            }
+        }
 
         /* Check if this virtual host have some redirection */
         if (sr->host_conf->header_redirect.data) {
             mk_header_set_http_status(sr, MK_REDIR_MOVED);
-            sr->headers.location = mk_string_dup(sr->host_conf->header_redirect.data);
+            sr->headers.location = mk_http_request_strdup(sr,
+                                            sr->host_conf->header_redirect.data,
+                                            sr->host_conf->header_redirect.len);
             sr->headers.content_length = 0;
             sr->headers.location = NULL;
             mk_header_prepare(cs, sr, server);
@@ -277,9 +330,56 @@ static void mk_request_premature_close(int http_status, struct mk_http_session *
     mk_http_session_remove(cs, server);
 }
 
+/* Take a read buffer for the session */
+static int mk_http_session_buffer_get(struct mk_http_session *cs,
+                                      struct mk_sched_conn *conn)
+{
+    struct mk_sched_worker *sched;
+
+    /* Network layers reading in bigger blocks get a private buffer */
+    sched = mk_sched_get_thread_conf();
+    if ((size_t) conn->net->buffer_size > sched->read_buffers.size) {
+        cs->body = mk_mem_alloc(conn->net->buffer_size + 1);
+        cs->body_size = conn->net->buffer_size;
+        cs->body_pooled = MK_FALSE;
+    }
+    else {
+        cs->body = mk_sched_buf_get(sched);
+        cs->body_size = sched->read_buffers.size;
+        cs->body_pooled = MK_TRUE;
+    }
+
+    if (!cs->body) {
+        cs->body_size = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Give back the read buffer of the session */
+static void mk_http_session_buffer_put(struct mk_http_session *cs)
+{
+    if (!cs->body) {
+        return;
+    }
+
+    if (cs->body_pooled == MK_TRUE) {
+        mk_sched_buf_put(mk_sched_get_thread_conf(), cs->body);
+    }
+    else {
+        mk_mem_free(cs->body);
+    }
+
+    cs->body = NULL;
+    cs->body_size = 0;
+    cs->body_length = 0;
+}
+
 int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs,
                          struct mk_server *server)
 {
+    int ret;
     int bytes;
     int max_read;
     int available = 0;
@@ -293,6 +393,15 @@ int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs,
 
     MK_TRACE("MAX REQUEST SIZE: %i", server->max_request_size);
 
+    /* Borrow a buffer, the connection has something to read */
+    if (!cs->body) {
+        ret = mk_http_session_buffer_get(cs, conn);
+        if (ret != 0) {
+            mk_request_premature_close(MK_SERVER_INTERNAL_ERROR, cs, server);
+            return -1;
+        }
+    }
+
  try_pending:
 
     available = cs->body_size - cs->body_length;
@@ -307,14 +416,22 @@ int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs,
         }
 
         /*
-         * Check if the body field still points to the initial body_fixed, if so,
-         * allow the new space required in body, otherwise perform a realloc over
-         * body.
+         * Check if the body field still points to a shared read buffer, if
+         * so, move the data to a private one with the new space required,
+         * otherwise perform a realloc over body.
          */
-        if (cs->body == cs->body_fixed) {
-            cs->body = mk_mem_alloc(new_size + 1);
+        if (cs->body_pooled == MK_TRUE) {
+            tmp = mk_mem_alloc(new_size + 1);
+            if (!tmp) {
+                mk_request_premature_close(MK_SERVER_INTERNAL_ERROR, cs,
+                                           server);
+                return -1;
+            }
+            memcpy(tmp, cs->body, cs->body_length);
+            mk_sched_buf_put(mk_sched_get_thread_conf(), cs->body);
+            cs->body = tmp;
             cs->body_size = new_size;
-            memcpy(cs->body, cs->body_fixed, cs->body_length);
+            cs->body_pooled = MK_FALSE;
             MK_TRACE("[FD %i] New size: %i, length: %i",
                      socket, new_size, cs->body_length);
         }
@@ -368,27 +485,416 @@ int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs,
     return total_bytes;
 }
 
-/* Build error page */
-static int mk_http_error_page(char *title, mk_ptr_t *message, char *signature,
-                              char **out_buf, unsigned long *out_size)
+/* Unnamed temporary file to hold a request body */
+static int mk_http_body_tmpfile()
 {
-    char *temp;
+    int fd;
+    char *dir;
+    char path[MK_MAX_PATH];
 
-    *out_buf = NULL;
+    dir = getenv("TMPDIR");
+    if (!dir || *dir == '\0') {
+        dir = "/tmp";
+    }
+
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        return fd;
+    }
+#endif
 
-    if (message) {
-        temp = mk_ptr_to_buf(*message);
+    /* The file system does not support O_TMPFILE */
+    snprintf(path, sizeof(path), "%s/monkey-body-XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        mk_libc_error("mkostemp");
+        return -1;
+    }
+    unlink(path);
+
+    return fd;
+}
+
+/*
+ * Hand a piece of the request body to its destination, it returns zero
+ * or the HTTP status to reply with.
+ */
+static int mk_http_body_store(struct mk_http_request *sr,
+                              char *buf, size_t size)
+{
+    ssize_t bytes;
+    size_t total = 0;
+    struct mk_vhost_handler *h;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if (sr->body_mode == MK_HTTP_BODY_STREAM) {
+        h = sr->body_handler;
+        if (h->cb_body(sr, buf, size, h->data) != 0) {
+            return MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+        }
     }
     else {
-        temp = mk_string_dup("");
+        while (total < size) {
+            bytes = write(sr->body_fd, buf + total, size - total);
+            if (bytes == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                mk_libc_error("write");
+                return MK_SERVER_INTERNAL_ERROR;
+            }
+            total += bytes;
+        }
     }
 
-    mk_string_build(out_buf, out_size,
-                    MK_REQUEST_DEFAULT_PAGE, title, temp, signature);
-    mk_mem_free(temp);
+    sr->body_stored += size;
     return 0;
 }
 
+/* Library handler taking the body as it arrives, if the request maps to one */
+static struct mk_vhost_handler *mk_http_body_handler(struct mk_http_session *cs,
+                                                     struct mk_http_request *sr,
+                                                     struct mk_server *server)
+{
+    char *uri;
+    struct mk_vhost *host;
+    struct mk_vhost_alias *alias;
+    struct mk_http_header *header;
+    struct mk_vhost_handler *h;
+
+    host = sr->host_conf;
+    header = &cs->parser.headers[MK_HEADER_HOST];
+    if (header->type == MK_HEADER_HOST) {
+        mk_vhost_get(header->val, &host, &alias, server);
+    }
+
+    if (mk_list_is_empty(&host->handlers) == 0) {
+        return NULL;
+    }
+
+    uri = mk_utils_url_decode(sr->uri, &sr->arena);
+    if (!uri) {
+        uri = mk_http_request_strdup(sr, sr->uri.data, sr->uri.len);
+        if (!uri) {
+            return NULL;
+        }
+    }
+
+    h = mk_vhost_handler_next(host, NULL, uri, strlen(uri));
+    if (h && h->cb_body) {
+        return h;
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand the decoded part of a chunked body to its destination and move
+ * the raw bytes not decoded yet right after what stays in the buffer.
+ */
+static int mk_http_body_chunked_flush(struct mk_http_session *cs,
+                                      struct mk_http_request *sr)
+{
+    int ret;
+    int len;
+    struct mk_http_parser *p = &cs->parser;
+
+    if (sr->body_mode >= MK_HTTP_BODY_SPILL) {
+        ret = mk_http_body_store(sr, cs->body + p->start,
+                                 p->chunk_out - p->start);
+        if (ret != 0) {
+            return ret;
+        }
+        p->chunk_out = p->start;
+    }
+
+    len = cs->body_length - p->chunk_in;
+    if (p->chunk_in != p->chunk_out) {
+        memmove(cs->body + p->chunk_out, cs->body + p->chunk_in, len);
+    }
+    p->chunk_in = p->chunk_out;
+    cs->body_length = p->chunk_in + len;
+
+    return 0;
+}
+
+/*
+ * The headers are complete and the body is still arriving: decide where
+ * it goes. Small bodies stay in the read buffer, big ones and the ones
+ * of streaming handlers are taken out of it as they arrive. A chunked
+ * body has no known size, it stays in memory until the buffer is full.
+ * It returns zero or the HTTP status to reply with.
+ */
+static int mk_http_body_start(struct mk_http_session *cs,
+                              struct mk_http_request *sr,
+                              struct mk_server *server)
+{
+    int ret;
+    long size;
+    struct mk_http_parser *p = &cs->parser;
+
+    if (sr->protocol == MK_HTTP_PROTOCOL_UNKNOWN) {
+        return MK_SERVER_HTTP_VERSION_UNSUP;
+    }
+
+    if (p->chunked == MK_TRUE) {
+        size = p->body_received;
+    }
+    else {
+        size = p->header_content_length;
+        if (size > server->max_request_size) {
+            return MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+        }
+    }
+
+    sr->body_handler = mk_http_body_handler(cs, sr, server);
+    if (sr->body_handler) {
+        sr->body_mode = MK_HTTP_BODY_STREAM;
+    }
+    else if (p->chunked == MK_FALSE && size > server->body_spill_size) {
+        sr->body_mode = MK_HTTP_BODY_SPILL;
+    }
+    else {
+        sr->body_mode = MK_HTTP_BODY_MEMORY;
+        return 0;
+    }
+
+    MK_TRACE("[FD %i] Request body of %li bytes, mode %i",
+             cs->socket, size, sr->body_mode);
+
+    if (sr->body_mode == MK_HTTP_BODY_SPILL) {
+        sr->body_fd = mk_http_body_tmpfile();
+        if (sr->body_fd == -1) {
+            return MK_SERVER_INTERNAL_ERROR;
+        }
+    }
+
+    if (p->chunked == MK_TRUE) {
+        return mk_http_body_chunked_flush(cs, sr);
+    }
+
+    /* What arrived with the headers, the buffer keeps the headers only */
+    ret = mk_http_body_store(sr, cs->body + p->start,
+                             cs->body_length - p->start);
+    cs->body_length = p->start;
+
+    return ret;
+}
+
+/* Is the body of the request still being taken out of the connection ? */
+static inline int mk_http_body_pending(struct mk_http_session *cs,
+                                       struct mk_http_request *sr)
+{
+    struct mk_http_parser *p = &cs->parser;
+
+    if (p->chunked == MK_TRUE) {
+        return (sr->body_mode != MK_HTTP_BODY_NONE &&
+                p->chunk_state != MK_ST_CHUNK_DONE);
+    }
+
+    return (sr->body_mode >= MK_HTTP_BODY_SPILL &&
+            sr->body_stored < p->header_content_length);
+}
+
+/* A spilled body is handed to the handlers as memory anyways */
+static int mk_http_body_map(struct mk_http_request *sr)
+{
+    void *map;
+
+    if (sr->body_stored == 0) {
+        return 0;
+    }
+
+    map = mmap(NULL, sr->body_stored, PROT_READ, MAP_PRIVATE,
+               sr->body_fd, 0);
+    if (map == MAP_FAILED) {
+        mk_libc_error("mmap");
+        return -1;
+    }
+    sr->data.data = map;
+    sr->data.len = sr->body_stored;
+
+    return 0;
+}
+
+/*
+ * Take the body of the request from the connection, never more than what
+ * Content-Length says so a pipelined request stays in the socket. It
+ * returns -1 if the session was closed, 1 once the body is complete.
+ */
+static int mk_http_body_read(struct mk_sched_conn *conn,
+                             struct mk_http_session *cs,
+                             struct mk_http_request *sr,
+                             struct mk_server *server)
+{
+    int ret;
+    int size;
+    int bytes;
+    long pending;
+    char buf[MK_HTTP_BODY_CHUNK];
+    struct mk_http_parser *p = &cs->parser;
+
+    pending = p->header_content_length - sr->body_stored;
+    while (pending > 0) {
+        size = pending < MK_HTTP_BODY_CHUNK ? pending : MK_HTTP_BODY_CHUNK;
+        bytes = mk_sched_conn_read(conn, buf, size);
+        if (bytes == 0) {
+            errno = 0;
+            return -1;
+        }
+        else if (bytes == -1) {
+            if (errno == EAGAIN) {
+                break;
+            }
+            return -1;
+        }
+
+        ret = mk_http_body_store(sr, buf, bytes);
+        if (ret != 0) {
+            mk_request_premature_close(ret, cs, server);
+            return -1;
+        }
+        pending -= bytes;
+
+        if (bytes < size) {
+            break;
+        }
+    }
+
+    /* Uploads time out only when they stall */
+    conn->arrive_time = mk_clock_now();
+
+    if (pending > 0) {
+        return 0;
+    }
+
+    if (sr->body_mode == MK_HTTP_BODY_SPILL && mk_http_body_map(sr) != 0) {
+        mk_request_premature_close(MK_SERVER_INTERNAL_ERROR, cs, server);
+        return -1;
+    }
+
+    /* Nothing is left in the buffer after the headers */
+    p->body_received = sr->body_stored;
+    p->i = p->start - 1;
+
+    return 1;
+}
+
+/*
+ * Read a chunked body straight into the free space of the read buffer
+ * and decode it there. The buffer is never moved so what the parser
+ * pointed so far stays valid: when it gets full the decoded data is
+ * taken out of it, a body kept in memory is spilled at that point. It
+ * returns -1 if the session was closed, 1 once the body is complete.
+ */
+static int mk_http_body_chunked(struct mk_sched_conn *conn,
+                                struct mk_http_session *cs,
+                                struct mk_http_request *sr,
+                                struct mk_server *server)
+{
+    int ret;
+    int size;
+    int bytes;
+    struct mk_http_parser *p = &cs->parser;
+
+    do {
+        size = cs->body_size - cs->body_length;
+        if (size <= 0) {
+            ret = mk_http_body_chunked_flush(cs, sr);
+            if (ret == 0 && cs->body_length >= cs->body_size &&
+                sr->body_mode == MK_HTTP_BODY_MEMORY) {
+                sr->body_fd = mk_http_body_tmpfile();
+                if (sr->body_fd == -1) {
+                    ret = MK_SERVER_INTERNAL_ERROR;
+                }
+                else {
+                    sr->body_mode = MK_HTTP_BODY_SPILL;
+                    ret = mk_http_body_chunked_flush(cs, sr);
+                }
+            }
+
+            /* A chunk size or trailer line bigger than the buffer */
+            if (ret == 0 && cs->body_length >= cs->body_size) {
+                ret = MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+            }
+            if (ret != 0) {
+                mk_request_premature_close(ret, cs, server);
+                return -1;
+            }
+            size = cs->body_size - cs->body_length;
+        }
+
+        bytes = mk_sched_conn_read(conn, cs->body + cs->body_length, size);
+        if (bytes == 0) {
+            errno = 0;
+            return -1;
+        }
+        else if (bytes == -1) {
+            if (errno == EAGAIN) {
+                break;
+            }
+            return -1;
+        }
+        cs->body_length += bytes;
+        cs->body[cs->body_length] = '\0';
+
+        ret = mk_http_parser_chunked(p, cs->body, cs->body_length, server);
+        if (ret != MK_HTTP_PARSER_OK && ret != MK_HTTP_PARSER_PENDING) {
+            mk_request_premature_close(-ret, cs, server);
+            return -1;
+        }
+
+        /* Streaming handlers get the data as soon as it's decoded */
+        if (sr->body_mode >= MK_HTTP_BODY_SPILL) {
+            ret = mk_http_body_chunked_flush(cs, sr);
+            if (ret != 0) {
+                mk_request_premature_close(ret, cs, server);
+                return -1;
+            }
+        }
+    } while (p->chunk_state != MK_ST_CHUNK_DONE && bytes == size);
+
+    /* Uploads time out only when they stall */
+    conn->arrive_time = mk_clock_now();
+
+    if (p->chunk_state != MK_ST_CHUNK_DONE) {
+        return 0;
+    }
+
+    if (sr->body_mode == MK_HTTP_BODY_SPILL && mk_http_body_map(sr) != 0) {
+        mk_request_premature_close(MK_SERVER_INTERNAL_ERROR, cs, server);
+        return -1;
+    }
+    else if (sr->body_mode == MK_HTTP_BODY_MEMORY) {
+        sr->data.data = cs->body + p->start;
+        sr->data.len = p->chunk_out - p->start;
+    }
+
+    /* What follows the body belongs to the next request */
+    p->i = p->chunk_in - 1;
+
+    return 1;
+}
+
+static void mk_http_body_release(struct mk_http_request *sr)
+{
+    if (sr->body_fd == -1) {
+        return;
+    }
+
+    if (sr->data.data) {
+        munmap(sr->data.data, sr->data.len);
+        sr->data.data = NULL;
+        sr->data.len = 0;
+    }
+    close(sr->body_fd);
+    sr->body_fd = -1;
+}
+
 static int mk_http_range_set(struct mk_http_request *sr, size_t file_size,
                              struct mk_server *server)
 {
@@ -464,13 +970,19 @@ static int mk_http_range_parse(struct mk_http_request *sr)
 
     /* =yyy-xxx */
     if ((eq_pos + 1 != sep_pos) && (len > sep_pos + 1)) {
-        buffer = mk_string_copy_substr(sr->range.data, eq_pos + 1, sep_pos);
+        buffer = mk_http_request_strdup(sr, sr->range.data + eq_pos + 1,
+                                        sep_pos - eq_pos - 1);
+        if (!buffer) {
+            return -1;
+        }
         sh->ranges[0] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
 
-        buffer = mk_string_copy_substr(sr->range.data, sep_pos + 1, len);
+        buffer = mk_http_request_strdup(sr, sr->range.data + sep_pos + 1,
+                                        len - sep_pos - 1);
+        if (!buffer) {
+            return -1;
+        }
         sh->ranges[1] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
 
         if (sh->ranges[1] < 0 || (sh->ranges[0] > sh->ranges[1])) {
             return -1;
@@ -481,9 +993,12 @@ static int mk_http_range_parse(struct mk_http_request *sr)
     }
     /* =yyy- */
     if ((eq_pos + 1 != sep_pos) && (len == sep_pos + 1)) {
-        buffer = mk_string_copy_substr(sr->range.data, eq_pos + 1, len);
+        buffer = mk_http_request_strdup(sr, sr->range.data + eq_pos + 1,
+                                        len - eq_pos - 1);
+        if (!buffer) {
+            return -1;
+        }
         sr->headers.ranges[0] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
 
         sh->content_length = (sh->content_length - sh->ranges[0]);
         return 0;
@@ -492,6 +1007,136 @@ static int mk_http_range_parse(struct mk_http_request *sr)
     return -1;
 }
 
+/*
+ * Look for the entity tag of the file in an If-Match, If-None-Match or
+ * If-Range value. The tags we generate are strong, a weak one in the
+ * list only matches using the weak comparison.
+ */
+static int mk_http_etag_match(mk_ptr_t *list, char *etag, int etag_len,
+                              int weak)
+{
+    int w;
+    char *tag;
+    char *p = list->data;
+    char *end = list->data + list->len;
+
+    while (p < end) {
+        if (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+            continue;
+        }
+        else if (*p == '*') {
+            return MK_TRUE;
+        }
+
+        w = MK_FALSE;
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/') {
+            w = MK_TRUE;
+            p += 2;
+        }
+
+        if (*p != '"') {
+            return MK_FALSE;
+        }
+        tag = p;
+        p = memchr(p + 1, '"', end - p - 1);
+        if (!p) {
+            return MK_FALSE;
+        }
+        p++;
+
+        if ((w == MK_FALSE || weak == MK_TRUE) && p - tag == etag_len &&
+            memcmp(tag, etag, etag_len) == 0) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/* The quoted entity tag of the file, out of the ETag header row */
+static inline char *mk_http_etag(struct mk_http_request *sr, int *len)
+{
+    *len = sr->headers.etag_len - (sizeof("ETag: ") - 1) - 2;
+    return sr->headers.etag_buf + (sizeof("ETag: ") - 1);
+}
+
+/*
+ * Evaluate the conditional headers of a static file request in the
+ * order defined by RFC 7232 section 6. It returns zero to serve the
+ * file, MK_NOT_MODIFIED or MK_CLIENT_PRECOND_FAILED.
+ */
+static int mk_http_conditional(struct mk_http_request *sr)
+{
+    int len;
+    char *etag;
+    time_t date;
+    time_t mtime = sr->file_info.last_modification;
+
+    etag = mk_http_etag(sr, &len);
+
+    if (sr->if_match.data) {
+        if (mk_http_etag_match(&sr->if_match, etag, len,
+                               MK_FALSE) == MK_FALSE) {
+            return MK_CLIENT_PRECOND_FAILED;
+        }
+    }
+    else if (sr->if_unmodified_since.data) {
+        date = mk_utils_http_date(sr->if_unmodified_since.data,
+                                  sr->if_unmodified_since.len);
+        if (date >= 0 && mtime > date) {
+            return MK_CLIENT_PRECOND_FAILED;
+        }
+    }
+
+    if (sr->if_none_match.data) {
+        if (mk_http_etag_match(&sr->if_none_match, etag, len,
+                               MK_TRUE) == MK_TRUE) {
+            if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD) {
+                return MK_NOT_MODIFIED;
+            }
+            return MK_CLIENT_PRECOND_FAILED;
+        }
+    }
+    else if (sr->if_modified_since.data &&
+             (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD)) {
+        date = mk_utils_http_date(sr->if_modified_since.data,
+                                  sr->if_modified_since.len);
+        if (date >= 0 && mtime <= date) {
+            return MK_NOT_MODIFIED;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * If-Range: the range applies only if the file still has the given
+ * entity tag (strong comparison) or modification date.
+ */
+static int mk_http_if_range(struct mk_http_request *sr)
+{
+    int len;
+    char *etag;
+    mk_ptr_t *val = &sr->if_range;
+
+    if (!val->data) {
+        return MK_TRUE;
+    }
+
+    if (val->len > 0 && (val->data[0] == '"' || val->data[0] == 'W')) {
+        etag = mk_http_etag(sr, &len);
+        return mk_http_etag_match(val, etag, len, MK_FALSE);
+    }
+
+    if (mk_utils_http_date(val->data, val->len) ==
+        sr->file_info.last_modification) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
 static int mk_http_directory_redirect_check(struct mk_http_session *cs,
                                             struct mk_http_request *sr,
                                             struct mk_server *server)
@@ -511,12 +1156,15 @@ static int mk_http_directory_redirect_check(struct mk_http_session *cs,
         return 0;
     }
 
-    host = mk_ptr_to_buf(sr->host);
+    host = mk_http_request_strdup(sr, sr->host.data, sr->host.len);
 
     /*
      * Add ending slash to the location string
      */
-    location = mk_mem_alloc(sr->uri_processed.len + 2);
+    location = mk_http_request_alloc(sr, sr->uri_processed.len + 2);
+    if (!host || !location) {
+        return -1;
+    }
     memcpy(location, sr->uri_processed.data, sr->uri_processed.len);
     location[sr->uri_processed.len]     = '/';
     location[sr->uri_processed.len + 1] = '\0';
@@ -533,16 +1181,16 @@ static int mk_http_directory_redirect_check(struct mk_http_session *cs,
     }
 
     if (port_redirect > 0) {
-        mk_string_build(&real_location, &len, "%s://%s:%i%s\r\n",
-                        protocol, host, port_redirect, location);
+        real_location = mk_http_request_printf(sr, &len, "%s://%s:%i%s\r\n",
+                                               protocol, host, port_redirect,
+                                               location);
     }
     else {
-        mk_string_build(&real_location, &len, "%s://%s%s\r\n",
-                        protocol, host, location);
+        real_location = mk_http_request_printf(sr, &len, "%s://%s%s\r\n",
+                                               protocol, host, location);
     }
 
     MK_TRACE("Redirecting to '%s'", real_location);
-    mk_mem_free(host);
 
     mk_header_set_http_status(sr, MK_REDIR_MOVED);
     sr->headers.content_length = 0;
@@ -554,9 +1202,6 @@ static int mk_http_directory_redirect_check(struct mk_http_session *cs,
         (server->max_keep_alive_request - cs->counter_connections);
 
     mk_header_prepare(cs, sr, server);
-
-    /* we do not free() real_location as it's freed by iov */
-    mk_mem_free(location);
     sr->headers.location = NULL;
     return -1;
 }
@@ -630,8 +1275,6 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     int ret;
     int ret_file;
     struct mk_mimetype *mime;
-    struct mk_list *head;
-    struct mk_list *handlers;
     struct mk_plugin *plugin;
     struct mk_vhost_handler *h_handler;
     struct mk_http_thread *mth = NULL;
@@ -641,6 +1284,15 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
 
     MK_TRACE("[FD %i] HTTP Protocol Init, session %p", cs->socket, sr);
 
+    /* Response cache: reply from memory or wait for a fill in progress */
+    ret = mk_http_cache_lookup(cs, sr, server);
+    if (ret == MK_HTTP_CACHE_HIT) {
+        return MK_EXIT_OK;
+    }
+    else if (ret == MK_HTTP_CACHE_WAIT) {
+        return MK_PLUGIN_RET_CONTINUE;
+    }
+
     /* Request to root path of the virtualhost in question */
     if (sr->uri_processed.len == 1 && sr->uri_processed.data[0] == '/') {
         sr->real_path.data = sr->host_conf->documentroot.data;
@@ -664,16 +1316,19 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             sr->real_path.len = len;
         }
         else {
-            ret = mk_buffer_cat(&sr->real_path,
-                                sr->host_conf->documentroot.data,
-                                sr->host_conf->documentroot.len,
-                                sr->uri_processed.data,
-                                sr->uri_processed.len);
-
-            if (ret < 0) {
+            sr->real_path.data = mk_http_request_alloc(sr, len + 1);
+            if (!sr->real_path.data) {
                 MK_TRACE("Error composing real path");
                 return MK_EXIT_ERROR;
             }
+            memcpy(sr->real_path.data,
+                   sr->host_conf->documentroot.data,
+                   sr->host_conf->documentroot.len);
+            memcpy(sr->real_path.data + sr->host_conf->documentroot.len,
+                   sr->uri_processed.data,
+                   sr->uri_processed.len);
+            sr->real_path.data[len] = '\0';
+            sr->real_path.len = len;
         }
     }
 
@@ -722,26 +1377,24 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     ret_file = mk_file_get_info(sr->real_path.data, &sr->file_info, MK_FILE_READ);
 
     /* Manually set the headers input streams */
-    sr->in_headers.type        = MK_STREAM_IOV;
-    sr->in_headers.dynamic     = MK_FALSE;
-    sr->in_headers.cb_consumed = NULL;
-    sr->in_headers.cb_finished = NULL;
-    sr->in_headers.stream      = &sr->stream;
-    mk_list_add(&sr->in_headers._head, &sr->stream.inputs);
+    mk_http_headers_link(sr);
 
     /* Plugin Stage 30: look for handlers for this request */
     if (sr->stage30_blocked == MK_FALSE) {
         sr->uri_processed.data[sr->uri_processed.len] = '\0';
-        handlers = &sr->host_conf->handlers;
-        mk_list_foreach(head, handlers) {
-            h_handler = mk_list_entry(head, struct mk_vhost_handler, _head);
-
-            if (regexec(h_handler->match,
-                        sr->uri_processed.data, 0, NULL, 0) != 0) {
-                continue;
-            }
-
+        h_handler = NULL;
+        while ((h_handler = mk_vhost_handler_next(sr->host_conf, h_handler,
+                                                  sr->uri_processed.data,
+                                                  sr->uri_processed.len))) {
             if (h_handler->cb) {
+                /* A streaming handler gets the body it didn't see yet */
+                if (h_handler->cb_body && sr->data.len > 0 &&
+                    h_handler->cb_body(sr, sr->data.data, sr->data.len,
+                                       h_handler->data) != 0) {
+                    return mk_http_error(MK_CLIENT_REQUEST_ENTITY_TOO_LARGE,
+                                         cs, sr, server);
+                }
+
                 /* Create coroutine/thread context */
                 sr->headers.content_length = 0;
                 mth = mk_http_thread_create(MK_HTTP_THREAD_LIB,
@@ -765,7 +1418,6 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                 ret = plugin->stage->stage30(plugin, cs, sr,
                                              h_handler->n_params,
                                              &h_handler->params);
-                mk_header_prepare(cs, sr, server);
             }
 
             MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
@@ -818,18 +1470,18 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                                           &index_length, &index_bytes,
                                           server);
         if (index_path) {
-            if (sr->real_path.data != sr->real_path_static) {
-                mk_ptr_free(&sr->real_path);
-                sr->real_path.data = mk_string_dup(index_path);
-            }
             /* If it's static and it still fits */
-            else if (index_length < MK_PATH_BASE) {
+            if (sr->real_path.data == sr->real_path_static &&
+                index_length < MK_PATH_BASE) {
                 memcpy(sr->real_path_static, index_path, index_length);
                 sr->real_path_static[index_length] = '\0';
             }
-            /* It was static, but didn't fit */
             else {
-                sr->real_path.data = mk_string_dup(index_path);
+                sr->real_path.data = mk_http_request_strdup(sr, index_path,
+                                                            index_length);
+                if (!sr->real_path.data) {
+                    return -1;
+                }
             }
             sr->real_path.len  = index_length;
 
@@ -860,23 +1512,21 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     /* Plugin Stage 30: look for handlers for this request */
     if (sr->stage30_blocked == MK_FALSE) {
         char *uri;
+        int uri_len;
 
         if (!index_path) {
             sr->uri_processed.data[sr->uri_processed.len] = '\0';
             uri = sr->uri_processed.data;
+            uri_len = sr->uri_processed.len;
         }
         else {
             uri = sr->real_path.data + index_bytes;
+            uri_len = sr->real_path.len - index_bytes;
         }
 
-        handlers = &sr->host_conf->handlers;
-        mk_list_foreach(head, handlers) {
-            h_handler = mk_list_entry(head, struct mk_vhost_handler, _head);
-            if (regexec(h_handler->match,
-                        uri, 0, NULL, 0) != 0) {
-                continue;
-            }
-
+        h_handler = NULL;
+        while ((h_handler = mk_vhost_handler_next(sr->host_conf, h_handler,
+                                                  uri, uri_len))) {
             plugin = h_handler->handler;
             sr->stage30_handler = h_handler->handler;
             ret = plugin->stage->stage30(plugin, cs, sr,
@@ -966,19 +1616,15 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                                     (unsigned int) sr->file_info.last_modification,
                                     sr->file_info.size);
 
-    if (sr->if_modified_since.data && sr->method == MK_METHOD_GET) {
-        time_t date_client;       /* Date sent by client */
-        time_t date_file_server;  /* Date server file */
-
-        date_client = mk_utils_gmt2utime(sr->if_modified_since.data);
-        date_file_server = sr->file_info.last_modification;
-
-        if (date_file_server <= date_client &&
-            date_client > 0) {
-            mk_header_set_http_status(sr, MK_NOT_MODIFIED);
-            mk_header_prepare(cs, sr, server);
-            return MK_EXIT_OK;
-        }
+    /* Conditional request */
+    ret = mk_http_conditional(sr);
+    if (ret == MK_NOT_MODIFIED) {
+        mk_header_set_http_status(sr, MK_NOT_MODIFIED);
+        mk_header_prepare(cs, sr, server);
+        return MK_EXIT_OK;
+    }
+    else if (ret != 0) {
+        return mk_http_error(ret, cs, sr, server);
     }
 
     /* Object size for log and response headers */
@@ -1004,8 +1650,9 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             sr->headers.content_type = mime->header_type;
         }
 
-        /* HTTP Ranges */
-        if (sr->range.data != NULL && server->resume == MK_TRUE) {
+        /* HTTP Ranges, If-Range asks for the full file when it changed */
+        if (sr->range.data != NULL && server->resume == MK_TRUE &&
+            mk_http_if_range(sr) == MK_TRUE) {
             if (mk_http_range_parse(sr) < 0) {
                 sr->headers.ranges[0] = -1;
                 sr->headers.ranges[1] = -1;
@@ -1107,11 +1754,12 @@ int mk_http_keepalive_check(struct mk_http_session *cs,
 
 static inline void mk_http_request_ka_next(struct mk_http_session *cs)
 {
-    cs->body_length = 0;
+    /* Nothing left to parse, the connection goes idle without a buffer */
+    mk_http_session_buffer_put(cs);
     cs->counter_connections++;
 
     /* Update data for scheduler */
-    cs->init_time = log_current_utime;
+    cs->init_time = mk_clock_now();
     cs->status = MK_REQUEST_STATUS_INCOMPLETE;
 
     /* Initialize parser */
@@ -1161,6 +1809,17 @@ int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
             return 1;
         }
         else if (status == MK_HTTP_PARSER_PENDING) {
+            /* It completes in a further read event */
+            cs->status = MK_REQUEST_STATUS_INCOMPLETE;
+
+            /* The pipelined request carries a body, see where it goes */
+            if (cs->parser.level == REQ_LEVEL_BODY) {
+                status = mk_http_body_start(cs, sr, server);
+                if (status != 0) {
+                    mk_request_premature_close(status, cs, server);
+                    return -1;
+                }
+            }
             return 0;
         }
         else if (status == MK_HTTP_PARSER_ERROR) {
@@ -1197,22 +1856,117 @@ void cb_stream_page_finished(struct mk_stream_input *in)
     mk_mem_free(page);
 }
 
+/* Default error pages, the ones without message show the request URI */
+static const struct {
+    int status;
+    char *title;
+    char *message;
+} mk_http_error_defaults[] = {
+    {MK_CLIENT_FORBIDDEN, "Forbidden", NULL},
+    {MK_CLIENT_NOT_FOUND, "Not Found",
+     "The requested URL was not found on this server."},
+    {MK_CLIENT_REQUEST_ENTITY_TOO_LARGE, "Entity too large",
+     "The request entity is too large."},
+    {MK_CLIENT_METHOD_NOT_ALLOWED, "Method Not Allowed", NULL},
+    {MK_SERVER_NOT_IMPLEMENTED, "Method Not Implemented", NULL},
+    {MK_SERVER_INTERNAL_ERROR, "Internal Server Error", NULL}
+};
+
+#define MK_HTTP_ERROR_DEFAULTS                                  \
+    (sizeof(mk_http_error_defaults) / sizeof(mk_http_error_defaults[0]))
+
+/*
+ * Render the default error pages once the server signature is known, so
+ * error responses are served from memory.
+ */
+int mk_http_error_pages_init(struct mk_server *server)
+{
+    unsigned int i;
+    char *head = NULL;
+    char *tail = NULL;
+    unsigned long head_len;
+    unsigned long tail_len;
+    struct mk_http_error_page *ep;
+
+    server->error_pages = mk_mem_alloc_z(sizeof(struct mk_http_error_page) *
+                                         MK_HTTP_ERROR_DEFAULTS);
+    if (!server->error_pages) {
+        return -1;
+    }
+
+    for (i = 0; i < MK_HTTP_ERROR_DEFAULTS; i++) {
+        ep = &server->error_pages[i];
+
+        mk_string_build(&head, &head_len, MK_REQUEST_DEFAULT_PAGE_HEAD "%s",
+                        mk_http_error_defaults[i].title,
+                        mk_http_error_defaults[i].message ?
+                        mk_http_error_defaults[i].message : "");
+        mk_string_build(&tail, &tail_len, MK_REQUEST_DEFAULT_PAGE_TAIL,
+                        server->server_signature);
+        if (!head || !tail) {
+            mk_mem_free(head);
+            mk_mem_free(tail);
+            mk_http_error_pages_free(server);
+            return -1;
+        }
+
+        ep->page.data = mk_mem_alloc(head_len + tail_len + 1);
+        if (!ep->page.data) {
+            mk_mem_free(head);
+            mk_mem_free(tail);
+            mk_http_error_pages_free(server);
+            return -1;
+        }
+        memcpy(ep->page.data, head, head_len);
+        memcpy(ep->page.data + head_len, tail, tail_len + 1);
+        ep->page.len = head_len + tail_len;
+        ep->split    = head_len;
+        ep->uri      = (mk_http_error_defaults[i].message == NULL);
+        ep->status   = mk_http_error_defaults[i].status;
+
+        mk_mem_free(head);
+        mk_mem_free(tail);
+        head = NULL;
+        tail = NULL;
+    }
+
+    return 0;
+}
+
+void mk_http_error_pages_free(struct mk_server *server)
+{
+    unsigned int i;
+
+    if (!server->error_pages) {
+        return;
+    }
+
+    for (i = 0; i < MK_HTTP_ERROR_DEFAULTS; i++) {
+        mk_ptr_free(&server->error_pages[i].page);
+    }
+    mk_mem_free(server->error_pages);
+    server->error_pages = NULL;
+}
+
 /* Enqueue an error response. This function always returns MK_EXIT_OK */
 int mk_http_error(int http_status, struct mk_http_session *cs,
                   struct mk_http_request *sr,
                   struct mk_server *server)
 {
-    int ret, fd;
+    unsigned int i;
     size_t count;
-    mk_ptr_t message;
+    char *buf;
     mk_ptr_t page;
+    mk_ptr_t uri;
+    mk_ptr_t tail;
     struct mk_vhost_error_page *entry;
     struct mk_list *head;
-    struct file_info finfo;
     struct mk_iov *iov;
 
     mk_header_set_http_status(sr, http_status);
     mk_ptr_reset(&page);
+    mk_ptr_reset(&uri);
+    mk_ptr_reset(&tail);
 
     /*
      * We are nice sending error pages for clients who at least respect
@@ -1222,86 +1976,39 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
         http_status != MK_CLIENT_BAD_REQUEST &&
         http_status != MK_CLIENT_REQUEST_ENTITY_TOO_LARGE) {
 
-        /* Lookup a customized error page */
+        /* Lookup a customized error page, loaded with the virtual host */
         mk_list_foreach(head, &sr->host_conf->error_pages) {
             entry = mk_list_entry(head, struct mk_vhost_error_page, _head);
-            if (entry->status != http_status) {
+            if (entry->status != http_status || !entry->data) {
                 continue;
             }
 
-            /* validate error file */
-            ret = mk_file_get_info(entry->real_path, &finfo, MK_FILE_READ);
-            if (ret == -1) {
-                break;
-            }
+            page.data = entry->data;
+            page.len  = entry->size;
+            break;
+        }
+    }
 
-            /* open file */
-            fd = open(entry->real_path, server->open_flags);
-            if (fd == -1) {
-                break;
+    /* Default page: head, request URI (if shown) and tail */
+    if (!page.data && server->error_pages) {
+        for (i = 0; i < MK_HTTP_ERROR_DEFAULTS; i++) {
+            if (server->error_pages[i].status != http_status) {
+                continue;
             }
 
-            /* Outgoing headers */
-            sr->headers.content_length = finfo.size;
-            sr->headers.real_length    = finfo.size;
-            mk_header_prepare(cs, sr, server);
-
-            /* Stream setup */
-            mk_stream_in_file(&sr->stream, &sr->in_file, sr->file_fd,
-                              finfo.size, 0, NULL, NULL);
-            return MK_EXIT_OK;
-        }
-    }
-
-    mk_ptr_reset(&message);
-
-    switch (http_status) {
-    case MK_CLIENT_FORBIDDEN:
-        mk_http_error_page("Forbidden",
-                           &sr->uri,
-                           server->server_signature,
-                           &page.data, &page.len);
-        break;
-    case MK_CLIENT_NOT_FOUND:
-        mk_string_build(&message.data, &message.len,
-                        "The requested URL was not found on this server.");
-        mk_http_error_page("Not Found",
-                           &message,
-                           server->server_signature,
-                           &page.data, &page.len);
-        mk_ptr_free(&message);
-        break;
-    case MK_CLIENT_REQUEST_ENTITY_TOO_LARGE:
-        mk_string_build(&message.data, &message.len,
-                        "The request entity is too large.");
-        mk_http_error_page("Entity too large",
-                           &message,
-                           server->server_signature,
-                           &page.data, &page.len);
-        mk_ptr_free(&message);
-        break;
-    case MK_CLIENT_METHOD_NOT_ALLOWED:
-        mk_http_error_page("Method Not Allowed",
-                           &sr->uri,
-                           server->server_signature,
-                           &page.data, &page.len);
-        break;
-    case MK_SERVER_NOT_IMPLEMENTED:
-        mk_http_error_page("Method Not Implemented",
-                           &sr->uri,
-                           server->server_signature,
-                           &page.data, &page.len);
-        break;
-    case MK_SERVER_INTERNAL_ERROR:
-        mk_http_error_page("Internal Server Error",
-                           &sr->uri,
-                           server->server_signature,
-                           &page.data, &page.len);
-        break;
+            page.data = server->error_pages[i].page.data;
+            page.len  = server->error_pages[i].split;
+            tail.data = page.data + page.len;
+            tail.len  = server->error_pages[i].page.len - page.len;
+            if (server->error_pages[i].uri == MK_TRUE) {
+                uri = sr->uri;
+            }
+            break;
+        }
     }
 
     if (page.len > 0 && sr->method != MK_METHOD_HEAD && sr->method != MK_METHOD_UNKNOWN) {
-        sr->headers.content_length = page.len;
+        sr->headers.content_length = page.len + uri.len + tail.len;
     }
     else {
         sr->headers.content_length = 0;
@@ -1319,21 +2026,38 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
         mk_ptr_set(&sr->headers.content_type, "Content-Type: text/html\r\n");
     }
 
+    mk_http_headers_link(sr);
     mk_header_prepare(cs, sr, server);
-    if (page.data) {
-        if (sr->method != MK_METHOD_HEAD) {
-            if (sr->headers._extra_rows) {
-                iov = sr->headers._extra_rows;
-                sr->in_headers_extra.bytes_total += page.len;
-            }
-            else {
-                iov = &sr->headers.headers_iov;
-                sr->in_headers.bytes_total += page.len;
-            }
-            mk_iov_add(iov, page.data, page.len, MK_TRUE);
+    if (page.data && sr->headers.content_length > 0) {
+        if (sr->headers._extra_rows) {
+            iov = sr->headers._extra_rows;
+            sr->in_headers_extra.bytes_total += sr->headers.content_length;
         }
         else {
-            mk_mem_free(page.data);
+            iov = &sr->headers.headers_iov;
+            sr->in_headers.bytes_total += sr->headers.content_length;
+        }
+
+        /* Not enough iov room for the pieces, join them */
+        if (iov->size - iov->iov_idx < 3 && (uri.len > 0 || tail.len > 0)) {
+            buf = mk_http_request_alloc(sr, sr->headers.content_length);
+            if (buf) {
+                memcpy(buf, page.data, page.len);
+                memcpy(buf + page.len, uri.data, uri.len);
+                memcpy(buf + page.len + uri.len, tail.data, tail.len);
+                page.data = buf;
+                page.len  = sr->headers.content_length;
+                mk_ptr_reset(&uri);
+                mk_ptr_reset(&tail);
+            }
+        }
+
+        mk_iov_add(iov, page.data, page.len, MK_FALSE);
+        if (uri.len > 0) {
+            mk_iov_add(iov, uri.data, uri.len, MK_FALSE);
+        }
+        if (tail.len > 0) {
+            mk_iov_add(iov, tail.data, tail.len, MK_FALSE);
         }
     }
 
@@ -1374,10 +2098,8 @@ void mk_http_session_remove(struct mk_http_session *cs,
         }
     }
 
-    if (cs->body != cs->body_fixed) {
-        mk_mem_free(cs->body);
-    }
     mk_http_request_free_list(cs, server);
+    mk_http_session_buffer_put(cs);
     mk_list_del(&cs->request_list);
 
     cs->_sched_init = MK_FALSE;
@@ -1413,19 +2135,11 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn,
     /* creation time in unix time */
     cs->init_time = conn->arrive_time;
 
-    /* alloc space for body content */
-    if (conn->net->buffer_size > MK_REQUEST_CHUNK) {
-        cs->body = mk_mem_alloc(conn->net->buffer_size);
-        cs->body_size = conn->net->buffer_size;
-    }
-    else {
-        /* Buffer size based in Chunk bytes */
-        cs->body = cs->body_fixed;
-        cs->body_size = MK_REQUEST_CHUNK;
-    }
-
-    /* Current data length */
+    /* The read buffer is taken when data arrives */
+    cs->body = NULL;
+    cs->body_size = 0;
     cs->body_length = 0;
+    cs->body_pooled = MK_FALSE;
 
     /* Init session request list */
     mk_list_init(&cs->request_list);
@@ -1433,30 +2147,54 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn,
     /* Initialize the parser */
     mk_http_parser_init(&cs->parser);
 
+    /* No virtual host resolved yet */
+    cs->vhost_name_len = -1;
+    cs->vhost = NULL;
+    cs->vhost_alias = NULL;
+
     return 0;
 }
 
 
+char *mk_http_request_printf(struct mk_http_request *sr, unsigned long *len,
+                             const char *fmt, ...)
+{
+    char *buf;
+    va_list ap;
+
+    va_start(ap, fmt);
+    buf = mk_arena_vprintf(&sr->arena, len, fmt, ap);
+    va_end(ap);
+
+    return buf;
+}
+
 void mk_http_request_free(struct mk_http_request *sr, struct mk_server *server)
 {
     /* Let the vhost interface to handle the session close */
     mk_vhost_close(sr, server);
 
-    if (sr->headers.location) {
-        mk_mem_free(sr->headers.location);
+    if (sr->stream.channel) {
+        mk_stream_release(&sr->stream);
     }
 
-    if (sr->uri_processed.data != sr->uri.data) {
-        mk_ptr_free(&sr->uri_processed);
+    /* The library kept the request open (topic subscriber) */
+    if (sr->lib_release) {
+        sr->lib_release(sr);
+        sr->lib_release = NULL;
     }
 
-    if (sr->real_path.data != sr->real_path_static) {
-        mk_ptr_free(&sr->real_path);
-    }
+    /* Store the response or drop the references of a cached one */
+    mk_http_cache_request_free(sr);
 
-    if (sr->stream.channel) {
-        mk_stream_release(&sr->stream);
-    }
+    /* Spilled request body */
+    mk_http_body_release(sr);
+
+    /*
+     * Decoded URI, real path, locations and any other buffer taken from
+     * the request arena go away at once.
+     */
+    mk_arena_reset(&sr->arena);
 }
 
 void mk_http_request_free_list(struct mk_http_session *cs,
@@ -1516,6 +2254,55 @@ struct mk_http_header *mk_http_header_get(int name, struct mk_http_request *req,
 /*
  * Main callbacks for the Scheduler
  */
+/* Drop what the client sends, returns -1 if the connection was closed */
+static int mk_http_discard(struct mk_sched_conn *conn)
+{
+    int bytes;
+    char buf[1024];
+
+    do {
+        bytes = mk_sched_conn_read(conn, buf, sizeof(buf));
+    } while (bytes == sizeof(buf));
+
+    if (bytes == 0 || (bytes == -1 && errno != EAGAIN)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The request is complete, process it */
+static int mk_http_request_ready(struct mk_sched_conn *conn,
+                                 struct mk_sched_worker *worker,
+                                 struct mk_http_session *cs,
+                                 struct mk_http_request *sr,
+                                 struct mk_server *server)
+{
+    int ret;
+
+    if (mk_http_status_completed(cs, conn) == -1) {
+        mk_http_session_remove(cs, server);
+        return -1;
+    }
+    mk_sched_conn_timeout_del(conn);
+    ret = mk_http_request_prepare(cs, sr, server);
+
+    /*
+     * If the response is already queued in the request stream let
+     * the event loop write it. Handlers serving the request
+     * asynchronously leave the stream empty and flush on their own,
+     * a library handler waiting for the socket owns the event.
+     */
+    if (ret == MK_EXIT_OK && conn->event.type != MK_EVENT_THREAD &&
+        mk_list_is_empty(&sr->stream.inputs) != 0) {
+        mk_event_add(worker->loop, conn->event.fd,
+                     MK_EVENT_CONNECTION, MK_EVENT_WRITE,
+                     &conn->event);
+    }
+
+    return ret;
+}
+
 int mk_http_sched_read(struct mk_sched_conn *conn,
                        struct mk_sched_worker *worker,
                        struct mk_server *server)
@@ -1523,7 +2310,7 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
     int ret;
     int status;
     size_t count;
-    (void) worker;
+    char *body;
     struct mk_http_session *cs;
     struct mk_http_request *sr;
 
@@ -1541,7 +2328,31 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
         }
     }
 
+    /* A topic subscriber does not take more requests */
+    if (mk_list_is_empty(&cs->request_list) != 0) {
+        sr = mk_list_entry_first(&cs->request_list,
+                                 struct mk_http_request, _head);
+        if (sr->lib_sub) {
+            return mk_http_discard(conn);
+        }
+
+        /* The body of the request is taken out of the read buffer */
+        if (mk_http_body_pending(cs, sr) == MK_TRUE) {
+            if (cs->parser.chunked == MK_TRUE) {
+                ret = mk_http_body_chunked(conn, cs, sr, server);
+            }
+            else {
+                ret = mk_http_body_read(conn, cs, sr, server);
+            }
+            if (ret == 1) {
+                ret = mk_http_request_ready(conn, worker, cs, sr, server);
+            }
+            return ret;
+        }
+    }
+
     /* Invoke the read handler, on this case we only support HTTP (for now :) */
+    body = cs->body;
     ret = mk_http_handler_read(conn, cs, server);
     if (ret > 0) {
         if (mk_list_is_empty(&cs->request_list) == 0) {
@@ -1552,17 +2363,25 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
         }
         else {
             sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
+
+            /*
+             * The pending request did not fit and the buffer was moved to a
+             * bigger one: the parser and the request still reference the old
+             * memory, so parse it again from the start. What the first
+             * parse allocated from the arena (decoded URI) is released.
+             */
+            if (body && cs->body != body) {
+                mk_http_parser_init(&cs->parser);
+                mk_list_del(&sr->stream._head);
+                mk_arena_reset(&sr->arena);
+                mk_http_request_init(cs, sr, server);
+            }
         }
         status = mk_http_parser(sr, &cs->parser, cs->body,
                                 cs->body_length, server);
         if (status == MK_HTTP_PARSER_OK) {
             MK_TRACE("[FD %i] HTTP_PARSER_OK", socket);
-            if (mk_http_status_completed(cs, conn) == -1) {
-                mk_http_session_remove(cs, server);
-                return -1;
-            }
-            mk_sched_conn_timeout_del(conn);
-            ret = mk_http_request_prepare(cs, sr, server);
+            ret = mk_http_request_ready(conn, worker, cs, sr, server);
         }
         else if (status == MK_HTTP_PARSER_ERROR) {
             /* The HTTP parser may enqueued some response error */
@@ -1575,6 +2394,16 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
         }
         else {
             MK_TRACE("[FD %i] HTTP_PARSER_PENDING", socket);
+
+            /* Headers are complete, the body is still arriving */
+            if (cs->parser.level == REQ_LEVEL_BODY &&
+                sr->body_mode == MK_HTTP_BODY_NONE) {
+                status = mk_http_body_start(cs, sr, server);
+                if (status != 0) {
+                    mk_request_premature_close(status, cs, server);
+                    return -1;
+                }
+            }
         }
     }
 
@@ -1610,8 +2439,23 @@ int mk_http_sched_done(struct mk_sched_conn *conn,
     struct mk_http_request *sr;
 
     session = mk_http_session_get(conn);
+
+    /*
+     * The session may be gone already: mk_http_error() ends the request
+     * itself and releases a session that must be closed.
+     */
+    if (session->_sched_init == MK_FALSE) {
+        return -1;
+    }
+
     sr = mk_list_entry_first(&session->request_list,
                              struct mk_http_request, _head);
+
+    /* A topic subscriber is not finalized when its stream runs dry */
+    if (sr->lib_sub) {
+        return 0;
+    }
+
     mk_plugin_stage_run_40(session, sr, server);
 
     return mk_http_request_end(session, server);
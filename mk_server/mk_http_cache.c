@@ -0,0 +1,901 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <pthread.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_cache.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_scheduler.h>
+
+/*
+ * Response micro-cache for dynamic handlers
+ * -----------------------------------------
+ * Locations listed in the [CACHE] section of a virtual host get their
+ * responses stored in memory for a few seconds, so a burst of requests
+ * for the same resource reaches the handler (FastCGI, proxy, library
+ * callbacks...) only once.
+ *
+ * The first request that misses creates the entry and runs the handler
+ * as usual while a tap on its channel copies every byte written to the
+ * client. When the request ends the copy is validated and stored. Other
+ * requests for the same key arriving meanwhile do not reach the handler:
+ * they are parked on the entry and their workers are signaled once the
+ * fill finishes, then they get the cached response or, if the response
+ * could not be stored, run the request again.
+ *
+ * The store is shared by all workers and protected by a single mutex, it
+ * only holds short critical sections: lookups, insertions and moving
+ * parked requests around.
+ */
+
+static int cache_enabled = MK_FALSE;
+static size_t cache_used;
+static size_t cache_limit;
+static size_t cache_object_max;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mk_list cache_table[MK_HTTP_CACHE_BUCKETS];
+static struct mk_list cache_lru;
+
+/* Parked requests ready to be resumed, one list per worker */
+static struct mk_list *cache_ready;
+
+static const mk_ptr_t cache_row_cc = mk_ptr_init("Cache-Control");
+static const mk_ptr_t cache_row_cl = mk_ptr_init("Content-Length");
+static const mk_ptr_t cache_row_te = mk_ptr_init("Transfer-Encoding");
+static const mk_ptr_t cache_row_cookie = mk_ptr_init("Set-Cookie");
+
+/* Rows the core adds on every response, never stored */
+static const mk_ptr_t cache_rows_skip[] = {
+    mk_ptr_init("Server"),
+    mk_ptr_init("Date"),
+    mk_ptr_init("Connection"),
+    mk_ptr_init("Keep-Alive"),
+    mk_ptr_init("Age")
+};
+
+struct mk_http_cache_rule *mk_http_cache_rule_create(char *match, int ttl)
+{
+    int ret;
+    char tmp[80];
+    struct mk_http_cache_rule *rule;
+
+    if (ttl <= 0) {
+        mk_err("Cache config: invalid TTL for '%s'", match);
+        return NULL;
+    }
+
+    rule = mk_mem_alloc_z(sizeof(struct mk_http_cache_rule));
+    if (!rule) {
+        return NULL;
+    }
+
+    ret = regcomp(&rule->match, match, REG_EXTENDED|REG_ICASE|REG_NOSUB);
+    if (ret) {
+        regerror(ret, &rule->match, tmp, sizeof(tmp));
+        mk_err("Cache config: Failed to compile regex: %s", tmp);
+        mk_mem_free(rule);
+        return NULL;
+    }
+    rule->ttl = ttl;
+
+    return rule;
+}
+
+/* Register a request header whose value is part of the cache key */
+int mk_http_cache_rule_vary(struct mk_http_cache_rule *rule, char *header)
+{
+    if (rule->n_vary >= MK_HTTP_CACHE_VARY_MAX) {
+        mk_err("Cache config: too many Vary headers, max %i",
+               MK_HTTP_CACHE_VARY_MAX);
+        return -1;
+    }
+
+    rule->vary[rule->n_vary].data = mk_string_dup(header);
+    rule->vary[rule->n_vary].len  = strlen(header);
+    rule->n_vary++;
+
+    return 0;
+}
+
+void mk_http_cache_rule_free(struct mk_http_cache_rule *rule)
+{
+    int i;
+
+    for (i = 0; i < rule->n_vary; i++) {
+        mk_mem_free(rule->vary[i].data);
+    }
+    regfree(&rule->match);
+    mk_mem_free(rule);
+}
+
+static inline size_t cache_entry_size(struct mk_http_cache_entry *entry)
+{
+    return sizeof(struct mk_http_cache_entry) + entry->key_len + entry->size;
+}
+
+static void cache_entry_free(struct mk_http_cache_entry *entry)
+{
+    mk_mem_free(entry->key);
+    mk_mem_free(entry->data);
+    mk_mem_free(entry);
+}
+
+/* Make an entry unreachable, it is released when its last user is gone */
+static void cache_unlink(struct mk_http_cache_entry *entry)
+{
+    mk_list_del(&entry->_head);
+    entry->linked = MK_FALSE;
+
+    if (entry->status == MK_HTTP_CACHE_READY) {
+        mk_list_del(&entry->_lru);
+        cache_used -= cache_entry_size(entry);
+    }
+
+    if (entry->refs == 0) {
+        cache_entry_free(entry);
+    }
+}
+
+static void cache_release(struct mk_http_cache_entry *entry)
+{
+    entry->refs--;
+    if (entry->refs == 0 && entry->linked == MK_FALSE) {
+        cache_entry_free(entry);
+    }
+}
+
+/* Keep the store under the memory budget: expired entries first, then LRU */
+static void cache_evict(time_t now)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_cache_entry *entry;
+
+    if (cache_used <= cache_limit) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, &cache_lru) {
+        entry = mk_list_entry(head, struct mk_http_cache_entry, _lru);
+        if (entry->expire <= now) {
+            cache_unlink(entry);
+        }
+    }
+
+    mk_list_foreach_safe(head, tmp, &cache_lru) {
+        if (cache_used <= cache_limit) {
+            break;
+        }
+        entry = mk_list_entry(head, struct mk_http_cache_entry, _lru);
+        cache_unlink(entry);
+    }
+}
+
+/*
+ * Hand the parked requests of an entry to their workers. A worker is
+ * signaled only when its list was empty, otherwise a signal is already
+ * pending.
+ */
+static void cache_wake(struct mk_http_cache_entry *entry)
+{
+    int ret;
+    uint64_t val = MK_SCHED_SIGNAL_HTTP_CACHE;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *ready;
+    struct mk_http_cache_req *req;
+
+    mk_list_foreach_safe(head, tmp, &entry->waiters) {
+        req = mk_list_entry(head, struct mk_http_cache_req, _head);
+        mk_list_del(&req->_head);
+
+        ready = &cache_ready[req->worker->idx];
+        if (mk_list_is_empty(ready) == 0) {
+            ret = write(req->worker->signal_channel_w, &val, sizeof(val));
+            if (ret == -1) {
+                mk_libc_error("write");
+            }
+        }
+        mk_list_add(&req->_head, ready);
+    }
+}
+
+static struct mk_http_cache_rule *cache_rule_match(struct mk_http_request *sr)
+{
+    struct mk_list *head;
+    struct mk_http_cache_rule *rule;
+
+    sr->uri_processed.data[sr->uri_processed.len] = '\0';
+    mk_list_foreach(head, &sr->host_conf->cache_rules) {
+        rule = mk_list_entry(head, struct mk_http_cache_rule, _head);
+        if (regexec(&rule->match, sr->uri_processed.data, 0, NULL, 0) == 0) {
+            return rule;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find the value of a request header by name, known or not */
+static struct mk_http_header *cache_header_find(struct mk_http_parser *parser,
+                                                mk_ptr_t *name)
+{
+    int i;
+    struct mk_list *head;
+    struct mk_http_header *header;
+
+    mk_list_foreach(head, &parser->header_list) {
+        header = mk_list_entry(head, struct mk_http_header, _head);
+        if (header->key.len == name->len &&
+            strncasecmp(header->key.data, name->data, name->len) == 0) {
+            return header;
+        }
+    }
+
+    for (i = 0; i < parser->headers_extra_count; i++) {
+        header = &parser->headers_extra[i];
+        if (header->key.len == name->len &&
+            strncasecmp(header->key.data, name->data, name->len) == 0) {
+            return header;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Compose the key: virtual host, method, protocol version, URI with the
+ * query string and the value of each Vary header. The protocol is part
+ * of the key as responses to HTTP/1.0 and HTTP/1.1 clients are framed
+ * differently (chunked encoding).
+ */
+static char *cache_key(struct mk_http_session *cs, struct mk_http_request *sr,
+                       struct mk_http_cache_rule *rule, size_t *key_len)
+{
+    int i;
+    int len;
+    size_t size;
+    char *p;
+    char *key;
+    struct mk_http_header *vary[MK_HTTP_CACHE_VARY_MAX];
+
+    size = 64 + sr->uri.len + sr->query_string.len;
+    for (i = 0; i < rule->n_vary; i++) {
+        vary[i] = cache_header_find(&cs->parser, &rule->vary[i]);
+        size += 2;
+        if (vary[i]) {
+            size += vary[i]->val.len;
+        }
+    }
+
+    key = mk_mem_alloc(size);
+    if (!key) {
+        return NULL;
+    }
+
+    len = snprintf(key, 64, "%p %i %i ",
+                   (void *) sr->host_conf, sr->method, sr->protocol);
+    p = key + len;
+
+    memcpy(p, sr->uri.data, sr->uri.len);
+    p += sr->uri.len;
+    if (sr->query_string.len > 0) {
+        *p++ = '?';
+        memcpy(p, sr->query_string.data, sr->query_string.len);
+        p += sr->query_string.len;
+    }
+
+    for (i = 0; i < rule->n_vary; i++) {
+        *p++ = '\n';
+        if (vary[i]) {
+            *p++ = '=';
+            memcpy(p, vary[i]->val.data, vary[i]->val.len);
+            p += vary[i]->val.len;
+        }
+    }
+
+    *key_len = p - key;
+    return key;
+}
+
+static struct mk_http_cache_entry *cache_find(unsigned int hash,
+                                              char *key, size_t key_len)
+{
+    struct mk_list *head;
+    struct mk_list *bucket;
+    struct mk_http_cache_entry *entry;
+
+    bucket = &cache_table[hash & (MK_HTTP_CACHE_BUCKETS - 1)];
+    mk_list_foreach(head, bucket) {
+        entry = mk_list_entry(head, struct mk_http_cache_entry, _head);
+        if (entry->hash == hash && entry->key_len == key_len &&
+            memcmp(entry->key, key, key_len) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * The response of a fill cannot be stored: drop the entry now and let the
+ * parked requests go to the handler, a long or endless response must not
+ * hold them until it ends.
+ */
+static int cache_fill_overflow(struct mk_http_cache_req *req)
+{
+    if (req->overflow == MK_TRUE) {
+        return -1;
+    }
+    req->overflow = MK_TRUE;
+
+    pthread_mutex_lock(&cache_mutex);
+    cache_unlink(req->entry);
+    cache_wake(req->entry);
+    pthread_mutex_unlock(&cache_mutex);
+
+    return -1;
+}
+
+/* Channel tap: keep a copy of the response written by the filling request */
+static int cache_cb_written(struct mk_channel *channel, char *buf, size_t len)
+{
+    size_t size;
+    char *tmp;
+    struct mk_http_cache_req *req = channel->written_data;
+
+    if (!buf || req->overflow == MK_TRUE) {
+        return cache_fill_overflow(req);
+    }
+
+    /* The announced length already tells the response will not fit */
+    if (req->sr->headers.content_length > 0 &&
+        (size_t) req->sr->headers.content_length > cache_object_max) {
+        return cache_fill_overflow(req);
+    }
+
+    if (req->len + len > req->size) {
+        if (req->len + len > cache_object_max) {
+            return cache_fill_overflow(req);
+        }
+
+        size = req->size ? req->size * 2 : MK_REQUEST_CHUNK;
+        while (size < req->len + len) {
+            size *= 2;
+        }
+        if (size > cache_object_max) {
+            size = cache_object_max;
+        }
+
+        tmp = mk_mem_realloc(req->buf, size);
+        if (!tmp) {
+            return cache_fill_overflow(req);
+        }
+        req->buf  = tmp;
+        req->size = size;
+    }
+
+    memcpy(req->buf + req->len, buf, len);
+    req->len += len;
+
+    return 0;
+}
+
+static inline int cache_row_is(char *row, size_t len, const mk_ptr_t *name)
+{
+    return (len > name->len && row[name->len] == ':' &&
+            strncasecmp(row, name->data, name->len) == 0);
+}
+
+/*
+ * Validate the copy of a response and build the data stored in the entry.
+ * Responses that set cookies, are marked private or uncacheable, or are
+ * not complete (framing does not match the body) are rejected.
+ */
+static int cache_response_build(struct mk_http_cache_req *req,
+                                 struct mk_http_cache_entry *entry)
+{
+    int i;
+    int skip;
+    int status;
+    int chunked = MK_FALSE;
+    long content_length = -1;
+    size_t len;
+    size_t rows_len = 0;
+    size_t body_len;
+    char *p;
+    char *end;
+    char *row;
+    char *body;
+    char *data;
+    char *rows_end;
+
+    /* Head: status line and rows */
+    end = memmem(req->buf, req->len, "\r\n\r\n", 4);
+    if (!end) {
+        return -1;
+    }
+    rows_end = end + 2;
+    body = end + 4;
+    body_len = req->len - (body - req->buf);
+
+    p = memmem(req->buf, rows_end - req->buf, "\r\n", 2);
+    if (p - req->buf < 12 || strncmp(req->buf, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    status = atoi(req->buf + 9);
+    if (status != MK_HTTP_OK && status != MK_HTTP_NON_AUTH_INFO &&
+        status != MK_REDIR_MULTIPLE && status != MK_REDIR_MOVED &&
+        status != MK_CLIENT_NOT_FOUND && status != MK_CLIENT_GONE) {
+        return -1;
+    }
+
+    /* Stored rows never take more than the original ones */
+    data = mk_mem_alloc(req->len);
+    if (!data) {
+        return -1;
+    }
+    entry->status_len = (p + 2) - req->buf;
+    memcpy(data, req->buf, entry->status_len);
+
+    for (row = p + 2; row < rows_end; row = p + 2) {
+        p = memmem(row, rows_end - row, "\r\n", 2);
+        len = p - row;
+
+        if (cache_row_is(row, len, &cache_row_cookie)) {
+            goto reject;
+        }
+        else if (cache_row_is(row, len, &cache_row_cc)) {
+            if (memmem(row, len, "private", 7) ||
+                memmem(row, len, "no-store", 8) ||
+                memmem(row, len, "no-cache", 8)) {
+                goto reject;
+            }
+        }
+        else if (cache_row_is(row, len, &cache_row_cl)) {
+            content_length = strtol(row + 15, NULL, 10);
+        }
+        else if (cache_row_is(row, len, &cache_row_te)) {
+            if (memmem(row, len, "chunked", 7)) {
+                chunked = MK_TRUE;
+            }
+        }
+
+        skip = MK_FALSE;
+        for (i = 0; i < (int) (sizeof(cache_rows_skip) / sizeof(mk_ptr_t)); i++) {
+            if (cache_row_is(row, len, &cache_rows_skip[i])) {
+                skip = MK_TRUE;
+                break;
+            }
+        }
+        if (skip == MK_FALSE) {
+            memcpy(data + entry->status_len + rows_len, row, len + 2);
+            rows_len += len + 2;
+        }
+    }
+
+    /* The body must be complete */
+    if (req->sr->method == MK_METHOD_HEAD) {
+        if (body_len != 0) {
+            goto reject;
+        }
+    }
+    else if (chunked == MK_TRUE) {
+        if (body_len < 5 || memcmp(body + body_len - 5, "0\r\n\r\n", 5) != 0) {
+            goto reject;
+        }
+    }
+    else if (content_length < 0 || (size_t) content_length != body_len) {
+        goto reject;
+    }
+
+    memcpy(data + entry->status_len + rows_len, "\r\n", 2);
+    memcpy(data + entry->status_len + rows_len + 2, body, body_len);
+
+    entry->data        = data;
+    entry->size        = entry->status_len + rows_len + 2 + body_len;
+    entry->rows_len    = rows_len;
+    entry->http_status = status;
+
+    return 0;
+
+ reject:
+    mk_mem_free(data);
+    return -1;
+}
+
+/* Queue the cached response on the request stream */
+static void cache_hit(struct mk_http_cache_req *req)
+{
+    int len;
+    size_t offset;
+    mk_ptr_t *preset;
+    struct mk_iov *iov = &req->iov;
+    struct mk_http_session *cs = req->cs;
+    struct mk_http_request *sr = req->sr;
+    struct mk_http_cache_entry *entry = req->entry;
+
+    req->role = MK_HTTP_CACHE_REQ_HIT;
+
+    iov->io = req->io;
+    iov->buf_to_free = NULL;
+    mk_iov_init(iov, sizeof(req->io) / sizeof(struct iovec), 0);
+
+    mk_iov_add(iov, entry->data, entry->status_len, MK_FALSE);
+    preset = mk_clock_headers_preset(cs->server);
+    mk_iov_add(iov, preset->data, preset->len, MK_FALSE);
+    mk_iov_add(iov, entry->data + entry->status_len, entry->rows_len,
+               MK_FALSE);
+
+    /* Same rules than mk_header_prepare() */
+    if (cs->close_now == MK_TRUE) {
+        mk_iov_add(iov, mk_header_conn_close.data, mk_header_conn_close.len,
+                   MK_FALSE);
+    }
+    else if (sr->connection.len > 0 && sr->protocol != MK_HTTP_PROTOCOL_11) {
+        mk_iov_add(iov, mk_header_conn_ka.data, mk_header_conn_ka.len,
+                   MK_FALSE);
+    }
+
+    len = snprintf(req->age, sizeof(req->age), "Age: %li\r\n",
+                   (long) (mk_clock_now() - entry->created));
+    mk_iov_add(iov, req->age, len, MK_FALSE);
+
+    offset = entry->status_len + entry->rows_len;
+    mk_iov_add(iov, entry->data + offset, entry->size - offset, MK_FALSE);
+
+    mk_stream_in_iov(&sr->stream, &req->in, iov, NULL, NULL);
+
+    sr->headers.status = entry->http_status;
+    sr->headers.sent = MK_TRUE;
+}
+
+/*
+ * Called from mk_http_init() before looking for a handler. It returns
+ * MK_HTTP_CACHE_PASS when the request must be processed (and maybe its
+ * response stored), MK_HTTP_CACHE_HIT when the response was queued from
+ * memory or MK_HTTP_CACHE_WAIT when the request was parked on a fill.
+ */
+int mk_http_cache_lookup(struct mk_http_session *cs,
+                         struct mk_http_request *sr,
+                         struct mk_server *server)
+{
+    int can_wait;
+    size_t key_len;
+    char *key;
+    unsigned int hash;
+    time_t now = mk_clock_now();
+    struct mk_http_cache_req *req;
+    struct mk_http_cache_rule *rule;
+    struct mk_http_cache_entry *entry;
+    (void) server;
+
+    if (cache_enabled == MK_FALSE ||
+        mk_list_is_empty(&sr->host_conf->cache_rules) == 0) {
+        return MK_HTTP_CACHE_PASS;
+    }
+
+    if ((sr->method != MK_METHOD_GET && sr->method != MK_METHOD_HEAD) ||
+        (sr->protocol != MK_HTTP_PROTOCOL_10 &&
+         sr->protocol != MK_HTTP_PROTOCOL_11) ||
+        cs->parser.headers[MK_HEADER_AUTHORIZATION].type ==
+        MK_HEADER_AUTHORIZATION ||
+        sr->range.data) {
+        return MK_HTTP_CACHE_PASS;
+    }
+
+    /* Conditional requests are evaluated against the file itself */
+    if (sr->if_match.data || sr->if_none_match.data ||
+        sr->if_modified_since.data || sr->if_unmodified_since.data) {
+        return MK_HTTP_CACHE_PASS;
+    }
+
+    rule = cache_rule_match(sr);
+    if (!rule) {
+        return MK_HTTP_CACHE_PASS;
+    }
+
+    key = cache_key(cs, sr, rule, &key_len);
+    if (!key) {
+        return MK_HTTP_CACHE_PASS;
+    }
+    hash = mk_string_hash(key, key_len, MK_STR_SENSITIVE);
+
+    req = mk_mem_alloc_z(sizeof(struct mk_http_cache_req));
+    if (!req) {
+        mk_mem_free(key);
+        return MK_HTTP_CACHE_PASS;
+    }
+    req->cs   = cs;
+    req->sr   = sr;
+    req->rule = rule;
+
+    /*
+     * A request can only be parked when it was read from the socket. The
+     * next request of a pipeline is started from the write path and must
+     * queue its response right away.
+     */
+    can_wait = !(cs->conn->event.mask & MK_EVENT_WRITE);
+
+    pthread_mutex_lock(&cache_mutex);
+
+    entry = cache_find(hash, key, key_len);
+    if (entry && entry->status == MK_HTTP_CACHE_READY && entry->expire <= now) {
+        cache_unlink(entry);
+        entry = NULL;
+    }
+
+    if (entry && entry->status == MK_HTTP_CACHE_READY) {
+        entry->refs++;
+        mk_list_del(&entry->_lru);
+        mk_list_add(&entry->_lru, &cache_lru);
+        pthread_mutex_unlock(&cache_mutex);
+
+        mk_mem_free(key);
+        req->entry = entry;
+        sr->cache = req;
+        cache_hit(req);
+        return MK_HTTP_CACHE_HIT;
+    }
+    else if (entry) {
+        if (can_wait == MK_FALSE) {
+            pthread_mutex_unlock(&cache_mutex);
+            mk_mem_free(key);
+            mk_mem_free(req);
+            return MK_HTTP_CACHE_PASS;
+        }
+
+        entry->refs++;
+        req->role   = MK_HTTP_CACHE_REQ_WAIT;
+        req->entry  = entry;
+        req->worker = mk_sched_get_thread_conf();
+        req->parked = MK_TRUE;
+        mk_list_add(&req->_head, &entry->waiters);
+        pthread_mutex_unlock(&cache_mutex);
+
+        MK_TRACE("[FD %i] cache wait on fill", cs->socket);
+        mk_mem_free(key);
+        sr->cache = req;
+        return MK_HTTP_CACHE_WAIT;
+    }
+
+    /* Miss: this request fills the entry */
+    entry = mk_mem_alloc_z(sizeof(struct mk_http_cache_entry));
+    if (!entry) {
+        pthread_mutex_unlock(&cache_mutex);
+        mk_mem_free(key);
+        mk_mem_free(req);
+        return MK_HTTP_CACHE_PASS;
+    }
+    entry->status  = MK_HTTP_CACHE_FILLING;
+    entry->linked  = MK_TRUE;
+    entry->refs    = 1;
+    entry->hash    = hash;
+    entry->key     = key;
+    entry->key_len = key_len;
+    mk_list_init(&entry->waiters);
+    mk_list_add(&entry->_head,
+                &cache_table[hash & (MK_HTTP_CACHE_BUCKETS - 1)]);
+    pthread_mutex_unlock(&cache_mutex);
+
+    req->role  = MK_HTTP_CACHE_REQ_FILL;
+    req->entry = entry;
+    sr->cache  = req;
+
+    cs->channel->cb_written   = cache_cb_written;
+    cs->channel->written_data = req;
+
+    return MK_HTTP_CACHE_PASS;
+}
+
+/* The filling request is gone: store its response or drop the entry */
+static void cache_fill_end(struct mk_http_cache_req *req)
+{
+    int ret = -1;
+    time_t now = mk_clock_now();
+    struct mk_http_cache_entry *entry = req->entry;
+
+    if (req->overflow == MK_FALSE && req->len > 0) {
+        ret = cache_response_build(req, entry);
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+    if (ret == 0) {
+        entry->status  = MK_HTTP_CACHE_READY;
+        entry->created = now;
+        entry->expire  = now + req->rule->ttl;
+        cache_used += cache_entry_size(entry);
+        mk_list_add(&entry->_lru, &cache_lru);
+        cache_evict(now);
+    }
+    else if (entry->linked == MK_TRUE) {
+        /* Parked requests will run again, one of them fills the entry */
+        cache_unlink(entry);
+    }
+
+    cache_wake(entry);
+    cache_release(entry);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/* Release the cache state of a request, called when the request is freed */
+void mk_http_cache_request_free(struct mk_http_request *sr)
+{
+    struct mk_channel *channel;
+    struct mk_http_cache_req *req = sr->cache;
+
+    if (!req) {
+        return;
+    }
+    sr->cache = NULL;
+
+    if (req->role == MK_HTTP_CACHE_REQ_FILL) {
+        channel = req->cs->channel;
+        if (channel->written_data == req) {
+            channel->cb_written   = NULL;
+            channel->written_data = NULL;
+        }
+        cache_fill_end(req);
+    }
+    else {
+        pthread_mutex_lock(&cache_mutex);
+        if (req->parked == MK_TRUE) {
+            mk_list_del(&req->_head);
+        }
+        cache_release(req->entry);
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+    mk_mem_free(req->buf);
+    mk_mem_free(req);
+}
+
+/*
+ * A fill this worker was waiting for finished (MK_SCHED_SIGNAL_HTTP_CACHE):
+ * serve the parked requests from the entry or, if it could not be stored,
+ * process them again.
+ */
+void mk_http_cache_worker_wake(struct mk_sched_worker *sched,
+                               struct mk_server *server)
+{
+    int ret;
+    struct mk_list list;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *ready;
+    struct mk_sched_conn *conn;
+    struct mk_http_session *cs;
+    struct mk_http_request *sr;
+    struct mk_http_cache_req *req;
+
+    mk_list_init(&list);
+
+    pthread_mutex_lock(&cache_mutex);
+    ready = &cache_ready[sched->idx];
+    mk_list_foreach(head, ready) {
+        req = mk_list_entry(head, struct mk_http_cache_req, _head);
+        req->parked = MK_FALSE;
+    }
+    if (mk_list_is_empty(ready) != 0) {
+        mk_list_cat(ready, &list);
+        mk_list_init(ready);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    mk_list_foreach_safe(head, tmp, &list) {
+        req = mk_list_entry(head, struct mk_http_cache_req, _head);
+        mk_list_del(&req->_head);
+
+        cs = req->cs;
+        sr = req->sr;
+        conn = cs->conn;
+
+        if (req->entry->status == MK_HTTP_CACHE_READY) {
+            cache_hit(req);
+            mk_event_add(sched->loop, conn->event.fd,
+                         MK_EVENT_CONNECTION, MK_EVENT_WRITE, &conn->event);
+            continue;
+        }
+
+        mk_http_cache_request_free(sr);
+        ret = mk_http_init(cs, sr, server);
+        if (ret == MK_EXIT_OK && mk_list_is_empty(&sr->stream.inputs) != 0) {
+            mk_event_add(sched->loop, conn->event.fd,
+                         MK_EVENT_CONNECTION, MK_EVENT_WRITE, &conn->event);
+        }
+        else if (ret < 0 && conn->status != MK_SCHED_CONN_CLOSED) {
+            mk_sched_event_close(conn, sched, MK_EP_SOCKET_CLOSED, server);
+        }
+    }
+}
+
+int mk_http_cache_init(struct mk_server *server)
+{
+    int i;
+    struct mk_list *head;
+    struct mk_vhost *host;
+
+    if (server->cache_memory == 0) {
+        return 0;
+    }
+
+    /* Nothing to do if no virtual host has cache rules */
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        if (mk_list_is_empty(&host->cache_rules) != 0) {
+            break;
+        }
+    }
+    if (head == &server->hosts) {
+        return 0;
+    }
+
+    cache_ready = mk_mem_alloc(sizeof(struct mk_list) * server->workers);
+    if (!cache_ready) {
+        return -1;
+    }
+    for (i = 0; i < server->workers; i++) {
+        mk_list_init(&cache_ready[i]);
+    }
+
+    for (i = 0; i < MK_HTTP_CACHE_BUCKETS; i++) {
+        mk_list_init(&cache_table[i]);
+    }
+    mk_list_init(&cache_lru);
+
+    cache_used       = 0;
+    cache_limit      = server->cache_memory;
+    cache_object_max = cache_limit / 8;
+    cache_enabled    = MK_TRUE;
+
+    return 0;
+}
+
+void mk_http_cache_exit(struct mk_server *server)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_cache_entry *entry;
+    (void) server;
+
+    if (cache_enabled == MK_FALSE) {
+        return;
+    }
+
+    for (i = 0; i < MK_HTTP_CACHE_BUCKETS; i++) {
+        mk_list_foreach_safe(head, tmp, &cache_table[i]) {
+            entry = mk_list_entry(head, struct mk_http_cache_entry, _head);
+            mk_list_del(&entry->_head);
+            cache_entry_free(entry);
+        }
+    }
+
+    mk_mem_free(cache_ready);
+    cache_enabled = MK_FALSE;
+}
@@ -25,11 +25,22 @@
 #include <errno.h>
 #include <stdint.h>
 #include <limits.h>
+#include <endian.h>
 
 #include <monkey/mk_http.h>
 #include <monkey/mk_http_parser.h>
 #include <monkey/mk_http_status.h>
 
+#include "mk_http_parser_tables.h"
+#include "mk_http_parser_hash.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef MK_HAVE_AVX2_DISPATCH
+#include <immintrin.h>
+#endif
+
 #define mark_end()                              \
     p->end = p->i;                              \
     p->chars = -1;
@@ -39,57 +50,196 @@
     continue
 
 #define field_len()   (p->end - p->start)
-#define header_scope_eq(p, x) p->header_min = p->header_max = x
 
-struct row_entry {
-    int len;
-    const char name[32];
-};
-
-struct row_entry mk_methods_table[] = {
-    { 3, "GET"     },
-    { 4, "POST"    },
-    { 4, "HEAD"    },
-    { 3, "PUT"     },
-    { 6, "DELETE"  },
-    { 7, "OPTIONS" }
-};
-
-struct row_entry mk_headers_table[] = {
-    {  6, "accept"              },
-    { 14, "accept-charset"      },
-    { 15, "accept-encoding"     },
-    { 15, "accept-language"     },
-    { 13, "authorization"       },
-    { 13, "cache-control"       },
-    {  6, "cookie"              },
-    { 10, "connection"          },
-    { 14, "content-length"      },
-    { 13, "content-range"       },
-    { 12, "content-type"        },
-    {  4, "host"                },
-    { 14, "http2-settings"      },
-    { 17, "if-modified-since"   },
-    { 13, "last-modified"       },
-    { 19, "last-modified-since" },
-    {  5, "range"               },
-    {  7, "referer"             },
-    {  7, "upgrade"             },
-    { 10, "user-agent"          }
-};
+/* Case insensitive compare against a lowercase table entry */
+static inline int word_ieq(const char *value, const char *expected, int len)
+{
+    int n;
+    int off;
+
+    for (off = 0; off < len; off += 8) {
+        n = len - off;
+        if (word_fold(word_load(value + off, n)) !=
+            word_load(expected + off, n)) {
+            return MK_FALSE;
+        }
+    }
+    return MK_TRUE;
+}
 
-static inline void char_lookup(char *buf, char c, int len, struct mk_http_parser *p)
+/* Lookup a case folded string in a hashed table, -1 if not found */
+static inline int table_find(const struct row_entry *table,
+                             const signed char *slots,
+                             uint64_t mul, int bits,
+                             const char *value, int len)
+{
+    int i;
+    uint64_t w;
+
+    w = word_fold(word_load(value, len));
+    i = slots[word_hash(w, len, mul, bits)];
+    if (i < 0 || table[i].len != len) {
+        return -1;
+    }
+
+    if (w != word_load(table[i].name, len)) {
+        return -1;
+    }
+    if (len > 8 && word_ieq(value + 8, table[i].name + 8, len - 8) == MK_FALSE) {
+        return -1;
+    }
+    return i;
+}
+
+static inline int header_find(const char *value, int len)
+{
+    if (len <= 0 || len >= (int) sizeof(mk_headers_table[0].name)) {
+        return -1;
+    }
+    return table_find(mk_headers_table, mk_headers_slots,
+                      MK_HEADERS_HASH_MUL, MK_HEADERS_HASH_BITS, value, len);
+}
+
+static inline int token_find(const char *value, int len)
+{
+    if (len <= 0 || len >= (int) sizeof(mk_tokens_table[0].name)) {
+        return -1;
+    }
+    return table_find(mk_tokens_table, mk_tokens_slots,
+                      MK_TOKENS_HASH_MUL, MK_TOKENS_HASH_BITS, value, len);
+}
+
+/*
+ * Delimiter scanning: return the position of the first byte in
+ * buf[i..len) that matches any of a, b, c or d, or len if there is
+ * none. Callers looking for less than four bytes repeat one of them.
+ */
+typedef int (*delim_scan_t)(const char *, int, int, int, int, int, int);
+
+static int delim_scan_scalar(const char *buf, int i, int len,
+                             int a, int b, int c, int d)
 {
-    int x = 0;
+    for (; i < len; i++) {
+        if (buf[i] == a || buf[i] == b || buf[i] == c || buf[i] == d) {
+            return i;
+        }
+    }
+    return len;
+}
 
-    x = p->i;
-    do {
-        if (buf[x] == c) {
-            p->i = x;
-            return;
+#ifdef __SSE2__
+static int delim_scan_sse2(const char *buf, int i, int len,
+                           int a, int b, int c, int d)
+{
+    int mask;
+    __m128i v;
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    __m128i vc = _mm_set1_epi8(c);
+    __m128i vd = _mm_set1_epi8(d);
+
+    for (; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = _mm_movemask_epi8(
+                   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                             _mm_cmpeq_epi8(v, vb)),
+                                _mm_or_si128(_mm_cmpeq_epi8(v, vc),
+                                             _mm_cmpeq_epi8(v, vd))));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return delim_scan_scalar(buf, i, len, a, b, c, d);
+}
+#endif
+
+#ifdef MK_HAVE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static int delim_scan_avx2(const char *buf, int i, int len,
+                           int a, int b, int c, int d)
+{
+    unsigned int mask;
+    __m256i v;
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    __m256i vc = _mm256_set1_epi8(c);
+    __m256i vd = _mm256_set1_epi8(d);
+
+    for (; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        mask = _mm256_movemask_epi8(
+                   _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                                   _mm256_cmpeq_epi8(v, vb)),
+                                   _mm256_or_si256(_mm256_cmpeq_epi8(v, vc),
+                                                   _mm256_cmpeq_epi8(v, vd))));
+        if (mask) {
+            return i + __builtin_ctz(mask);
         }
-        x++;
-    } while (x < len);
+    }
+    return delim_scan_sse2(buf, i, len, a, b, c, d);
+}
+#endif
+
+/*
+ * The scanner is chosen once by mk_http_parser_scan_init() before the
+ * workers start, until then the baseline of the build is used.
+ */
+#ifdef __SSE2__
+static delim_scan_t delim_scan = delim_scan_sse2;
+#else
+static delim_scan_t delim_scan = delim_scan_scalar;
+#endif
+
+int mk_http_parser_scan_init(int type)
+{
+    delim_scan_t func = NULL;
+
+    switch (type) {
+    case MK_HTTP_PARSER_SCAN_AUTO:
+#ifdef __SSE2__
+        func = delim_scan_sse2;
+#else
+        func = delim_scan_scalar;
+#endif
+#ifdef MK_HAVE_AVX2_DISPATCH
+        if (__builtin_cpu_supports("avx2")) {
+            func = delim_scan_avx2;
+        }
+#endif
+        break;
+    case MK_HTTP_PARSER_SCAN_SCALAR:
+        func = delim_scan_scalar;
+        break;
+#ifdef __SSE2__
+    case MK_HTTP_PARSER_SCAN_SSE2:
+        func = delim_scan_sse2;
+        break;
+#endif
+#ifdef MK_HAVE_AVX2_DISPATCH
+    case MK_HTTP_PARSER_SCAN_AVX2:
+        if (__builtin_cpu_supports("avx2")) {
+            func = delim_scan_avx2;
+        }
+        break;
+#endif
+    }
+
+    if (!func) {
+        return -1;
+    }
+
+    delim_scan = func;
+    return 0;
+}
+
+static inline void char_lookup(char *buf, char c, int len, struct mk_http_parser *p)
+{
+    int x;
+
+    x = delim_scan(buf, p->i, len, c, c, c, c);
+    if (x < len) {
+        p->i = x;
+    }
 }
 
 static inline int str_searchr(char *buf, char c, int len)
@@ -108,8 +258,9 @@ static inline int str_searchr(char *buf, char c, int len)
 static inline int method_lookup(struct mk_http_request *req,
                                 struct mk_http_parser *p, char *buffer)
 {
-    int i = 0;
+    int i;
     int len;
+    uint64_t w;
 
     /* Method lenght */
     len = field_len();
@@ -119,26 +270,20 @@ static inline int method_lookup(struct mk_http_request *req,
     req->method_p.data = buffer + p->start;
     req->method_p.len  = len;
 
-    if (p->method >= 0) {
-        if (strncmp(buffer + p->start + 1,
-                    mk_methods_table[p->method].name + 1,
-                    len - 1) == 0) {
-            req->method = p->method;
-            return req->method;
-        }
+    /* Methods are case sensitive and fit in one word */
+    if (len > 8) {
+        return MK_METHOD_UNKNOWN;
     }
 
-    for (i = 0; i < MK_METHOD_SIZEOF; i++) {
-        if (len != mk_methods_table[i].len) {
-            continue;
-        }
-
-        if (strncmp(buffer + p->start, mk_methods_table[i].name, len) == 0) {
-            req->method = i;
-            return i;
-        }
+    w = word_load(buffer + p->start, len);
+    i = mk_methods_slots[word_hash(w, len, MK_METHODS_HASH_MUL,
+                                   MK_METHODS_HASH_BITS)];
+    if (i >= 0 && mk_methods_table[i].len == len &&
+        w == word_load(mk_methods_table[i].name, len)) {
+        req->method = i;
     }
-    return MK_METHOD_UNKNOWN;
+
+    return req->method;
 }
 
 static inline void request_set(mk_ptr_t *ptr, struct mk_http_parser *p, char *buffer)
@@ -148,32 +293,94 @@ static inline void request_set(mk_ptr_t *ptr, struct mk_http_parser *p, char *bu
 }
 
 /*
- * expected: a known & expected value in lowercase
- * value   : the expected string value in the header
- * len     : the value string length.
- *
- * If it matches it return zero. Otherwise -1.
+ * Connection header: a comma separated list of tokens. A single
+ * keep-alive or close token is reported as such, otherwise the value
+ * is unknown but it may still ask for an upgrade.
  */
-static inline int header_cmp(const char *expected, char *value, int len)
+static inline int connection_lookup(mk_ptr_t *val)
 {
     int i = 0;
+    int len;
+    int token;
+    int count = 0;
+    int first = -1;
+    int flags = 0;
+    char *s = val->data;
+
+    while (i < (int) val->len) {
+        if (s[i] == ',' || s[i] == ' ' || s[i] == '\t') {
+            i++;
+            continue;
+        }
 
-    if (len >= 8) {
-        if (expected[0] != tolower(value[0])) return -1;
-        if (expected[1] != tolower(value[1])) return -1;
-        if (expected[2] != tolower(value[2])) return -1;
-        if (expected[3] != tolower(value[3])) return -1;
-        if (expected[4] != tolower(value[4])) return -1;
-        if (expected[5] != tolower(value[5])) return -1;
-        if (expected[6] != tolower(value[6])) return -1;
-        if (expected[7] != tolower(value[7])) return -1;
-        i = 8;
+        len = 0;
+        while (i + len < (int) val->len && s[i + len] != ',' &&
+               s[i + len] != ' ' && s[i + len] != '\t') {
+            len++;
+        }
+
+        token = token_find(s + i, len);
+        if (count == 0) {
+            first = token;
+        }
+        count++;
+
+        if (token == MK_TOKEN_UPGRADE) {
+            flags |= MK_HTTP_PARSER_CONN_UPGRADE;
+        }
+        else if (token == MK_TOKEN_HTTP2_SETTINGS) {
+            flags |= MK_HTTP_PARSER_CONN_HTTP2_SE;
+        }
+        i += len;
     }
 
-    for (; i < len; i++) {
-        if (expected[i] != tolower(value[i])) {
-            return -1;
+    if (count == 1 && first == MK_TOKEN_KEEP_ALIVE) {
+        return MK_HTTP_PARSER_CONN_KA;
+    }
+    else if (count == 1 && first == MK_TOKEN_CLOSE) {
+        return MK_HTTP_PARSER_CONN_CLOSE;
+    }
+    else if (flags != 0) {
+        return flags;
+    }
+
+    return MK_HTTP_PARSER_CONN_UNKNOWN;
+}
+
+/*
+ * Transfer-Encoding header: chunked is the only coding we decode and it
+ * must be the last one, otherwise the body length is unknown.
+ */
+static inline int transfer_encoding_lookup(mk_ptr_t *val)
+{
+    int i = 0;
+    int len;
+    int token = -1;
+    int count = 0;
+    char *s = val->data;
+
+    while (i < (int) val->len) {
+        if (s[i] == ',' || s[i] == ' ' || s[i] == '\t') {
+            i++;
+            continue;
+        }
+
+        len = 0;
+        while (i + len < (int) val->len && s[i + len] != ',' &&
+               s[i + len] != ' ' && s[i + len] != '\t') {
+            len++;
         }
+
+        token = token_find(s + i, len);
+        count++;
+        i += len;
+    }
+
+    if (token != MK_TOKEN_CHUNKED) {
+        return -MK_CLIENT_BAD_REQUEST;
+    }
+    else if (count > 1) {
+        return -MK_SERVER_NOT_IMPLEMENTED;
     }
 
     return 0;
@@ -183,131 +390,94 @@ static inline int header_lookup(struct mk_http_parser *p, char *buffer)
 {
     int i;
     int len;
-    int pos;
+    int ret;
     long val;
+    uint64_t w;
     char *endptr;
     char *tmp;
 
     struct mk_http_header *header;
     struct mk_http_header *header_extra;
-    struct row_entry *h;
 
     len = (p->header_sep - p->header_key);
-    for (i = p->header_min; i <= p->header_max && i >= 0; i++) {
-        h = &mk_headers_table[i];
-        /* Check string length first */
-        if (h->len != len) {
-            continue;
-        }
-
-        if (header_cmp(h->name + 1, buffer + p->header_key + 1, len - 1) == 0) {
-            /* We got a header match, register the header index */
-            header = &p->headers[i];
-            header->type = i;
-            header->key.data = buffer + p->header_key;
-            header->key.len  = len;
-            header->val.data = buffer + p->header_val;
-            header->val.len  = p->end - p->header_val;
-            p->header_count++;
-            mk_list_add(&header->_head, &p->header_list);
-
-            if (i == MK_HEADER_HOST) {
-                /* Handle a possible port number in the Host header */
-                int sep = str_searchr(header->val.data, ':', header->val.len);
-                if (sep > 0) {
-                    int plen;
-                    short int port_size = 6;
-                    char port[port_size];
-
-                    plen = header->val.len - sep - 1;
-                    if (plen <= 0 || plen >= port_size) {
-                        return -MK_CLIENT_BAD_REQUEST;
-                    }
-                    memcpy(&port, header->val.data + sep + 1, plen);
-                    port[plen] = '\0';
-
-                    errno = 0;
-                    val = strtol(port, &endptr, 10);
-                    if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
-                        || (errno != 0 && val == 0)) {
-                        return -MK_CLIENT_BAD_REQUEST;
-                    }
-
-                    if (endptr == port || *endptr != '\0') {
-                        return -MK_CLIENT_BAD_REQUEST;
-                    }
-
-                    p->header_host_port = val;
-
-                    /* Re-set the Host header value without port */
-                    header->val.len = sep;
+    i = header_find(buffer + p->header_key, len);
+    if (i >= 0) {
+        /* We got a header match, register the header index */
+        header = &p->headers[i];
+        header->type = i;
+        header->key.data = buffer + p->header_key;
+        header->key.len  = len;
+        header->val.data = buffer + p->header_val;
+        header->val.len  = p->end - p->header_val;
+        p->header_count++;
+        mk_list_add(&header->_head, &p->header_list);
+
+        if (i == MK_HEADER_HOST) {
+            /* Handle a possible port number in the Host header */
+            int sep = str_searchr(header->val.data, ':', header->val.len);
+            if (sep > 0) {
+                int plen;
+                short int port_size = 6;
+                char port[port_size];
+
+                plen = header->val.len - sep - 1;
+                if (plen <= 0 || plen >= port_size) {
+                    return -MK_CLIENT_BAD_REQUEST;
                 }
-            }
-            else if (i == MK_HEADER_CONTENT_LENGTH) {
+                memcpy(&port, header->val.data + sep + 1, plen);
+                port[plen] = '\0';
+
                 errno = 0;
-                val = strtol(header->val.data, &endptr, 10);
+                val = strtol(port, &endptr, 10);
                 if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
                     || (errno != 0 && val == 0)) {
-                    return -MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
-                }
-                if (endptr == header->val.data) {
-                    return -1;
-                }
-                if (val < 0) {
-                    return -1;
+                    return -MK_CLIENT_BAD_REQUEST;
                 }
 
-                p->header_content_length = val;
-            }
-            else if (i == MK_HEADER_CONNECTION) {
-                /* Check Connection: Keep-Alive */
-                if (header->val.len == sizeof(MK_CONN_KEEP_ALIVE) - 1) {
-                    if (header_cmp(MK_CONN_KEEP_ALIVE,
-                                   header->val.data,
-                                   header->val.len ) == 0) {
-                        p->header_connection = MK_HTTP_PARSER_CONN_KA;
-                    }
+                if (endptr == port || *endptr != '\0') {
+                    return -MK_CLIENT_BAD_REQUEST;
                 }
-                /* Check Connection: Close */
-                else if (header->val.len == sizeof(MK_CONN_CLOSE) -1) {
-                    if (header_cmp(MK_CONN_CLOSE,
-                                   header->val.data, header->val.len) == 0) {
-                        p->header_connection = MK_HTTP_PARSER_CONN_CLOSE;
-                    }
-                }
-                else {
-                    p->header_connection = MK_HTTP_PARSER_CONN_UNKNOWN;
 
-                    /* Try to find some known values */
+                p->header_host_port = val;
 
-                    /* Connection: upgrade */
-                    pos = mk_string_search_n(header->val.data,
-                                             "Upgrade",
-                                             MK_STR_INSENSITIVE,
-                                             header->val.len);
-                    if (pos >= 0) {
-                        p->header_connection = MK_HTTP_PARSER_CONN_UPGRADE;
-                    }
-
-                    /* Connection: HTTP2-Settings */
-                    pos = mk_string_search_n(header->val.data,
-                                             "HTTP2-Settings",
-                                             MK_STR_INSENSITIVE,
-                                             header->val.len);
-                    if (pos >= 0) {
-                        p->header_connection |= MK_HTTP_PARSER_CONN_HTTP2_SE;
-                    }
-                }
+                /* Re-set the Host header value without port */
+                header->val.len = sep;
             }
-            else if (i == MK_HEADER_UPGRADE) {
-                    if (header_cmp(MK_UPGRADE_H2C,
-                                   header->val.data, header->val.len) == 0) {
-                        p->header_upgrade = MK_HTTP_PARSER_UPGRADE_H2C;
-                    }
+        }
+        else if (i == MK_HEADER_CONTENT_LENGTH) {
+            errno = 0;
+            val = strtol(header->val.data, &endptr, 10);
+            if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+                || (errno != 0 && val == 0)) {
+                return -MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+            }
+            if (endptr == header->val.data) {
+                return -1;
+            }
+            if (val < 0) {
+                return -1;
             }
 
-            return 0;
+            p->header_content_length = val;
+        }
+        else if (i == MK_HEADER_CONNECTION) {
+            p->header_connection = connection_lookup(&header->val);
+        }
+        else if (i == MK_HEADER_TRANSFER_ENCODING) {
+            ret = transfer_encoding_lookup(&header->val);
+            if (ret != 0) {
+                return ret;
+            }
+            p->chunked = MK_TRUE;
+        }
+        else if (i == MK_HEADER_UPGRADE) {
+            if (token_find(header->val.data,
+                           header->val.len) == MK_TOKEN_H2C) {
+                p->header_upgrade = MK_HTTP_PARSER_UPGRADE_H2C;
+            }
         }
+
+        return 0;
     }
 
     /*
@@ -320,8 +490,9 @@ static inline int header_lookup(struct mk_http_parser *p, char *buffer)
         header_extra->key.len  = len;
 
         /* Transform the header key string to lowercase */
-        for (i = 0; i < len; i++) {
-            tmp[i] = tolower(tmp[i]);
+        for (i = 0; i < len; i += 8) {
+            w = htole64(word_fold(word_load(tmp + i, len - i)));
+            memcpy(tmp + i, &w, (len - i) < 8 ? (len - i) : 8);
         }
 
         header_extra->val.data = buffer + p->header_val;
@@ -356,8 +527,9 @@ static inline int mk_http_parser_ok(struct mk_http_request *req,
 
     /* POST checks */
     if (req->method == MK_METHOD_POST || req->method == MK_METHOD_PUT) {
-        /* validate Content-Length exists */
-        if (p->headers[MK_HEADER_CONTENT_LENGTH].type == 0) {
+        /* validate Content-Length exists or the body is chunked */
+        if (p->headers[MK_HEADER_CONTENT_LENGTH].type == 0 &&
+            p->chunked == MK_FALSE) {
             mk_http_error(MK_CLIENT_LENGTH_REQUIRED, req->session, req, server);
             return MK_HTTP_PARSER_ERROR;
         }
@@ -373,7 +545,6 @@ static inline int mk_http_parser_ok(struct mk_http_request *req,
 int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                    char *buffer, int buf_len, struct mk_server *server)
 {
-    int s;
     int tmp;
     int ret;
     int len;
@@ -402,24 +573,8 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
         if (p->level == REQ_LEVEL_FIRST) {
             switch (p->status) {
             case MK_ST_REQ_METHOD:                      /* HTTP Method */
+                /* The method is looked up once the whole token is known */
                 if (p->chars == -1) {
-                    switch (buffer[p->i]) {
-                    case 'G':
-                        p->method = MK_METHOD_GET;
-                        break;
-                    case 'P':
-                        p->method = MK_METHOD_POST;
-                        break;
-                    case 'H':
-                        p->method = MK_METHOD_HEAD;
-                        break;
-                    case 'D':
-                        p->method = MK_METHOD_DELETE;
-                        break;
-                    case 'O':
-                        p->method = MK_METHOD_OPTIONS;
-                        break;
-                    }
                     continue;
                 }
 
@@ -439,6 +594,14 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                 }
                 break;
             case MK_ST_REQ_URI:                         /* URI */
+                /* Skip to the next byte this state cares about */
+                tmp = delim_scan(buffer, p->i, len, ' ', '?', '\r', '\n');
+                if (tmp == len) {
+                    p->i = len - 1;
+                    continue;
+                }
+                p->i = tmp;
+
                 if (buffer[p->i] == ' ') {
                     mark_end();
                     p->status = MK_ST_REQ_PROT_VERSION;
@@ -556,50 +719,8 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                     }
                 }
 
+                /* Start of a header row, the name is hashed once complete */
                 if (p->chars == 0) {
-                    /*
-                     * We reach the start of a Header row, lets catch the most
-                     * probable header.
-                     *
-                     * The goal of this 'first row character lookup', is to define a
-                     * small range set of probable headers comparison once we catch
-                     * a header end.
-                     */
-                    s = tolower(buffer[p->i]);
-                    switch (s) {
-                    case 'a':
-                        p->header_min = MK_HEADER_ACCEPT;
-                        p->header_max = MK_HEADER_AUTHORIZATION;
-                        break;
-                    case 'c':
-                        p->header_min = MK_HEADER_CACHE_CONTROL;
-                        p->header_max = MK_HEADER_CONTENT_TYPE;
-                        break;
-                    case 'h':
-                        p->header_min = MK_HEADER_HOST;
-                        p->header_max = MK_HEADER_HTTP2_SETTINGS;
-                        break;
-                    case 'i':
-                        header_scope_eq(p, MK_HEADER_IF_MODIFIED_SINCE);
-                        break;
-                    case 'l':
-                        p->header_min = MK_HEADER_LAST_MODIFIED;
-                        p->header_max = MK_HEADER_LAST_MODIFIED_SINCE;
-                        break;
-                    case 'r':
-                        p->header_min = MK_HEADER_RANGE;
-                        p->header_max = MK_HEADER_REFERER;
-                        break;
-                    case 'u':
-                        p->header_min = MK_HEADER_UPGRADE;
-                        p->header_max = MK_HEADER_USER_AGENT;
-                        break;
-                    default:
-                        p->header_key = -1;
-                        p->header_sep = -1;
-                        p->header_min = -1;
-                        p->header_max = -1;
-                    };
                     p->header_key = p->i;
                     continue;
                 }
@@ -635,6 +756,14 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
             }
             /* New header row starts */
             else if (p->status == MK_ST_HEADER_VAL_STARTS) {
+                /* Skip the value up to the end of the row */
+                tmp = delim_scan(buffer, p->i, len, '\r', '\n', '\r', '\n');
+                if (tmp == len) {
+                    p->i = len - 1;
+                    continue;
+                }
+                p->i = tmp;
+
                 /* Maybe there is no more headers and we reach the end ? */
                 if (buffer[p->i] == '\r') {
                     mark_end();
@@ -684,7 +813,20 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
         }
         else if (p->level == REQ_LEVEL_END) {
             if (buffer[p->i] == '\n') {
-                if (p->header_content_length > 0) {
+                if (p->chunked == MK_TRUE) {
+                    /* A sender can't set both, it's a smuggling attempt */
+                    if (p->header_content_length >= 0) {
+                        mk_http_error(MK_CLIENT_BAD_REQUEST, req->session,
+                                      req, server);
+                        return MK_HTTP_PARSER_ERROR;
+                    }
+                    p->level = REQ_LEVEL_BODY;
+                    p->chars = -1;
+                    p->chunk_state = MK_ST_CHUNK_SIZE_START;
+                    p->chunk_in = p->chunk_out = p->i + 1;
+                    start_next();
+                }
+                else if (p->header_content_length > 0) {
                     p->level = REQ_LEVEL_BODY;
                     p->chars = -1;
                     start_next();
@@ -704,15 +846,31 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
              * - A Pipeline Request
              * - A Body content (POST/PUT methods)
              */
-            if (p->header_content_length > 0) {
+            if (p->chunked == MK_TRUE) {
+                ret = mk_http_parser_chunked(p, buffer, len, server);
+                if (ret == MK_HTTP_PARSER_PENDING) {
+                    return ret;
+                }
+                else if (ret != MK_HTTP_PARSER_OK) {
+                    mk_http_error(-ret, req->session, req, server);
+                    return MK_HTTP_PARSER_ERROR;
+                }
+
+                /* What follows the body belongs to the next request */
+                p->i = p->chunk_in - 1;
+                req->data.len  = p->chunk_out - p->start;
+                req->data.data = (buffer + p->start);
+            }
+            else if (p->header_content_length > 0) {
 
                 p->body_received = len - p->start;
                 if ((len - p->start) < p->header_content_length) {
                     return MK_HTTP_PARSER_PENDING;
                 }
 
-                /* Cut off */
-                p->i += p->body_received;
+                /* Cut off, a pipelined request may follow the body */
+                p->body_received = p->header_content_length;
+                p->i = p->start + p->body_received - 1;
                 req->data.len  = p->body_received;
                 req->data.data = (buffer + p->start);
             }
@@ -722,3 +880,159 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
 
     return MK_HTTP_PARSER_PENDING;
 }
+
+static inline int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/*
+ * Decode a chunked body in place: the chunk data found in
+ * buffer[chunk_in..len) is moved down to chunk_out, dropping the chunk
+ * sizes, extensions and trailers. It can be called again every time
+ * more data arrives and the caller may move the data around, only the
+ * offsets are kept. It returns MK_HTTP_PARSER_OK once the last chunk
+ * and the trailers are done, MK_HTTP_PARSER_PENDING if more data is
+ * required or the negative HTTP status to reply with.
+ */
+int mk_http_parser_chunked(struct mk_http_parser *p, char *buffer, int len,
+                           struct mk_server *server)
+{
+    int n;
+    int x;
+    int val;
+    char c;
+
+    if (p->chunk_state == MK_ST_CHUNK_DONE) {
+        return MK_HTTP_PARSER_OK;
+    }
+
+    while (p->chunk_in < len) {
+        c = buffer[p->chunk_in];
+
+        switch (p->chunk_state) {
+        case MK_ST_CHUNK_DATA:
+            n = len - p->chunk_in;
+            if (n > p->chunk_size) {
+                n = p->chunk_size;
+            }
+            if (p->chunk_out != p->chunk_in) {
+                memmove(buffer + p->chunk_out, buffer + p->chunk_in, n);
+            }
+            p->chunk_in += n;
+            p->chunk_out += n;
+            p->chunk_size -= n;
+            p->body_received += n;
+
+            if (p->chunk_size == 0) {
+                p->chunk_state = MK_ST_CHUNK_DATA_CR;
+            }
+            continue;
+        case MK_ST_CHUNK_SIZE_START:
+        case MK_ST_CHUNK_SIZE:
+            val = hex_value(c);
+            if (val >= 0) {
+                p->chunk_size = (p->chunk_size << 4) | val;
+                if (p->body_received + p->chunk_size + p->chunk_extra >
+                    server->max_request_size) {
+                    return -MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+                }
+                p->chunk_state = MK_ST_CHUNK_SIZE;
+            }
+            else if (p->chunk_state == MK_ST_CHUNK_SIZE_START) {
+                return -MK_CLIENT_BAD_REQUEST;
+            }
+            else if (c == ';' || c == ' ' || c == '\t') {
+                p->chunk_state = MK_ST_CHUNK_EXT;
+            }
+            else if (c == '\r') {
+                p->chunk_state = MK_ST_CHUNK_SIZE_LF;
+            }
+            else {
+                return -MK_CLIENT_BAD_REQUEST;
+            }
+            break;
+        case MK_ST_CHUNK_EXT:
+        case MK_ST_CHUNK_TRAILER_LINE:
+            /* Extensions and trailer fields are skipped */
+            x = delim_scan(buffer, p->chunk_in, len, '\r', '\n', '\r', '\n');
+            p->chunk_extra += x - p->chunk_in;
+            if (p->body_received + p->chunk_extra > server->max_request_size) {
+                return -MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+            }
+            p->chunk_in = x;
+            if (x == len) {
+                continue;
+            }
+            if (buffer[x] != '\r') {
+                return -MK_CLIENT_BAD_REQUEST;
+            }
+            if (p->chunk_state == MK_ST_CHUNK_EXT) {
+                p->chunk_state = MK_ST_CHUNK_SIZE_LF;
+            }
+            else {
+                p->chunk_state = MK_ST_CHUNK_TRAILER_LF;
+            }
+            break;
+        case MK_ST_CHUNK_SIZE_LF:
+            if (c != '\n') {
+                return -MK_CLIENT_BAD_REQUEST;
+            }
+            if (p->chunk_size > 0) {
+                p->chunk_state = MK_ST_CHUNK_DATA;
+            }
+            else {
+                p->chunk_state = MK_ST_CHUNK_TRAILER;
+            }
+            break;
+        case MK_ST_CHUNK_DATA_CR:
+            if (c != '\r') {
+                return -MK_CLIENT_BAD_REQUEST;
+            }
+            p->chunk_state = MK_ST_CHUNK_DATA_LF;
+            break;
+        case MK_ST_CHUNK_DATA_LF:
+            if (c != '\n') {
+                return -MK_CLIENT_BAD_REQUEST;
+            }
+            p->chunk_state = MK_ST_CHUNK_SIZE_START;
+            break;
+        case MK_ST_CHUNK_TRAILER:
+            /* An empty line ends the trailer section */
+            if (c == '\r') {
+                p->chunk_state = MK_ST_CHUNK_END_LF;
+            }
+            else if (c == '\n') {
+                return -MK_CLIENT_BAD_REQUEST;
+            }
+            else {
+                p->chunk_state = MK_ST_CHUNK_TRAILER_LINE;
+            }
+            break;
+        case MK_ST_CHUNK_TRAILER_LF:
+            if (c != '\n') {
+                return -MK_CLIENT_BAD_REQUEST;
+            }
+            p->chunk_state = MK_ST_CHUNK_TRAILER;
+            break;
+        case MK_ST_CHUNK_END_LF:
+            if (c != '\n') {
+                return -MK_CLIENT_BAD_REQUEST;
+            }
+            p->chunk_in++;
+            p->chunk_state = MK_ST_CHUNK_DONE;
+            return MK_HTTP_PARSER_OK;
+        }
+        p->chunk_in++;
+        p->chunk_extra++;
+    }
+
+    return MK_HTTP_PARSER_PENDING;
+}
@@ -0,0 +1,140 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_HTTP_PARSER_TABLES_H
+#define MK_HTTP_PARSER_TABLES_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_parser.h>
+
+/*
+ * Perfect hashing
+ * ---------------
+ * Methods, header names and tokens are found hashing their first eight
+ * bytes (case folded, except for methods) plus the length:
+ *
+ *   slot = ((word + len) * MUL) >> (64 - BITS)
+ *
+ * The multipliers and the slot of every entry of the tables below are
+ * generated at build time by tools/mk_phash.c (mk_http_parser_hash.h),
+ * the build fails if an entry cannot get a slot of its own. Header
+ * names and tokens are stored lowercase, the order of the entries is
+ * the order of their enum.
+ */
+
+struct row_entry {
+    int len;
+    const char name[32];
+};
+
+static const struct row_entry mk_methods_table[] = {
+    { 3, "GET"     },
+    { 4, "POST"    },
+    { 4, "HEAD"    },
+    { 3, "PUT"     },
+    { 6, "DELETE"  },
+    { 7, "OPTIONS" }
+};
+
+static const struct row_entry mk_headers_table[] = {
+    {  6, "accept"              },
+    { 14, "accept-charset"      },
+    { 15, "accept-encoding"     },
+    { 15, "accept-language"     },
+    { 13, "authorization"       },
+    { 13, "cache-control"       },
+    {  6, "cookie"              },
+    { 10, "connection"          },
+    { 14, "content-length"      },
+    { 13, "content-range"       },
+    { 12, "content-type"        },
+    {  4, "host"                },
+    { 14, "http2-settings"      },
+    {  8, "if-match"            },
+    { 17, "if-modified-since"   },
+    { 13, "if-none-match"       },
+    {  8, "if-range"            },
+    { 19, "if-unmodified-since" },
+    { 13, "last-modified"       },
+    { 19, "last-modified-since" },
+    {  5, "range"               },
+    {  7, "referer"             },
+    { 17, "transfer-encoding"   },
+    {  7, "upgrade"             },
+    { 10, "user-agent"          }
+};
+
+/* Connection and Upgrade header tokens we take decisions on */
+enum {
+    MK_TOKEN_KEEP_ALIVE = 0,
+    MK_TOKEN_CLOSE,
+    MK_TOKEN_UPGRADE,
+    MK_TOKEN_HTTP2_SETTINGS,
+    MK_TOKEN_H2C,
+    MK_TOKEN_CHUNKED,
+    MK_TOKEN_SIZEOF
+};
+
+static const struct row_entry mk_tokens_table[] = {
+    { 10, MK_CONN_KEEP_ALIVE    },
+    {  5, MK_CONN_CLOSE         },
+    {  7, MK_CONN_UPGRADE       },
+    { 14, "http2-settings"      },
+    {  3, MK_UPGRADE_H2C        },
+    {  7, MK_TE_CHUNKED         }
+};
+
+/* Load up to eight bytes as a little endian word, zero padded */
+static inline uint64_t word_load(const char *s, int len)
+{
+    int i;
+    uint64_t w = 0;
+
+    if (len >= 8) {
+        memcpy(&w, s, 8);
+        return le64toh(w);
+    }
+
+    for (i = 0; i < len; i++) {
+        w |= (uint64_t) (unsigned char) s[i] << (i * 8);
+    }
+    return w;
+}
+
+/* Lowercase the ASCII letters of a word, other bytes are untouched */
+static inline uint64_t word_fold(uint64_t w)
+{
+    uint64_t b = w & 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t ge_a = b + 0x3f3f3f3f3f3f3f3fULL;
+    uint64_t gt_z = b + 0x2525252525252525ULL;
+
+    return w | (((ge_a & ~gt_z & ~w) & 0x8080808080808080ULL) >> 2);
+}
+
+static inline unsigned int word_hash(uint64_t w, int len,
+                                     uint64_t mul, int bits)
+{
+    return ((w + len) * mul) >> (64 - bits);
+}
+
+#endif
@@ -25,6 +25,21 @@
 #include <monkey/mk_http_thread.h>
 
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * On these architectures libco allocates the coroutine as a single block:
+ * the saved registers are at the bottom and the stack grows down from the
+ * top, so the stack can be guarded and inspected from here.
+ */
+#if defined(__i386__) || defined(__amd64__) || \
+    defined(__arm__) || defined(__aarch64__)
+#define MK_HTTP_THREAD_STACK_INLINE
+#endif
+
+#define MK_HTTP_THREAD_CONTEXT  512     /* room for the saved registers  */
+#define MK_HTTP_THREAD_PAINT   0x6b     /* pattern of an untouched stack */
 
 /*
  * libco do not support parameters in the entrypoint function due to the
@@ -46,70 +61,94 @@ struct mk_http_libco_params libco_param;
 
 pthread_key_t mk_thread_key;
 
-static inline void thread_cb_init_vars()
+static void thread_cb_init_vars()
 {
+    int ret;
+    int mask;
     int close;
-    int type = libco_param.type;
-    struct mk_vhost_handler *handler = libco_param.handler;
-    struct mk_http_session *session = libco_param.session;
-    struct mk_http_request *request = libco_param.request;
-    struct mk_thread *th = libco_param.th;
+    int type;
+    struct mk_vhost_handler *handler;
+    struct mk_http_session *session;
+    struct mk_http_request *request;
+    struct mk_thread *th;
     struct mk_http_thread *mth;
-    //struct mk_plugin *plugin;
+    struct mk_sched_worker *sched;
+    struct mk_channel *channel;
 
     /*
-     * Until this point the th->callee already set the variables, so we
-     * wait until the core wanted to resume so we really trigger the
-     * output callback.
+     * The coroutine is reused once the handler finished: every round takes
+     * the parameters of a new invocation.
      */
-    co_switch(th->caller);
-
-    if (type == MK_HTTP_THREAD_LIB) {
-        /* Invoke the handler callback */
-        handler->cb(request, handler->data);
+    while (1) {
+        type = libco_param.type;
+        handler = libco_param.handler;
+        session = libco_param.session;
+        request = libco_param.request;
+        th = libco_param.th;
 
         /*
-         * Once the callback finished, we need to sanitize the connection
-         * so other further requests can be processed.
+         * Until this point the th->callee already set the variables, so we
+         * wait until the core wanted to resume so we really trigger the
+         * output callback.
          */
-        int ret;
-        struct mk_sched_worker *sched;
-        struct mk_channel *channel;
-
-        channel = request->session->channel;
-        sched = mk_sched_get_thread_conf();
-
-        MK_EVENT_NEW(channel->event);
-        ret = mk_event_add(sched->loop,
-                           channel->fd,
-                           MK_EVENT_CONNECTION,
-                           MK_EVENT_READ, channel->event);
-        if (ret == -1) {
-            //return -1;
+        co_switch(th->caller);
+
+        if (type == MK_HTTP_THREAD_LIB) {
+            /* Invoke the handler callback */
+            handler->cb(request, handler->data);
+
+            /*
+             * Once the callback finished, we need to sanitize the connection
+             * so other further requests can be processed.
+             */
+            channel = request->session->channel;
+            sched = mk_sched_get_thread_conf();
+            mth = request->thread;
+
+            /*
+             * A topic subscriber stays connected, the event loop writes
+             * what gets published to it.
+             */
+            if (request->lib_sub) {
+                mask = MK_EVENT_READ;
+                if (mk_list_is_empty(&request->stream.inputs) != 0) {
+                    mask = MK_EVENT_WRITE;
+                }
+                mk_event_add(sched->loop, channel->fd,
+                             MK_EVENT_CONNECTION, mask, channel->event);
+                mk_http_thread_purge(mth, MK_FALSE);
+            }
+            else {
+                /* The handler only leaves the loop when it was congested */
+                ret = mk_event_add(sched->loop,
+                                   channel->fd,
+                                   MK_EVENT_CONNECTION,
+                                   MK_EVENT_READ, channel->event);
+                if (ret == -1) {
+                    //return -1;
+                }
+
+                /*
+                 * Finalize request internally, if ret == -1 means we should
+                 * ask to shutdown the connection.
+                 */
+                ret = mk_http_request_end(session, session->server);
+                if (ret == -1) {
+                    close = MK_TRUE;
+                }
+                else {
+                    close = MK_FALSE;
+                }
+                mk_http_thread_purge(mth, close);
+            }
         }
-
-        /* Save temporal session */
-        mth = request->thread;
-
-        /*
-         * Finalize request internally, if ret == -1 means we should
-         * ask to shutdown the connection.
-         */
-        ret = mk_http_request_end(session, session->server);
-        if (ret == -1) {
-            close = MK_TRUE;
-        }
-        else {
-            close = MK_FALSE;
+        else if (type == MK_HTTP_THREAD_PLUGIN) {
+            /* FIXME: call plugin handler callback with params */
         }
-        mk_http_thread_purge(mth, close);
 
-        /* Return control to caller */
+        /* Return control to caller, the next round starts from here */
         mk_thread_yield(th);
     }
-    else if (type == MK_HTTP_THREAD_PLUGIN) {
-        /* FIXME: call plugin handler callback with params */
-    }
 }
 
 static inline void thread_params_set(struct mk_thread *th,
@@ -132,6 +171,117 @@ static inline void thread_params_set(struct mk_thread *th,
     co_switch(th->callee);
 }
 
+/* Protect the bottom of the stack and paint it to measure the usage */
+static void http_thread_stack_init(struct mk_http_thread *mth,
+                                   struct mk_sched_worker *sched,
+                                   cothread_t co, size_t size)
+{
+    mth->guard = NULL;
+    mth->stack_low = NULL;
+    mth->stack_high = NULL;
+
+#ifdef MK_HTTP_THREAD_STACK_INLINE
+    int ret;
+    uintptr_t page = sched->mem_pagesize;
+    uintptr_t guard;
+
+    guard = ((uintptr_t) co + MK_HTTP_THREAD_CONTEXT + page - 1) & ~(page - 1);
+    mth->stack_low = (char *) co + MK_HTTP_THREAD_CONTEXT;
+    mth->stack_high = (char *) co + size;
+
+    if (guard + page < (uintptr_t) mth->stack_high) {
+        ret = mprotect((void *) guard, page, PROT_NONE);
+        if (ret == 0) {
+            mth->guard = (char *) guard;
+            mth->stack_low = (char *) guard + page;
+        }
+    }
+
+    /* Leave the top alone, libco placed the entry point there */
+    if (sched->coroutines.stack_check == MK_TRUE) {
+        memset(mth->stack_low, MK_HTTP_THREAD_PAINT,
+               (mth->stack_high - mth->stack_low) - MK_HTTP_THREAD_CONTEXT);
+    }
+#else
+    (void) sched;
+    (void) co;
+    (void) size;
+#endif
+}
+
+/* Stack bytes used at some point, found from the first painted byte */
+static void http_thread_stack_measure(struct mk_http_thread *mth,
+                                      struct mk_sched_worker *sched)
+{
+    size_t used;
+    unsigned long *p;
+    unsigned long paint = ((unsigned long) -1 / 0xff) * MK_HTTP_THREAD_PAINT;
+
+    if (!mth->stack_low) {
+        return;
+    }
+
+    p = (unsigned long *) mth->stack_low;
+    while ((char *) p < mth->stack_high && *p == paint) {
+        p++;
+    }
+
+    used = mth->stack_high - (char *) p;
+    if (used > sched->coroutines.stack_peak) {
+        sched->coroutines.stack_peak = used;
+        MK_TRACE("[thread] stack peak %zu of %zu bytes",
+                 used, sched->coroutines.stack_size);
+    }
+}
+
+static void http_thread_free(struct mk_http_thread *mth)
+{
+    struct mk_thread *th = mth->parent;
+    struct mk_sched_worker *sched;
+
+    /* The stack memory goes back to malloc(3), drop the guard first */
+    if (mth->guard) {
+        sched = mk_sched_get_thread_conf();
+        mprotect(mth->guard, sched->mem_pagesize, PROT_READ | PROT_WRITE);
+    }
+
+    mk_thread_destroy(th);
+}
+
+static struct mk_http_thread *http_thread_new(struct mk_sched_worker *sched)
+{
+    size_t stack_size;
+    struct mk_thread *th = NULL;
+    struct mk_http_thread *mth;
+    struct mk_sched_co_pool *pool = &sched->coroutines;
+
+    th = mk_thread_new(sizeof(struct mk_http_thread), NULL);
+    if (!th) {
+        return NULL;
+    }
+
+    mth = (struct mk_http_thread *) MK_THREAD_DATA(th);
+    mth->parent = th;
+
+    /* Reserve room for the registers area and the guard page */
+    th->caller = co_active();
+    th->callee = co_create(pool->stack_size + MK_HTTP_THREAD_CONTEXT +
+                           (2 * sched->mem_pagesize),
+                           thread_cb_init_vars, &stack_size);
+    if (!th->callee) {
+        mk_mem_free(th);
+        return NULL;
+    }
+
+#ifdef MK_HAVE_VALGRIND
+    th->valgrind_stack_id = VALGRIND_STACK_REGISTER(th->callee,
+                                                    ((char *)th->callee) + stack_size);
+#endif
+
+    http_thread_stack_init(mth, sched, th->callee, stack_size);
+    return mth;
+}
+
 struct mk_http_thread *mk_http_thread_create(int type,
                                              struct mk_vhost_handler *handler,
                                              struct mk_http_session *session,
@@ -139,43 +289,41 @@ struct mk_http_thread *mk_http_thread_create(int type,
                                              int n_params,
                                              struct mk_list *params)
 {
-    size_t stack_size;
     struct mk_thread *th = NULL;
     struct mk_http_thread *mth;
     struct mk_sched_worker *sched;
+    struct mk_sched_co_pool *pool;
 
     sched = mk_sched_get_thread_conf();
     if (!sched) {
         return NULL;
     }
 
-    th = mk_thread_new(sizeof(struct mk_http_thread), NULL);
-    if (!th) {
-        return NULL;
+    /* Take a parked coroutine if any */
+    pool = &sched->coroutines;
+    if (pool->free > 0) {
+        mth = mk_list_entry_first(&pool->free_list,
+                                  struct mk_http_thread, _head);
+        mk_list_del(&mth->_head);
+        pool->free--;
     }
-
-    mth = (struct mk_http_thread *) MK_THREAD_DATA(th);
-    if (!mth) {
-        return NULL;
+    else {
+        mth = http_thread_new(sched);
+        if (!mth) {
+            return NULL;
+        }
     }
+    pool->live++;
 
+    th = mth->parent;
     mth->session = session;
     mth->request = request;
-    mth->parent  = th;
     mth->close   = MK_FALSE;
     request->thread = mth;
     mk_list_add(&mth->_head, &sched->threads);
 
-    th->caller = co_active();
-    th->callee = co_create(MK_THREAD_STACK_SIZE,
-                           thread_cb_init_vars, &stack_size);
-
-#ifdef MK_HAVE_VALGRIND
-    th->valgrind_stack_id = VALGRIND_STACK_REGISTER(th->callee,
-                                                    ((char *)th->callee) + stack_size);
-#endif
-
     /* Workaround for makecontext() */
+    th->caller = co_active();
     thread_params_set(th, type, handler, session, request, n_params, params);
 
     return mth;
@@ -203,19 +351,80 @@ int mk_http_thread_purge(struct mk_http_thread *mth, int close)
 
 int mk_http_thread_destroy(struct mk_http_thread *mth)
 {
-    struct mk_thread *th;
+    struct mk_sched_worker *sched;
 
     /* Unlink from scheduler thread list */
     mk_list_del(&mth->_head);
 
+    sched = mk_sched_get_thread_conf();
+    sched->coroutines.live--;
+
     /* release original memory context */
-    th = mth->parent;
     mth->session->channel->event->type = MK_EVENT_CONNECTION;
-    mk_thread_destroy(th);
+    http_thread_free(mth);
+
+    return 0;
+}
+
+/* A purged thread finished its handler, park the coroutine for reuse */
+int mk_http_thread_release(struct mk_http_thread *mth)
+{
+    struct mk_sched_worker *sched;
+    struct mk_sched_co_pool *pool;
+
+    sched = mk_sched_get_thread_conf();
+    pool = &sched->coroutines;
+
+    if (pool->stack_check == MK_TRUE) {
+        http_thread_stack_measure(mth, sched);
+    }
+
+    if (pool->free >= pool->keep) {
+        return mk_http_thread_destroy(mth);
+    }
+
+    mk_list_del(&mth->_head);
+    pool->live--;
+
+    mth->session->channel->event->type = MK_EVENT_CONNECTION;
+    mth->session = NULL;
+    mth->request = NULL;
+
+    mk_list_add(&mth->_head, &pool->free_list);
+    pool->free++;
 
     return 0;
 }
 
+void mk_http_thread_pool_init(struct mk_sched_worker *sched,
+                              struct mk_server *server)
+{
+    struct mk_sched_co_pool *pool = &sched->coroutines;
+
+    pool->stack_size = server->thread_stack_size;
+    pool->stack_peak = 0;
+    pool->stack_check = server->thread_stack_check;
+    pool->keep = server->thread_stack_pool;
+    pool->live = 0;
+    pool->free = 0;
+    mk_list_init(&pool->free_list);
+}
+
+void mk_http_thread_pool_exit(struct mk_sched_worker *sched)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_thread *mth;
+    struct mk_sched_co_pool *pool = &sched->coroutines;
+
+    mk_list_foreach_safe(head, tmp, &pool->free_list) {
+        mth = mk_list_entry(head, struct mk_http_thread, _head);
+        mk_list_del(&mth->_head);
+        http_thread_free(mth);
+    }
+    pool->free = 0;
+}
+
 int mk_http_thread_event(struct mk_event *event)
 {
     struct mk_sched_conn *conn = (struct mk_sched_conn *) event;
@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sys/stat.h>
 
 #include <monkey/mk_lib.h>
 #include <monkey/monkey.h>
@@ -30,6 +31,8 @@
 #include <monkey/mk_thread.h>
 #include <monkey/mk_scheduler.h>
 #include <monkey/mk_fifo.h>
+#include <monkey/mk_http_cache.h>
+#include <monkey/mk_affinity.h>
 
 #define config_eq(a, b) strcasecmp(a, b)
 
@@ -45,11 +48,218 @@ static inline int bool_val(char *v)
     return -1;
 }
 
+/*
+ * Blocking handlers
+ * -----------------
+ * A blocking handler gets a coroutine on the worker like any other
+ * handler, but the coroutine hands the callback to the thread pool and
+ * waits. The API calls made from the pool thread are pushed back to the
+ * worker, run by the coroutine and the result is given to the pool thread.
+ */
+#define MK_LIB_CALL_SEND    1
+#define MK_LIB_CALL_FILE    2
+#define MK_LIB_CALL_FLUSH   3
+#define MK_LIB_CALL_DONE    4
+#define MK_LIB_CALL_END     5       /* the callback returned */
+#define MK_LIB_CALL_SUB     6
+
+struct mk_lib_pool {
+    int exit;
+    int n_threads;
+    pthread_t *tids;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mk_list jobs;            /* jobs waiting for a thread        */
+    struct mk_list handlers;        /* struct mk_lib_blocking           */
+};
+
+struct mk_lib_blocking {
+    void (*cb)(mk_request_t *, void *);
+    void *data;
+    mk_ctx_t *ctx;
+    struct mk_list _head;
+};
+
+struct mk_lib_job {
+    /* Must be the first field, pushed to the owner worker */
+    struct mk_sched_call call;
+
+    struct mk_lib_blocking *handler;
+    mk_request_t *req;
+    struct mk_sched_worker *sched;  /* worker owning the connection     */
+    struct mk_thread *th;           /* coroutine running the calls      */
+
+    /* Call in progress and its arguments */
+    int type;
+    int pending;
+    int ret;
+    struct iovec *iov;
+    int iovcnt;
+    size_t len;
+    int own;
+    void (*cb_free)(char *, void *);
+    void *data;
+    int fd;
+    off_t offset;
+    int tid;
+
+    int replied;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mk_list _head;           /* link to pool->jobs               */
+};
+
+static void mk_lib_blocking_cb(mk_request_t *req, void *data);
+static int mk_lib_topics_start(mk_ctx_t *ctx);
+static void mk_lib_topics_destroy(mk_ctx_t *ctx);
+
+/* Return the job if the caller is a pool thread serving the request */
+static inline struct mk_lib_job *mk_lib_job_remote(mk_request_t *req)
+{
+    if (req->lib_job && !mk_sched_get_thread_conf()) {
+        return req->lib_job;
+    }
+    return NULL;
+}
+
+static void mk_lib_job_free(struct mk_lib_job *job)
+{
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    mk_mem_free(job);
+}
+
+/*
+ * Pool thread: let the worker run the call and wait for the result. If the
+ * worker is shutting down the call fails right away.
+ */
+static int mk_lib_job_call(struct mk_lib_job *job, int type)
+{
+    job->type = type;
+    job->replied = MK_FALSE;
+    if (mk_sched_call_push(job->sched, &job->call) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    while (job->replied == MK_FALSE) {
+        pthread_cond_wait(&job->cond, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return job->ret;
+}
+
+static void mk_lib_pool_worker(void *data)
+{
+    struct mk_lib_job *job;
+    struct mk_lib_pool *pool = data;
+
+    mk_utils_worker_rename("monkey: handler");
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->exit == MK_FALSE && mk_list_is_empty(&pool->jobs) == 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->exit == MK_TRUE) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = mk_list_entry_first(&pool->jobs, struct mk_lib_job, _head);
+        mk_list_del(&job->_head);
+        pthread_mutex_unlock(&pool->lock);
+
+        job->handler->cb(job->req, job->handler->data);
+
+        /*
+         * The worker finalizes the request, the job is not ours anymore
+         * unless the worker is gone and its coroutine with it.
+         */
+        job->type = MK_LIB_CALL_END;
+        if (mk_sched_call_push(job->sched, &job->call) != 0) {
+            mk_lib_job_free(job);
+        }
+    }
+}
+
+static int mk_lib_pool_start(struct mk_lib_pool *pool, int n)
+{
+    int i;
+    int ret;
+
+    pool->tids = mk_mem_alloc(sizeof(pthread_t) * n);
+    if (!pool->tids) {
+        return -1;
+    }
+
+    pool->exit = MK_FALSE;
+    for (i = 0; i < n; i++) {
+        ret = mk_utils_worker_spawn(mk_lib_pool_worker, pool, &pool->tids[i]);
+        if (ret != 0) {
+            break;
+        }
+        pool->n_threads++;
+    }
+
+    return (pool->n_threads > 0) ? 0 : -1;
+}
+
+/*
+ * Stop the pool threads once their running callback returns. Jobs no thread
+ * took are handed back to their coroutine as finished.
+ */
+static void mk_lib_pool_stop(struct mk_lib_pool *pool)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_lib_job *job;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->exit = MK_TRUE;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->tids[i], NULL);
+    }
+    pool->n_threads = 0;
+    mk_mem_free(pool->tids);
+    pool->tids = NULL;
+
+    mk_list_foreach_safe(head, tmp, &pool->jobs) {
+        job = mk_list_entry(head, struct mk_lib_job, _head);
+        mk_list_del(&job->_head);
+
+        job->type = MK_LIB_CALL_END;
+        if (mk_sched_call_push(job->sched, &job->call) != 0) {
+            mk_lib_job_free(job);
+        }
+    }
+}
+
+static void mk_lib_pool_destroy(struct mk_lib_pool *pool)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_lib_blocking *handler;
+
+    mk_list_foreach_safe(head, tmp, &pool->handlers) {
+        handler = mk_list_entry(head, struct mk_lib_blocking, _head);
+        mk_list_del(&handler->_head);
+        mk_mem_free(handler);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    mk_mem_free(pool);
+}
+
 mk_ctx_t *mk_create()
 {
     mk_ctx_t *ctx;
 
-    ctx = mk_mem_alloc(sizeof(mk_ctx_t));
+    ctx = mk_mem_alloc_z(sizeof(mk_ctx_t));
     if (!ctx) {
         return NULL;
     }
@@ -71,11 +281,20 @@ mk_ctx_t *mk_create()
      * before to enter the event loop
      */
     mk_sched_worker_cb_add(ctx->server, mk_fifo_worker_setup, ctx->fifo);
+
+    /* Topics get their fifo queue once the first one is created */
+    ctx->topics_qid = -1;
+    mk_list_init(&ctx->topics);
+
     return ctx;
 }
 
 int mk_destroy(mk_ctx_t *ctx)
 {
+    if (ctx->pool) {
+        mk_lib_pool_destroy(ctx->pool);
+    }
+    mk_lib_topics_destroy(ctx);
     mk_fifo_destroy(ctx->fifo);
     mk_mem_free(ctx);
 
@@ -136,8 +355,13 @@ static void mk_lib_worker(void *data)
     mk_ctx_t *ctx = data;
     server = ctx->server;
 
-    /* Start the service */
-    mk_server_setup(server);
+    /* Start the service, a failed setup is reported to mk_start() */
+    if (mk_server_setup(server) != 0) {
+        val = MK_SERVER_SIGNAL_STOP;
+        bytes = write(server->lib_ch_manager[1], &val, sizeof(val));
+        (void) bytes;
+        return;
+    }
     mk_server_loop(server);
 
     /*
@@ -179,6 +403,20 @@ int mk_start(mk_ctx_t *ctx)
 
     server = ctx->server;
 
+    /* Subscribers of the topics are kept by every worker */
+    ret = mk_lib_topics_start(ctx);
+    if (ret != 0) {
+        return -1;
+    }
+
+    /* Threads for the blocking handlers */
+    if (ctx->pool) {
+        ret = mk_lib_pool_start(ctx->pool, server->handler_threads);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+
     ret = mk_utils_worker_spawn(mk_lib_worker, ctx, &tid);
     if (ret == -1) {
         return -1;
@@ -212,6 +450,14 @@ int mk_stop(mk_ctx_t *ctx)
     uint64_t val;
     struct mk_server *server = ctx->server;
 
+    /*
+     * Blocking handlers still need their workers to send the response,
+     * stop the pool first.
+     */
+    if (ctx->pool) {
+        mk_lib_pool_stop(ctx->pool);
+    }
+
     val = MK_SERVER_SIGNAL_STOP;
     n = write(server->lib_ch_manager[1], &val, sizeof(val));
     if (n <= 0) {
@@ -221,6 +467,7 @@ int mk_stop(mk_ctx_t *ctx)
 
     /* Wait for the child thread to exit */
     pthread_join(ctx->worker_tid, NULL);
+
     return 0;
 }
 
@@ -235,6 +482,40 @@ int mk_worker_callback(mk_ctx_t *ctx,
     return mk_sched_worker_cb_add(ctx->server, cb_func, data);
 }
 
+/*
+ * Stop (drain = MK_TRUE) or resume handing new connections to a worker,
+ * only available when the server uses SO_REUSEPORT listeners.
+ */
+int mk_worker_drain(mk_ctx_t *ctx, int wid, int drain)
+{
+    return mk_server_reuseport_drain(ctx->server, wid, drain);
+}
+
+/*
+ * Highest stack usage measured on the handler coroutines of the workers,
+ * only available when ThreadStackCheck is enabled. It helps to right-size
+ * ThreadStackSize.
+ */
+size_t mk_worker_stack_peak(mk_ctx_t *ctx)
+{
+    int i;
+    size_t peak = 0;
+    struct mk_sched_ctx *sched_ctx = ctx->server->sched_ctx;
+
+    if (!sched_ctx || !sched_ctx->workers) {
+        return 0;
+    }
+
+    /* Values are written by the workers, they are approximate */
+    for (i = 0; i < ctx->server->workers; i++) {
+        if (sched_ctx->workers[i].coroutines.stack_peak > peak) {
+            peak = sched_ctx->workers[i].coroutines.stack_peak;
+        }
+    }
+
+    return peak;
+}
+
 int mk_config_set_property(struct mk_server *server, char *k, char *v)
 {
     int b;
@@ -257,6 +538,19 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
             server->workers = num;
         }
     }
+    else if (config_eq(k, "WorkerAffinity") == 0) {
+        ret = mk_affinity_parse(v, server);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+    else if (config_eq(k, "ConnectionPool") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->conn_pool_size = num;
+    }
     else if (config_eq(k, "Timeout") == 0) {
         num = atoi(v);
         if (num <= 0) {
@@ -315,6 +609,55 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         }
         server->max_request_size = num;
     }
+    else if (config_eq(k, "ReadBufferSize") == 0) {
+        num = atoi(v);
+        if (num <= 0) {
+            return -1;
+        }
+        server->read_buf_size = num * 1024;
+    }
+    else if (config_eq(k, "BodySpillSize") == 0) {
+        num = atoi(v);
+        if (num <= 0) {
+            return -1;
+        }
+        server->body_spill_size = num * 1024;
+    }
+    else if (config_eq(k, "ReadBuffers") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->read_buf_pool = num;
+    }
+    else if (config_eq(k, "ThreadStackSize") == 0) {
+        num = atoi(v);
+        if (num <= 0) {
+            return -1;
+        }
+        server->thread_stack_size = num * 1024;
+    }
+    else if (config_eq(k, "ThreadStacks") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->thread_stack_pool = num;
+    }
+    else if (config_eq(k, "HandlerThreads") == 0) {
+        num = atoi(v);
+        if (num <= 0) {
+            return -1;
+        }
+        server->handler_threads = num;
+    }
+    else if (config_eq(k, "ThreadStackCheck") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->thread_stack_check = b;
+    }
     else if (config_eq(k, "SymLink") == 0) {
         b = bool_val(v);
         if (b == -1) {
@@ -332,6 +675,13 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         }
         server->fdt = b;
     }
+    else if (config_eq(k, "CacheMemory") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->cache_memory = (size_t) num * 1024 * 1024;
+    }
 
     return 0;
 }
@@ -395,6 +745,7 @@ int mk_vhost_create(mk_ctx_t *ctx, char *name)
     mk_list_init(&h->error_pages);
     mk_list_init(&h->server_names);
     mk_list_init(&h->handlers);
+    mk_list_init(&h->cache_rules);
 
     /* Host alias */
     halias = mk_mem_alloc_z(sizeof(struct mk_vhost_alias));
@@ -495,14 +846,124 @@ int mk_vhost_handler(mk_ctx_t *ctx, int vid, char *regex,
     return 0;
 }
 
-/* Flush streams data associated to a request in question */
-int mk_http_flush(mk_request_t *req)
+/*
+ * Same as mk_vhost_handler() but the callback runs on a thread of the
+ * handler pool (HandlerThreads), so it can block without stalling the
+ * other connections of the worker.
+ */
+int mk_vhost_handler_blocking(mk_ctx_t *ctx, int vid, char *regex,
+                              void (*cb)(mk_request_t *, void *), void *data)
 {
     int ret;
-    size_t out_bytes = 0;
+    struct mk_lib_pool *pool;
+    struct mk_lib_blocking *handler;
 
-    ret = mk_channel_stream_write(&req->stream, &out_bytes);
-    return ret;
+    if (!ctx->pool) {
+        pool = mk_mem_alloc_z(sizeof(struct mk_lib_pool));
+        if (!pool) {
+            return -1;
+        }
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->cond, NULL);
+        mk_list_init(&pool->jobs);
+        mk_list_init(&pool->handlers);
+        ctx->pool = pool;
+    }
+
+    handler = mk_mem_alloc(sizeof(struct mk_lib_blocking));
+    if (!handler) {
+        return -1;
+    }
+    handler->cb = cb;
+    handler->data = data;
+    handler->ctx = ctx;
+
+    ret = mk_vhost_handler(ctx, vid, regex, mk_lib_blocking_cb, handler);
+    if (ret != 0) {
+        mk_mem_free(handler);
+        return -1;
+    }
+    mk_list_add(&handler->_head, &ctx->pool->handlers);
+
+    return 0;
+}
+
+/*
+ * Same as mk_vhost_handler() but the request body is not buffered:
+ * 'cb_body' gets every piece of it as it arrives from the client, then
+ * 'cb' is invoked as usual. 'cb_body' returns 0 to keep receiving or -1
+ * to reject the request (413). Reading stops while 'cb_body' runs, so a
+ * slow consumer slows the client down.
+ */
+int mk_vhost_handler_stream(mk_ctx_t *ctx, int vid, char *regex,
+                            int (*cb_body)(mk_request_t *, char *, size_t,
+                                           void *),
+                            void (*cb)(mk_request_t *, void *), void *data)
+{
+    struct mk_vhost *vh;
+    struct mk_vhost_handler *handler;
+
+    vh = mk_vhost_lookup(ctx, vid);
+    if (!vh) {
+        return -1;
+    }
+
+    handler = mk_vhost_handler_match(regex, cb, data);
+    if (!handler) {
+        return -1;
+    }
+    handler->cb_body = cb_body;
+    mk_list_add(&handler->_head, &vh->handlers);
+
+    return 0;
+}
+
+/*
+ * Cache the responses of the requests matching 'regex' for 'ttl' seconds,
+ * 'vary' is an optional space separated list of request headers that are
+ * part of the cache key.
+ */
+int mk_vhost_cache(mk_ctx_t *ctx, int vid, char *regex, int ttl, char *vary)
+{
+    int ret = 0;
+    struct mk_list *head;
+    struct mk_list *list;
+    struct mk_string_line *entry;
+    struct mk_vhost *vh;
+    struct mk_http_cache_rule *rule;
+
+    vh = mk_vhost_lookup(ctx, vid);
+    if (!vh || ttl <= 0) {
+        return -1;
+    }
+
+    rule = mk_http_cache_rule_create(regex, ttl);
+    if (!rule) {
+        return -1;
+    }
+
+    if (vary) {
+        list = mk_string_split_line(vary);
+        if (!list) {
+            mk_http_cache_rule_free(rule);
+            return -1;
+        }
+        mk_list_foreach(head, list) {
+            entry = mk_list_entry(head, struct mk_string_line, _head);
+            ret = mk_http_cache_rule_vary(rule, entry->val);
+            if (ret != 0) {
+                break;
+            }
+        }
+        mk_string_split_free(list);
+        if (ret != 0) {
+            mk_http_cache_rule_free(rule);
+            return -1;
+        }
+    }
+    mk_list_add(&rule->_head, &vh->cache_rules);
+
+    return 0;
 }
 
 int mk_http_status(mk_request_t *req, int status)
@@ -530,7 +991,7 @@ int mk_http_header(mk_request_t *req,
     }
 
     len = key_len + val_len + 4;
-    buf = mk_mem_alloc(len);
+    buf = mk_http_request_alloc(req, len);
     if (!buf) {
         /* we don't free extra_rows as it's released later */
         return -1;
@@ -546,8 +1007,8 @@ int mk_http_header(mk_request_t *req,
     buf[pos++] = '\r';
     buf[pos++] = '\n';
 
-    /* Add the new buffer */
-    mk_iov_add(h->_extra_rows, buf, pos, MK_TRUE);
+    /* Add the new buffer, it belongs to the request */
+    mk_iov_add(h->_extra_rows, buf, pos, MK_FALSE);
 
     return 0;
 }
@@ -590,12 +1051,6 @@ static inline int chunk_header(long num, char *out)
     return c;
 }
 
-static void free_chunk_header(struct mk_stream_input *input)
-{
-    mk_mem_free(input->buffer);
-    input->buffer = NULL;
-}
-
 
 /* Check if response headers were processed, otherwise prepare them */
 static int headers_setup(mk_request_t *req)
@@ -617,94 +1072,561 @@ static int headers_setup(mk_request_t *req)
     return 0;
 }
 
-/* Enqueue some data for the body response */
-int mk_http_send(mk_request_t *req, char *buf, size_t len,
-                 void (*cb_finish)(mk_request_t *))
+/*
+ * Body chunks are queued in batches: every batch is a single IOV input in
+ * the request stream, so one writev(2) moves many chunks. The chunk framing
+ * and small payloads are copied into the batch itself, bigger payloads are
+ * referenced.
+ */
+#define MK_LIB_BATCH_IOV      64       /* iovec entries per batch          */
+#define MK_LIB_BATCH_DATA   4096       /* inline bytes: framing and copies */
+#define MK_LIB_BATCH_OWN      16       /* buffers owned per batch          */
+#define MK_LIB_COPY_MAX      512       /* payloads copied into the batch   */
+#define MK_LIB_FLUSH_BYTES 16384       /* queued bytes triggering a write  */
+#define MK_LIB_CHUNK_HEAD     20       /* "<hex length>\r\n"              */
+
+struct mk_lib_buf {
+    char *buf;
+    void (*cb_free)(char *, void *);
+    void *data;
+};
+
+struct mk_lib_batch {
+    /* Must be the first field: releasing the input frees the batch */
+    struct mk_stream_input in;
+
+    mk_request_t *req;
+    int n_own;
+    size_t data_len;
+    struct mk_iov iov;
+    struct iovec io[MK_LIB_BATCH_IOV];
+    struct mk_lib_buf own[MK_LIB_BATCH_OWN];
+    char data[MK_LIB_BATCH_DATA];
+};
+
+/* The batch was written or discarded, give back the buffers it owned */
+static void mk_lib_batch_finished(struct mk_stream_input *in)
 {
-    int chunk_len;
-    int ret;
-    char *tmp;
-    char chunk_pre[32];
-    (void) cb_finish;
+    int i;
+    struct mk_lib_batch *batch = (struct mk_lib_batch *) in;
 
-    if (req->session->channel->status != MK_CHANNEL_OK) {
-        return -1;
+    for (i = 0; i < batch->n_own; i++) {
+        if (batch->own[i].cb_free) {
+            batch->own[i].cb_free(batch->own[i].buf, batch->own[i].data);
+        }
     }
 
-    if (req->headers.status == -1) {
-        /* Cannot append data if the status have not been set */
-        mk_err("HTTP: set the response status first");
-        return -1;
+    if (batch->req->lib_batch == batch) {
+        batch->req->lib_batch = NULL;
     }
+}
 
-    /* Chunk encoding prefix */
-    if (req->protocol == MK_HTTP_PROTOCOL_11) {
-        chunk_len = chunk_header(len, chunk_pre);
-        tmp = mk_string_dup(chunk_pre);
-        if (!tmp) {
-            return -1;
-        }
-        ret = mk_stream_in_raw(&req->stream, NULL,
-                               tmp, chunk_len, NULL, free_chunk_header);
-        if (ret != 0) {
-            return -1;
-        }
+/* Get a batch with room for 'entries' iovecs and 'bytes' of inline data */
+static struct mk_lib_batch *mk_lib_batch_get(mk_request_t *req, int entries,
+                                             size_t bytes, int own)
+{
+    int ret;
+    struct mk_lib_batch *batch;
+
+    batch = req->lib_batch;
+    if (batch &&
+        batch->iov.iov_idx + entries <= MK_LIB_BATCH_IOV &&
+        batch->data_len + bytes <= MK_LIB_BATCH_DATA &&
+        (own == MK_FALSE || batch->n_own < MK_LIB_BATCH_OWN)) {
+        return batch;
     }
 
-    /* Append raw data */
-    if (len > 0) {
-        ret = mk_stream_in_raw(&req->stream, NULL,
-                               buf, len, NULL, NULL);
-        if (ret == 0) {
-            /* Update count of bytes */
-            req->stream_size += len;
-        }
+    batch = mk_mem_alloc(sizeof(struct mk_lib_batch));
+    if (!batch) {
+        return NULL;
     }
-
-    if (req->protocol == MK_HTTP_PROTOCOL_11 && len > 0) {
-        ret = mk_stream_in_raw(&req->stream, NULL,
-                               "\r\n", 2, NULL, NULL);
+    batch->req = req;
+    batch->n_own = 0;
+    batch->data_len = 0;
+    batch->iov.io = batch->io;
+    batch->iov.buf_to_free = NULL;
+    mk_iov_init(&batch->iov, MK_LIB_BATCH_IOV, 0);
+
+    ret = mk_stream_in_iov(&req->stream, &batch->in, &batch->iov,
+                           NULL, mk_lib_batch_finished);
+    if (ret != 0) {
+        mk_mem_free(batch);
+        return NULL;
     }
+    batch->in.dynamic = MK_TRUE;
 
-    /* Validate if the response headers are ready */
-    headers_setup(req);
-
-    /* Flush channel data */
-    ret = mk_http_flush(req);
+    req->lib_batch = batch;
+    return batch;
+}
 
-    /*
-     * Flush have been done, before to return our original caller, we want to yield
-     * and give some execution time to the event loop to avoid possible blocking
-     * since the caller might be using this mk_http_send() in a loop.
-     */
-    mk_lib_yield(req);
-    return ret;
+static inline void mk_lib_batch_add(struct mk_lib_batch *batch,
+                                    char *buf, size_t len)
+{
+    mk_iov_add(&batch->iov, buf, len, MK_FALSE);
+    batch->in.bytes_total += len;
 }
 
-int mk_http_done(mk_request_t *req)
+/*
+ * Write what is queued for the request. Returns MK_CHANNEL_BUSY if the
+ * socket cannot take more data, zero when everything was written or -1 on
+ * error.
+ */
+static int mk_lib_write(mk_request_t *req)
 {
-    if (req->session->channel->status != MK_CHANNEL_OK) {
-        return -1;
-    }
+    int ret;
+    size_t count;
+    struct mk_channel *channel = req->session->channel;
+
+    /* Entries of a batch are modified while written, stop appending */
+    req->lib_batch = NULL;
+
+    do {
+        ret = mk_channel_write(channel, &count);
+    } while (ret == MK_CHANNEL_FLUSH);
+
+    if (ret & (MK_CHANNEL_DONE | MK_CHANNEL_EMPTY)) {
+        return 0;
+    }
+    else if (ret == MK_CHANNEL_BUSY) {
+        return MK_CHANNEL_BUSY;
+    }
+
+    return -1;
+}
+
+/* Write everything queued, waiting on the event loop when congested */
+int mk_http_flush(mk_request_t *req)
+{
+    int ret;
+    struct mk_lib_job *job;
+
+    job = mk_lib_job_remote(req);
+    if (job) {
+        return mk_lib_job_call(job, MK_LIB_CALL_FLUSH);
+    }
+
+    while ((ret = mk_lib_write(req)) == MK_CHANNEL_BUSY) {
+        mk_lib_yield(req);
+    }
+
+    return ret;
+}
+
+/* Validate the request can take body data and set the response headers */
+static int mk_lib_ready(mk_request_t *req)
+{
+    if (req->session->channel->status != MK_CHANNEL_OK) {
+        return -1;
+    }
+
+    if (req->headers.status == -1) {
+        /* Cannot append data if the status have not been set */
+        mk_err("HTTP: set the response status first");
+        return -1;
+    }
 
     /* Validate if the response headers are ready */
     headers_setup(req);
+    return 0;
+}
+
+/* Queue 'len' bytes from 'iov' as a single body chunk */
+static int mk_lib_send(mk_request_t *req, struct iovec *iov, int iovcnt,
+                       size_t len, int own,
+                       void (*cb_free)(char *, void *), void *data)
+{
+    int i;
+    int ret;
+    int copy;
+    int chunked;
+    size_t n = 0;
+    char *p;
+    struct mk_lib_job *job;
+    struct mk_lib_batch *batch;
+
+    job = mk_lib_job_remote(req);
+    if (job) {
+        job->iov = iov;
+        job->iovcnt = iovcnt;
+        job->len = len;
+        job->own = own;
+        job->cb_free = cb_free;
+        job->data = data;
+        return mk_lib_job_call(job, MK_LIB_CALL_SEND);
+    }
+
+    if (mk_lib_ready(req) == -1) {
+        goto error;
+    }
+
+    chunked = (req->protocol == MK_HTTP_PROTOCOL_11);
+    if (len == 0) {
+        /* Nothing to queue, a zero length chunk ends the body */
+        if (chunked) {
+            batch = mk_lib_batch_get(req, 1, 0, MK_FALSE);
+            if (!batch) {
+                return -1;
+            }
+            mk_lib_batch_add(batch, "0\r\n\r\n", 5);
+        }
+        return mk_http_flush(req);
+    }
 
-    if (req->headers.transfer_encoding == MK_HEADER_TE_TYPE_CHUNKED) {
-        /* Append end-of-chunk bytes */
-        mk_http_send(req, NULL, 0, NULL);
+    /*
+     * Small payloads of the caller are copied together with the framing,
+     * the rest is referenced.
+     */
+    copy = (own == MK_FALSE && len <= MK_LIB_COPY_MAX);
+    if (copy) {
+        batch = mk_lib_batch_get(req, 1, MK_LIB_CHUNK_HEAD + len + 2,
+                                 MK_FALSE);
     }
     else {
-        mk_http_send(req, NULL, 0, NULL);
+        batch = mk_lib_batch_get(req,
+                                 iovcnt + 2 < MK_LIB_BATCH_IOV ?
+                                 iovcnt + 2 : MK_LIB_BATCH_IOV,
+                                 MK_LIB_CHUNK_HEAD, own);
+    }
+    if (!batch) {
+        goto error;
+    }
+
+    p = batch->data + batch->data_len;
+    if (chunked) {
+        n = chunk_header(len, p);
+    }
+
+    if (copy) {
+        for (i = 0; i < iovcnt; i++) {
+            memcpy(p + n, iov[i].iov_base, iov[i].iov_len);
+            n += iov[i].iov_len;
+        }
+        if (chunked) {
+            p[n++] = '\r';
+            p[n++] = '\n';
+        }
+        mk_lib_batch_add(batch, p, n);
+        batch->data_len += n;
+    }
+    else {
+        if (n > 0) {
+            mk_lib_batch_add(batch, p, n);
+            batch->data_len += n;
+        }
+
+        /* Only long arrays of the caller continue on a new batch */
+        for (i = 0; i < iovcnt + chunked; i++) {
+            if (batch->iov.iov_idx == MK_LIB_BATCH_IOV) {
+                batch = mk_lib_batch_get(req, 1, 0, MK_FALSE);
+                if (!batch) {
+                    goto error;
+                }
+            }
+            if (i < iovcnt) {
+                mk_lib_batch_add(batch, iov[i].iov_base, iov[i].iov_len);
+            }
+            else {
+                mk_lib_batch_add(batch, mk_iov_crlf.data, mk_iov_crlf.len);
+            }
+        }
+
+        if (own == MK_TRUE) {
+            batch->own[batch->n_own].buf = iov[0].iov_base;
+            batch->own[batch->n_own].cb_free = cb_free;
+            batch->own[batch->n_own].data = data;
+            batch->n_own++;
+        }
+    }
+    req->stream_size += len;
+
+    /* The caller keeps its buffer, it must be written before returning */
+    if (own == MK_FALSE && copy == MK_FALSE) {
+        return mk_http_flush(req);
+    }
+
+    if (batch->in.bytes_total < MK_LIB_FLUSH_BYTES) {
+        return 0;
     }
 
-    if (req->session->close_now == MK_TRUE) {
+    /* Only give the event loop a round when the socket is full */
+    ret = mk_lib_write(req);
+    if (ret == MK_CHANNEL_BUSY) {
         mk_lib_yield(req);
+        ret = 0;
     }
 
+    return ret;
+
+ error:
+    if (own == MK_TRUE && cb_free) {
+        cb_free(iov[0].iov_base, data);
+    }
+    return -1;
+}
+
+/* Enqueue some data for the body response */
+int mk_http_send(mk_request_t *req, char *buf, size_t len,
+                 void (*cb_finish)(mk_request_t *))
+{
+    struct iovec iov = {buf, len};
+    (void) cb_finish;
+
+    return mk_lib_send(req, &iov, 1, len, MK_FALSE, NULL, NULL);
+}
+
+/*
+ * Same as mk_http_send() but the buffer now belongs to the server: it's
+ * written without a copy and 'cb_free' (optional) is invoked with 'data'
+ * once it's not longer needed, also on error.
+ */
+int mk_http_send_buf(mk_request_t *req, char *buf, size_t len,
+                     void (*cb_free)(char *, void *), void *data)
+{
+    struct iovec iov = {buf, len};
+
+    return mk_lib_send(req, &iov, 1, len, MK_TRUE, cb_free, data);
+}
+
+/* Send the buffers of an array as a single body chunk */
+int mk_http_send_iov(mk_request_t *req, struct iovec *iov, int iovcnt)
+{
+    int i;
+    size_t len = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    /* An empty chunk would end the body */
+    if (len == 0) {
+        return 0;
+    }
+
+    return mk_lib_send(req, iov, iovcnt, len, MK_FALSE, NULL, NULL);
+}
+
+/*
+ * Send 'len' bytes of a file starting at 'offset' through sendfile(2), a
+ * zero length sends up to the end of the file. The descriptor is not
+ * closed, the data is written before returning.
+ */
+int mk_http_send_fd(mk_request_t *req, int fd, off_t offset, size_t len)
+{
+    int ret;
+    int chunked;
+    size_t n;
+    char *p;
+    struct stat st;
+    struct mk_lib_job *job;
+    struct mk_lib_batch *batch;
+
+    job = mk_lib_job_remote(req);
+    if (job) {
+        job->fd = fd;
+        job->offset = offset;
+        job->len = len;
+        return mk_lib_job_call(job, MK_LIB_CALL_FILE);
+    }
+
+    if (mk_lib_ready(req) == -1) {
+        return -1;
+    }
+
+    if (len == 0) {
+        if (fstat(fd, &st) == -1) {
+            mk_libc_error("fstat");
+            return -1;
+        }
+        if (st.st_size <= offset) {
+            return 0;
+        }
+        len = st.st_size - offset;
+    }
+
+    chunked = (req->protocol == MK_HTTP_PROTOCOL_11);
+    if (chunked) {
+        batch = mk_lib_batch_get(req, 1, MK_LIB_CHUNK_HEAD, MK_FALSE);
+        if (!batch) {
+            return -1;
+        }
+        p = batch->data + batch->data_len;
+        n = chunk_header(len, p);
+        mk_lib_batch_add(batch, p, n);
+        batch->data_len += n;
+    }
+
+    ret = mk_stream_in_file(&req->stream, NULL, fd, len, offset,
+                            NULL, NULL);
+    if (ret != 0) {
+        return -1;
+    }
+
+    /* Data queued after the file goes to a new batch */
+    req->lib_batch = NULL;
+
+    if (chunked) {
+        batch = mk_lib_batch_get(req, 1, 0, MK_FALSE);
+        if (!batch) {
+            return -1;
+        }
+        mk_lib_batch_add(batch, mk_iov_crlf.data, mk_iov_crlf.len);
+    }
+    req->stream_size += len;
+
+    return mk_http_flush(req);
+}
+
+int mk_http_done(mk_request_t *req)
+{
+    struct mk_lib_job *job;
+
+    job = mk_lib_job_remote(req);
+    if (job) {
+        return mk_lib_job_call(job, MK_LIB_CALL_DONE);
+    }
+
+    if (req->session->channel->status != MK_CHANNEL_OK) {
+        return -1;
+    }
+
+    /* Append end-of-chunk bytes (if any) and write everything */
+    mk_lib_send(req, NULL, 0, 0, MK_FALSE, NULL, NULL);
+
+    /*
+     * Sends only yield when the socket is congested: give the event loop a
+     * round so the request is not finalized from the read callback that
+     * started the handler.
+     */
+    mk_lib_yield(req);
+
     return 0;
 }
 
+/* Worker: a call of a pool thread arrived, resume the coroutine */
+static void mk_lib_job_wake(struct mk_sched_call *call)
+{
+    struct mk_lib_job *job = (struct mk_lib_job *) call;
+
+    job->pending = MK_TRUE;
+    mk_thread_resume(job->th);
+}
+
+/*
+ * Worker exiting with the call still pending, its coroutine is destroyed:
+ * fail the call of the pool thread or free a finished job.
+ */
+static void mk_lib_job_cancel(struct mk_sched_call *call)
+{
+    struct mk_lib_job *job = (struct mk_lib_job *) call;
+
+    if (job->type == MK_LIB_CALL_END) {
+        mk_lib_job_free(job);
+        return;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->ret = -1;
+    job->replied = MK_TRUE;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static int mk_lib_job_run(struct mk_lib_job *job)
+{
+    mk_request_t *req = job->req;
+
+    switch (job->type) {
+    case MK_LIB_CALL_SEND:
+        return mk_lib_send(req, job->iov, job->iovcnt, job->len, job->own,
+                           job->cb_free, job->data);
+    case MK_LIB_CALL_FILE:
+        return mk_http_send_fd(req, job->fd, job->offset, job->len);
+    case MK_LIB_CALL_FLUSH:
+        return mk_http_flush(req);
+    case MK_LIB_CALL_DONE:
+        return mk_http_done(req);
+    case MK_LIB_CALL_SUB:
+        return mk_topic_subscribe(job->handler->ctx, job->tid, req);
+    }
+
+    return -1;
+}
+
+/*
+ * Coroutine of a blocking handler: queue the callback on the pool and run
+ * the calls it makes until it returns.
+ */
+static void mk_lib_blocking_cb(mk_request_t *req, void *data)
+{
+    struct mk_lib_job *job;
+    struct mk_channel *channel;
+    struct mk_sched_worker *sched;
+    struct mk_lib_blocking *handler = data;
+    struct mk_lib_pool *pool = handler->ctx->pool;
+
+    job = NULL;
+    if (pool->n_threads > 0) {
+        job = mk_mem_alloc_z(sizeof(struct mk_lib_job));
+    }
+    if (!job) {
+        mk_http_status(req, 500);
+        mk_http_done(req);
+        return;
+    }
+    sched = mk_sched_get_thread_conf();
+    channel = req->session->channel;
+
+    job->call.cb = mk_lib_job_wake;
+    job->call.cb_cancel = mk_lib_job_cancel;
+    job->handler = handler;
+    job->req = req;
+    job->sched = sched;
+    job->th = pthread_getspecific(mk_thread_key);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    req->lib_job = job;
+
+    /*
+     * Nothing is read from the connection meanwhile, it's watched only so
+     * the event loop does not take it back.
+     */
+    channel->thread = job->th;
+    mk_event_add(sched->loop, channel->fd,
+                 MK_EVENT_THREAD, MK_EVENT_READ, channel->event);
+
+    pthread_mutex_lock(&pool->lock);
+    mk_list_add(&job->_head, &pool->jobs);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    while (1) {
+        mk_thread_yield(job->th);
+
+        if (job->pending == MK_FALSE) {
+            /* Woken up by the client, stop watching the connection */
+            if (channel->event->status & MK_EVENT_REGISTERED) {
+                mk_event_del(sched->loop, channel->event);
+            }
+            continue;
+        }
+        job->pending = MK_FALSE;
+
+        if (job->type == MK_LIB_CALL_END) {
+            break;
+        }
+
+        job->ret = mk_lib_job_run(job);
+
+        pthread_mutex_lock(&job->lock);
+        job->replied = MK_TRUE;
+        pthread_cond_signal(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    req->lib_job = NULL;
+    mk_lib_job_free(job);
+}
+
 /* Create a messaging queue end-point */
 int mk_mq_create(mk_ctx_t *ctx, char *name, void (*cb), void *data)
 {
@@ -714,12 +1636,416 @@ int mk_mq_create(mk_ctx_t *ctx, char *name, void (*cb), void *data)
     return id;
 }
 
-/* Write a message to a specific queue ID */
+/* Write a message to a specific queue ID, every worker gets a copy */
 int mk_mq_send(mk_ctx_t *ctx, int qid, void *data, size_t size)
 {
     return mk_fifo_send(ctx->fifo, qid, data, size);
 }
 
+/*
+ * Write a message to a single worker: 'worker' is the worker index,
+ * MK_FIFO_ANY picks the next one in round-robin.
+ */
+int mk_mq_send_worker(mk_ctx_t *ctx, int qid, int worker,
+                      void *data, size_t size)
+{
+    return mk_fifo_send_worker(ctx->fifo, qid, worker, data, size);
+}
+
+/* Write a message to the worker owning 'key' */
+int mk_mq_send_key(mk_ctx_t *ctx, int qid, void *key, size_t key_len,
+                   void *data, size_t size)
+{
+    return mk_fifo_send_key(ctx->fifo, qid, key, key_len, data, size);
+}
+
+/*
+ * Topics
+ * ------
+ * A request subscribed to a topic stays open once its handler returns and
+ * every message published to the topic is appended to its stream. The
+ * message is framed once in a buffer shared by the workers, each worker
+ * references it from the streams of its own subscribers.
+ */
+struct mk_lib_topic {
+    int id;
+    char *name;
+    size_t max_pending;             /* bytes queued per subscriber      */
+    int policy;                     /* MK_TOPIC_SKIP or MK_TOPIC_CLOSE  */
+    struct mk_lib_topic_worker *workers;
+    struct mk_list _head;
+};
+
+/* Subscribers of a topic owned by a worker, only the worker touch them */
+struct mk_lib_topic_worker {
+    int count;
+    struct mk_list subs;            /* struct mk_lib_sub                */
+};
+
+struct mk_lib_sub {
+    mk_request_t *req;
+    size_t pending;                 /* bytes queued, not written yet    */
+    struct mk_lib_topic_worker *tw;
+    struct mk_list _head;
+};
+
+struct mk_lib_msg {
+    int refs;                       /* workers holding the message      */
+    struct mk_lib_topic *topic;
+    size_t head;                    /* chunk header length              */
+    size_t size;                    /* payload length                   */
+    char data[];                    /* "<hex length>\r\n" payload "\r\n" */
+};
+
+struct mk_lib_msg_set;
+
+struct mk_lib_msg_ref {
+    /* Must be the first field: the stream input of a subscriber */
+    struct mk_stream_input in;
+
+    size_t len;
+    struct mk_lib_sub *sub;
+    struct mk_lib_msg_set *set;
+    struct mk_iov iov;
+    struct iovec io[1];
+};
+
+/* The inputs a worker queued for a message, a single allocation */
+struct mk_lib_msg_set {
+    int pending;                    /* inputs not finished yet          */
+    struct mk_lib_msg *msg;
+    struct mk_lib_msg_ref refs[];
+};
+
+static struct mk_lib_topic *mk_lib_topic_get(mk_ctx_t *ctx, int tid)
+{
+    struct mk_list *head;
+    struct mk_lib_topic *topic;
+
+    mk_list_foreach(head, &ctx->topics) {
+        topic = mk_list_entry(head, struct mk_lib_topic, _head);
+        if (topic->id == tid) {
+            return topic;
+        }
+    }
+
+    return NULL;
+}
+
+static inline void mk_lib_msg_release(struct mk_lib_msg *msg)
+{
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        mk_mem_free(msg);
+    }
+}
+
+/* A subscriber wrote its copy of a message or the request is gone */
+static void mk_lib_msg_finished(struct mk_stream_input *in)
+{
+    struct mk_lib_msg_ref *ref = (struct mk_lib_msg_ref *) in;
+    struct mk_lib_msg_set *set = ref->set;
+
+    ref->sub->pending -= ref->len;
+
+    set->pending--;
+    if (set->pending == 0) {
+        mk_lib_msg_release(set->msg);
+        mk_mem_free(set);
+    }
+}
+
+/* The subscribed request is released */
+static void mk_lib_topic_leave(mk_request_t *req)
+{
+    struct mk_lib_sub *sub = req->lib_sub;
+
+    mk_list_del(&sub->_head);
+    sub->tw->count--;
+    mk_mem_free(sub);
+    req->lib_sub = NULL;
+}
+
+/* Worker: queue a published message for the local subscribers */
+static void mk_lib_topic_deliver(mk_mq_t *queue, void *data, size_t size,
+                                 void *ctx_data)
+{
+    size_t len;
+    char *buf;
+    struct mk_list drop;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_lib_msg *msg;
+    struct mk_lib_msg_set *set = NULL;
+    struct mk_lib_msg_ref *ref;
+    struct mk_lib_sub *sub;
+    struct mk_lib_topic *topic;
+    struct mk_lib_topic_worker *tw;
+    struct mk_sched_conn *conn;
+    struct mk_sched_worker *sched;
+    mk_ctx_t *ctx = ctx_data;
+    mk_request_t *req;
+    (void) queue;
+    (void) size;
+
+    memcpy(&msg, data, sizeof(msg));
+    topic = msg->topic;
+    sched = mk_sched_get_thread_conf();
+    tw = &topic->workers[sched->idx];
+
+    if (tw->count > 0) {
+        set = mk_mem_alloc(sizeof(struct mk_lib_msg_set) +
+                           sizeof(struct mk_lib_msg_ref) * tw->count);
+    }
+    if (!set) {
+        mk_lib_msg_release(msg);
+        return;
+    }
+    set->pending = 0;
+    set->msg = msg;
+
+    mk_list_init(&drop);
+    mk_list_foreach_safe(head, tmp, &tw->subs) {
+        sub = mk_list_entry(head, struct mk_lib_sub, _head);
+        req = sub->req;
+
+        /* Without chunked encoding the payload goes alone */
+        if (req->protocol == MK_HTTP_PROTOCOL_11) {
+            buf = msg->data;
+            len = msg->head + msg->size + 2;
+        }
+        else {
+            buf = msg->data + msg->head;
+            len = msg->size;
+        }
+
+        /* Slow subscriber */
+        if (topic->max_pending > 0 && sub->pending + len > topic->max_pending) {
+            if (topic->policy == MK_TOPIC_CLOSE) {
+                mk_list_del(&sub->_head);
+                mk_list_add(&sub->_head, &drop);
+            }
+            continue;
+        }
+
+        ref = &set->refs[set->pending++];
+        ref->len = len;
+        ref->sub = sub;
+        ref->set = set;
+        ref->iov.io = ref->io;
+        ref->iov.buf_to_free = NULL;
+        mk_iov_init(&ref->iov, 1, 0);
+        mk_iov_add(&ref->iov, buf, len, MK_FALSE);
+        mk_stream_in_iov(&req->stream, &ref->in, &ref->iov,
+                         NULL, mk_lib_msg_finished);
+        sub->pending += len;
+
+        /* A running handler owns the connection and writes on its own */
+        conn = req->session->conn;
+        if (conn->event.type == MK_EVENT_CONNECTION &&
+            !(conn->event.mask & MK_EVENT_WRITE)) {
+            mk_event_add(sched->loop, conn->event.fd,
+                         MK_EVENT_CONNECTION, MK_EVENT_WRITE, &conn->event);
+        }
+    }
+
+    if (set->pending == 0) {
+        mk_lib_msg_release(msg);
+        mk_mem_free(set);
+    }
+
+    /* Closing the connection releases the subscriber */
+    mk_list_foreach_safe(head, tmp, &drop) {
+        sub = mk_list_entry(head, struct mk_lib_sub, _head);
+        conn = sub->req->session->conn;
+        MK_TRACE("[FD %i] slow topic subscriber, closing", conn->event.fd);
+        mk_sched_event_close(conn, sched, MK_EP_SOCKET_CLOSED, ctx->server);
+    }
+}
+
+/*
+ * Create a topic, it must be done before mk_start(). A subscriber having
+ * more than 'max_pending' bytes queued (zero means no limit) misses the
+ * new messages (MK_TOPIC_SKIP) or is disconnected (MK_TOPIC_CLOSE).
+ */
+int mk_topic_create(mk_ctx_t *ctx, char *name, size_t max_pending,
+                    int policy)
+{
+    int id = 0;
+    struct mk_list *head;
+    struct mk_lib_topic *topic;
+
+    if (policy != MK_TOPIC_SKIP && policy != MK_TOPIC_CLOSE) {
+        return -1;
+    }
+
+    mk_list_foreach(head, &ctx->topics) {
+        topic = mk_list_entry(head, struct mk_lib_topic, _head);
+        if (strcmp(topic->name, name) == 0) {
+            return -1;
+        }
+        id = topic->id + 1;
+    }
+
+    /* Published messages reach the workers through a single queue */
+    if (ctx->topics_qid == -1) {
+        ctx->topics_qid = mk_fifo_queue_create(ctx->fifo, "mk_topics",
+                                               mk_lib_topic_deliver, ctx);
+        if (ctx->topics_qid == -1) {
+            return -1;
+        }
+    }
+
+    topic = mk_mem_alloc_z(sizeof(struct mk_lib_topic));
+    if (!topic) {
+        return -1;
+    }
+    topic->name = mk_string_dup(name);
+    if (!topic->name) {
+        mk_mem_free(topic);
+        return -1;
+    }
+    topic->id = id;
+    topic->max_pending = max_pending;
+    topic->policy = policy;
+    mk_list_add(&topic->_head, &ctx->topics);
+
+    return id;
+}
+
+/*
+ * Subscribe the request to a topic: the response headers are sent and the
+ * request stays open once the handler returns, every published message is
+ * a new chunk of the body. It ends when the client disconnects.
+ */
+int mk_topic_subscribe(mk_ctx_t *ctx, int tid, mk_request_t *req)
+{
+    int ret;
+    struct mk_lib_sub *sub;
+    struct mk_lib_job *job;
+    struct mk_lib_topic *topic;
+    struct mk_sched_worker *sched;
+
+    job = mk_lib_job_remote(req);
+    if (job) {
+        job->tid = tid;
+        return mk_lib_job_call(job, MK_LIB_CALL_SUB);
+    }
+
+    topic = mk_lib_topic_get(ctx, tid);
+    if (!topic || !topic->workers || req->lib_sub) {
+        return -1;
+    }
+
+    if (mk_lib_ready(req) == -1) {
+        return -1;
+    }
+
+    /* Headers and anything queued so far go out first */
+    ret = mk_http_flush(req);
+    if (ret != 0) {
+        return -1;
+    }
+
+    sub = mk_mem_alloc(sizeof(struct mk_lib_sub));
+    if (!sub) {
+        return -1;
+    }
+    sched = mk_sched_get_thread_conf();
+    sub->req = req;
+    sub->pending = 0;
+    sub->tw = &topic->workers[sched->idx];
+    mk_list_add(&sub->_head, &sub->tw->subs);
+    sub->tw->count++;
+
+    req->lib_sub = sub;
+    req->lib_release = mk_lib_topic_leave;
+
+    return 0;
+}
+
+/*
+ * Publish a message to the subscribers of a topic: the data is copied once
+ * and shared by all of them.
+ */
+int mk_topic_publish(mk_ctx_t *ctx, int tid, void *data, size_t size)
+{
+    int ret;
+    struct mk_lib_msg *msg;
+    struct mk_lib_topic *topic;
+
+    /* An empty chunk would end the responses */
+    if (size == 0) {
+        return -1;
+    }
+
+    topic = mk_lib_topic_get(ctx, tid);
+    if (!topic || !topic->workers) {
+        return -1;
+    }
+
+    msg = mk_mem_alloc(sizeof(struct mk_lib_msg) +
+                       MK_LIB_CHUNK_HEAD + size + 2);
+    if (!msg) {
+        return -1;
+    }
+    msg->topic = topic;
+    msg->size = size;
+    msg->head = chunk_header(size, msg->data);
+    memcpy(msg->data + msg->head, data, size);
+    memcpy(msg->data + msg->head + size, "\r\n", 2);
+
+    /*
+     * Every worker registered on the fifo takes the message, their number
+     * is set before any of them can read it.
+     */
+    msg->refs = 0;
+    ret = mk_fifo_send_count(ctx->fifo, ctx->topics_qid, &msg, sizeof(msg),
+                             &msg->refs);
+    if (ret != 0 || msg->refs == 0) {
+        mk_mem_free(msg);
+        return (ret != 0) ? -1 : 0;
+    }
+
+    return 0;
+}
+
+static int mk_lib_topics_start(mk_ctx_t *ctx)
+{
+    int i;
+    int workers = ctx->server->workers;
+    struct mk_list *head;
+    struct mk_lib_topic *topic;
+
+    mk_list_foreach(head, &ctx->topics) {
+        topic = mk_list_entry(head, struct mk_lib_topic, _head);
+        topic->workers = mk_mem_alloc_z(sizeof(struct mk_lib_topic_worker) *
+                                        workers);
+        if (!topic->workers) {
+            return -1;
+        }
+        for (i = 0; i < workers; i++) {
+            mk_list_init(&topic->workers[i].subs);
+        }
+    }
+
+    return 0;
+}
+
+static void mk_lib_topics_destroy(mk_ctx_t *ctx)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_lib_topic *topic;
+
+    mk_list_foreach_safe(head, tmp, &ctx->topics) {
+        topic = mk_list_entry(head, struct mk_lib_topic, _head);
+        mk_list_del(&topic->_head);
+        mk_mem_free(topic->workers);
+        mk_mem_free(topic->name);
+        mk_mem_free(topic);
+    }
+}
+
 int mk_main()
 {
     while (1) {
@@ -35,31 +35,76 @@
 
 struct mk_mimetype *mimetype_default;
 
-static int rbtree_compare(const void *lhs, const void *rhs)
+static struct mk_mimetype *mimetype_get(struct mk_server *server,
+                                        const char *name, int len)
 {
-    return strcmp((const char *)lhs, (const char *)rhs);
-}
+    int i;
+    unsigned int mask;
+    unsigned int hash;
+    struct mk_mimetype *entry;
 
-/* Match mime type for requested resource */
-inline struct mk_mimetype *mk_mimetype_lookup(struct mk_server *server, char *name)
-{
-    int cmp;
-    struct rb_tree_node *node = server->mimetype_rb_head.root;
-
-    while (node) {
-        struct mk_mimetype *entry = container_of(node, struct mk_mimetype, _rb_head);
-        cmp = strcmp(name, entry->name);
-        if (cmp < 0)
-            node = node->left;
-        else if (cmp > 0)
-            node = node->right;
-        else {
+    if (!server->mimetype_table) {
+        return NULL;
+    }
+
+    hash = mk_string_hash(name, len, MK_STR_INSENSITIVE);
+    mask = server->mimetype_table_size - 1;
+
+    for (i = hash & mask; (entry = server->mimetype_table[i]); i = (i + 1) & mask) {
+        if (entry->hash == hash && entry->name_len == len &&
+            strncasecmp(entry->name, name, len) == 0) {
             return entry;
         }
     }
     return NULL;
 }
 
+static void mimetype_insert(struct mk_mimetype **table, int size,
+                            struct mk_mimetype *mime)
+{
+    int i;
+    unsigned int mask = size - 1;
+
+    for (i = mime->hash & mask; table[i]; i = (i + 1) & mask);
+    table[i] = mime;
+}
+
+/* Keep the table at most half full so probe chains stay short */
+static int mimetype_table_grow(struct mk_server *server)
+{
+    int i;
+    int size;
+    struct mk_mimetype **table;
+
+    if (server->mimetype_table &&
+        (server->mimetype_count + 1) * 2 <= server->mimetype_table_size) {
+        return 0;
+    }
+
+    size = server->mimetype_table_size ? server->mimetype_table_size * 2 :
+        MIMETYPE_TABLE_SIZE;
+    table = mk_mem_alloc_z(sizeof(struct mk_mimetype *) * size);
+    if (!table) {
+        return -1;
+    }
+
+    for (i = 0; i < server->mimetype_table_size; i++) {
+        if (server->mimetype_table[i]) {
+            mimetype_insert(table, size, server->mimetype_table[i]);
+        }
+    }
+
+    mk_mem_free(server->mimetype_table);
+    server->mimetype_table = table;
+    server->mimetype_table_size = size;
+    return 0;
+}
+
+struct mk_mimetype *mk_mimetype_lookup(struct mk_server *server, char *name)
+{
+    return mimetype_get(server, name, strlen(name));
+}
+
 int mk_mimetype_add(struct mk_server *server, char *name, const char *type)
 {
     int len = strlen(type) + 3;
@@ -70,8 +115,15 @@ int mk_mimetype_add(struct mk_server *server, char *name, const char *type)
     p = name;
     for ( ; *p; ++p) *p = tolower(*p);
 
+    if (mimetype_table_grow(server) != 0) {
+        return -1;
+    }
+
     new_mime = mk_mem_alloc_z(sizeof(struct mk_mimetype));
     new_mime->name = mk_string_dup(name);
+    new_mime->name_len = strlen(name);
+    new_mime->hash = mk_string_hash(name, new_mime->name_len,
+                                    MK_STR_INSENSITIVE);
     new_mime->type.data = mk_mem_alloc(len);
     new_mime->type.len = len - 1;
     new_mime->header_type.data = mk_mem_alloc(len + 32);
@@ -83,9 +135,12 @@ int mk_mimetype_add(struct mk_server *server, char *name, const char *type)
     strcat(new_mime->type.data, MK_CRLF);
     new_mime->type.data[len-1] = '\0';
 
-    /* Insert the node into the RBT */
-    rb_tree_insert(&server->mimetype_rb_head,
-                   new_mime->name, &new_mime->_rb_head);
+    /* Index the extension, the first definition wins */
+    if (!mimetype_get(server, new_mime->name, new_mime->name_len)) {
+        mimetype_insert(server->mimetype_table, server->mimetype_table_size,
+                        new_mime);
+        server->mimetype_count++;
+    }
 
     /* Add to linked list head */
     mk_list_add(&new_mime->_head, &server->mimetype_list);
@@ -99,7 +154,9 @@ int mk_mimetype_init(struct mk_server *server)
 
     /* Initialize the heads */
     mk_list_init(&server->mimetype_list);
-    rb_tree_new(&server->mimetype_rb_head, rbtree_compare);
+    server->mimetype_table = NULL;
+    server->mimetype_table_size = 0;
+    server->mimetype_count = 0;
 
     name = mk_string_dup(MIMETYPE_DEFAULT_NAME);
     if (server->mimetype_default_str) {
@@ -175,16 +232,18 @@ struct mk_mimetype *mk_mimetype_find(struct mk_server *server, mk_ptr_t *filenam
 
     j = len = filename->len;
 
-    /* looking for extension */
-    while (j >= 0 && filename->data[j] != '.') {
-        j--;
+    /* looking for extension, it never goes past the last path component */
+    while (--j >= 0 && filename->data[j] != '.') {
+        if (filename->data[j] == '/') {
+            return NULL;
+        }
     }
 
     if (j <= 0) {
         return NULL;
     }
 
-    return mk_mimetype_lookup(server, filename->data + j + 1);
+    return mimetype_get(server, filename->data + j + 1, len - j - 1);
 }
 
 void mk_mimetype_free_all(struct mk_server *server)
@@ -200,4 +259,9 @@ void mk_mimetype_free_all(struct mk_server *server)
         mk_mem_free(mime->header_type.data);
         mk_mem_free(mime);
     }
+
+    mk_mem_free(server->mimetype_table);
+    server->mimetype_table = NULL;
+    server->mimetype_table_size = 0;
+    server->mimetype_count = 0;
 }
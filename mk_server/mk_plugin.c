@@ -244,6 +244,17 @@ void mk_plugin_unregister(struct mk_plugin *p)
 
 }
 
+static void *mk_plugin_request_alloc(struct mk_http_request *sr, size_t size)
+{
+    return mk_http_request_alloc(sr, size);
+}
+
+static char *mk_plugin_request_strdup(struct mk_http_request *sr,
+                                      const char *str, size_t len)
+{
+    return mk_http_request_strdup(sr, str, len);
+}
+
 void mk_plugin_api_init(struct mk_server *server)
 {
     /* Create an instance of the API */
@@ -271,6 +282,9 @@ void mk_plugin_api_init(struct mk_server *server)
     api->mem_alloc_z = mk_mem_alloc_z;
     api->mem_realloc = mk_mem_realloc;
     api->mem_free = mk_mem_free;
+    api->request_alloc = mk_plugin_request_alloc;
+    api->request_strdup = mk_plugin_request_strdup;
+    api->request_printf = mk_http_request_printf;
 
     /* String Callbacks */
     api->str_build = mk_string_build;
@@ -647,6 +661,19 @@ int mk_plugin_http_request_end(struct mk_plugin *plugin,
             return -1;
         }
     }
+    else if (ret > 0) {
+        /*
+         * The next pipelined request queued its response right away (e.g.
+         * a static file or a cache hit), the connection may be waiting for
+         * READ events only while the plugin was running.
+         */
+        sr = mk_list_entry_first(&cs->request_list,
+                                 struct mk_http_request, _head);
+        if (mk_list_is_empty(&sr->stream.inputs) != 0) {
+            mk_event_add(mk_sched_loop(), cs->conn->event.fd,
+                         MK_EVENT_CONNECTION, MK_EVENT_WRITE, cs->conn);
+        }
+    }
 
     return ret;
 }
@@ -668,12 +695,12 @@ void mk_plugin_event_bad_return(const char *hook, int ret)
 
 int mk_plugin_time_now_unix()
 {
-    return log_current_utime;
+    return mk_clock_now();
 }
 
 mk_ptr_t *mk_plugin_time_now_human()
 {
-    return &log_current_time;
+    return mk_clock_log_time();
 }
 
 int mk_plugin_sched_remove_client(int socket, struct mk_server *server)
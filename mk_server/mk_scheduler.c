@@ -34,10 +34,15 @@
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
 #include <monkey/mk_http_thread.h>
+#include <monkey/mk_affinity.h>
 
 #include <signal.h>
 #include <sys/syscall.h>
 
+#ifdef MK_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 extern struct mk_sched_handler mk_http_handler;
 extern struct mk_sched_handler mk_http2_handler;
 
@@ -49,35 +54,92 @@ static int pth_init;
 static pthread_cond_t  pth_cond;
 static pthread_mutex_t pth_mutex;
 
+/* Active connections of a worker, including the ones still queued to it */
+static inline unsigned long long _worker_load(struct mk_sched_worker *worker)
+{
+    unsigned long long accepted;
+    unsigned long long closed;
+    uint64_t queued;
+
+    accepted = __atomic_load_n(&worker->accepted_connections, __ATOMIC_RELAXED);
+    closed   = __atomic_load_n(&worker->closed_connections, __ATOMIC_RELAXED);
+    queued   = __atomic_load_n(&worker->handoff.enqueue_pos, __ATOMIC_RELAXED) -
+               __atomic_load_n(&worker->handoff.dequeue_pos, __ATOMIC_RELAXED);
+
+    return (accepted - closed) + queued;
+}
+
+/* xorshift32, one state per producer thread */
+static inline unsigned int _next_random()
+{
+    static __thread unsigned int state = 0;
+
+    if (mk_unlikely(state == 0)) {
+        state = (unsigned int) time(NULL) ^ (unsigned int) pthread_self() ^
+                0x9e3779b9;
+        if (state == 0) {
+            state = 1;
+        }
+    }
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
 /*
- * Returns the worker id which should take a new incomming connection,
- * it returns the worker id with less active connections. Just used
- * if config->scheduler_mode is MK_SCHEDULER_FAIR_BALANCING.
+ * Returns the worker id which should take a new incomming connection. Just
+ * used if config->scheduler_mode is MK_SCHEDULER_FAIR_BALANCING.
+ *
+ * Two workers are picked at random and the one with less active
+ * connections wins (power of two choices), the cost per connection does
+ * not depend on the number of workers. Only when the chosen worker looks
+ * full all the workers are checked to confirm the server is over capacity.
  */
 static inline int _next_target(struct mk_server *server)
 {
     int i;
-    int target = 0;
-    unsigned long long tmp = 0, cur = 0;
+    int a;
+    int b;
+    int target;
+    unsigned long long cur;
+    unsigned long long tmp;
     struct mk_sched_ctx *ctx = server->sched_ctx;
-    struct mk_sched_worker *worker;
 
-    cur = (ctx->workers[0].accepted_connections -
-           ctx->workers[0].closed_connections);
-    if (cur == 0) {
-        return 0;
+    if (server->workers == 1) {
+        target = 0;
+        cur = _worker_load(&ctx->workers[0]);
+    }
+    else {
+        a = _next_random() % server->workers;
+        b = _next_random() % (server->workers - 1);
+        if (b >= a) {
+            b++;
+        }
+
+        cur = _worker_load(&ctx->workers[a]);
+        tmp = _worker_load(&ctx->workers[b]);
+        if (tmp < cur) {
+            target = b;
+            cur = tmp;
+        }
+        else {
+            target = a;
+        }
     }
 
-    /* Finds the lowest load worker */
-    for (i = 1; i < server->workers; i++) {
-        worker = &ctx->workers[i];
-        tmp = worker->accepted_connections - worker->closed_connections;
+    if (mk_likely(cur < server->server_capacity)) {
+        return target;
+    }
+
+    /* Slow path: find the lowest load worker */
+    for (i = 0; i < server->workers; i++) {
+        tmp = _worker_load(&ctx->workers[i]);
         if (tmp < cur) {
             target = i;
             cur = tmp;
-
-            if (cur == 0)
-                break;
         }
     }
 
@@ -108,6 +170,517 @@ struct mk_sched_worker *mk_sched_next_target(struct mk_server *server)
     return NULL;
 }
 
+/*
+ * Fair Balancing handoff
+ * ----------------------
+ * The acceptor thread (producer) pushes accepted sockets to the queue of
+ * the target worker and wakes it up once per batch, the worker (consumer)
+ * registers them on its own event loop. The queue is a bounded ring where
+ * every slot carries a sequence number telling if it's free or ready.
+ */
+static int mk_sched_handoff_init(struct mk_sched_worker *sched)
+{
+    int ret;
+    uint64_t i;
+    struct mk_sched_handoff *h = &sched->handoff;
+
+    h->slots = mk_mem_alloc(sizeof(struct mk_sched_handoff_slot) *
+                            MK_SCHED_HANDOFF_SIZE);
+    if (!h->slots) {
+        return -1;
+    }
+
+    for (i = 0; i < MK_SCHED_HANDOFF_SIZE; i++) {
+        h->slots[i].seq = i;
+    }
+    h->enqueue_pos = 0;
+    h->dequeue_pos = 0;
+    h->signaled = MK_FALSE;
+
+#ifdef MK_HAVE_EVENTFD
+    h->fd_r = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (h->fd_r == -1) {
+        mk_libc_error("eventfd");
+        mk_mem_free(h->slots);
+        return -1;
+    }
+    h->fd_w = h->fd_r;
+
+    MK_EVENT_NEW(&h->event);
+    ret = mk_event_add(sched->loop, h->fd_r,
+                       MK_EVENT_NOTIFICATION, MK_EVENT_READ, &h->event);
+#else
+    ret = mk_event_channel_create(sched->loop, &h->fd_r, &h->fd_w, &h->event);
+#endif
+    if (ret != 0) {
+        mk_mem_free(h->slots);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void mk_sched_handoff_exit(struct mk_sched_worker *sched,
+                                  struct mk_server *server)
+{
+    int fd;
+    struct mk_server_listen *listener;
+    struct mk_sched_handoff *h = &sched->handoff;
+
+    if (!h->slots) {
+        return;
+    }
+
+    /* Connections never registered */
+    while (mk_sched_handoff_pop(sched, &fd, &listener) == 0) {
+        listener->network->network->close(fd);
+    }
+
+    close(h->fd_r);
+    if (h->fd_w != h->fd_r) {
+        close(h->fd_w);
+    }
+    mk_mem_free(h->slots);
+    h->slots = NULL;
+    (void) server;
+}
+
+/* Queue an accepted socket, returns -1 if the worker queue is full */
+int mk_sched_handoff_push(struct mk_sched_worker *sched, int fd,
+                          struct mk_server_listen *listener)
+{
+    int64_t diff;
+    uint64_t pos;
+    uint64_t seq;
+    struct mk_sched_handoff_slot *slot;
+    struct mk_sched_handoff *h = &sched->handoff;
+
+    pos = __atomic_load_n(&h->enqueue_pos, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &h->slots[pos & (MK_SCHED_HANDOFF_SIZE - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t) seq - (int64_t) pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&h->enqueue_pos, &pos, pos + 1,
+                                            MK_TRUE, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&h->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->fd = fd;
+    slot->listener = listener;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Wake up the worker, only if it was not already notified */
+void mk_sched_handoff_signal(struct mk_sched_worker *sched)
+{
+    int ret;
+    uint64_t val = 1;
+    struct mk_sched_handoff *h = &sched->handoff;
+
+    if (__atomic_exchange_n(&h->signaled, MK_TRUE, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    ret = write(h->fd_w, &val, sizeof(val));
+    if (ret == -1) {
+        mk_libc_error("write");
+    }
+}
+
+/*
+ * The worker got the notification: new pushes must signal again. Called
+ * before draining the queue, so nothing pushed meanwhile is missed.
+ */
+void mk_sched_handoff_ack(struct mk_sched_worker *sched)
+{
+    __atomic_store_n(&sched->handoff.signaled, MK_FALSE, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Consumer side, returns -1 when the queue is empty */
+int mk_sched_handoff_pop(struct mk_sched_worker *sched, int *fd,
+                         struct mk_server_listen **listener)
+{
+    uint64_t pos;
+    uint64_t seq;
+    struct mk_sched_handoff_slot *slot;
+    struct mk_sched_handoff *h = &sched->handoff;
+
+    pos = h->dequeue_pos;
+    slot = &h->slots[pos & (MK_SCHED_HANDOFF_SIZE - 1)];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq != pos + 1) {
+        return -1;
+    }
+
+    *fd = slot->fd;
+    *listener = slot->listener;
+    __atomic_store_n(&slot->seq, pos + MK_SCHED_HANDOFF_SIZE,
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&h->dequeue_pos, pos + 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/*
+ * Worker calls
+ * ------------
+ * Library handlers running on the thread pool hand their API calls to the
+ * worker owning the connection. The producers push to a lock-free stack,
+ * the worker takes the whole stack at once and runs it in order. When the
+ * worker exits the stack is closed: pending calls are canceled and new
+ * pushes fail.
+ */
+#define MK_SCHED_CALLS_CLOSED  ((struct mk_sched_call *) 1)
+
+static int mk_sched_calls_init(struct mk_sched_worker *sched)
+{
+    int ret;
+    struct mk_sched_calls *c = &sched->calls;
+
+    c->head = NULL;
+
+#ifdef MK_HAVE_EVENTFD
+    c->fd_r = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (c->fd_r == -1) {
+        mk_libc_error("eventfd");
+        return -1;
+    }
+    c->fd_w = c->fd_r;
+
+    MK_EVENT_NEW(&c->event);
+    ret = mk_event_add(sched->loop, c->fd_r,
+                       MK_EVENT_NOTIFICATION, MK_EVENT_READ, &c->event);
+#else
+    ret = mk_event_channel_create(sched->loop, &c->fd_r, &c->fd_w, &c->event);
+#endif
+
+    return ret;
+}
+
+static void mk_sched_calls_exit(struct mk_sched_worker *sched,
+                                struct mk_server *server)
+{
+    struct mk_sched_call *call;
+    struct mk_sched_call *next;
+    struct mk_sched_calls *c = &sched->calls;
+
+    if (server->lib_mode == MK_FALSE) {
+        return;
+    }
+
+    call = __atomic_exchange_n(&c->head, MK_SCHED_CALLS_CLOSED,
+                               __ATOMIC_ACQUIRE);
+    while (call) {
+        next = call->next;
+        if (call->cb_cancel) {
+            call->cb_cancel(call);
+        }
+        call = next;
+    }
+
+    close(c->fd_r);
+    if (c->fd_w != c->fd_r) {
+        close(c->fd_w);
+    }
+}
+
+/*
+ * Queue a call to run on the worker event loop, returns -1 if the worker
+ * is gone: the call will never run.
+ */
+int mk_sched_call_push(struct mk_sched_worker *sched,
+                       struct mk_sched_call *call)
+{
+    int ret;
+    uint64_t val = 1;
+    struct mk_sched_call *head;
+    struct mk_sched_calls *c = &sched->calls;
+
+    head = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+    do {
+        if (head == MK_SCHED_CALLS_CLOSED) {
+            return -1;
+        }
+        call->next = head;
+    } while (!__atomic_compare_exchange_n(&c->head, &head, call, MK_TRUE,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+
+    /* The worker drains the whole stack, only wake it if it was empty */
+    if (head) {
+        return 0;
+    }
+
+    ret = write(c->fd_w, &val, sizeof(val));
+    if (ret == -1) {
+        mk_libc_error("write");
+    }
+
+    return 0;
+}
+
+/* Worker side: run the calls pushed so far, oldest first */
+void mk_sched_calls_run(struct mk_sched_worker *sched)
+{
+    struct mk_sched_call *call;
+    struct mk_sched_call *next;
+    struct mk_sched_call *list = NULL;
+
+    call = __atomic_exchange_n(&sched->calls.head, NULL, __ATOMIC_ACQUIRE);
+    while (call) {
+        next = call->next;
+        call->next = list;
+        list = call;
+        call = next;
+    }
+
+    while (list) {
+        next = list->next;
+        list->cb(list);
+        list = next;
+    }
+}
+
+/*
+ * Connection object pools
+ * -----------------------
+ * Every worker keeps the memory of its closed connections in a free list
+ * per object size and reuses it for the next ones, objects never move
+ * between threads. The lists are trimmed when the worker gets idle.
+ */
+static struct mk_sched_conn_pool *mk_sched_conn_pool_lookup(
+                                             struct mk_sched_worker *sched,
+                                             size_t size)
+{
+    int i;
+    struct mk_sched_conn_pool *pool;
+
+    for (i = 0; i < MK_SCHED_CONN_POOLS; i++) {
+        pool = &sched->conn_pools[i];
+        if (pool->size == size) {
+            return pool;
+        }
+        if (pool->size == 0) {
+            pool->size = size;
+            mk_list_init(&pool->free_list);
+            return pool;
+        }
+    }
+
+    return NULL;
+}
+
+/* Get a zeroed connection object of 'size' bytes */
+static struct mk_sched_conn *mk_sched_conn_pool_get(struct mk_sched_worker *sched,
+                                                    size_t size)
+{
+    struct mk_sched_conn *conn;
+    struct mk_sched_conn_pool *pool;
+
+    pool = mk_sched_conn_pool_lookup(sched, size);
+    if (mk_unlikely(!pool)) {
+        return mk_mem_alloc_z(size);
+    }
+
+    if (pool->free > 0) {
+        conn = mk_list_entry_last(&pool->free_list, struct mk_sched_conn,
+                                  event._head);
+        mk_list_del(&conn->event._head);
+        pool->free--;
+        memset(conn, '\0', size);
+    }
+    else {
+        conn = mk_mem_alloc_z(size);
+        if (!conn) {
+            return NULL;
+        }
+    }
+
+    conn->pool = pool;
+    pool->live++;
+
+    return conn;
+}
+
+/* Release a closed connection object, called after each loop round */
+void mk_sched_conn_pool_put(struct mk_sched_worker *sched,
+                            struct mk_sched_conn *conn)
+{
+    struct mk_sched_conn_pool *pool = conn->pool;
+    (void) sched;
+
+    if (!pool) {
+        mk_mem_free(conn);
+        return;
+    }
+
+    pool->live--;
+    pool->free++;
+    mk_list_add(&conn->event._head, &pool->free_list);
+}
+
+/* Preallocate 'n' objects for the connections of a protocol handler */
+static void mk_sched_conn_pool_warm(struct mk_sched_worker *sched,
+                                    struct mk_sched_handler *handler, int n)
+{
+    int i;
+    size_t size;
+    struct mk_sched_conn *conn;
+    struct mk_sched_conn_pool *pool;
+
+    size = sizeof(struct mk_sched_conn) + handler->sched_extra_size;
+    pool = mk_sched_conn_pool_lookup(sched, size);
+    if (!pool) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        conn = mk_mem_alloc_z(size);
+        if (!conn) {
+            break;
+        }
+        mk_list_add(&conn->event._head, &pool->free_list);
+        pool->free++;
+    }
+}
+
+/*
+ * Give memory back under low load: a pool keeps at most as many free
+ * objects as connections in use, or ConnectionPool if that's higher.
+ */
+void mk_sched_conn_pool_trim(struct mk_sched_worker *sched,
+                             struct mk_server *server)
+{
+    int i;
+    unsigned int keep;
+    struct mk_sched_conn *conn;
+    struct mk_sched_conn_pool *pool;
+
+    for (i = 0; i < MK_SCHED_CONN_POOLS; i++) {
+        pool = &sched->conn_pools[i];
+        if (pool->size == 0) {
+            break;
+        }
+
+        keep = pool->live;
+        if (keep < (unsigned int) server->conn_pool_size) {
+            keep = server->conn_pool_size;
+        }
+
+        while (pool->free > keep) {
+            conn = mk_list_entry_first(&pool->free_list, struct mk_sched_conn,
+                                       event._head);
+            mk_list_del(&conn->event._head);
+            mk_mem_free(conn);
+            pool->free--;
+        }
+    }
+}
+
+static void mk_sched_conn_pool_exit(struct mk_sched_worker *sched)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_sched_conn *conn;
+    struct mk_sched_conn_pool *pool;
+
+    for (i = 0; i < MK_SCHED_CONN_POOLS; i++) {
+        pool = &sched->conn_pools[i];
+        if (pool->size == 0) {
+            break;
+        }
+
+        mk_list_foreach_safe(head, tmp, &pool->free_list) {
+            conn = mk_list_entry(head, struct mk_sched_conn, event._head);
+            mk_list_del(&conn->event._head);
+            mk_mem_free(conn);
+        }
+        pool->free = 0;
+    }
+}
+
+/*
+ * Read buffers
+ * ------------
+ * A free buffer stores its list node in its own memory. Every buffer has
+ * one extra byte so readers can always NULL terminate the data.
+ */
+static void mk_sched_buf_pool_init(struct mk_sched_worker *sched,
+                                   struct mk_server *server)
+{
+    struct mk_sched_buf_pool *pool = &sched->read_buffers;
+
+    pool->size = server->read_buf_size;
+    pool->keep = server->read_buf_pool;
+    pool->live = 0;
+    pool->free = 0;
+    mk_list_init(&pool->free_list);
+}
+
+char *mk_sched_buf_get(struct mk_sched_worker *sched)
+{
+    struct mk_list *head;
+    struct mk_sched_buf_pool *pool = &sched->read_buffers;
+
+    if (pool->free > 0) {
+        head = pool->free_list.next;
+        mk_list_del(head);
+        pool->free--;
+    }
+    else {
+        head = mk_mem_alloc(pool->size + 1);
+        if (!head) {
+            return NULL;
+        }
+    }
+
+    pool->live++;
+    return (char *) head;
+}
+
+void mk_sched_buf_put(struct mk_sched_worker *sched, char *buf)
+{
+    struct mk_list *head = (struct mk_list *) buf;
+    struct mk_sched_buf_pool *pool = &sched->read_buffers;
+
+    pool->live--;
+    if (pool->free >= pool->keep) {
+        mk_mem_free(buf);
+        return;
+    }
+
+    mk_list_add(head, &pool->free_list);
+    pool->free++;
+}
+
+static void mk_sched_buf_pool_exit(struct mk_sched_worker *sched)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_sched_buf_pool *pool = &sched->read_buffers;
+
+    mk_list_foreach_safe(head, tmp, &pool->free_list) {
+        mk_list_del(head);
+        mk_mem_free(head);
+    }
+    pool->free = 0;
+}
+
 /*
  * This function is invoked when the core triggers a MK_SCHED_SIGNAL_FREE_ALL
  * event through the signal channels, it means the server will stop working
@@ -146,6 +719,12 @@ void mk_sched_worker_free(struct mk_server *server)
     mk_bug(!worker);
 
     /* FIXME!: there is nothing done here with the worker context */
+    mk_sched_handoff_exit(worker, server);
+    mk_sched_calls_exit(worker, server);
+    mk_sched_event_free_all(worker);
+    mk_sched_conn_pool_exit(worker);
+    mk_sched_buf_pool_exit(worker);
+    mk_http_thread_pool_exit(worker);
 
     /* Free master array (av queue & busy queue) */
     mk_mem_free(MK_TLS_GET(mk_tls_sched_cs));
@@ -195,16 +774,8 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     }
 
     handler = listener->protocol;
-    if (handler->sched_extra_size > 0) {
-        void *data;
-        size = (sizeof(struct mk_sched_conn) + handler->sched_extra_size);
-        data = mk_mem_alloc_z(size);
-        conn = (struct mk_sched_conn *) data;
-    }
-    else {
-        conn = mk_mem_alloc_z(sizeof(struct mk_sched_conn));
-    }
-
+    size = (sizeof(struct mk_sched_conn) + handler->sched_extra_size);
+    conn = mk_sched_conn_pool_get(sched, size);
     if (!conn) {
         mk_err("[server] Could not register client");
         return NULL;
@@ -215,7 +786,7 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     event->type         = MK_EVENT_CONNECTION;
     event->mask         = MK_EVENT_EMPTY;
     event->status       = MK_EVENT_NONE;
-    conn->arrive_time   = log_current_utime;
+    conn->arrive_time   = mk_clock_now();
     conn->protocol      = handler;
     conn->net           = listener->network->network;
     conn->is_timeout_on = MK_FALSE;
@@ -331,6 +902,20 @@ void *mk_sched_launch_worker_loop(void *data)
     /* Avoid SIGPIPE signals on this thread */
     mk_signal_thread_sigpipe_safe();
 
+    /* Register working thread */
+    wid = mk_sched_register_thread(server);
+    sched = &ctx->workers[wid];
+
+    /*
+     * Pin the worker before any allocation, so the memory it touches
+     * first (event loop, caches, connections) lands on its NUMA node.
+     */
+    sched->cpu = mk_affinity_worker_cpu(server, wid);
+    if (sched->cpu >= 0 && mk_affinity_set(sched->cpu) != 0) {
+        mk_warn("Could not pin worker %i to CPU %i", wid, sched->cpu);
+        sched->cpu = -1;
+    }
+
     /* Init specific thread cache */
     mk_sched_thread_lists_init();
     mk_cache_worker_init();
@@ -338,9 +923,6 @@ void *mk_sched_launch_worker_loop(void *data)
     /* Virtual hosts: initialize per thread-vhost data */
     mk_vhost_fdt_worker_init(server);
 
-    /* Register working thread */
-    wid = mk_sched_register_thread(server);
-    sched = &ctx->workers[wid];
     sched->loop = mk_event_loop_create(MK_EVENT_QUEUE_SIZE);
     if (!sched->loop) {
         mk_err("Error creating Scheduler loop");
@@ -364,9 +946,35 @@ void *mk_sched_launch_worker_loop(void *data)
         exit(EXIT_FAILURE);
     }
 
+    /* Fair Balancing: queue for the connections accepted by the master */
+    if (server->scheduler_mode == MK_SCHEDULER_FAIR_BALANCING) {
+        ret = mk_sched_handoff_init(sched);
+        if (ret != 0) {
+            mk_err("Error creating Scheduler handoff queue");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (server->lib_mode == MK_TRUE) {
+        ret = mk_sched_calls_init(sched);
+        if (ret != 0) {
+            mk_err("Error creating Scheduler calls queue");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     mk_list_init(&sched->event_free_queue);
+    mk_list_init(&sched->conn_free_queue);
+    mk_sched_buf_pool_init(sched, server);
     mk_list_init(&sched->threads);
     mk_list_init(&sched->threads_purge);
+    mk_http_thread_pool_init(sched, server);
+
+    /* Warm up the connection pool of the HTTP handler */
+    if (server->conn_pool_size > 0) {
+        mk_sched_conn_pool_warm(sched, &mk_http_handler,
+                                server->conn_pool_size);
+    }
 
     /*
      * ULONG_MAX BUG test only
@@ -392,6 +1000,21 @@ void *mk_sched_launch_worker_loop(void *data)
         if (!sched->listeners) {
             exit(EXIT_FAILURE);
         }
+
+        /* Workers start in order: the last one completes every group */
+        if (sched->idx == server->workers - 1) {
+            mk_server_reuseport_steer(server);
+        }
+    }
+
+    /*
+     * Invoke custom worker-callbacks defined by the scheduler (lib), they
+     * run before the launcher is released so the worker is fully set up
+     * (e.g: its message queue) once mk_start() returns.
+     */
+    mk_list_foreach(head, &server->sched_worker_callbacks) {
+        wcb = mk_list_entry(head, struct mk_sched_worker_cb, _head);
+        wcb->cb_func(wcb->data);
     }
 
     /* Unlock the conditional initializator */
@@ -400,12 +1023,6 @@ void *mk_sched_launch_worker_loop(void *data)
     pthread_cond_signal(&pth_cond);
     pthread_mutex_unlock(&pth_mutex);
 
-    /* Invoke custom worker-callbacks defined by the scheduler (lib) */
-    mk_list_foreach(head, &server->sched_worker_callbacks) {
-        wcb = mk_list_entry(head, struct mk_sched_worker_cb, _head);
-        wcb->cb_func(wcb->data);
-    }
-
     mk_mem_free(thinfo);
 
     /* init server thread loop */
@@ -468,8 +1085,9 @@ int mk_sched_init(struct mk_server *server)
         return -1;
     }
 
+    /* Workers are cache line aligned, see struct mk_sched_worker */
     size = (sizeof(struct mk_sched_worker) * server->workers);
-    ctx->workers = mk_mem_alloc(size);
+    ctx->workers = mk_mem_alloc_aligned(MK_SCHED_CACHELINE, size);
     if (!ctx->workers) {
         mk_libc_error("malloc");
         mk_mem_free(ctx);
@@ -528,7 +1146,8 @@ int mk_sched_remove_client(struct mk_sched_conn *conn,
     /* Invoke plugins in stage 50 */
     mk_plugin_stage_run_50(event->fd, server);
 
-    sched->closed_connections++;
+    __atomic_store_n(&sched->closed_connections,
+                     sched->closed_connections + 1, __ATOMIC_RELAXED);
 
     /* Unlink from the red-black tree */
     //rb_erase(&conn->_rb_head, &sched->rb_queue);
@@ -539,7 +1158,11 @@ int mk_sched_remove_client(struct mk_sched_conn *conn,
 
     /* Release and return */
     mk_channel_clean(&conn->channel);
-    mk_sched_event_free(&conn->event);
+    /* The object goes back to its pool once this loop round is done */
+    if ((conn->event.type & MK_EVENT_IDLE) == 0) {
+        conn->event.type |= MK_EVENT_IDLE;
+        mk_list_add(&conn->event._head, &sched->conn_free_queue);
+    }
     conn->status = MK_SCHED_CONN_CLOSED;
 
     MK_LT_SCHED(remote_fd, "DELETE_CLIENT");
@@ -564,7 +1187,7 @@ int mk_sched_drop_connection(struct mk_sched_conn *conn,
                              struct mk_sched_worker *sched,
                              struct mk_server *server)
 {
-    mk_sched_threads_destroy_all(sched);
+    mk_sched_threads_destroy_conn(sched, conn);
     return mk_sched_remove_client(conn, sched, server);
 }
 
@@ -572,10 +1195,13 @@ int mk_sched_check_timeouts(struct mk_sched_worker *sched,
                             struct mk_server *server)
 {
     int client_timeout;
+    time_t now;
     struct mk_sched_conn *conn;
     struct mk_list *head;
     struct mk_list *temp;
 
+    now = mk_clock_now();
+
     /* PENDING CONN TIMEOUT */
     mk_list_foreach_safe(head, temp, &sched->timeout_queue) {
         conn = mk_list_entry(head, struct mk_sched_conn, timeout_head);
@@ -586,7 +1212,7 @@ int mk_sched_check_timeouts(struct mk_sched_worker *sched,
         client_timeout = conn->arrive_time + server->timeout;
 
         /* Check timeout */
-        if (client_timeout <= log_current_utime) {
+        if (client_timeout <= now) {
             MK_TRACE("Scheduler, closing fd %i due TIMEOUT",
                      conn->event.fd);
             MK_LT_SCHED(conn->event.fd, "TIMEOUT_CONN_PENDING");
@@ -596,6 +1222,7 @@ int mk_sched_check_timeouts(struct mk_sched_worker *sched,
         }
     }
 
+    mk_sched_conn_pool_trim(sched, server);
     return 0;
 }
 
@@ -618,11 +1245,44 @@ static int sched_thread_cleanup(struct mk_sched_worker *sched,
 
 }
 
+/* Threads that finished their handler, their coroutines are reused */
 int mk_sched_threads_purge(struct mk_sched_worker *sched)
 {
     int c = 0;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_thread *mth;
+
+    mk_list_foreach_safe(head, tmp, &sched->threads_purge) {
+        mth = mk_list_entry(head, struct mk_http_thread, _head);
+        mk_http_thread_release(mth);
+        c++;
+    }
+
+    return c;
+}
+
+/*
+ * Threads of a connection being dropped, the handlers serving other
+ * connections may still be waiting to be resumed.
+ */
+int mk_sched_threads_destroy_conn(struct mk_sched_worker *sched,
+                                  struct mk_sched_conn *conn)
+{
+    int c = 0;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_thread *mth;
+
+    c = mk_sched_threads_purge(sched);
+    mk_list_foreach_safe(head, tmp, &sched->threads) {
+        mth = mk_list_entry(head, struct mk_http_thread, _head);
+        if (mth->session->conn == conn) {
+            mk_http_thread_destroy(mth);
+            c++;
+        }
+    }
 
-    c = sched_thread_cleanup(sched, &sched->threads_purge);
     return c;
 }
 
@@ -630,7 +1290,7 @@ int mk_sched_threads_destroy_all(struct mk_sched_worker *sched)
 {
     int c = 0;
 
-    c = sched_thread_cleanup(sched, &sched->threads_purge);
+    c = mk_sched_threads_purge(sched);
     c += sched_thread_cleanup(sched, &sched->threads);
 
     return c;
@@ -29,12 +29,17 @@
 #include <monkey/mk_core.h>
 #include <monkey/mk_fifo.h>
 #include <monkey/mk_http_thread.h>
+#include <monkey/mk_http_cache.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
+#if defined (__linux__)
+#include <linux/filter.h>
+#endif
+
 pthread_key_t mk_server_fifo_key;
 
 /* Return the number of clients that can be attended  */
@@ -67,45 +72,323 @@ unsigned int mk_server_capacity(struct mk_server *server)
     return cur;
 }
 
+/* Register an accepted socket on the event loop of the worker 'sched' */
 static inline
-struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
-                                               void *data,
-                                               struct mk_server *server)
+struct mk_sched_conn *mk_server_conn_register(struct mk_sched_worker *sched,
+                                              int client_fd,
+                                              struct mk_server_listen *listener,
+                                              struct mk_server *server)
 {
     int ret;
-    int client_fd = -1;
     struct mk_sched_conn *conn;
-    struct mk_server_listen *listener = data;
-
-    client_fd = mk_socket_accept(listener->server_fd);
-    if (mk_unlikely(client_fd == -1)) {
-        MK_TRACE("[server] Accept connection failed: %s", strerror(errno));
-        goto error;
-    }
 
     conn = mk_sched_add_connection(client_fd, listener, sched, server);
     if (mk_unlikely(!conn)) {
         goto error;
     }
 
+    __atomic_store_n(&sched->accepted_connections,
+                     sched->accepted_connections + 1, __ATOMIC_RELAXED);
+
     ret = mk_event_add(sched->loop, client_fd,
                        MK_EVENT_CONNECTION, MK_EVENT_READ, conn);
     if (mk_unlikely(ret != 0)) {
         mk_err("[server] Error registering file descriptor: %s",
                strerror(errno));
-        goto error;
+        /* Closes the socket and releases the connection object */
+        mk_sched_remove_client(conn, sched, server);
+        return NULL;
     }
 
-    sched->accepted_connections++;
     MK_TRACE("[server] New connection arrived: FD %i", client_fd);
     return conn;
 
 error:
-    if (client_fd != -1) {
-        listener->network->network->close(client_fd);
+    listener->network->network->close(client_fd);
+    return NULL;
+}
+
+static inline
+struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
+                                               void *data,
+                                               struct mk_server *server)
+{
+    int client_fd = -1;
+    struct mk_server_listen *listener = data;
+
+    client_fd = mk_socket_accept(listener->server_fd);
+    if (mk_unlikely(client_fd == -1)) {
+        MK_TRACE("[server] Accept connection failed: %s", strerror(errno));
+        return NULL;
     }
 
-    return NULL;
+    return mk_server_conn_register(sched, client_fd, listener, server);
+}
+
+/* Fair Balancing: register the connections handed by the acceptor thread */
+static void mk_server_handoff_drain(struct mk_sched_worker *sched,
+                                    struct mk_server *server)
+{
+    int client_fd;
+    struct mk_server_listen *listener;
+
+    mk_sched_handoff_ack(sched);
+    while (mk_sched_handoff_pop(sched, &client_fd, &listener) == 0) {
+        mk_server_conn_register(sched, client_fd, listener, server);
+    }
+}
+
+/*
+ * Fair Balancing: accept a batch of connections from a listener and hand
+ * them to the workers, each worker is signaled once per batch.
+ */
+static void mk_server_balancer_accept(struct mk_server_listen *listener,
+                                      struct mk_server *server)
+{
+    int i;
+    int n;
+    int ret;
+    int client_fd;
+    int n_targets = 0;
+    struct mk_sched_worker *sched;
+    struct mk_sched_worker *targets[MK_SCHED_ACCEPT_BATCH];
+
+    for (n = 0; n < MK_SCHED_ACCEPT_BATCH; n++) {
+        client_fd = mk_socket_accept(listener->server_fd);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                MK_TRACE("[server] Accept connection failed: %s",
+                         strerror(errno));
+            }
+            break;
+        }
+
+        sched = mk_sched_next_target(server);
+        if (!sched) {
+            mk_warn("[server] Over capacity.");
+            listener->network->network->close(client_fd);
+            break;
+        }
+
+        ret = mk_sched_handoff_push(sched, client_fd, listener);
+        if (ret != 0) {
+            /* The worker is not keeping up with its queue */
+            mk_warn("[server] Worker %i handoff queue is full", sched->idx);
+            listener->network->network->close(client_fd);
+            continue;
+        }
+
+        for (i = 0; i < n_targets; i++) {
+            if (targets[i] == sched) {
+                break;
+            }
+        }
+        if (i == n_targets) {
+            targets[n_targets++] = sched;
+        }
+    }
+
+    for (i = 0; i < n_targets; i++) {
+        mk_sched_handoff_signal(targets[i]);
+    }
+}
+
+#if defined (SO_ATTACH_REUSEPORT_CBPF)
+static pthread_mutex_t mutex_steer = PTHREAD_MUTEX_INITIALIZER;
+static int steer_attached = MK_FALSE;
+
+#define STEER_STMT(c, k)        (struct sock_filter) BPF_STMT(c, k)
+#define STEER_JEQ(k)            (struct sock_filter) \
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, k, 0, 1)
+#define STEER_RET(k)            STEER_STMT(BPF_RET | BPF_K, k)
+#define STEER_LD(k)             STEER_STMT(BPF_LD | BPF_W | BPF_ABS, \
+                                           SKF_AD_OFF + k)
+#define STEER_FALLBACK          0xffffffff
+
+/*
+ * Build the classic BPF program that picks the listener of a SO_REUSEPORT
+ * group. Worker N owns the Nth socket of every group (workers create their
+ * listeners in order), so returning N hands the connection to worker N:
+ *
+ *  - the CPU that received the packet selects the worker pinned there
+ *    (only if no other worker is pinned to the same CPU),
+ *  - otherwise an out of range index makes the kernel use its own hash,
+ *  - if some worker is drained the fallback spreads by the packet hash
+ *    (or the CPU) over the active workers only.
+ */
+static int mk_server_steer_build(struct mk_server *server,
+                                 struct sock_filter *code)
+{
+    int i;
+    int j;
+    int n = 0;
+    int n_active = 0;
+    int active[server->workers];
+    struct mk_sched_ctx *ctx = server->sched_ctx;
+    struct mk_sched_worker *worker;
+
+    code[n++] = STEER_LD(SKF_AD_CPU);
+    for (i = 0; i < server->workers; i++) {
+        worker = &ctx->workers[i];
+        if (worker->drained == MK_TRUE) {
+            continue;
+        }
+        active[n_active++] = i;
+
+        if (worker->cpu < 0) {
+            continue;
+        }
+
+        /* A CPU shared by several workers is left to the fallback */
+        for (j = 0; j < server->workers; j++) {
+            if (j != i && ctx->workers[j].cpu == worker->cpu &&
+                ctx->workers[j].drained == MK_FALSE) {
+                break;
+            }
+        }
+        if (j == server->workers) {
+            code[n++] = STEER_JEQ(worker->cpu);
+            code[n++] = STEER_RET(i);
+        }
+    }
+
+    if (n_active == server->workers) {
+        code[n++] = STEER_RET(STEER_FALLBACK);
+        return n;
+    }
+    if (n_active == 0) {
+        return -1;
+    }
+
+    code[n++] = STEER_LD(SKF_AD_RXHASH);
+    code[n++] = STEER_JEQ(0);
+    code[n++] = STEER_LD(SKF_AD_CPU);
+    code[n++] = STEER_STMT(BPF_ALU | BPF_MOD | BPF_K, n_active);
+    for (i = 0; i < n_active; i++) {
+        code[n++] = STEER_JEQ(i);
+        code[n++] = STEER_RET(active[i]);
+    }
+    code[n++] = STEER_RET(active[0]);
+
+    return n;
+}
+
+/*
+ * Attach the steering program to every listener group. The caller holds
+ * mutex_steer, it also guards the 'drained' flag of the workers.
+ */
+static int mk_server_steer_attach(struct mk_server *server)
+{
+    int i;
+    int n;
+    int ret = 0;
+    int steer = MK_FALSE;
+    struct mk_list *head;
+    struct mk_sched_ctx *ctx = server->sched_ctx;
+    struct mk_sched_worker *last;
+    struct mk_server_listen *listener;
+    struct sock_fprog prog;
+    struct sock_filter code[4 + server->workers * 4];
+
+    for (i = 0; i < server->workers; i++) {
+        if (ctx->workers[i].cpu >= 0 || ctx->workers[i].drained == MK_TRUE) {
+            steer = MK_TRUE;
+        }
+    }
+
+    last = &ctx->workers[server->workers - 1];
+    n = mk_server_steer_build(server, code);
+    if (n <= 0 || !last->listeners) {
+        return -1;
+    }
+
+    /* Nothing to steer and no program to replace */
+    if (steer == MK_FALSE && steer_attached == MK_FALSE) {
+        return 0;
+    }
+
+    prog.len = n;
+    prog.filter = code;
+    mk_list_foreach(head, last->listeners) {
+        listener = mk_list_entry(head, struct mk_server_listen, _head);
+        if (setsockopt(listener->server_fd, SOL_SOCKET,
+                       SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+            mk_warn("[server] Could not attach SO_REUSEPORT program, "
+                    "using the kernel hash");
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0) {
+        steer_attached = MK_TRUE;
+    }
+
+    return ret;
+}
+#endif
+
+/*
+ * REUSEPORT mode: attach the steering program to every listener group.
+ * The groups are complete once the last worker created its listeners.
+ * Without pinned or drained workers the kernel hash is left alone.
+ */
+int mk_server_reuseport_steer(struct mk_server *server)
+{
+#if defined (SO_ATTACH_REUSEPORT_CBPF)
+    int ret;
+
+    if (server->scheduler_mode != MK_SCHEDULER_REUSEPORT) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex_steer);
+    ret = mk_server_steer_attach(server);
+    pthread_mutex_unlock(&mutex_steer);
+
+    return ret;
+#else
+    (void) server;
+    return -1;
+#endif
+}
+
+/*
+ * Take a worker out of the REUSEPORT balancing (drain = MK_TRUE) or put it
+ * back. A drained worker keeps serving its connections but the kernel
+ * stops handing it new ones. If the new program can't be attached the
+ * worker keeps its previous state.
+ */
+int mk_server_reuseport_drain(struct mk_server *server, int wid, int drain)
+{
+#if defined (SO_ATTACH_REUSEPORT_CBPF)
+    int ret;
+    int prev;
+    struct mk_sched_ctx *ctx = server->sched_ctx;
+    struct mk_sched_worker *worker;
+
+    if (server->scheduler_mode != MK_SCHEDULER_REUSEPORT ||
+        wid < 0 || wid >= server->workers) {
+        return -1;
+    }
+
+    worker = &ctx->workers[wid];
+
+    pthread_mutex_lock(&mutex_steer);
+    prev = worker->drained;
+    worker->drained = drain;
+    ret = mk_server_steer_attach(server);
+    if (ret != 0) {
+        worker->drained = prev;
+    }
+    pthread_mutex_unlock(&mutex_steer);
+
+    return ret;
+#else
+    (void) server;
+    (void) wid;
+    (void) drain;
+    return -1;
+#endif
 }
 
 void mk_server_listen_free()
@@ -152,6 +435,7 @@ struct mk_list *mk_server_listen_init(struct mk_server *server)
     struct mk_list *listeners;
     struct mk_event *event;
     struct mk_server_listen *listener;
+    struct mk_sched_worker *sched;
     struct mk_sched_handler *protocol;
     struct mk_plugin *plugin;
     struct mk_config_listener *listen;
@@ -181,6 +465,14 @@ struct mk_list *mk_server_listen_init(struct mk_server *server)
 #endif
             }
 
+            /* Pinned worker: keep packets, socket and worker on one CPU */
+            if (reuse_port == MK_TRUE) {
+                sched = mk_sched_get_thread_conf();
+                if (sched && sched->cpu >= 0) {
+                    mk_socket_set_incoming_cpu(server_fd, sched->cpu);
+                }
+            }
+
             listener = mk_mem_alloc(sizeof(struct mk_server_listen));
 
             /* configure the internal event_state */
@@ -275,7 +567,7 @@ static int mk_server_fifo_worker_setup(struct mk_event_loop *evl)
         return -1;
     }
 
-    ret = mk_event_add(evl, fw->channel[0],
+    ret = mk_event_add(evl, fw->fd_r,
                        MK_EVENT_FIFO, MK_EVENT_READ,
                        fw);
     if (ret != 0) {
@@ -301,7 +593,6 @@ void mk_server_loop_balancer(struct mk_server *server)
     struct mk_server_listen *listener;
     struct mk_event *event;
     struct mk_event_loop *evl;
-    struct mk_sched_worker *sched;
 
     /* Init the listeners */
     listeners = mk_server_listen_init(server);
@@ -317,9 +608,13 @@ void mk_server_loop_balancer(struct mk_server *server)
         exit(EXIT_FAILURE);
     }
 
-    /* Register the listeners */
+    /*
+     * Register the listeners, they are non-blocking so a batch of
+     * connections can be accepted on every event.
+     */
     mk_list_foreach(head, listeners) {
         listener = mk_list_entry(head, struct mk_server_listen, _head);
+        mk_socket_set_nonblocking(listener->server_fd);
         mk_event_add(evl, listener->server_fd,
                      MK_EVENT_LISTENER, MK_EVENT_READ,
                      listener);
@@ -330,28 +625,23 @@ void mk_server_loop_balancer(struct mk_server *server)
         mk_event_foreach(event, evl) {
             if (event->mask & MK_EVENT_READ) {
                 /*
-                 * Accept connection: determinate which thread may work on this
-                 * new connection.
+                 * Accept connections and let the less loaded workers take
+                 * them through their handoff queues.
                  */
-                sched = mk_sched_next_target(server);
-                if (sched != NULL) {
-                    mk_server_listen_handler(sched, event, server);
+                mk_server_balancer_accept((struct mk_server_listen *) event,
+                                          server);
 #ifdef MK_HAVE_TRACE
-                    int i;
-                    struct mk_sched_ctx *ctx = server->sched_ctx;
-
-                    for (i = 0; i < server->workers; i++) {
-                        MK_TRACE("Worker Status");
-                        MK_TRACE(" WID %i / conx = %llu",
-                                 ctx->workers[i].idx,
-                                 ctx->workers[i].accepted_connections -
-                                 ctx->workers[i].closed_connections);
-                    }
-#endif
-                }
-                else {
-                    mk_warn("[server] Over capacity.");
+                int i;
+                struct mk_sched_ctx *ctx = server->sched_ctx;
+
+                for (i = 0; i < server->workers; i++) {
+                    MK_TRACE("Worker Status");
+                    MK_TRACE(" WID %i / conx = %llu",
+                             ctx->workers[i].idx,
+                             ctx->workers[i].accepted_connections -
+                             ctx->workers[i].closed_connections);
                 }
+#endif
             }
             else if (event->mask & MK_EVENT_CLOSE) {
                 mk_err("[server] Error on socket %d: %s",
@@ -511,6 +801,15 @@ void mk_server_worker_loop(struct mk_server *server)
                         mk_sched_worker_free(server);
                         return;
                     }
+                    else if (val == MK_SCHED_SIGNAL_HTTP_CACHE) {
+                        mk_http_cache_worker_wake(sched, server);
+                    }
+                }
+                else if (event == &sched->handoff.event) {
+                    mk_server_handoff_drain(sched, server);
+                }
+                else if (event == &sched->calls.event) {
+                    mk_sched_calls_run(sched);
                 }
                 else if (event->fd == timeout_fd) {
                     mk_sched_check_timeouts(sched, server);
@@ -106,6 +106,21 @@ int mk_socket_set_tcp_reuseport(int sockfd)
     return setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 }
 
+/*
+ * Hint the kernel to pick this (SO_REUSEPORT) listener for the connections
+ * whose packets are processed on 'cpu'.
+ */
+int mk_socket_set_incoming_cpu(int sockfd, int cpu)
+{
+#if defined (SO_INCOMING_CPU)
+    return setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+#else
+    (void) sockfd;
+    (void) cpu;
+    return -1;
+#endif
+}
+
 int mk_socket_create(int domain, int type, int protocol)
 {
     int fd;
@@ -30,6 +30,8 @@ struct mk_channel *mk_channel_new(int type, int fd)
     channel->type   = type;
     channel->fd     = fd;
     channel->status = MK_CHANNEL_OK;
+    channel->cb_written = NULL;
+    channel->written_data = NULL;
     mk_list_init(&channel->streams);
 
     return channel;
@@ -55,6 +57,61 @@ static inline size_t channel_write_in_file(struct mk_channel *channel,
     return bytes;
 }
 
+/* Pass to the channel tap the bytes just written from an input */
+static void channel_tap(struct mk_channel *channel,
+                        struct mk_stream_input *in, size_t bytes)
+{
+    int i;
+    int ret = 0;
+    off_t offset;
+    size_t len;
+    ssize_t n;
+    char tmp[4096];
+    struct mk_iov *iov;
+
+    if (in->type == MK_STREAM_RAW) {
+        ret = channel->cb_written(channel, in->buffer, bytes);
+    }
+    else if (in->type == MK_STREAM_IOV) {
+        /* Entries still hold the data, mk_iov_consume() runs after us */
+        iov = in->buffer;
+        for (i = 0; i < iov->iov_idx && bytes > 0 && ret == 0; i++) {
+            len = iov->io[i].iov_len;
+            if (len == 0) {
+                continue;
+            }
+            if (len > bytes) {
+                len = bytes;
+            }
+            ret = channel->cb_written(channel, iov->io[i].iov_base, len);
+            bytes -= len;
+        }
+    }
+    else if (in->type == MK_STREAM_FILE) {
+        /* sendfile(2) already moved the offset past the data sent */
+        offset = in->bytes_offset - bytes;
+        while (bytes > 0 && ret == 0) {
+            len = bytes < sizeof(tmp) ? bytes : sizeof(tmp);
+            n = pread(in->fd, tmp, len, offset);
+            if (n <= 0) {
+                ret = -1;
+                break;
+            }
+            ret = channel->cb_written(channel, tmp, n);
+            offset += n;
+            bytes -= n;
+        }
+    }
+    else {
+        ret = -1;
+    }
+
+    if (ret == -1) {
+        channel->cb_written(channel, NULL, 0);
+        channel->cb_written = NULL;
+    }
+}
+
 size_t mk_stream_size(struct mk_stream *stream)
 {
     return (stream->bytes_total - stream->bytes_offset);
@@ -109,12 +166,15 @@ int mk_channel_flush(struct mk_channel *channel)
 
 int mk_stream_in_release(struct mk_stream_input *in)
 {
+    int dynamic = in->dynamic;
+
+    /* Unlink first, the owner may release the input from the callback */
+    mk_stream_input_unlink(in);
     if (in->cb_finished) {
         in->cb_finished(in);
     }
 
-    mk_stream_input_unlink(in);
-    if (in->dynamic == MK_TRUE) {
+    if (dynamic == MK_TRUE) {
         mk_mem_free(in);
     }
 
@@ -142,6 +202,9 @@ int mk_channel_stream_write(struct mk_stream *stream, size_t *count)
         input = mk_list_entry(head, struct mk_stream_input, _head);
         if (input->type == MK_STREAM_FILE) {
             bytes = channel_write_in_file(channel, input);
+            if (bytes > 0 && channel->cb_written) {
+                channel_tap(channel, input, bytes);
+            }
         }
         else if (input->type == MK_STREAM_IOV) {
             iov = input->buffer;
@@ -154,6 +217,10 @@ int mk_channel_stream_write(struct mk_stream *stream, size_t *count)
             MK_TRACE("[CH %i] STREAM_IOV, wrote %d bytes",
                      channel->fd, bytes);
             if (bytes > 0) {
+                if (channel->cb_written) {
+                    channel_tap(channel, input, bytes);
+                }
+
                 /* Perform the adjustment on mk_iov */
                 mk_iov_consume(iov, bytes);
             }
@@ -163,6 +230,9 @@ int mk_channel_stream_write(struct mk_stream *stream, size_t *count)
                                         input->buffer, input->bytes_total);
             MK_TRACE("[CH %i] STREAM_RAW, bytes=%lu/%lu\n",
                      channel->fd, bytes, input->bytes_total);
+            if (bytes > 0 && channel->cb_written) {
+                channel_tap(channel, input, bytes);
+            }
         }
 
         if (bytes > 0) {
@@ -226,6 +296,9 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
     if (channel->type == MK_CHANNEL_SOCKET) {
         if (input->type == MK_STREAM_FILE) {
             bytes = channel_write_in_file(channel, input);
+            if (bytes > 0 && channel->cb_written) {
+                channel_tap(channel, input, bytes);
+            }
         }
         else if (input->type == MK_STREAM_IOV) {
             iov   = input->buffer;
@@ -238,6 +311,10 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
             MK_TRACE("[CH %i] STREAM_IOV, wrote %d bytes",
                      channel->fd, bytes);
             if (bytes > 0) {
+                if (channel->cb_written) {
+                    channel_tap(channel, input, bytes);
+                }
+
                 /* Perform the adjustment on mk_iov */
                 mk_iov_consume(iov, bytes);
             }
@@ -249,6 +326,9 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
                      channel->fd, bytes, input->bytes_total);
             if (bytes > 0) {
                 /* DEPRECATED: consume_raw(input, bytes); */
+                if (channel->cb_written) {
+                    channel_tap(channel, input, bytes);
+                }
             }
         }
 
@@ -66,24 +66,29 @@ int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr,
     }
 
     if (sr->uri_processed.len > (unsigned int) (offset+limit)) {
-        user_uri = mk_mem_alloc(sr->uri_processed.len);
+        user_uri = mk_http_request_strdup(sr,
+                                          sr->uri_processed.data +
+                                          (offset + limit),
+                                          sr->uri_processed.len -
+                                          offset - limit);
         if (!user_uri) {
             return -1;
         }
 
-        memcpy(user_uri,
-               sr->uri_processed.data + (offset + limit),
-               sr->uri_processed.len - offset - limit);
-        user_uri[sr->uri_processed.len - offset - limit] = '\0';
-
-        mk_string_build(&sr->real_path.data, &sr->real_path.len,
-                        "%s/%s%s",
-                        s_user->pw_dir, server->conf_user_pub, user_uri);
-        mk_mem_free(user_uri);
+        sr->real_path.data = mk_http_request_printf(sr, &sr->real_path.len,
+                                                    "%s/%s%s",
+                                                    s_user->pw_dir,
+                                                    server->conf_user_pub,
+                                                    user_uri);
     }
     else {
-        mk_string_build(&sr->real_path.data, &sr->real_path.len,
-                        "%s/%s", s_user->pw_dir, server->conf_user_pub);
+        sr->real_path.data = mk_http_request_printf(sr, &sr->real_path.len,
+                                                    "%s/%s", s_user->pw_dir,
+                                                    server->conf_user_pub);
+    }
+
+    if (!sr->real_path.data) {
+        return -1;
     }
 
     sr->user_home = MK_TRUE;
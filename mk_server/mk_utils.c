@@ -43,8 +43,6 @@
 #include <execinfo.h>
 #endif
 
-#define MK_UTILS_GMT_DATEFORMAT "%a, %d %b %Y %H:%M:%S GMT"
-
 /* Date helpers */
 static const char mk_date_wd[][6]  = {"Sun, ", "Mon, ", "Tue, ", "Wed, ", "Thu, ", "Fri, ", "Sat, "};
 static const char mk_date_ym[][5] = {"Jan ", "Feb ", "Mar ", "Apr ", "May ", "Jun ", "Jul ",
@@ -178,19 +176,153 @@ int mk_utils_utime2gmt(char **data, time_t date)
     return size;
 }
 
-time_t mk_utils_gmt2utime(char *date)
+/* Up to four digits, -1 if any of them is not a digit */
+static inline int mk_utils_date_digits(const char *s, int n)
+{
+    int i;
+    int val = 0;
+
+    for (i = 0; i < n; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return -1;
+        }
+        val = (val * 10) + (s[i] - '0');
+    }
+
+    return val;
+}
+
+static inline int mk_utils_date_month(const char *s)
+{
+    int i;
+
+    for (i = 0; i < 12; i++) {
+        if (s[0] == mk_date_ym[i][0] && s[1] == mk_date_ym[i][1] &&
+            s[2] == mk_date_ym[i][2]) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* 'HH:MM:SS' to seconds of the day */
+static inline int mk_utils_date_clock(const char *s)
 {
-    time_t new_unix_time;
-    struct tm t_data;
-    memset(&t_data, 0, sizeof(struct tm));
+    int hour;
+    int min;
+    int sec;
 
-    if (!strptime(date, MK_UTILS_GMT_DATEFORMAT, (struct tm *) &t_data)) {
+    if (s[2] != ':' || s[5] != ':') {
         return -1;
     }
 
-    new_unix_time = timegm((struct tm *) &t_data);
+    hour = mk_utils_date_digits(s, 2);
+    min = mk_utils_date_digits(s + 3, 2);
+    sec = mk_utils_date_digits(s + 6, 2);
+    if (hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60) {
+        return -1;
+    }
 
-    return (new_unix_time);
+    return (hour * 3600) + (min * 60) + sec;
+}
+
+/* Days from the epoch to a civil date, month goes from 0 to 11 */
+static inline long mk_utils_date_days(int year, int mon, int mday)
+{
+    long era;
+    long yoe;
+    long doy;
+
+    /* Years start in March so the leap day is the last one */
+    if (mon < 2) {
+        year--;
+        mon += 10;
+    }
+    else {
+        mon -= 2;
+    }
+
+    era = year / 400;
+    yoe = year - (era * 400);
+    doy = ((153 * mon) + 2) / 5 + mday - 1;
+
+    return (era * 146097) + (yoe * 365) + (yoe / 4) - (yoe / 100) + doy - 719468;
+}
+
+/*
+ * Parse an HTTP-date (RFC 7231 section 7.1.1.1) into Unix time. The
+ * preferred IMF-fixdate is checked first at fixed offsets, the obsolete
+ * RFC 850 and asctime() formats are still accepted. It returns -1 if
+ * the value is not a valid date, what follows a valid date is ignored.
+ */
+time_t mk_utils_http_date(const char *date, int len)
+{
+    int i;
+    int year;
+    int mon;
+    int mday;
+    int clock;
+    const char *s = date;
+
+    if (len >= 29 && s[3] == ',' && s[4] == ' ') {
+        /* IMF-fixdate: Sun, 06 Nov 1994 08:49:37 GMT */
+        if (s[7] != ' ' || s[11] != ' ' || s[16] != ' ' ||
+            memcmp(s + 25, " GMT", 4) != 0) {
+            return -1;
+        }
+        mday = mk_utils_date_digits(s + 5, 2);
+        mon = mk_utils_date_month(s + 8);
+        year = mk_utils_date_digits(s + 12, 4);
+        clock = mk_utils_date_clock(s + 17);
+    }
+    else if (len >= 24 && s[3] == ' ') {
+        /* asctime(): Sun Nov  6 08:49:37 1994 */
+        if (s[7] != ' ' || s[10] != ' ' || s[19] != ' ') {
+            return -1;
+        }
+        mon = mk_utils_date_month(s + 4);
+        if (s[8] == ' ') {
+            mday = mk_utils_date_digits(s + 9, 1);
+        }
+        else {
+            mday = mk_utils_date_digits(s + 8, 2);
+        }
+        clock = mk_utils_date_clock(s + 11);
+        year = mk_utils_date_digits(s + 20, 4);
+    }
+    else {
+        /* RFC 850: Sunday, 06-Nov-94 08:49:37 GMT */
+        for (i = 6; i < 10 && i < len && s[i] != ','; i++);
+        if (i == 10 || len - i < 24) {
+            return -1;
+        }
+        s += i + 1;
+        if (s[0] != ' ' || s[3] != '-' || s[7] != '-' || s[10] != ' ' ||
+            memcmp(s + 19, " GMT", 4) != 0) {
+            return -1;
+        }
+        mday = mk_utils_date_digits(s + 1, 2);
+        mon = mk_utils_date_month(s + 4);
+        year = mk_utils_date_digits(s + 8, 2);
+        clock = mk_utils_date_clock(s + 11);
+
+        /* Two digits years are not meant to be too far in the future */
+        if (year >= 0) {
+            year += (year < 70) ? 2000 : 1900;
+        }
+    }
+
+    if (mday < 1 || mday > 31 || mon < 0 || year < 1970 || clock < 0) {
+        return -1;
+    }
+
+    return (mk_utils_date_days(year, mon, mday) * 86400) + clock;
+}
+
+time_t mk_utils_gmt2utime(char *date)
+{
+    return mk_utils_http_date(date, strlen(date));
 }
 
 int mk_buffer_cat(mk_ptr_t *p, char *buf1, int len1, char *buf2, int len2)
@@ -247,9 +379,10 @@ int mk_utils_hex2int(char *hex, int len)
 }
 
 /* If the URI contains hexa format characters it will return
- * convert the Hexa values to ASCII character
+ * convert the Hexa values to ASCII character, the new buffer is
+ * taken from 'arena'.
  */
-char *mk_utils_url_decode(mk_ptr_t uri)
+char *mk_utils_url_decode(mk_ptr_t uri, struct mk_arena *arena)
 {
     int tmp, hex_result;
     unsigned int i;
@@ -263,7 +396,11 @@ char *mk_utils_url_decode(mk_ptr_t uri)
 
     i = tmp;
 
-    buf = mk_mem_alloc_z(uri.len + 1);
+    buf = mk_arena_alloc(arena, uri.len + 1);
+    if (!buf) {
+        return NULL;
+    }
+
     if (i > 0) {
         memcpy(buf, uri.data, i);
         buf_idx = i;
@@ -280,7 +417,6 @@ char *mk_utils_url_decode(mk_ptr_t uri)
                 buf[buf_idx] = hex_result;
             }
             else {
-                mk_mem_free(buf);
                 return NULL;
             }
             i += 2;
@@ -17,6 +17,8 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <monkey/mk_info.h>
 #include <monkey/monkey.h>
 #include <monkey/mk_core.h>
@@ -24,6 +26,7 @@
 #include <monkey/mk_vhost_tls.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_http_status.h>
+#include <monkey/mk_http_cache.h>
 #include <monkey/mk_info.h>
 
 #include <regex.h>
@@ -55,6 +58,120 @@ static int str_to_regex(char *str, regex_t *reg)
     return 0;
 }
 
+/*
+ * Most handler rules are a literal with anchors: '^/api/', '\.php$' or
+ * '/cgi-bin/.*'. Those are turned into a plain (case insensitive) string
+ * compare, anything else is left to regexec(). Returns -1 if the rule
+ * needs the regex engine.
+ */
+static int handler_literal(struct mk_vhost_handler *h, char *str)
+{
+    int len = 0;
+    int start;
+    int end = MK_FALSE;
+    char *p = str;
+    char *buf;
+
+    start = (*p == '^');
+    if (start) {
+        p++;
+    }
+    while (p[0] == '.' && p[1] == '*') {
+        start = MK_FALSE;
+        p += 2;
+    }
+
+    buf = mk_mem_alloc(strlen(p) + 1);
+    if (!buf) {
+        return -1;
+    }
+
+    while (*p) {
+        if (*p == '\\') {
+            /* only escaped operators, '\w', '\<' and friends are regex */
+            if (!p[1] || !strchr(".[](){}*+?|^$\\/-", p[1])) {
+                goto regex;
+            }
+            buf[len++] = p[1];
+            p += 2;
+        }
+        else if (p[0] == '.' && p[1] == '*') {
+            /* trailing wildcards: '/api/.*', '/api/.*$' */
+            while (p[0] == '.' && p[1] == '*') {
+                p += 2;
+            }
+            if (*p != '\0' && strcmp(p, "$") != 0) {
+                goto regex;
+            }
+            break;
+        }
+        else if (p[0] == '$' && p[1] == '\0') {
+            end = MK_TRUE;
+            break;
+        }
+        else if (strchr(".[](){}*+?|^$ ", *p)) {
+            goto regex;
+        }
+        else {
+            buf[len++] = *p++;
+        }
+    }
+    buf[len] = '\0';
+
+    if (start && end) {
+        h->match_type = MK_VHOST_MATCH_EXACT;
+    }
+    else if (start) {
+        h->match_type = MK_VHOST_MATCH_PREFIX;
+    }
+    else if (end) {
+        h->match_type = MK_VHOST_MATCH_SUFFIX;
+    }
+    else {
+        h->match_type = MK_VHOST_MATCH_CONTAINS;
+    }
+
+    if (len == 0 && h->match_type != MK_VHOST_MATCH_EXACT) {
+        h->match_type = MK_VHOST_MATCH_ANY;
+    }
+
+    h->match_str = buf;
+    h->match_len = len;
+    return 0;
+
+ regex:
+    mk_mem_free(buf);
+    return -1;
+}
+
+/* Compile a handler rule, the regex engine is the last resort */
+static int handler_compile(struct mk_vhost_handler *h, char *str)
+{
+    h->match = NULL;
+    h->match_str = NULL;
+    h->match_len = 0;
+
+    if (handler_literal(h, str) == 0) {
+        MK_TRACE("Handler rule '%s' matched as literal (type %i)",
+                 str, h->match_type);
+        return 0;
+    }
+
+    h->match_type = MK_VHOST_MATCH_REGEX;
+    h->match = mk_mem_alloc(sizeof(regex_t));
+    if (!h->match) {
+        return -1;
+    }
+
+    if (str_to_regex(str, h->match) == -1) {
+        mk_mem_free(h->match);
+        h->match = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * This function is triggered upon thread creation (inside the thread
  * context), here we configure per-thread data.
@@ -326,14 +443,10 @@ struct mk_vhost_handler *mk_vhost_handler_match(char *match,
     h->name  = NULL;
     h->cb    = cb;
     h->data  = data;
-    h->match = mk_mem_alloc(sizeof(regex_t));
-    if (!h->match) {
-        mk_mem_free(h);
-        return NULL;
-    }
+    h->cb_body = NULL;
     mk_list_init(&h->params);
 
-    ret = str_to_regex(match, h->match);
+    ret = handler_compile(h, match);
     if (ret == -1) {
         mk_mem_free(h);
         return NULL;
@@ -342,6 +455,121 @@ struct mk_vhost_handler *mk_vhost_handler_match(char *match,
     return h;
 }
 
+/* Route cache entry, the handler is NULL when nothing matched */
+struct vhost_route {
+    struct mk_vhost *host;
+    unsigned int hash;
+    int len;
+    struct mk_vhost_handler *handler;
+    char uri[MK_VHOST_ROUTE_URI_MAX];
+};
+
+static __thread struct vhost_route route_cache[MK_VHOST_ROUTE_CACHE];
+
+/*
+ * Find the cached route for the URI. On a miss the slot is taken over
+ * and returned with 'hit' unset, the caller stores the result on it.
+ */
+static struct vhost_route *route_cache_get(struct mk_vhost *host,
+                                           char *uri, int len, int *hit)
+{
+    unsigned int hash;
+    struct vhost_route *route;
+
+    *hit = MK_FALSE;
+    if (len >= MK_VHOST_ROUTE_URI_MAX) {
+        return NULL;
+    }
+
+    hash = mk_utils_gen_hash(uri, len);
+    route = &route_cache[hash % MK_VHOST_ROUTE_CACHE];
+
+    if (route->host == host && route->hash == hash && route->len == len &&
+        memcmp(route->uri, uri, len) == 0) {
+        *hit = MK_TRUE;
+        return route;
+    }
+
+    route->host = host;
+    route->hash = hash;
+    route->len  = len;
+    memcpy(route->uri, uri, len);
+    route->handler = NULL;
+
+    return route;
+}
+
+static inline int handler_literal_match(struct mk_vhost_handler *h,
+                                        char *uri, int len)
+{
+    switch (h->match_type) {
+    case MK_VHOST_MATCH_ANY:
+        return MK_TRUE;
+    case MK_VHOST_MATCH_EXACT:
+        return (len == h->match_len &&
+                strncasecmp(uri, h->match_str, len) == 0);
+    case MK_VHOST_MATCH_PREFIX:
+        return (len >= h->match_len &&
+                strncasecmp(uri, h->match_str, h->match_len) == 0);
+    case MK_VHOST_MATCH_SUFFIX:
+        return (len >= h->match_len &&
+                strncasecmp(uri + len - h->match_len,
+                            h->match_str, h->match_len) == 0);
+    case MK_VHOST_MATCH_CONTAINS:
+        return (strcasestr(uri, h->match_str) != NULL);
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Return the next handler after 'prev' (NULL to start) whose rule
+ * matches the NULL terminated URI. Rules are evaluated in the order they
+ * were registered, a plugin can decline a request and let the following
+ * one take it. Once a regex rule is reached, the answer of a fresh
+ * lookup is taken from the route cache of the worker.
+ */
+struct mk_vhost_handler *mk_vhost_handler_next(struct mk_vhost *host,
+                                               struct mk_vhost_handler *prev,
+                                               char *uri, int len)
+{
+    int hit;
+    struct mk_list *head;
+    struct mk_vhost_handler *h;
+    struct vhost_route *route = NULL;
+
+    head = prev ? &prev->_head : &host->handlers;
+    for (head = head->next; head != &host->handlers; head = head->next) {
+        h = mk_list_entry(head, struct mk_vhost_handler, _head);
+
+        if (h->match_type != MK_VHOST_MATCH_REGEX) {
+            if (handler_literal_match(h, uri, len)) {
+                goto found;
+            }
+            continue;
+        }
+
+        /* The rules checked so far did not match, the cache is valid */
+        if (!prev && !route) {
+            route = route_cache_get(host, uri, len, &hit);
+            if (hit) {
+                return route->handler;
+            }
+        }
+
+        if (regexec(h->match, uri, 0, NULL, 0) == 0) {
+            goto found;
+        }
+    }
+    h = NULL;
+
+ found:
+    if (route) {
+        route->handler = h;
+    }
+    return h;
+}
+
 /*
  * Open a virtual host configuration file and return a structure with
  * definitions.
@@ -352,6 +580,7 @@ struct mk_vhost *mk_vhost_read(char *path)
     char *tmp;
     char *host_low;
     struct stat checkdir;
+    struct file_info f_info;
     struct mk_vhost *host;
     struct mk_vhost_alias *new_alias;
     struct mk_vhost_error_page *err_page;
@@ -359,6 +588,7 @@ struct mk_vhost *mk_vhost_read(char *path)
     struct mk_rconf_section *section_host;
     struct mk_rconf_section *section_ep;
     struct mk_rconf_section *section_handlers;
+    struct mk_rconf_section *section_cache;
     struct mk_rconf_entry *entry_ep;
     struct mk_string_line *entry;
     struct mk_list *head, *list, *line;
@@ -393,6 +623,9 @@ struct mk_vhost *mk_vhost_read(char *path)
     /* Init list for content handlers */
     mk_list_init(&host->handlers);
 
+    /* Init list for response cache rules */
+    mk_list_init(&host->cache_rules);
+
     /* Lookup Servername */
     list = mk_rconf_section_get_key(section_host, "Servername", MK_RCONF_LIST);
     if (!list) {
@@ -491,6 +724,17 @@ struct mk_vhost *mk_vhost_read(char *path)
             mk_string_build(&err_page->real_path, &len, "%s/%s",
                             host->documentroot.data, err_page->file);
 
+            /* Keep the page in memory, error responses do no file I/O */
+            if (mk_file_get_info(err_page->real_path, &f_info,
+                                 MK_FILE_READ) == 0) {
+                err_page->data = mk_file_to_buffer(err_page->real_path);
+                err_page->size = f_info.size;
+            }
+            if (!err_page->data) {
+                mk_warn("Virtual Host: cannot load error page %s",
+                        err_page->real_path);
+            }
+
             MK_TRACE("Map error page: status %i -> %s", err_page->status, err_page->file);
 
             /* Link page to the error page list */
@@ -498,11 +742,60 @@ struct mk_vhost *mk_vhost_read(char *path)
         }
     }
 
-    /* Handlers */
+    /* Response cache: Match <regex> <TTL> [Vary header ...] */
     int i;
     int params;
+    char *c_match = NULL;
     struct mk_list *head_line;
+    struct mk_http_cache_rule *c_rule;
+
+    section_cache = mk_rconf_section_get(cnf, "CACHE");
+    if (section_cache) {
+        mk_list_foreach(head, &section_cache->entries) {
+            entry_ep = mk_list_entry(head, struct mk_rconf_entry, _head);
+            if (strcasecmp(entry_ep->key, "Match") != 0) {
+                continue;
+            }
+
+            line = mk_string_split_line(entry_ep->val);
+            if (!line) {
+                continue;
+            }
+            if (mk_list_size(line) < 2) {
+                mk_err("[Host Cache] invalid Match value");
+                exit(EXIT_FAILURE);
+            }
+
+            i = 0;
+            c_rule = NULL;
+            mk_list_foreach(head_line, line) {
+                entry = mk_list_entry(head_line, struct mk_string_line, _head);
+                switch (i) {
+                case 0:
+                    c_match = entry->val;
+                    break;
+                case 1:
+                    c_rule = mk_http_cache_rule_create(c_match,
+                                                       atoi(entry->val));
+                    if (!c_rule) {
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+                default:
+                    /* request headers part of the key */
+                    ret = mk_http_cache_rule_vary(c_rule, entry->val);
+                    if (ret == -1) {
+                        exit(EXIT_FAILURE);
+                    }
+                };
+                i++;
+            }
+            mk_string_split_free(line);
+            mk_list_add(&c_rule->_head, &host->cache_rules);
+        }
+    }
 
+    /* Handlers */
     section_handlers = mk_rconf_section_get(cnf, "HANDLERS");
     if (!section_handlers) {
         return host;
@@ -514,7 +807,7 @@ struct mk_vhost *mk_vhost_read(char *path)
             if (!line) {
                 continue;
             }
-            h_handler = mk_mem_alloc(sizeof(struct mk_vhost_handler));
+            h_handler = mk_mem_alloc_z(sizeof(struct mk_vhost_handler));
             if (!h_handler) {
                 exit(EXIT_FAILURE);
             }
@@ -527,7 +820,7 @@ struct mk_vhost *mk_vhost_read(char *path)
                 entry = mk_list_entry(head_line, struct mk_string_line, _head);
                 switch (i) {
                 case 0:
-                    ret = str_to_regex(entry->val, h_handler->match);
+                    ret = handler_compile(h_handler, entry->val);
                     if (ret == -1) {
                         return NULL;
                     }
@@ -626,6 +919,7 @@ void mk_vhost_set_single(char *path, struct mk_server *server)
     }
     mk_list_add(&host->_head, &server->hosts);
     mk_list_init(&host->handlers);
+    mk_list_init(&host->cache_rules);
 }
 
 /* Given a configuration directory, start reading the virtual host entries */
@@ -706,29 +1000,136 @@ void mk_vhost_init(char *path, struct mk_server *server)
 }
 
 
+/* Wildcard entries are stored by the suffix that follows '*.' */
+static inline char *vhost_alias_key(struct mk_vhost_alias *alias, int *len)
+{
+    if (alias->wildcard) {
+        *len = alias->len - 2;
+        return alias->name + 2;
+    }
+
+    *len = alias->len;
+    return alias->name;
+}
+
+static struct mk_vhost_alias *vhost_table_get(struct mk_server *server,
+                                              const char *name, int len,
+                                              int wildcard)
+{
+    int i;
+    int key_len;
+    char *key;
+    unsigned int mask;
+    unsigned int hash;
+    struct mk_vhost_alias *entry;
+
+    hash = mk_string_hash(name, len, MK_STR_INSENSITIVE);
+    mask = server->vhost_table_size - 1;
+
+    for (i = hash & mask; (entry = server->vhost_table[i]); i = (i + 1) & mask) {
+        if (entry->hash != hash || entry->wildcard != wildcard) {
+            continue;
+        }
+
+        key = vhost_alias_key(entry, &key_len);
+        if (key_len == len && strncasecmp(key, name, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Index every server name in a hash table, exact names and wildcard
+ * suffixes share it. It must run once all virtual hosts are registered
+ * and before the workers start, lookups are lock free.
+ */
+int mk_vhost_index(struct mk_server *server)
+{
+    int i;
+    int len;
+    int size = 16;
+    int count = 0;
+    char *key;
+    unsigned int mask;
+    struct mk_list *head;
+    struct mk_list *head_alias;
+    struct mk_vhost *host;
+    struct mk_vhost_alias *alias;
+
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        count += mk_list_size(&host->server_names);
+    }
+
+    while (size < count * 2) {
+        size <<= 1;
+    }
+
+    mk_mem_free(server->vhost_table);
+    server->vhost_table = mk_mem_alloc_z(sizeof(struct mk_vhost_alias *) * size);
+    if (!server->vhost_table) {
+        server->vhost_table_size = 0;
+        return -1;
+    }
+    server->vhost_table_size = size;
+    mask = size - 1;
+
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        mk_list_foreach(head_alias, &host->server_names) {
+            alias = mk_list_entry(head_alias, struct mk_vhost_alias, _head);
+            alias->host = host;
+            alias->len = strlen(alias->name);
+            alias->wildcard = (alias->len > 2 &&
+                               alias->name[0] == '*' && alias->name[1] == '.');
+
+            /* The first virtual host defining a name owns it */
+            key = vhost_alias_key(alias, &len);
+            if (vhost_table_get(server, key, len, alias->wildcard)) {
+                continue;
+            }
+
+            alias->hash = mk_string_hash(key, len, MK_STR_INSENSITIVE);
+            for (i = alias->hash & mask; server->vhost_table[i];
+                 i = (i + 1) & mask);
+            server->vhost_table[i] = alias;
+        }
+    }
+
+    return 0;
+}
+
 /* Lookup a registered virtual host based on the given 'host' input */
 int mk_vhost_get(mk_ptr_t host, struct mk_vhost **vhost,
                  struct mk_vhost_alias **alias,
                  struct mk_server *server)
 {
-    struct mk_vhost *entry_host;
-    struct mk_vhost_alias *entry_alias;
-    struct mk_list *head_vhost, *head_alias;
-
-    mk_list_foreach(head_vhost, &server->hosts) {
-        entry_host = mk_list_entry(head_vhost, struct mk_vhost, _head);
-        mk_list_foreach(head_alias, &entry_host->server_names) {
-            entry_alias = mk_list_entry(head_alias, struct mk_vhost_alias, _head);
-            if (entry_alias->len == host.len &&
-                strncmp(entry_alias->name, host.data, host.len) == 0) {
-                *vhost = entry_host;
-                *alias = entry_alias;
-                return 0;
-            }
+    int i;
+    struct mk_vhost_alias *entry;
+
+    if (server->vhost_table_size == 0 || host.len == 0) {
+        return -1;
+    }
+
+    /* Exact name first */
+    entry = vhost_table_get(server, host.data, host.len, MK_FALSE);
+
+    /* Then the most specific wildcard: a.b.example.com, b.example.com... */
+    for (i = 0; !entry && i < (int) host.len - 1; i++) {
+        if (host.data[i] == '.') {
+            entry = vhost_table_get(server, host.data + i + 1,
+                                    host.len - i - 1, MK_TRUE);
         }
     }
 
-    return -1;
+    if (!entry) {
+        return -1;
+    }
+
+    *vhost = entry->host;
+    *alias = entry;
+    return 0;
 }
 
 static void mk_vhost_handler_free(struct mk_vhost_handler *h)
@@ -745,8 +1146,11 @@ static void mk_vhost_handler_free(struct mk_vhost_handler *h)
         mk_mem_free(param);
     }
 
-    regfree(h->match);
-    mk_mem_free(h->match);
+    if (h->match) {
+        regfree(h->match);
+        mk_mem_free(h->match);
+    }
+    mk_mem_free(h->match_str);
     mk_mem_free(h->name);
     mk_mem_free(h);
 }
@@ -756,6 +1160,7 @@ void mk_vhost_free_all(struct mk_server *server)
     struct mk_vhost *host;
     struct mk_vhost_alias *host_alias;
     struct mk_vhost_handler *host_handler;
+    struct mk_http_cache_rule *cache_rule;
     struct mk_vhost_error_page *ep;
     struct mk_list *head;
     struct mk_list *tmp;
@@ -779,12 +1184,20 @@ void mk_vhost_free_all(struct mk_server *server)
             mk_vhost_handler_free(host_handler);
         }
 
+        /* Response cache rules */
+        mk_list_foreach_safe(head2, tmp2, &host->cache_rules) {
+            cache_rule = mk_list_entry(head2, struct mk_http_cache_rule, _head);
+            mk_list_del(&cache_rule->_head);
+            mk_http_cache_rule_free(cache_rule);
+        }
+
         /* Free error pages */
         mk_list_foreach_safe(head2, tmp2, &host->error_pages) {
             ep = mk_list_entry(head2, struct mk_vhost_error_page, _head);
             mk_list_del(&ep->_head);
             mk_mem_free(ep->file);
             mk_mem_free(ep->real_path);
+            mk_mem_free(ep->data);
             mk_mem_free(ep);
         }
 
@@ -798,4 +1211,8 @@ void mk_vhost_free_all(struct mk_server *server)
         mk_mem_free(host->file);
         mk_mem_free(host);
     }
+
+    mk_mem_free(server->vhost_table);
+    server->vhost_table = NULL;
+    server->vhost_table_size = 0;
 }
@@ -24,6 +24,9 @@
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_mimetype.h>
+#include <monkey/mk_http_cache.h>
+#include <monkey/mk_http_parser.h>
+#include <monkey/mk_vhost.h>
 
 void mk_server_info(struct mk_server *server)
 {
@@ -130,27 +133,41 @@ struct mk_server *mk_server_create()
 int mk_server_setup(struct mk_server *server)
 {
     int ret;
-    pthread_t tid;
 
     /* Core and Scheduler setup */
     mk_config_start_configure(server);
     mk_config_signature(server);
 
+    /* Default error pages, they carry the server signature */
+    ret = mk_http_error_pages_init(server);
+    if (ret != 0) {
+        return -1;
+    }
+
+    /* Request parser: widest delimiter scanner, before any worker runs */
+    mk_http_parser_scan_init(MK_HTTP_PARSER_SCAN_AUTO);
+
+    /* Virtual hosts are all registered now, index their names */
+    ret = mk_vhost_index(server);
+    if (ret != 0) {
+        return -1;
+    }
+
     mk_sched_init(server);
 
-    /* Clock init that must happen before starting threads */
+    /* Server start time */
     mk_clock_sequential_init(server);
 
-    /* Load plugins */
-    mk_plugin_api_init();
-    mk_plugin_load_all(server);
-
-    /* Workers: logger and clock */
-    ret = mk_utils_worker_spawn((void *) mk_clock_worker_init, server, &tid);
+    /* Response cache shared by the workers */
+    ret = mk_http_cache_init(server);
     if (ret != 0) {
         return -1;
     }
 
+    /* Load plugins */
+    mk_plugin_api_init();
+    mk_plugin_load_all(server);
+
     /* Init thread keys */
     mk_thread_keys_init();
 
@@ -188,7 +205,8 @@ void mk_exit_all(struct mk_server *server)
 
     /* Continue exiting */
     mk_plugin_exit_all(server);
-    mk_clock_exit();
+    mk_http_cache_exit(server);
+    mk_http_error_pages_free(server);
 
     mk_sched_exit(server);
     mk_config_free_all(server);
@@ -0,0 +1,176 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Build time generator of the perfect hashes used by the request parser
+ * (see mk_http_parser_tables.h). For each table it searches a multiplier
+ * giving every entry a slot of its own, with the smallest slot array
+ * possible, and writes the multipliers and slot arrays to the file given
+ * as argument. The search is deterministic: same tables, same output.
+ *
+ * usage: mk_phash <output header>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mk_http_parser_tables.h"
+
+#define PHASH_TRIES     (1 << 22)
+#define PHASH_BITS_MAX  8
+
+struct phash_table {
+    const char *name;               /* prefix of the generated symbols */
+    const char *slots;
+    const struct row_entry *rows;
+    int n_rows;
+};
+
+struct phash_result {
+    uint64_t mul;
+    int bits;
+    signed char slots[1 << PHASH_BITS_MAX];
+};
+
+#define PHASH_TABLE(prefix, slots, table)                           \
+    { prefix, slots, table, sizeof(table) / sizeof(table[0]) }
+
+static struct phash_table phash_tables[] = {
+    PHASH_TABLE("MK_METHODS", "mk_methods_slots", mk_methods_table),
+    PHASH_TABLE("MK_HEADERS", "mk_headers_slots", mk_headers_table),
+    PHASH_TABLE("MK_TOKENS",  "mk_tokens_slots",  mk_tokens_table)
+};
+
+/* splitmix64, candidates for the multipliers */
+static uint64_t phash_next(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Slots of the entries for one multiplier, -1 on a collision */
+static int phash_try(struct phash_table *t, uint64_t mul, int bits,
+                     signed char *slots)
+{
+    int i;
+    unsigned int h;
+    uint64_t w;
+
+    memset(slots, -1, 1 << bits);
+    for (i = 0; i < t->n_rows; i++) {
+        w = word_load(t->rows[i].name, t->rows[i].len);
+        h = word_hash(w, t->rows[i].len, mul, bits);
+        if (slots[h] != -1) {
+            return -1;
+        }
+        slots[h] = i;
+    }
+
+    return 0;
+}
+
+static int phash_search(struct phash_table *t, struct phash_result *r)
+{
+    int n;
+    uint64_t state = 0x6d6b5f7068617368ULL;
+
+    for (r->bits = 1; (1 << r->bits) < t->n_rows; r->bits++);
+
+    for (; r->bits <= PHASH_BITS_MAX; r->bits++) {
+        for (n = 0; n < PHASH_TRIES; n++) {
+            r->mul = phash_next(&state) | 1;
+            if (phash_try(t, r->mul, r->bits, r->slots) == 0) {
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+static void phash_write(FILE *f, struct phash_table *t,
+                        struct phash_result *r)
+{
+    int i;
+    int row;
+    int last;
+
+    fprintf(f, "#define %s_HASH_MUL   0x%016llxULL\n",
+            t->name, (unsigned long long) r->mul);
+    fprintf(f, "#define %s_HASH_BITS  %i\n\n", t->name, r->bits);
+
+    fprintf(f, "static const signed char %s[1 << %s_HASH_BITS] = {\n",
+            t->slots, t->name);
+    for (i = 0; i < (1 << r->bits); i++) {
+        row = r->slots[i];
+        last = (i + 1 == (1 << r->bits));
+        fprintf(f, "    %3i%s", row, last ? "" : ",");
+        if (row >= 0) {
+            fprintf(f, "%s  /* %s */", last ? " " : "", t->rows[row].name);
+        }
+        fprintf(f, "\n");
+    }
+    fprintf(f, "};\n\n");
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    int n = sizeof(phash_tables) / sizeof(phash_tables[0]);
+    FILE *f;
+    struct phash_result results[sizeof(phash_tables) / sizeof(phash_tables[0])];
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <output header>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (phash_search(&phash_tables[i], &results[i]) != 0) {
+            fprintf(stderr, "mk_phash: no perfect hash found for %s, "
+                    "the entries collide on their first eight bytes\n",
+                    phash_tables[i].slots);
+            return EXIT_FAILURE;
+        }
+    }
+
+    f = fopen(argv[1], "w");
+    if (!f) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(f, "/* Generated by mk_server/tools/mk_phash.c, do not edit */\n\n"
+            "#ifndef MK_HTTP_PARSER_HASH_H\n"
+            "#define MK_HTTP_PARSER_HASH_H\n\n");
+    for (i = 0; i < n; i++) {
+        phash_write(f, &phash_tables[i], &results[i]);
+    }
+    fprintf(f, "#endif\n");
+
+    if (fclose(f) != 0) {
+        perror("fclose");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
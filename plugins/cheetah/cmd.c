@@ -297,8 +297,10 @@ void mk_cheetah_cmd_vhosts(struct mk_server *server)
 void mk_cheetah_cmd_workers(struct mk_server *server)
 {
     int i;
+    int j;
     unsigned long long active_connections;
     struct mk_sched_worker *node;
+    struct mk_sched_conn_pool *pool;
     struct mk_sched_ctx *ctx;
 
     ctx = server->sched_ctx;
@@ -309,6 +311,21 @@ void mk_cheetah_cmd_workers(struct mk_server *server)
         CHEETAH_WRITE("* Worker %i\n", node[i].idx);
         CHEETAH_WRITE("      - Task ID           : %i\n", node[i].pid);
         CHEETAH_WRITE("      - Active Connections: %llu\n", active_connections);
+
+        /* Values are read from another thread, they are approximate */
+        for (j = 0; j < MK_SCHED_CONN_POOLS; j++) {
+            pool = &node[i].conn_pools[j];
+            if (pool->size == 0) {
+                break;
+            }
+            CHEETAH_WRITE("      - Connection Pool   : %zu bytes, "
+                          "%u live, %u free\n",
+                          pool->size, pool->live, pool->free);
+        }
+        CHEETAH_WRITE("      - Read Buffers      : %zu bytes, "
+                      "%u live, %u free\n",
+                      node[i].read_buffers.size, node[i].read_buffers.live,
+                      node[i].read_buffers.free);
     }
 
     CHEETAH_WRITE("\n");
@@ -0,0 +1,308 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "proxy.h"
+#include "proxy_upstream.h"
+#include "proxy_handler.h"
+
+#include <sys/timerfd.h>
+
+struct proxy_config proxy_conf;
+pthread_key_t proxy_worker_key;
+
+/* Read a key keeping 'def' when it is not set, so '0' can be configured */
+static long proxy_conf_get(struct mk_rconf_section *section, char *key,
+                           int mode, long def)
+{
+    char *str;
+
+    if (!section) {
+        return def;
+    }
+
+    str = mk_api->config_section_get_key(section, key, MK_RCONF_STR);
+    if (!str) {
+        return def;
+    }
+    mk_api->mem_free(str);
+
+    return (long) mk_api->config_section_get_key(section, key, mode);
+}
+
+static int mk_proxy_config(char *path)
+{
+    int ret;
+    char *file = NULL;
+    char *address;
+    unsigned long len;
+    struct mk_list *head;
+    struct mk_rconf *conf;
+    struct mk_rconf_section *section;
+    struct proxy_upstream *u;
+
+    mk_list_init(&proxy_conf.upstreams);
+
+    mk_api->str_build(&file, &len, "%sproxy.conf", path);
+    conf = mk_api->config_open(file);
+    mk_api->mem_free(file);
+    if (!conf) {
+        return -1;
+    }
+
+    /* Global settings */
+    section = mk_api->config_section_get(conf, "PROXY");
+    proxy_conf.connect_timeout = proxy_conf_get(section, "ConnectTimeout",
+                                                MK_RCONF_NUM,
+                                                PROXY_CONNECT_TIMEOUT);
+    proxy_conf.read_timeout = proxy_conf_get(section, "ReadTimeout",
+                                             MK_RCONF_NUM,
+                                             PROXY_READ_TIMEOUT);
+    proxy_conf.retries = proxy_conf_get(section, "Retries",
+                                        MK_RCONF_NUM, PROXY_RETRIES);
+    proxy_conf.splice = proxy_conf_get(section, "Splice",
+                                       MK_RCONF_BOOL, MK_TRUE);
+
+    if (proxy_conf.connect_timeout < 1 || proxy_conf.read_timeout < 1 ||
+        proxy_conf.retries < 0 || proxy_conf.splice == -1) {
+        mk_warn("[proxy] invalid value in [PROXY] section");
+        mk_api->config_free(conf);
+        return -1;
+    }
+
+    /* Upstreams */
+    mk_list_foreach(head, &conf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "UPSTREAM") != 0) {
+            continue;
+        }
+
+        u = mk_api->mem_alloc_z(sizeof(struct proxy_upstream));
+        if (!u) {
+            mk_api->config_free(conf);
+            return -1;
+        }
+        u->name = mk_api->config_section_get_key(section, "Name",
+                                                 MK_RCONF_STR);
+        address = mk_api->config_section_get_key(section, "Address",
+                                                 MK_RCONF_STR);
+        u->keepalive = proxy_conf_get(section, "KeepAlive",
+                                      MK_RCONF_NUM, PROXY_KEEPALIVE);
+        u->keepalive_timeout = proxy_conf_get(section, "KeepAliveTimeout",
+                                              MK_RCONF_NUM,
+                                              PROXY_KEEPALIVE_TIMEOUT);
+
+        if (!u->name || !address) {
+            mk_warn("[proxy] [UPSTREAM] requires Name and Address");
+            mk_api->config_free(conf);
+            return -1;
+        }
+
+        ret = proxy_upstream_resolve(u, address);
+        mk_api->mem_free(address);
+        if (ret == -1) {
+            mk_api->config_free(conf);
+            return -1;
+        }
+
+        mk_list_add(&u->_head, &proxy_conf.upstreams);
+        PLUGIN_TRACE("[proxy] upstream %s -> %s:%i (keepalive=%i)",
+                     u->name, u->host, u->port, u->keepalive);
+    }
+
+    mk_api->config_free(conf);
+
+    if (mk_list_is_empty(&proxy_conf.upstreams) == 0) {
+        mk_warn("[proxy] no [UPSTREAM] defined");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Runs every second on each worker */
+static int cb_proxy_timer(void *data)
+{
+    uint64_t val;
+    struct proxy_worker *w = data;
+
+    if (read(w->event.fd, &val, sizeof(val)) <= 0) {
+        return 0;
+    }
+
+    w->now = proxy_now();
+    proxy_request_expire(w);
+    proxy_pool_expire(w);
+
+    return 0;
+}
+
+int mk_proxy_stage30(struct mk_plugin *plugin,
+                     struct mk_http_session *cs,
+                     struct mk_http_request *sr,
+                     int n_params,
+                     struct mk_list *params)
+{
+    struct mk_vhost_handler_param *param;
+    struct proxy_upstream *u;
+
+    /* Already being served */
+    if (sr->handler_data) {
+        return MK_PLUGIN_RET_CONTINUE;
+    }
+
+    /* Match /app/.* proxy [upstream name] */
+    if (n_params > 0) {
+        param = mk_api->handler_param_get(0, params);
+        u = proxy_upstream_lookup(param->p.data, param->p.len);
+    }
+    else {
+        u = mk_list_entry_first(&proxy_conf.upstreams,
+                                struct proxy_upstream, _head);
+    }
+
+    if (!u) {
+        mk_warn("[proxy] unknown upstream in handler for %.*s",
+                (int) sr->uri.len, sr->uri.data);
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    return proxy_request_start(plugin, cs, sr, u);
+}
+
+int mk_proxy_stage30_hangup(struct mk_plugin *plugin,
+                            struct mk_http_session *cs,
+                            struct mk_http_request *sr)
+{
+    (void) plugin;
+    (void) cs;
+
+    if (!sr->handler_data) {
+        return -1;
+    }
+
+    proxy_request_hangup(sr->handler_data);
+    return 0;
+}
+
+int mk_proxy_plugin_init(struct plugin_api **api, char *confdir)
+{
+    int ret;
+
+    mk_api = *api;
+
+    ret = mk_proxy_config(confdir);
+    if (ret == -1) {
+        mk_warn("[proxy] configuration error/missing, plugin disabled.");
+        return -1;
+    }
+
+    pthread_key_create(&proxy_worker_key, NULL);
+    return 0;
+}
+
+int mk_proxy_plugin_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct proxy_upstream *u;
+
+    mk_list_foreach_safe(head, tmp, &proxy_conf.upstreams) {
+        u = mk_list_entry(head, struct proxy_upstream, _head);
+        mk_list_del(&u->_head);
+        mk_api->mem_free(u->name);
+        mk_api->mem_free(u->host);
+        mk_api->mem_free(u);
+    }
+
+    return 0;
+}
+
+int mk_proxy_master_init(struct mk_server *server)
+{
+    (void) server;
+    return 0;
+}
+
+void mk_proxy_worker_init()
+{
+    int fd;
+    int ret;
+    struct itimerspec its;
+    struct proxy_worker *w;
+
+    w = mk_api->mem_alloc_z(sizeof(struct proxy_worker));
+    if (!w) {
+        exit(EXIT_FAILURE);
+    }
+    mk_list_init(&w->requests);
+    w->now = proxy_now();
+
+    ret = proxy_pool_init(w);
+    if (ret == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    /* One second tick to expire requests and idle connections */
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        mk_libc_error("timerfd_create");
+        exit(EXIT_FAILURE);
+    }
+
+    its.it_value.tv_sec = 1;
+    its.it_value.tv_nsec = 0;
+    its.it_interval.tv_sec = 1;
+    its.it_interval.tv_nsec = 0;
+    timerfd_settime(fd, 0, &its, NULL);
+
+    MK_EVENT_NEW(&w->event);
+    w->event.handler = cb_proxy_timer;
+    ret = mk_api->ev_add(mk_api->sched_loop(), fd,
+                         MK_EVENT_CUSTOM, MK_EVENT_READ, w);
+    if (ret == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_setspecific(proxy_worker_key, (void *) w);
+}
+
+struct mk_plugin_stage mk_plugin_stage_proxy = {
+    .stage30        = &mk_proxy_stage30,
+    .stage30_hangup = &mk_proxy_stage30_hangup
+};
+
+struct mk_plugin mk_plugin_proxy = {
+    /* Identification */
+    .shortname     = "proxy",
+    .name          = "HTTP Reverse Proxy",
+    .version       = MK_VERSION_STR,
+    .hooks         = MK_PLUGIN_STAGE,
+
+    /* Init / Exit */
+    .init_plugin   = mk_proxy_plugin_init,
+    .exit_plugin   = mk_proxy_plugin_exit,
+
+    /* Init Levels */
+    .master_init   = mk_proxy_master_init,
+    .worker_init   = mk_proxy_worker_init,
+
+    /* Type */
+    .stage         = &mk_plugin_stage_proxy
+};
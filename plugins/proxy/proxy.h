@@ -0,0 +1,88 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_PROXY_H
+#define MK_PROXY_H
+
+#include <monkey/mk_api.h>
+
+#include <sys/socket.h>
+
+/* Defaults used when a key is missing from proxy.conf */
+#define PROXY_CONNECT_TIMEOUT      5
+#define PROXY_READ_TIMEOUT        30
+#define PROXY_RETRIES              1
+#define PROXY_KEEPALIVE           16
+#define PROXY_KEEPALIVE_TIMEOUT   30
+
+/* An [UPSTREAM] entry from proxy.conf */
+struct proxy_upstream {
+    char *name;
+    char *host;
+    int   port;
+
+    /* Resolved once at startup, workers never call getaddrinfo() */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    int keepalive;            /* idle connections kept per worker */
+    int keepalive_timeout;    /* seconds an idle connection is kept */
+
+    struct mk_list _head;
+};
+
+/* Global [PROXY] settings */
+struct proxy_config {
+    int connect_timeout;
+    int read_timeout;
+    int retries;
+    int splice;
+
+    struct mk_list upstreams;
+};
+
+/*
+ * Per worker context: owns the timer used to expire requests and idle
+ * connections, the connection pools and the list of active requests.
+ */
+struct proxy_worker {
+    struct mk_event event;    /* timerfd, must be the first field */
+    time_t now;
+
+    struct mk_list pools;
+    struct mk_list requests;
+};
+
+extern struct proxy_config proxy_conf;
+extern pthread_key_t proxy_worker_key;
+
+static inline time_t proxy_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static inline struct proxy_worker *proxy_worker_get()
+{
+    return pthread_getspecific(proxy_worker_key);
+}
+
+#endif
@@ -0,0 +1,1204 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "proxy.h"
+#include "proxy_upstream.h"
+#include "proxy_handler.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+/* Chunked scanner states */
+enum {
+    CHUNK_SIZE = 0,
+    CHUNK_EXT,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+    CHUNK_END_LF,
+    CHUNK_DONE
+};
+
+/* Request headers never forwarded to the upstream */
+static mk_ptr_t proxy_request_skip[] = {
+    mk_ptr_init("connection"),
+    mk_ptr_init("keep-alive"),
+    mk_ptr_init("proxy-connection"),
+    mk_ptr_init("te"),
+    mk_ptr_init("trailer"),
+    mk_ptr_init("transfer-encoding"),
+    mk_ptr_init("upgrade"),
+    mk_ptr_init("expect"),
+    mk_ptr_init("x-forwarded-for"),
+    mk_ptr_init("x-forwarded-proto"),
+    mk_ptr_init("content-length"),
+    mk_ptr_init("host")
+};
+
+/* Response headers replaced by the core or meaningless after the hop */
+static mk_ptr_t proxy_response_skip[] = {
+    mk_ptr_init("connection"),
+    mk_ptr_init("keep-alive"),
+    mk_ptr_init("proxy-connection"),
+    mk_ptr_init("te"),
+    mk_ptr_init("trailer"),
+    mk_ptr_init("transfer-encoding"),
+    mk_ptr_init("upgrade"),
+    mk_ptr_init("content-length"),
+    mk_ptr_init("date"),
+    mk_ptr_init("server")
+};
+
+static int cb_proxy_conn(void *data);
+
+static inline int proxy_ptr_eq(mk_ptr_t *p, const char *data, size_t len)
+{
+    return (p->len == len && strncasecmp(p->data, data, len) == 0);
+}
+
+static int proxy_header_skip(mk_ptr_t *table, int size,
+                             const char *name, size_t len)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        if (proxy_ptr_eq(&table[i], name, len)) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Case insensitive search of a whole token in a comma separated header
+ * value, 'close' does not match 'x-close'.
+ */
+static int proxy_value_has(const char *val, size_t len, const char *token)
+{
+    size_t i = 0;
+    size_t start;
+    size_t end;
+    size_t t_len = strlen(token);
+
+    while (i < len) {
+        while (i < len && (val[i] == ' ' || val[i] == '\t')) {
+            i++;
+        }
+        start = i;
+        while (i < len && val[i] != ',') {
+            i++;
+        }
+        end = i;
+        while (end > start && (val[end - 1] == ' ' || val[end - 1] == '\t')) {
+            end--;
+        }
+
+        if (end - start == t_len &&
+            strncasecmp(val + start, token, t_len) == 0) {
+            return MK_TRUE;
+        }
+        i++;
+    }
+
+    return MK_FALSE;
+}
+
+static int proxy_idempotent(struct mk_http_request *sr)
+{
+    return (sr->method != MK_METHOD_POST && sr->method != MK_METHOD_UNKNOWN);
+}
+
+static inline char *proxy_cat(char *p, const char *data, size_t len)
+{
+    memcpy(p, data, len);
+    return p + len;
+}
+
+/*
+ * Compose the request head for the upstream: request line, the client
+ * headers minus the hop-by-hop ones, Host (with port), our own
+ * Content-Length, Connection and X-Forwarded-* headers. The request body
+ * buffered by the core is sent right after it.
+ */
+static int proxy_request_build(struct proxy_request *r)
+{
+    int tls;
+    int port;
+    size_t size;
+    char *p;
+    char ip[INET6_ADDRSTRLEN];
+    char *ip_p = ip;
+    char port_str[16];
+    char len_str[48];
+    char host_buf[300];
+    mk_ptr_t host;
+    unsigned long ip_len = 0;
+    struct mk_list *head;
+    struct mk_http_header *h;
+    struct mk_http_header *xff = NULL;
+    struct mk_http_request *sr = r->sr;
+    struct mk_http_session *cs = r->cs;
+    int n_skip = sizeof(proxy_request_skip) / sizeof(mk_ptr_t);
+
+    if (mk_api->socket_ip_str(cs->socket, &ip_p, sizeof(ip), &ip_len) != 0) {
+        ip_len = 0;
+    }
+    tls = (MK_SCHED_CONN_PROP(cs->conn) & MK_CAP_SOCK_TLS) ? MK_TRUE : MK_FALSE;
+
+    /* HTTP/1.0 clients may not send Host, name the upstream instead */
+    if (sr->host.data) {
+        host = sr->host;
+        port = cs->parser.header_host_port;
+    }
+    else if (strchr(r->upstream->host, ':')) {
+        host.len = snprintf(host_buf, sizeof(host_buf), "[%s]",
+                            r->upstream->host);
+        host.data = host_buf;
+        port = r->upstream->port;
+    }
+    else {
+        host.data = r->upstream->host;
+        host.len = strlen(host.data);
+        port = r->upstream->port;
+    }
+
+    if (port > 0) {
+        snprintf(port_str, sizeof(port_str), ":%i", port);
+    }
+    else {
+        port_str[0] = '\0';
+    }
+
+    /*
+     * The body goes out framed by the length the core holds: a chunked
+     * upload is already decoded, its original framing must not reach
+     * the upstream.
+     */
+    if (sr->data.len > 0 || sr->_content_length.data) {
+        snprintf(len_str, sizeof(len_str), "Content-Length: %lu\r\n",
+                 sr->data.len);
+    }
+    else {
+        len_str[0] = '\0';
+    }
+
+    /* Request line, Host, Content-Length, Connection, X-Forwarded-*, CRLF */
+    size = sr->method_p.len + sr->uri.len + sr->query_string.len + 16;
+    size += 8 + host.len + strlen(port_str);
+    size += strlen(len_str);
+    size += 24;
+    size += 23 + ip_len;
+    size += 26;
+    size += 2;
+
+    mk_list_foreach(head, &cs->parser.header_list) {
+        h = mk_list_entry(head, struct mk_http_header, _head);
+        if (proxy_ptr_eq(&h->key, "x-forwarded-for", 15)) {
+            xff = h;
+            size += h->val.len;
+            continue;
+        }
+        if (proxy_header_skip(proxy_request_skip, n_skip,
+                              h->key.data, h->key.len) == MK_TRUE) {
+            continue;
+        }
+        size += h->key.len + h->val.len + 4;
+    }
+
+    r->req_buf = mk_api->mem_alloc(size + sr->data.len);
+    if (!r->req_buf) {
+        return -1;
+    }
+    p = r->req_buf;
+
+    p = proxy_cat(p, sr->method_p.data, sr->method_p.len);
+    p = proxy_cat(p, " ", 1);
+    p = proxy_cat(p, sr->uri.data, sr->uri.len);
+    if (sr->query_string.len > 0) {
+        p = proxy_cat(p, "?", 1);
+        p = proxy_cat(p, sr->query_string.data, sr->query_string.len);
+    }
+    p = proxy_cat(p, " HTTP/1.1\r\n", 11);
+
+    p = proxy_cat(p, "Host: ", 6);
+    p = proxy_cat(p, host.data, host.len);
+    p = proxy_cat(p, port_str, strlen(port_str));
+    p = proxy_cat(p, MK_CRLF, 2);
+
+    mk_list_foreach(head, &cs->parser.header_list) {
+        h = mk_list_entry(head, struct mk_http_header, _head);
+        if (proxy_header_skip(proxy_request_skip, n_skip,
+                              h->key.data, h->key.len) == MK_TRUE) {
+            continue;
+        }
+        p = proxy_cat(p, h->key.data, h->key.len);
+        p = proxy_cat(p, ": ", 2);
+        p = proxy_cat(p, h->val.data, h->val.len);
+        p = proxy_cat(p, MK_CRLF, 2);
+    }
+
+    p = proxy_cat(p, len_str, strlen(len_str));
+    p = proxy_cat(p, "Connection: keep-alive\r\n", 24);
+
+    if (xff || ip_len > 0) {
+        p = proxy_cat(p, "X-Forwarded-For: ", 17);
+        if (xff) {
+            p = proxy_cat(p, xff->val.data, xff->val.len);
+            if (ip_len > 0) {
+                p = proxy_cat(p, ", ", 2);
+            }
+        }
+        p = proxy_cat(p, ip, ip_len);
+        p = proxy_cat(p, MK_CRLF, 2);
+    }
+
+    if (tls == MK_TRUE) {
+        p = proxy_cat(p, "X-Forwarded-Proto: https\r\n", 26);
+    }
+    else {
+        p = proxy_cat(p, "X-Forwarded-Proto: http\r\n", 25);
+    }
+    p = proxy_cat(p, MK_CRLF, 2);
+
+    if (sr->data.len > 0) {
+        p = proxy_cat(p, sr->data.data, sr->data.len);
+    }
+    r->req_len = p - r->req_buf;
+
+    return 0;
+}
+
+/* Detach the request from the session and release everything it holds */
+static void proxy_request_free(struct proxy_request *r)
+{
+    struct mk_event_loop *loop = mk_api->sched_loop();
+
+    mk_list_del(&r->_head);
+    r->sr->handler_data = NULL;
+
+    /* Inputs still queued on the client stream reference our buffer */
+    if (r->in_hdr._head.next) {
+        mk_stream_input_unlink(&r->in_hdr);
+    }
+    if (r->in_body._head.next) {
+        mk_stream_input_unlink(&r->in_body);
+    }
+
+    if (r->conn) {
+        proxy_conn_release(r->conn, MK_FALSE);
+        r->conn = NULL;
+    }
+
+    if (r->event.fd != -1) {
+        mk_api->ev_del(loop, &r->event);
+        close(r->event.fd);
+        r->event.fd = -1;
+    }
+
+    if (r->pipe[0] != -1) {
+        close(r->pipe[0]);
+        close(r->pipe[1]);
+    }
+
+    if (r->req_buf) {
+        mk_api->mem_free(r->req_buf);
+    }
+    mk_api->sched_event_free(&r->event);
+}
+
+/* The response was fully delivered (or cannot continue): end the request */
+static void proxy_request_end(struct proxy_request *r, int close)
+{
+    struct mk_plugin *plugin = r->plugin;
+    struct mk_http_session *cs = r->cs;
+
+    if (r->hangup == MK_TRUE) {
+        close = MK_TRUE;
+    }
+    proxy_request_free(r);
+    mk_api->http_request_end(plugin, cs, close);
+}
+
+/* Reply with an error status, only possible before the response started */
+static void proxy_request_error(struct proxy_request *r, int status)
+{
+    int ret;
+    struct mk_plugin *plugin = r->plugin;
+    struct mk_http_session *cs = r->cs;
+    struct mk_http_request *sr = r->sr;
+
+    PLUGIN_TRACE("[proxy] upstream %s failed, reply %i",
+                 r->upstream->name, status);
+
+    proxy_request_free(r);
+
+    mk_api->header_set_http_status(sr, status);
+    sr->headers.content_length = 0;
+    sr->headers.cgi = SH_NOCGI;
+    mk_api->header_prepare(plugin, cs, sr);
+
+    ret = mk_api->channel_flush(cs->channel);
+    if (ret & MK_CHANNEL_ERROR) {
+        mk_api->http_request_end(plugin, cs, MK_TRUE);
+    }
+    else if (ret == MK_CHANNEL_DONE || ret == MK_CHANNEL_EMPTY) {
+        mk_api->http_request_end(plugin, cs, MK_FALSE);
+    }
+
+    /* Otherwise the core ends the request once the channel drains */
+}
+
+/*
+ * Get an upstream connection for the request and wait for it to become
+ * writable. Connections that fail right away are retried as allowed.
+ */
+static int proxy_connect(struct proxy_request *r)
+{
+    int ret;
+    int reused;
+    struct proxy_conn *conn;
+    struct proxy_worker *w = proxy_worker_get();
+
+    while (1) {
+        conn = proxy_conn_get(w, r->upstream, &reused);
+        if (conn) {
+            break;
+        }
+        if (r->tries >= proxy_conf.retries) {
+            return -1;
+        }
+        r->tries++;
+    }
+
+    conn->r = r;
+    conn->event.handler = cb_proxy_conn;
+    r->conn = conn;
+    r->reused = reused;
+    r->req_sent = 0;
+    r->buf_len = 0;
+    r->received = 0;
+
+    if (reused == MK_TRUE) {
+        r->state = PROXY_SENDING;
+        r->deadline = proxy_now() + proxy_conf.read_timeout;
+    }
+    else {
+        r->state = PROXY_CONNECTING;
+        r->deadline = proxy_now() + proxy_conf.connect_timeout;
+    }
+
+    ret = mk_api->ev_add(mk_api->sched_loop(), conn->event.fd,
+                         MK_EVENT_CUSTOM, MK_EVENT_WRITE, conn);
+    if (ret == -1) {
+        proxy_conn_release(conn, MK_FALSE);
+        r->conn = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * The upstream failed. Before any response byte arrived the request can
+ * be sent again: always for connect errors, for other errors only when
+ * the method is idempotent. A stale pooled connection does not count as
+ * a retry. Otherwise reply with 'status' or, if the response already
+ * started, drop the client connection.
+ */
+static void proxy_request_fail(struct proxy_request *r, int status, int retry)
+{
+    int connect_error = (r->state == PROXY_CONNECTING);
+
+    if (r->conn) {
+        proxy_conn_release(r->conn, MK_FALSE);
+        r->conn = NULL;
+    }
+
+    if (r->headers_sent == MK_TRUE) {
+        proxy_request_end(r, MK_TRUE);
+        return;
+    }
+
+    if (retry == MK_TRUE && r->received == 0 &&
+        (connect_error || proxy_idempotent(r->sr))) {
+        if (r->reused == MK_TRUE || r->tries < proxy_conf.retries) {
+            if (r->reused == MK_FALSE) {
+                r->tries++;
+            }
+            if (proxy_connect(r) == 0) {
+                return;
+            }
+        }
+    }
+
+    proxy_request_error(r, status);
+}
+
+/* Write the request head and body to the upstream */
+static int proxy_send(struct proxy_request *r)
+{
+    ssize_t n;
+
+    while (r->req_sent < r->req_len) {
+        n = write(r->conn->event.fd, r->req_buf + r->req_sent,
+                  r->req_len - r->req_sent);
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            return -1;
+        }
+        r->req_sent += n;
+        r->deadline = proxy_now() + proxy_conf.read_timeout;
+    }
+
+    r->state = PROXY_HEADERS;
+    return mk_api->ev_add(mk_api->sched_loop(), r->conn->event.fd,
+                          MK_EVENT_CUSTOM, MK_EVENT_READ, r->conn);
+}
+
+/*
+ * Scan chunked data. It stops at the end of the last chunk and returns
+ * the number of bytes consumed. With 'strip' the chunk framing is removed
+ * in place and 'out' gets the payload length.
+ */
+static ssize_t proxy_chunked_feed(struct proxy_chunked *c, char *data,
+                                  size_t len, int strip, size_t *out)
+{
+    int v;
+    char ch;
+    size_t i = 0;
+    size_t n;
+    size_t o = 0;
+
+    while (i < len && c->state != CHUNK_DONE) {
+        if (c->state == CHUNK_DATA) {
+            n = len - i;
+            if (n > c->size) {
+                n = c->size;
+            }
+            if (strip == MK_TRUE) {
+                memmove(data + o, data + i, n);
+                o += n;
+            }
+            i += n;
+            c->size -= n;
+            if (c->size == 0) {
+                c->state = CHUNK_DATA_CR;
+            }
+            continue;
+        }
+
+        ch = data[i++];
+        switch (c->state) {
+        case CHUNK_SIZE:
+            if (ch >= '0' && ch <= '9') {
+                v = ch - '0';
+            }
+            else if (ch >= 'a' && ch <= 'f') {
+                v = ch - 'a' + 10;
+            }
+            else if (ch >= 'A' && ch <= 'F') {
+                v = ch - 'A' + 10;
+            }
+            else if (c->digits > 0 && (ch == ';' || ch == ' ' || ch == '\t')) {
+                c->state = CHUNK_EXT;
+                break;
+            }
+            else if (c->digits > 0 && ch == '\r') {
+                c->state = CHUNK_SIZE_LF;
+                break;
+            }
+            else {
+                return -1;
+            }
+            if (c->size > (SIZE_MAX >> 4)) {
+                return -1;
+            }
+            c->size = (c->size << 4) + v;
+            c->digits++;
+            break;
+        case CHUNK_EXT:
+            if (ch == '\r') {
+                c->state = CHUNK_SIZE_LF;
+            }
+            break;
+        case CHUNK_SIZE_LF:
+            if (ch != '\n') {
+                return -1;
+            }
+            c->state = (c->size == 0) ? CHUNK_TRAILER : CHUNK_DATA;
+            break;
+        case CHUNK_DATA_CR:
+            if (ch != '\r') {
+                return -1;
+            }
+            c->state = CHUNK_DATA_LF;
+            break;
+        case CHUNK_DATA_LF:
+            if (ch != '\n') {
+                return -1;
+            }
+            c->state = CHUNK_SIZE;
+            c->size = 0;
+            c->digits = 0;
+            break;
+        case CHUNK_TRAILER:
+            c->state = (ch == '\r') ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (ch == '\n') {
+                c->state = CHUNK_TRAILER;
+            }
+            break;
+        case CHUNK_END_LF:
+            if (ch != '\n') {
+                return -1;
+            }
+            c->state = CHUNK_DONE;
+            break;
+        }
+    }
+
+    *out = (strip == MK_TRUE) ? o : i;
+    return i;
+}
+
+/*
+ * Apply the response framing to 'len' bytes of body read from the
+ * upstream. Returns the number of bytes to forward to the client starting
+ * at 'data', or -1 if the upstream broke the framing.
+ */
+static ssize_t proxy_body_feed(struct proxy_request *r, char *data, size_t len)
+{
+    ssize_t ret;
+    size_t out = 0;
+
+    switch (r->framing) {
+    case PROXY_BODY_NONE:
+        if (len > 0) {
+            r->keepalive = MK_FALSE;
+        }
+        r->upstream_done = MK_TRUE;
+        return 0;
+    case PROXY_BODY_LENGTH:
+        if ((long) len >= r->remaining) {
+            if ((long) len > r->remaining) {
+                r->keepalive = MK_FALSE;
+            }
+            len = r->remaining;
+            r->upstream_done = MK_TRUE;
+        }
+        r->remaining -= len;
+        return len;
+    case PROXY_BODY_CHUNKED:
+    case PROXY_BODY_DECHUNK:
+        ret = proxy_chunked_feed(&r->chunked, data, len,
+                                 r->framing == PROXY_BODY_DECHUNK, &out);
+        if (ret == -1) {
+            return -1;
+        }
+        if (r->chunked.state == CHUNK_DONE) {
+            if ((size_t) ret < len) {
+                r->keepalive = MK_FALSE;
+            }
+            r->upstream_done = MK_TRUE;
+        }
+        return out;
+    case PROXY_BODY_CLOSE:
+        return len;
+    }
+
+    return -1;
+}
+
+/*
+ * Called by the core when one of our stream inputs has been fully
+ * written to the client. Outside of our own flush this is where reading
+ * from the upstream resumes, or where the request is released once the
+ * whole response went out; the core then ends it through the regular
+ * write path.
+ */
+static void cb_proxy_input_finished(struct mk_stream_input *in)
+{
+    struct proxy_request *r = in->context;
+    struct mk_http_session *cs = r->cs;
+
+    r->pending--;
+    if (r->pending > 0 || r->in_flush == MK_TRUE) {
+        return;
+    }
+
+    r->deadline = proxy_now() + proxy_conf.read_timeout;
+    if (r->upstream_done == MK_TRUE) {
+        if (r->hangup == MK_TRUE) {
+            cs->close_now = MK_TRUE;
+        }
+        proxy_request_free(r);
+        return;
+    }
+
+    /* Keep the core away from ending the request on the next write */
+    mk_api->ev_add(mk_api->sched_loop(), cs->socket,
+                   MK_EVENT_CONNECTION, MK_EVENT_READ, cs->conn);
+    if (r->conn) {
+        mk_api->ev_add(mk_api->sched_loop(), r->conn->event.fd,
+                       MK_EVENT_CUSTOM, MK_EVENT_READ, r->conn);
+    }
+}
+
+static void proxy_queue(struct proxy_request *r, struct mk_stream_input *in,
+                        struct mk_iov *iov, struct iovec *io,
+                        char *buf, size_t len)
+{
+    iov->io = io;
+    iov->buf_to_free = NULL;
+    mk_iov_init(iov, 1, 0);
+    mk_iov_add(iov, buf, len, MK_FALSE);
+
+    mk_stream_in_iov(&r->sr->stream, in, iov,
+                     NULL, cb_proxy_input_finished);
+    in->context = r;
+    r->pending++;
+}
+
+/* Push queued data to the client, returns -1 if the client went away */
+static int proxy_flush(struct proxy_request *r)
+{
+    int ret;
+    struct mk_sched_conn *conn = r->cs->conn;
+
+    r->in_flush = MK_TRUE;
+    ret = mk_api->channel_flush(r->cs->channel);
+    r->in_flush = MK_FALSE;
+
+    if (ret & MK_CHANNEL_ERROR) {
+        return -1;
+    }
+
+    if (r->pending == 0 && (conn->event.mask & MK_EVENT_WRITE)) {
+        mk_api->ev_add(mk_api->sched_loop(), conn->event.fd,
+                       MK_EVENT_CONNECTION, MK_EVENT_READ, conn);
+    }
+
+    return 0;
+}
+
+/*
+ * Parse the response head found in r->buf. The status line becomes the
+ * custom status of the core, kept header rows are compacted at the
+ * beginning of the buffer and queued right after the core headers.
+ * Returns 0 if more data is needed, 1 when done and -1 on error.
+ */
+static int proxy_response_headers(struct proxy_request *r)
+{
+    int ret;
+    int status;
+    int chunked = MK_FALSE;
+    int conn_close = MK_FALSE;
+    int conn_ka = MK_FALSE;
+    int http10;
+    int n_skip = sizeof(proxy_response_skip) / sizeof(mk_ptr_t);
+    long clen = -1;
+    char *end;
+    char *line;
+    char *eol;
+    char *colon;
+    char *val;
+    char *w;
+    size_t head_len;
+    size_t line_len;
+    size_t val_len;
+    ssize_t out;
+    struct mk_http_request *sr = r->sr;
+    struct response_headers *sh = &sr->headers;
+
+ again:
+    end = memmem(r->buf, r->buf_len, "\r\n\r\n", 4);
+    if (!end) {
+        return (r->buf_len == PROXY_BUF_SIZE) ? -1 : 0;
+    }
+    head_len = (end - r->buf) + 4;
+
+    if (head_len < 16 || strncmp(r->buf, "HTTP/1.", 7) != 0 ||
+        r->buf[8] != ' ' || !isdigit(r->buf[9]) ||
+        !isdigit(r->buf[10]) || !isdigit(r->buf[11])) {
+        return -1;
+    }
+    http10 = (r->buf[7] == '0');
+    status = (r->buf[9] - '0') * 100 + (r->buf[10] - '0') * 10 +
+        (r->buf[11] - '0');
+
+    /* Interim responses are not forwarded */
+    if (status >= 100 && status < 200) {
+        if (status == 101) {
+            return -1;
+        }
+        r->buf_len -= head_len;
+        memmove(r->buf, r->buf + head_len, r->buf_len);
+        goto again;
+    }
+
+    eol = memchr(r->buf, '\r', head_len);
+    line_len = eol - (r->buf + 9);
+    if (line_len > sizeof(r->status_line) - 12) {
+        line_len = sizeof(r->status_line) - 12;
+    }
+    ret = snprintf(r->status_line, sizeof(r->status_line),
+                   "HTTP/1.1 %.*s\r\n", (int) line_len, r->buf + 9);
+
+    /* Walk the header rows, keep the end-to-end ones */
+    w = r->buf;
+    line = eol + 2;
+    while (line < end + 2) {
+        eol = memchr(line, '\n', (end + 2) - line);
+        line_len = (eol + 1) - line;
+
+        colon = memchr(line, ':', line_len);
+        if (!colon) {
+            line = eol + 1;
+            continue;
+        }
+        val = colon + 1;
+        while (*val == ' ' || *val == '\t') {
+            val++;
+        }
+        val_len = eol - val;
+        if (val_len > 0 && val[val_len - 1] == '\r') {
+            val_len--;
+        }
+
+        if (colon - line == 10 && strncasecmp(line, "connection", 10) == 0) {
+            conn_close = proxy_value_has(val, val_len, "close");
+            conn_ka = proxy_value_has(val, val_len, "keep-alive");
+        }
+        else if (colon - line == 17 &&
+                 strncasecmp(line, "transfer-encoding", 17) == 0) {
+            chunked = proxy_value_has(val, val_len, "chunked");
+        }
+        else if (colon - line == 14 &&
+                 strncasecmp(line, "content-length", 14) == 0) {
+            clen = strtol(val, NULL, 10);
+            if (clen < 0) {
+                return -1;
+            }
+        }
+
+        if (proxy_header_skip(proxy_response_skip, n_skip,
+                              line, colon - line) == MK_FALSE) {
+            memmove(w, line, line_len);
+            w += line_len;
+        }
+        line = eol + 1;
+    }
+    memcpy(w, MK_CRLF, 2);
+    w += 2;
+
+    /* Decide how the body ends and if both connections can be reused */
+    r->keepalive = !conn_close && (!http10 || conn_ka);
+    if (sr->method == MK_METHOD_HEAD || status == 204 || status == 304) {
+        r->framing = PROXY_BODY_NONE;
+    }
+    else if (chunked == MK_TRUE) {
+        if (sr->protocol == MK_HTTP_PROTOCOL_11) {
+            r->framing = PROXY_BODY_CHUNKED;
+            sh->transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
+        }
+        else {
+            r->framing = PROXY_BODY_DECHUNK;
+            r->hangup = MK_TRUE;
+        }
+        clen = -1;
+    }
+    else if (clen >= 0) {
+        r->framing = PROXY_BODY_LENGTH;
+        r->remaining = clen;
+    }
+    else {
+        r->framing = PROXY_BODY_CLOSE;
+        r->keepalive = MK_FALSE;
+        r->hangup = MK_TRUE;
+    }
+
+    sh->status = MK_CUSTOM_STATUS;
+    sh->custom_status.data = r->status_line;
+    sh->custom_status.len = ret;
+    sh->content_length = clen;
+    sh->cgi = SH_CGI;
+    if (r->hangup == MK_TRUE) {
+        r->cs->close_now = MK_TRUE;
+    }
+    mk_api->header_prepare(r->plugin, r->cs, sr);
+
+    proxy_queue(r, &r->in_hdr, &r->iov_hdr, &r->io_hdr,
+                r->buf, w - r->buf);
+    r->headers_sent = MK_TRUE;
+    r->state = PROXY_BODY;
+
+    /* Body bytes that came along with the headers */
+    out = proxy_body_feed(r, r->buf + head_len, r->buf_len - head_len);
+    if (out == -1) {
+        return -1;
+    }
+    if (out > 0) {
+        proxy_queue(r, &r->in_body, &r->iov_body, &r->io_body,
+                    r->buf + head_len, out);
+    }
+    if (r->framing == PROXY_BODY_LENGTH && r->remaining == 0) {
+        r->upstream_done = MK_TRUE;
+    }
+
+    return 1;
+}
+
+/* Bytes move upstream -> pipe -> client without entering user space */
+static void proxy_splice(struct proxy_request *r)
+{
+    size_t len;
+    ssize_t n;
+    struct mk_event_loop *loop = mk_api->sched_loop();
+
+    while (1) {
+        if (r->pipe_len > 0) {
+            n = splice(r->pipe[0], NULL, r->event.fd, NULL, r->pipe_len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == -1) {
+                if (errno != EAGAIN) {
+                    proxy_request_end(r, MK_TRUE);
+                    return;
+                }
+
+                /* Slow client: wait for it and stop reading upstream */
+                if (r->event.mask == MK_EVENT_EMPTY) {
+                    mk_api->ev_add(loop, r->event.fd, MK_EVENT_CUSTOM,
+                                   MK_EVENT_WRITE, r);
+                }
+                if (r->conn) {
+                    mk_api->ev_del(loop, &r->conn->event);
+                }
+                return;
+            }
+            r->pipe_len -= n;
+            r->deadline = proxy_now() + proxy_conf.read_timeout;
+            continue;
+        }
+
+        if (r->upstream_done == MK_TRUE) {
+            proxy_request_end(r, MK_FALSE);
+            return;
+        }
+
+        if (r->event.mask != MK_EVENT_EMPTY) {
+            mk_api->ev_del(loop, &r->event);
+        }
+
+        len = PROXY_SPLICE_SIZE;
+        if (r->framing == PROXY_BODY_LENGTH && r->remaining < (long) len) {
+            len = r->remaining;
+        }
+
+        n = splice(r->conn->event.fd, NULL, r->pipe[1], NULL, len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1) {
+            if (errno != EAGAIN) {
+                proxy_request_end(r, MK_TRUE);
+                return;
+            }
+            if (r->conn->event.mask == MK_EVENT_EMPTY) {
+                mk_api->ev_add(loop, r->conn->event.fd, MK_EVENT_CUSTOM,
+                               MK_EVENT_READ, r->conn);
+            }
+            return;
+        }
+        else if (n == 0) {
+            if (r->framing != PROXY_BODY_CLOSE) {
+                proxy_request_end(r, MK_TRUE);
+                return;
+            }
+            r->upstream_done = MK_TRUE;
+        }
+        else {
+            r->received += n;
+            r->pipe_len += n;
+            r->deadline = proxy_now() + proxy_conf.read_timeout;
+            if (r->framing == PROXY_BODY_LENGTH) {
+                r->remaining -= n;
+                if (r->remaining == 0) {
+                    r->upstream_done = MK_TRUE;
+                }
+            }
+        }
+
+        if (r->upstream_done == MK_TRUE) {
+            proxy_conn_release(r->conn, r->keepalive);
+            r->conn = NULL;
+        }
+    }
+}
+
+static int cb_proxy_client(void *data)
+{
+    proxy_splice(data);
+    return 0;
+}
+
+/*
+ * Switch the body transfer to splice(2). Only for plain TCP clients and
+ * bodies that are not chunk encoded, once the client stream is empty. Not
+ * used while the response cache copies what is written to the channel.
+ */
+static int proxy_splice_start(struct proxy_request *r)
+{
+    int fd;
+
+    if (proxy_conf.splice == MK_FALSE || r->pending > 0 ||
+        r->upstream_done == MK_TRUE || r->cs->channel->cb_written ||
+        (MK_SCHED_CONN_PROP(r->cs->conn) & MK_CAP_SOCK_TLS) ||
+        (r->framing != PROXY_BODY_LENGTH && r->framing != PROXY_BODY_CLOSE)) {
+        return -1;
+    }
+
+    if (pipe2(r->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        r->pipe[0] = -1;
+        return -1;
+    }
+
+    fd = dup(r->cs->socket);
+    if (fd == -1) {
+        close(r->pipe[0]);
+        close(r->pipe[1]);
+        r->pipe[0] = -1;
+        return -1;
+    }
+
+    MK_EVENT_NEW(&r->event);
+    r->event.fd = fd;
+    r->event.handler = cb_proxy_client;
+    r->state = PROXY_SPLICE;
+
+    return 0;
+}
+
+/* Readable upstream while reading the response headers or the body */
+static void proxy_read(struct proxy_request *r)
+{
+    int ret;
+    ssize_t n;
+    ssize_t out;
+    struct proxy_conn *conn = r->conn;
+
+    if (r->pending > 0) {
+        /* The client has not taken the previous buffer yet */
+        mk_api->ev_del(mk_api->sched_loop(), &conn->event);
+        return;
+    }
+
+    if (r->state == PROXY_HEADERS) {
+        n = read(conn->event.fd, r->buf + r->buf_len,
+                 PROXY_BUF_SIZE - r->buf_len);
+    }
+    else {
+        n = read(conn->event.fd, r->buf, PROXY_BUF_SIZE);
+    }
+
+    if (n == -1) {
+        if (errno == EAGAIN) {
+            return;
+        }
+        proxy_request_fail(r, MK_SERVER_BAD_GATEWAY, MK_TRUE);
+        return;
+    }
+    else if (n == 0) {
+        if (r->state != PROXY_BODY || r->framing != PROXY_BODY_CLOSE) {
+            proxy_request_fail(r, MK_SERVER_BAD_GATEWAY, MK_TRUE);
+            return;
+        }
+        r->upstream_done = MK_TRUE;
+    }
+    else {
+        r->received += n;
+        r->deadline = proxy_now() + proxy_conf.read_timeout;
+    }
+
+    if (r->state == PROXY_HEADERS) {
+        r->buf_len += n;
+        ret = proxy_response_headers(r);
+        if (ret == 0) {
+            return;
+        }
+        else if (ret == -1) {
+            proxy_request_fail(r, MK_SERVER_BAD_GATEWAY, MK_FALSE);
+            return;
+        }
+    }
+    else if (n > 0) {
+        out = proxy_body_feed(r, r->buf, n);
+        if (out == -1) {
+            proxy_request_end(r, MK_TRUE);
+            return;
+        }
+        if (out > 0) {
+            proxy_queue(r, &r->in_body, &r->iov_body, &r->io_body,
+                        r->buf, out);
+        }
+    }
+
+    if (r->upstream_done == MK_TRUE) {
+        proxy_conn_release(conn, r->keepalive);
+        r->conn = NULL;
+    }
+
+    if (proxy_flush(r) == -1) {
+        proxy_request_end(r, MK_TRUE);
+        return;
+    }
+
+    if (r->pending > 0) {
+        if (r->conn) {
+            mk_api->ev_del(mk_api->sched_loop(), &r->conn->event);
+        }
+        return;
+    }
+
+    if (r->upstream_done == MK_TRUE) {
+        proxy_request_end(r, MK_FALSE);
+        return;
+    }
+
+    if (proxy_splice_start(r) == 0) {
+        proxy_splice(r);
+    }
+}
+
+/* Upstream connection event */
+static int cb_proxy_conn(void *data)
+{
+    int ret;
+    int error = 0;
+    socklen_t len = sizeof(error);
+    struct proxy_conn *conn = data;
+    struct proxy_request *r = conn->r;
+
+    if (!r) {
+        return 0;
+    }
+
+    switch (r->state) {
+    case PROXY_CONNECTING:
+        ret = getsockopt(conn->event.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (ret == -1 || error != 0) {
+            PLUGIN_TRACE("[proxy] connect to %s failed: %s",
+                         r->upstream->name, strerror(error));
+            proxy_request_fail(r, MK_SERVER_BAD_GATEWAY, MK_TRUE);
+            return 0;
+        }
+        r->state = PROXY_SENDING;
+        /* fall through */
+    case PROXY_SENDING:
+        if (proxy_send(r) == -1) {
+            proxy_request_fail(r, MK_SERVER_BAD_GATEWAY, MK_TRUE);
+        }
+        break;
+    case PROXY_HEADERS:
+    case PROXY_BODY:
+        proxy_read(r);
+        break;
+    case PROXY_SPLICE:
+        proxy_splice(r);
+        break;
+    }
+
+    return 0;
+}
+
+int proxy_request_start(struct mk_plugin *plugin,
+                        struct mk_http_session *cs,
+                        struct mk_http_request *sr,
+                        struct proxy_upstream *upstream)
+{
+    struct proxy_request *r;
+    struct proxy_worker *w = proxy_worker_get();
+
+    r = mk_api->mem_alloc_z(sizeof(struct proxy_request));
+    if (!r) {
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    MK_EVENT_NEW(&r->event);
+    r->event.fd = -1;
+    r->pipe[0] = -1;
+    r->pipe[1] = -1;
+    r->plugin = plugin;
+    r->cs = cs;
+    r->sr = sr;
+    r->upstream = upstream;
+
+    if (proxy_request_build(r) == -1) {
+        mk_api->mem_free(r);
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    if (proxy_connect(r) == -1) {
+        mk_api->mem_free(r->req_buf);
+        mk_api->mem_free(r);
+        mk_api->header_set_http_status(sr, MK_SERVER_BAD_GATEWAY);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    mk_list_add(&r->_head, &w->requests);
+    sr->handler_data = r;
+
+    return MK_PLUGIN_RET_CONTINUE;
+}
+
+/* The client connection is being closed by the core */
+void proxy_request_hangup(struct proxy_request *r)
+{
+    proxy_request_free(r);
+}
+
+/* Called from the worker timer: expire requests without progress */
+void proxy_request_expire(struct proxy_worker *w)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct proxy_request *r;
+
+    mk_list_foreach_safe(head, tmp, &w->requests) {
+        r = mk_list_entry(head, struct proxy_request, _head);
+        if (r->deadline > w->now) {
+            continue;
+        }
+
+        PLUGIN_TRACE("[proxy] request to %s timed out", r->upstream->name);
+        if (r->state == PROXY_CONNECTING) {
+            proxy_request_fail(r, MK_SERVER_GATEWAY_TIMEOUT, MK_TRUE);
+        }
+        else {
+            proxy_request_fail(r, MK_SERVER_GATEWAY_TIMEOUT, MK_FALSE);
+        }
+    }
+}
@@ -0,0 +1,120 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_PROXY_HANDLER_H
+#define MK_PROXY_HANDLER_H
+
+#include "proxy.h"
+#include "proxy_upstream.h"
+
+#define PROXY_BUF_SIZE      16384   /* response headers and buffered body */
+#define PROXY_SPLICE_SIZE   65536   /* max bytes moved per splice(2) call */
+
+/* Request states */
+enum {
+    PROXY_CONNECTING = 0,           /* waiting for connect() to complete  */
+    PROXY_SENDING,                  /* writing the request upstream       */
+    PROXY_HEADERS,                  /* reading the response headers       */
+    PROXY_BODY,                     /* body through the client stream     */
+    PROXY_SPLICE                    /* body through a pipe with splice(2) */
+};
+
+/* How the end of the response body is found */
+enum {
+    PROXY_BODY_NONE = 0,            /* HEAD, 1xx, 204 and 304 responses   */
+    PROXY_BODY_LENGTH,              /* Content-Length                     */
+    PROXY_BODY_CHUNKED,             /* chunked, passed through as is      */
+    PROXY_BODY_DECHUNK,             /* chunked, decoded for HTTP/1.0      */
+    PROXY_BODY_CLOSE                /* until the upstream closes          */
+};
+
+/* Incremental chunked-encoding scanner */
+struct proxy_chunked {
+    int state;
+    int digits;
+    size_t size;
+};
+
+struct proxy_request {
+    /*
+     * Event for a dup() of the client socket: it lets the plugin wait for
+     * the client to become writable while splicing, without touching the
+     * event owned by the core. Must be the first field.
+     */
+    struct mk_event event;
+
+    int state;
+    int framing;
+    int tries;                      /* retries done so far               */
+    int reused;                     /* connection came from the pool     */
+    int keepalive;                  /* upstream connection reusable      */
+    int hangup;                     /* close the client when done        */
+    int headers_sent;               /* response started on the client    */
+    int upstream_done;              /* whole response read from upstream */
+    int pending;                    /* our inputs queued on sr->stream   */
+    int in_flush;
+
+    time_t deadline;
+
+    struct proxy_upstream *upstream;
+    struct proxy_conn *conn;
+
+    struct mk_plugin *plugin;
+    struct mk_http_session *cs;
+    struct mk_http_request *sr;
+
+    /* Request head plus the buffered request body */
+    char *req_buf;
+    size_t req_len;
+    size_t req_sent;
+
+    /* Response */
+    size_t buf_len;
+    size_t received;
+    long remaining;
+    struct proxy_chunked chunked;
+
+    int pipe[2];
+    size_t pipe_len;
+
+    /*
+     * Response data is queued on the client stream as IOV inputs, the
+     * same kind the core uses for headers, so it is written by the
+     * regular channel path.
+     */
+    char status_line[128];
+    struct iovec io_hdr;
+    struct iovec io_body;
+    struct mk_iov iov_hdr;
+    struct mk_iov iov_body;
+    struct mk_stream_input in_hdr;
+    struct mk_stream_input in_body;
+
+    struct mk_list _head;
+    char buf[PROXY_BUF_SIZE];
+};
+
+int proxy_request_start(struct mk_plugin *plugin,
+                        struct mk_http_session *cs,
+                        struct mk_http_request *sr,
+                        struct proxy_upstream *upstream);
+void proxy_request_hangup(struct proxy_request *r);
+void proxy_request_expire(struct proxy_worker *w);
+
+#endif
@@ -0,0 +1,282 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "proxy.h"
+#include "proxy_upstream.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * Split a 'host:port' (or '[v6]:port') address and resolve it. This is
+ * done once when reading the configuration so workers can connect()
+ * without blocking on name resolution.
+ */
+int proxy_upstream_resolve(struct proxy_upstream *u, char *address)
+{
+    int ret;
+    int sep;
+    int len;
+    char *host;
+    char *port;
+    struct addrinfo hints;
+    struct addrinfo *res;
+
+    len = strlen(address);
+    port = strrchr(address, ':');
+    sep = port ? port - address : -1;
+    if (sep <= 0 || sep == len - 1) {
+        mk_warn("[proxy] upstream '%s': missing TCP port in '%s'",
+                u->name, address);
+        return -1;
+    }
+
+    if (address[0] == '[' && address[sep - 1] == ']') {
+        host = mk_api->str_copy_substr(address, 1, sep - 1);
+    }
+    else {
+        host = mk_api->str_copy_substr(address, 0, sep);
+    }
+    port = address + sep + 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    ret = getaddrinfo(host, port, &hints, &res);
+    if (ret != 0) {
+        mk_warn("[proxy] upstream '%s': cannot resolve %s: %s",
+                u->name, address, gai_strerror(ret));
+        mk_api->mem_free(host);
+        return -1;
+    }
+
+    memcpy(&u->addr, res->ai_addr, res->ai_addrlen);
+    u->addr_len = res->ai_addrlen;
+    u->host = host;
+    u->port = atoi(port);
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+struct proxy_upstream *proxy_upstream_lookup(char *name, size_t len)
+{
+    struct mk_list *head;
+    struct proxy_upstream *u;
+
+    mk_list_foreach(head, &proxy_conf.upstreams) {
+        u = mk_list_entry(head, struct proxy_upstream, _head);
+        if (strlen(u->name) == len && strncasecmp(u->name, name, len) == 0) {
+            return u;
+        }
+    }
+
+    return NULL;
+}
+
+/* Create one empty pool per configured upstream for the calling worker */
+int proxy_pool_init(struct proxy_worker *w)
+{
+    struct mk_list *head;
+    struct proxy_pool *pool;
+    struct proxy_upstream *u;
+
+    mk_list_init(&w->pools);
+    mk_list_foreach(head, &proxy_conf.upstreams) {
+        u = mk_list_entry(head, struct proxy_upstream, _head);
+
+        pool = mk_api->mem_alloc_z(sizeof(struct proxy_pool));
+        if (!pool) {
+            return -1;
+        }
+        pool->upstream = u;
+        mk_list_init(&pool->idle);
+        mk_list_add(&pool->_head, &w->pools);
+    }
+
+    return 0;
+}
+
+static struct proxy_pool *proxy_pool_get(struct proxy_worker *w,
+                                         struct proxy_upstream *u)
+{
+    struct mk_list *head;
+    struct proxy_pool *pool;
+
+    mk_list_foreach(head, &w->pools) {
+        pool = mk_list_entry(head, struct proxy_pool, _head);
+        if (pool->upstream == u) {
+            return pool;
+        }
+    }
+
+    return NULL;
+}
+
+static void proxy_conn_close(struct proxy_conn *conn)
+{
+    PLUGIN_TRACE("[proxy] close upstream connection fd=%i", conn->event.fd);
+
+    mk_api->ev_del(mk_api->sched_loop(), &conn->event);
+    close(conn->event.fd);
+    conn->event.fd = -1;
+    mk_api->sched_event_free(&conn->event);
+}
+
+/*
+ * An idle connection is registered for reads only to find out when the
+ * upstream closes it. Anything arriving while idle (EOF, errors or
+ * unexpected bytes) makes the connection unusable.
+ */
+static int cb_proxy_conn_idle(void *data)
+{
+    struct proxy_conn *conn = data;
+
+    mk_list_del(&conn->_head);
+    conn->pool->idle_count--;
+    proxy_conn_close(conn);
+
+    return 0;
+}
+
+static int proxy_conn_connect(struct proxy_upstream *u)
+{
+    int fd;
+    int ret;
+    int on = 1;
+
+    fd = socket(u->addr.ss_family,
+                SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        mk_libc_error("socket");
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    ret = connect(fd, (struct sockaddr *) &u->addr, u->addr_len);
+    if (ret == -1 && errno != EINPROGRESS) {
+        PLUGIN_TRACE("[proxy] connect to %s:%i failed: %s",
+                     u->host, u->port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Get a connection to the upstream: the most recently used idle one from
+ * the worker pool or a new non-blocking connect(). On return the event is
+ * still owned by the pool handler or unregistered, the caller sets the
+ * handler and interest it needs.
+ */
+struct proxy_conn *proxy_conn_get(struct proxy_worker *w,
+                                  struct proxy_upstream *u, int *reused)
+{
+    int fd;
+    struct proxy_pool *pool;
+    struct proxy_conn *conn;
+
+    pool = proxy_pool_get(w, u);
+    if (!pool) {
+        return NULL;
+    }
+
+    if (pool->idle_count > 0) {
+        conn = mk_list_entry_last(&pool->idle, struct proxy_conn, _head);
+        mk_list_del(&conn->_head);
+        pool->idle_count--;
+        conn->requests++;
+        *reused = MK_TRUE;
+        return conn;
+    }
+
+    fd = proxy_conn_connect(u);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    conn = mk_api->mem_alloc_z(sizeof(struct proxy_conn));
+    if (!conn) {
+        close(fd);
+        return NULL;
+    }
+
+    MK_EVENT_NEW(&conn->event);
+    conn->event.fd = fd;
+    conn->pool = pool;
+    conn->requests = 1;
+    *reused = MK_FALSE;
+
+    return conn;
+}
+
+/*
+ * Hand a connection back once a response has been fully read. It is kept
+ * only if the caller says it is reusable and the pool has room for it.
+ */
+void proxy_conn_release(struct proxy_conn *conn, int keep)
+{
+    int ret;
+    struct proxy_pool *pool = conn->pool;
+
+    conn->r = NULL;
+    if (keep == MK_FALSE || pool->idle_count >= pool->upstream->keepalive) {
+        proxy_conn_close(conn);
+        return;
+    }
+
+    conn->event.handler = cb_proxy_conn_idle;
+    ret = mk_api->ev_add(mk_api->sched_loop(), conn->event.fd,
+                         MK_EVENT_CUSTOM, MK_EVENT_READ, conn);
+    if (ret == -1) {
+        proxy_conn_close(conn);
+        return;
+    }
+
+    conn->idle_since = proxy_now();
+    mk_list_add(&conn->_head, &pool->idle);
+    pool->idle_count++;
+}
+
+/* Close idle connections older than the upstream KeepAliveTimeout */
+void proxy_pool_expire(struct proxy_worker *w)
+{
+    struct mk_list *head;
+    struct mk_list *p_head;
+    struct mk_list *tmp;
+    struct proxy_pool *pool;
+    struct proxy_conn *conn;
+
+    mk_list_foreach(p_head, &w->pools) {
+        pool = mk_list_entry(p_head, struct proxy_pool, _head);
+        mk_list_foreach_safe(head, tmp, &pool->idle) {
+            conn = mk_list_entry(head, struct proxy_conn, _head);
+            if (w->now - conn->idle_since < pool->upstream->keepalive_timeout) {
+                continue;
+            }
+            mk_list_del(&conn->_head);
+            pool->idle_count--;
+            proxy_conn_close(conn);
+        }
+    }
+}
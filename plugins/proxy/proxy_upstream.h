@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_PROXY_UPSTREAM_H
+#define MK_PROXY_UPSTREAM_H
+
+#include "proxy.h"
+
+struct proxy_request;
+
+/* Idle keep-alive connections to one upstream, owned by a worker */
+struct proxy_pool {
+    struct proxy_upstream *upstream;
+    int idle_count;
+    struct mk_list idle;
+    struct mk_list _head;
+};
+
+/* A TCP connection to an upstream, either idle in a pool or in use */
+struct proxy_conn {
+    struct mk_event event;        /* must be the first field */
+    time_t idle_since;
+    int requests;                 /* requests served on this connection */
+
+    struct proxy_pool *pool;
+    struct proxy_request *r;      /* owner, NULL while idle */
+    struct mk_list _head;
+};
+
+int proxy_upstream_resolve(struct proxy_upstream *u, char *address);
+struct proxy_upstream *proxy_upstream_lookup(char *name, size_t len);
+
+int proxy_pool_init(struct proxy_worker *w);
+
+struct proxy_conn *proxy_conn_get(struct proxy_worker *w,
+                                  struct proxy_upstream *u, int *reused);
+void proxy_conn_release(struct proxy_conn *conn, int keep);
+void proxy_pool_expire(struct proxy_worker *w);
+
+#endif